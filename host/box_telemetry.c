@@ -0,0 +1,77 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file box_telemetry.c
+ * @brief Decoder of the binary /telemetry record, for collectors.
+ */
+
+#include "box_telemetry.h"
+
+static uint32_t _get(const uint8_t *p, int size) {
+	uint32_t v = 0;
+
+	while (size--) v = (v << 8) | p[size];
+	return v;
+}
+
+/*
+ * @brief Decodes one record from buf.
+ *
+ * Records of a newer version are accepted if they keep the version 1
+ * fields, the extra bytes are skipped. Returns the length of the record, or
+ * one of the BOX_TELEMETRY_E* errors.
+ */
+
+int box_telemetry_decode(const uint8_t *buf, size_t len, struct box_telemetry *out) {
+	size_t size;
+
+	if (len < 4) return BOX_TELEMETRY_ESHORT;
+	if (buf[0] != BOX_TELEMETRY_MAGIC) return BOX_TELEMETRY_EMAGIC;
+	if (buf[1] < BOX_TELEMETRY_VERSION) return BOX_TELEMETRY_EVERSION;
+
+	size = _get(buf + 2, 2);
+	if (size < BOX_TELEMETRY_V1_SIZE) return BOX_TELEMETRY_EVERSION;
+	if (len < size) return BOX_TELEMETRY_ESHORT;
+
+	out->version = buf[1];
+	out->uptime_s = _get(buf + 4, 4);
+	out->temperature = (int16_t)_get(buf + 8, 2) / 10.0f;
+	out->humidity = _get(buf + 10, 2) / 10.0f;
+	out->ok = buf[12];
+	out->channels = buf[13];
+	out->relays = _get(buf + 14, 4);
+	out->dht_reads = _get(buf + 18, 4);
+	out->dht_errors = _get(buf + 22, 4);
+	out->heap_free = _get(buf + 26, 4);
+	out->index_hits = _get(buf + 30, 4);
+
+	return size;
+}
+
+/*
+ * @brief Returns the state of relay channel ch, 0 if there is no such
+ * channel.
+ */
+
+int box_telemetry_relay(const struct box_telemetry *t, int ch) {
+	if (ch < 0 || ch >= t->channels || ch >= 32) return 0;
+
+	return (t->relays >> ch) & 1;
+}
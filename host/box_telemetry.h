@@ -0,0 +1,60 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file box_telemetry.h
+ * @brief Decoder of the binary /telemetry record, for collectors.
+ *
+ * Depends only on the C library, so it can be copied into a collector as is.
+ * The record layout is described in user/telemetry.c.
+ */
+
+#ifndef BOX_TELEMETRY_H
+#define BOX_TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOX_TELEMETRY_MAGIC    0x42
+#define BOX_TELEMETRY_VERSION  1
+#define BOX_TELEMETRY_V1_SIZE  34
+
+// Errors of box_telemetry_decode
+#define BOX_TELEMETRY_ESHORT   -1
+#define BOX_TELEMETRY_EMAGIC   -2
+#define BOX_TELEMETRY_EVERSION -3
+
+struct box_telemetry {
+	int version;
+	uint32_t uptime_s;
+	float temperature;
+	float humidity;
+	int ok;
+	int channels;
+	uint32_t relays;
+	uint32_t dht_reads;
+	uint32_t dht_errors;
+	uint32_t heap_free;
+	uint32_t index_hits;
+};
+
+int box_telemetry_decode(const uint8_t *buf, size_t len, struct box_telemetry *out);
+int box_telemetry_relay(const struct box_telemetry *t, int ch);
+
+#endif
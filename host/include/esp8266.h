@@ -0,0 +1,389 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file esp8266.h
+ * @brief Host replacement for the SDK headers.
+ *
+ * Declares the part of the ESP8266 SDK used by the firmware so user/ can be
+ * built natively. Everything declared here is implemented by host/sim.c.
+ */
+
+#ifndef HOST_ESP8266_H
+#define HOST_ESP8266_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t  uint8;
+typedef int8_t   sint8;
+typedef int8_t   int8;
+typedef uint16_t uint16;
+typedef int16_t  sint16;
+typedef int16_t  int16;
+typedef uint32_t uint32;
+typedef int32_t  sint32;
+typedef int32_t  int32;
+typedef uint64_t uint64;
+typedef int64_t  sint64;
+typedef unsigned char bool;
+typedef bool BOOL;
+typedef int STATUS;
+
+#define true  1
+#define false 0
+#define TRUE  1
+#define FALSE 0
+#define OK    0
+#define FAIL  1
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define ICACHE_RAM_ATTR
+#define LOCAL static
+
+/* Console */
+
+extern int sim_quiet;
+int os_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define os_sprintf   sprintf
+#define os_memcpy    memcpy
+#define os_memset    memset
+#define os_memcmp    memcmp
+#define os_memmove   memmove
+#define os_strcpy    strcpy
+#define os_strncpy   strncpy
+#define os_strcmp    strcmp
+#define os_strncmp   strncmp
+#define os_strlen    strlen
+#define os_strstr    strstr
+#define os_strchr    strchr
+void os_install_putc1(void *p);
+
+/* Heap */
+
+void *sim_malloc(size_t size);
+void *sim_zalloc(size_t size);
+void sim_free(void *ptr);
+// The allocator entry points of the SDK, which pass the call site
+void *pvPortMalloc(size_t size, const char *file, unsigned line, bool iram);
+void *pvPortZalloc(size_t size, const char *file, unsigned line, bool iram);
+void *pvPortRealloc(void *ptr, size_t size, const char *file, unsigned line);
+void vPortFree(void *ptr, const char *file, unsigned line);
+#define os_malloc(s) pvPortMalloc(s, __FILE__, __LINE__, false)
+#define os_zalloc(s) pvPortZalloc(s, __FILE__, __LINE__, false)
+#define os_free(p)   vPortFree(p, __FILE__, __LINE__)
+uint32 system_get_free_heap_size(void);
+
+/* Time and timers */
+
+typedef void ETSTimerFunc(void *arg);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint64 timer_expire;
+	uint32 timer_period;
+	ETSTimerFunc *timer_func;
+	void *timer_arg;
+	int timer_armed;
+} ETSTimer;
+
+typedef ETSTimer os_timer_t;
+
+void os_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *arg);
+void os_timer_arm(ETSTimer *t, uint32 ms, bool repeat);
+void os_timer_disarm(ETSTimer *t);
+void os_delay_us(uint32 us);
+uint32 system_get_time(void);
+uint32 system_get_rtc_time(void);
+uint32 system_rtc_clock_cali_proc(void);
+bool system_rtc_mem_read(uint8 addr, void *dst, uint16 size);
+bool system_rtc_mem_write(uint8 addr, const void *src, uint16 size);
+void system_restart(void);
+void system_init_done_cb(void (*cb)(void));
+
+enum rst_reason {
+	REASON_DEFAULT_RST = 0,
+	REASON_WDT_RST,
+	REASON_EXCEPTION_RST,
+	REASON_SOFT_WDT_RST,
+	REASON_SOFT_RESTART,
+	REASON_DEEP_SLEEP_AWAKE,
+	REASON_EXT_SYS_RST
+};
+
+struct rst_info {
+	uint32 reason;
+	uint32 exccause;
+	uint32 epc1;
+	uint32 epc2;
+	uint32 epc3;
+	uint32 excvaddr;
+	uint32 depc;
+};
+
+struct rst_info *system_get_rst_info(void);
+
+/* Interrupts */
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+void sim_uart_intr(int enable);
+#define ETS_UART_INTR_DISABLE() sim_uart_intr(0)
+#define ETS_UART_INTR_ENABLE()  sim_uart_intr(1)
+
+/* GPIO */
+
+#define PERIPHS_IO_MUX_GPIO0_U 0
+#define PERIPHS_IO_MUX_U0TXD_U 1
+#define PERIPHS_IO_MUX_GPIO2_U 2
+#define PERIPHS_IO_MUX_U0RXD_U 3
+#define PERIPHS_IO_MUX_GPIO4_U 4
+#define PERIPHS_IO_MUX_GPIO5_U 5
+#define FUNC_GPIO0 0
+#define FUNC_GPIO1 3
+#define FUNC_GPIO2 0
+#define FUNC_GPIO3 3
+#define FUNC_GPIO4 0
+#define FUNC_GPIO5 0
+#define FUNC_U0TXD 0
+#define PIN_FUNC_SELECT(mux, func) ((void)(mux), (void)(func))
+#define PIN_PULLUP_DIS(mux) ((void)(mux))
+#define PIN_PULLUP_EN(mux) ((void)(mux))
+
+#define GPIO_OUT_ADDRESS 0x00
+#define GPIO_ENABLE_ADDRESS 0x0c
+#define GPIO_IN_ADDRESS 0x18
+
+uint32 sim_gpio_reg_read(uint32 reg);
+void sim_gpio_reg_write(uint32 reg, uint32 value);
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask);
+uint32 sim_gpio_input(uint32 gpio);
+
+#define GPIO_REG_READ(reg) sim_gpio_reg_read(reg)
+#define GPIO_REG_WRITE(reg, val) sim_gpio_reg_write(reg, val)
+#define GPIO_OUTPUT_SET(gpio, bit) \
+	gpio_output_set((bit) ? 1 << (gpio) : 0, (bit) ? 0 : 1 << (gpio), 1 << (gpio), 0)
+#define GPIO_DIS_OUTPUT(gpio) gpio_output_set(0, 0, 0, 1 << (gpio))
+#define GPIO_INPUT_GET(gpio) sim_gpio_input(gpio)
+
+/* SPI flash */
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+	SPI_FLASH_RESULT_OK,
+	SPI_FLASH_RESULT_ERR,
+	SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+
+/* WiFi */
+
+#define STATION_MODE    0x01
+#define SOFTAP_MODE     0x02
+#define STATIONAP_MODE  0x03
+
+enum {
+	STATION_IDLE = 0,
+	STATION_CONNECTING,
+	STATION_WRONG_PASSWORD,
+	STATION_NO_AP_FOUND,
+	STATION_CONNECT_FAIL,
+	STATION_GOT_IP
+};
+
+struct station_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 bssid_set;
+	uint8 bssid[6];
+};
+
+struct bss_info {
+	struct {
+		struct bss_info *stqe_next;
+	} next;
+	uint8 bssid[6];
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 channel;
+	sint8 rssi;
+	int authmode;
+	uint8 is_hidden;
+};
+
+typedef void (*scan_done_cb_t)(void *arg, STATUS status);
+
+enum {
+	EVENT_STAMODE_CONNECTED = 0,
+	EVENT_STAMODE_DISCONNECTED,
+	EVENT_STAMODE_AUTHMODE_CHANGE,
+	EVENT_STAMODE_GOT_IP,
+	EVENT_STAMODE_DHCP_TIMEOUT
+};
+
+#define REASON_ASSOC_LEAVE    8
+#define REASON_4WAY_HANDSHAKE_TIMEOUT 15
+#define REASON_BEACON_TIMEOUT 200
+#define REASON_NO_AP_FOUND    201
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+	uint32 ip;
+	uint32 mask;
+	uint32 gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+	Event_StaMode_Connected_t connected;
+	Event_StaMode_Disconnected_t disconnected;
+	Event_StaMode_Got_IP_t got_ip;
+} Event_Info_u;
+
+typedef struct {
+	uint32 event;
+	Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+uint8 wifi_get_opmode(void);
+bool wifi_set_opmode(uint8 mode);
+bool wifi_set_opmode_current(uint8 mode);
+bool wifi_station_get_config(struct station_config *config);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+uint8 wifi_station_get_connect_status(void);
+bool wifi_station_scan(void *config, scan_done_cb_t cb);
+sint8 wifi_station_get_rssi(void);
+uint8 wifi_get_channel(void);
+bool wifi_set_channel(uint8 channel);
+bool wifi_station_set_reconnect_policy(bool set);
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+uint32 system_get_chip_id(void);
+
+/* Network, espconn on top of host sockets */
+
+#define ESPCONN_OK          0
+#define ESPCONN_MEM        -1
+#define ESPCONN_TIMEOUT    -3
+#define ESPCONN_RTE        -4
+#define ESPCONN_INPROGRESS -5
+#define ESPCONN_ABRT      -8
+#define ESPCONN_RST       -9
+#define ESPCONN_CLSD      -10
+#define ESPCONN_CONN      -11
+#define ESPCONN_ARG       -12
+#define ESPCONN_ISCONN    -15
+
+enum espconn_type {
+	ESPCONN_INVALID = 0,
+	ESPCONN_TCP = 0x10,
+	ESPCONN_UDP = 0x20
+};
+
+enum espconn_state {
+	ESPCONN_NONE,
+	ESPCONN_WAIT,
+	ESPCONN_LISTEN,
+	ESPCONN_CONNECT,
+	ESPCONN_WRITE,
+	ESPCONN_READ,
+	ESPCONN_CLOSE
+};
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+typedef struct _esp_tcp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+	espconn_connect_callback connect_callback;
+	espconn_reconnect_callback reconnect_callback;
+	espconn_connect_callback disconnect_callback;
+} esp_tcp;
+
+typedef struct _esp_udp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+} esp_udp;
+
+struct espconn {
+	enum espconn_type type;
+	enum espconn_state state;
+	union {
+		esp_tcp *tcp;
+		esp_udp *udp;
+	} proto;
+	espconn_recv_callback recv_callback;
+	espconn_sent_callback sent_callback;
+	uint8 link_cnt;
+	void *reverse;
+};
+
+typedef struct _remot_info {
+	enum espconn_state state;
+	int remote_port;
+	uint8 remote_ip[4];
+} remot_info;
+
+uint32 ipaddr_addr(const char *cp);
+uint32 espconn_port(void);
+sint8 espconn_connect(struct espconn *espconn);
+sint8 espconn_disconnect(struct espconn *espconn);
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_create(struct espconn *espconn);
+sint8 espconn_delete(struct espconn *espconn);
+sint16 espconn_sendto(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_get_connection_info(struct espconn *pespconn, remot_info **pcon_info, uint8 typeflags);
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback cb);
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback cb);
+sint8 espconn_regist_time(struct espconn *espconn, uint32 interval, uint8 type_flag);
+
+#endif
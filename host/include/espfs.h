@@ -0,0 +1,6 @@
+typedef struct EspFsFile EspFsFile;
+
+int espFsInit(void *flashAddress);
+EspFsFile *espFsOpen(char *fileName);
+int espFsRead(EspFsFile *fh, char *buff, int len);
+void espFsClose(EspFsFile *fh);
@@ -0,0 +1 @@
+#include <esp8266.h>
@@ -0,0 +1,78 @@
+/**
+ * @file httpd.h
+ * @brief Host replacement for the libesphttpd server API.
+ *
+ * Same structures and calls as libesphttpd, implemented by host/sim.c on top
+ * of an in-memory connection that records everything the CGI sends.
+ */
+
+#ifndef HTTPD_H
+#define HTTPD_H
+
+#include <esp8266.h>
+
+#define HTTPDVER "0.4-host"
+
+#define HTTPD_CGI_MORE 0
+#define HTTPD_CGI_DONE 1
+#define HTTPD_CGI_NOTFOUND 2
+#define HTTPD_CGI_AUTHENTICATED 3
+
+#define HTTPD_METHOD_GET 1
+#define HTTPD_METHOD_POST 2
+
+typedef struct HttpdPriv HttpdPriv;
+typedef struct HttpdConnData HttpdConnData;
+typedef struct HttpdPostData HttpdPostData;
+
+typedef int (* cgiSendCallback)(HttpdConnData *connData);
+
+struct espconn;
+
+struct HttpdConnData {
+	struct espconn *conn;
+	char requestType;
+	char *url;
+	char *getArgs;
+	const void *cgiArg;
+	void *cgiData;
+	void *cgiPrivData;
+	HttpdPriv *priv;
+	cgiSendCallback cgi;
+	HttpdPostData *post;
+	int remote_port;
+	uint8 remote_ip[4];
+};
+
+struct HttpdPostData {
+	int len;
+	int buffSize;
+	int buffLen;
+	int received;
+	char *buff;
+	char *multipartBoundary;
+};
+
+typedef struct {
+	const char *url;
+	cgiSendCallback cgiCb;
+	const void *cgiArg;
+} HttpdBuiltInUrl;
+
+typedef void (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
+
+int cgiRedirect(HttpdConnData *connData);
+int cgiEspFsHook(HttpdConnData *connData);
+int cgiEspFsTemplate(HttpdConnData *connData);
+void httpdRedirect(HttpdConnData *conn, char *newUrl);
+int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
+int httpdFindArg(char *line, char *arg, char *buff, int buffLen);
+void httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
+const char *httpdGetMimetype(char *url);
+void httpdStartResponse(HttpdConnData *conn, int code);
+void httpdHeader(HttpdConnData *conn, const char *field, const char *val);
+void httpdEndHeaders(HttpdConnData *conn);
+int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
+int httpdSend(HttpdConnData *conn, const char *data, int len);
+
+#endif
@@ -0,0 +1 @@
+#include <httpd.h>
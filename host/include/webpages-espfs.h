@@ -0,0 +1 @@
+extern char webpages_espfs_start[];
@@ -0,0 +1,535 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file load.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief HTTP load generator for the web interface.
+ *
+ * Runs a number of dashboard clients against the device, or against the host
+ * stand-in of serve.c, each one sending its next request as soon as the last
+ * one is answered. Requests are picked from a weighted mix of routes, and the
+ * run reports throughput and, for every route, latency percentiles and bytes
+ * per response.
+ *
+ * Results can be saved as JSON and compared against a previous run, failing
+ * if a route got slower or lost throughput over the tolerance.
+ *
+ * With -k clients ask for keep-alive and send their next request on the same
+ * connection while the server keeps it open, like a browser does.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_MAX_CLIENTS 64
+#define LOAD_MAX_ROUTES 16
+#define LOAD_MAX_SAMPLES (1 << 20)
+#define LOAD_TIMEOUT_MS 5000
+
+struct LoadRoute {
+	const char *name;
+	const char *urls[2];
+	int weight;
+	// Results
+	unsigned long *latency;
+	int count;
+	int errors;
+	unsigned long long bytes;
+};
+
+// Default mix of a dashboard: mostly page loads, a few toggles and scans
+static struct LoadRoute routes[LOAD_MAX_ROUTES] = {
+	{"index", {"/index.tpl", NULL}, 50},
+	{"static", {"/style.css", "/wifi/wifi.js"}, 25},
+	{"relay", {"/relay.cgi?relay=on", "/relay.cgi?relay=off"}, 10},
+	{"wifiscan", {"/wifi/wifiscan.cgi", NULL}, 10},
+	{"metrics", {"/metrics", NULL}, 5},
+};
+static int nroutes = 5;
+
+enum LoadState {
+	LOAD_IDLE,
+	LOAD_CONNECTING,
+	LOAD_SENDING,
+	LOAD_RECEIVING
+};
+
+struct LoadClient {
+	int fd;
+	enum LoadState state;
+	struct LoadRoute *route;
+	char req[600];
+	int reqLen, sent;
+	char head[512];
+	int received;
+	// Length of the headers and of the body, -1 until known
+	int headLen, bodyLen;
+	int kept;
+	unsigned long long start;
+	int toggle;
+};
+
+static struct LoadClient clients[LOAD_MAX_CLIENTS];
+static struct sockaddr_in target;
+static char host[128];
+static int totalWeight;
+static int keepAlive;
+static int reused;
+
+static unsigned long long _now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct LoadRoute *_load_find(const char *name) {
+	int i;
+
+	for (i = 0; i < nroutes; i++) {
+		if (!strcmp(routes[i].name, name)) return &routes[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Parses a mix like "index=5,relay=1,/settings.tpl=1". Names are
+ * routes of the default mix, paths starting with / add a route. Routes left
+ * out of the mix get no requests. Returns 1 on error.
+ */
+
+static int _load_parse_mix(char *mix) {
+	char *item, *eq;
+	int i;
+
+	for (i = 0; i < nroutes; i++) routes[i].weight = 0;
+
+	for (item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+		struct LoadRoute *r;
+
+		eq = strchr(item, '=');
+		if (eq == NULL) return 1;
+		*eq = 0;
+
+		r = _load_find(item);
+
+		if (r == NULL) {
+			if (item[0] != '/' || nroutes == LOAD_MAX_ROUTES) return 1;
+			r = &routes[nroutes++];
+			r->name = r->urls[0] = item;
+		}
+
+		r->weight = atoi(eq + 1);
+	}
+
+	return 0;
+}
+
+static int _load_parse_target(const char *arg) {
+	struct addrinfo hints, *res;
+	const char *colon = strrchr(arg, ':');
+	char port[8] = "80";
+
+	if (!strncmp(arg, "http://", 7)) arg += 7;
+
+	snprintf(host, sizeof(host), "%s", arg);
+	colon = strrchr(host, ':');
+
+	if (colon != NULL) {
+		snprintf(port, sizeof(port), "%s", colon + 1);
+		host[colon - host] = 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res)) return 1;
+
+	memcpy(&target, res->ai_addr, sizeof(target));
+	freeaddrinfo(res);
+	return 0;
+}
+
+static struct LoadRoute *_load_pick(void) {
+	int n = rand() % totalWeight;
+	int i;
+
+	for (i = 0; i < nroutes; i++) {
+		if (n < routes[i].weight) return &routes[i];
+		n -= routes[i].weight;
+	}
+
+	return &routes[0];
+}
+
+static void _load_record(struct LoadClient *c, int ok) {
+	struct LoadRoute *r = c->route;
+
+	if (!ok) {
+		r->errors++;
+	} else if (r->count < LOAD_MAX_SAMPLES) {
+		r->latency[r->count++] = _now_us() - c->start;
+	}
+
+	if (c->fd >= 0 && !(ok && c->kept)) {
+		close(c->fd);
+		c->fd = -1;
+	}
+	c->state = LOAD_IDLE;
+}
+
+static void _load_start(struct LoadClient *c) {
+	const char *url;
+
+	c->route = _load_pick();
+	url = c->route->urls[c->route->urls[1] != NULL ? c->toggle++ & 1 : 0];
+	c->reqLen = snprintf(c->req, sizeof(c->req), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+			url, host, keepAlive ? "keep-alive" : "close");
+	c->sent = 0;
+	c->received = 0;
+	c->headLen = c->bodyLen = -1;
+	c->start = _now_us();
+
+	// The connection of the last response is still open
+	if (c->fd >= 0) {
+		reused++;
+		c->kept = 0;
+		c->state = LOAD_SENDING;
+		return;
+	}
+
+	c->kept = 0;
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	fcntl(c->fd, F_SETFL, O_NONBLOCK);
+
+	if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) && errno != EINPROGRESS) {
+		_load_record(c, 0);
+		return;
+	}
+
+	c->state = LOAD_CONNECTING;
+}
+
+static void _load_event(struct LoadClient *c, short revents) {
+	char buff[1460];
+	int n, status;
+
+	if (c->state == LOAD_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+		if (err) {
+			_load_record(c, 0);
+			return;
+		}
+
+		c->state = LOAD_SENDING;
+	}
+
+	if (c->state == LOAD_SENDING) {
+		n = send(c->fd, c->req + c->sent, c->reqLen - c->sent, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno != EAGAIN) _load_record(c, 0);
+			return;
+		}
+
+		c->sent += n;
+		if (c->sent == c->reqLen) c->state = LOAD_RECEIVING;
+		return;
+	}
+
+	n = recv(c->fd, buff, sizeof(buff), 0);
+
+	if (n < 0) {
+		if (errno != EAGAIN) _load_record(c, 0);
+		return;
+	}
+
+	if (c->received < (int)sizeof(c->head) - 1) {
+		int keep = sizeof(c->head) - 1 - c->received;
+
+		memcpy(c->head + c->received, buff, n < keep ? n : keep);
+		c->head[c->received + (n < keep ? n : keep)] = 0;
+	}
+
+	c->received += n;
+
+	if (c->headLen < 0 && strstr(c->head, "\r\n\r\n") != NULL) {
+		char *length = strcasestr(c->head, "\r\nContent-Length:");
+
+		c->headLen = strstr(c->head, "\r\n\r\n") + 4 - c->head;
+		if (length != NULL) c->bodyLen = atoi(length + 17);
+		c->kept = keepAlive && c->bodyLen >= 0 && strcasestr(c->head, "\r\nConnection: keep-alive") != NULL;
+	}
+
+	// A kept alive response ends with its body, others when the server closes
+	if (n > 0 && !(c->kept && c->received >= c->headLen + c->bodyLen)) return;
+
+	if (c->received == 0 || sscanf(c->head, "HTTP/%*s %d", &status) != 1 || status >= 500) {
+		_load_record(c, 0);
+		return;
+	}
+
+	c->route->bytes += c->received;
+	_load_record(c, 1);
+}
+
+static int _cmp_ul(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double _percentile_ms(struct LoadRoute *r, double p) {
+	if (r->count == 0) return 0;
+
+	return r->latency[(int)(p * (r->count - 1) + 0.5)] / 1000.0;
+}
+
+struct LoadResult {
+	char route[32];
+	int requests, errors;
+	double rps, p50, p90, p99, max, bytes;
+};
+
+static void _load_result(struct LoadRoute *r, double seconds, struct LoadResult *res) {
+	snprintf(res->route, sizeof(res->route), "%s", r->name);
+	res->requests = r->count;
+	res->errors = r->errors;
+	res->rps = r->count / seconds;
+	res->p50 = _percentile_ms(r, 0.50);
+	res->p90 = _percentile_ms(r, 0.90);
+	res->p99 = _percentile_ms(r, 0.99);
+	res->max = r->count ? r->latency[r->count - 1] / 1000.0 : 0;
+	res->bytes = r->count ? (double)r->bytes / r->count : 0;
+}
+
+// One route per line, so a previous run can be read back with sscanf
+#define LOAD_JSON_ROUTE "    {\"route\": \"%s\", \"requests\": %d, \"errors\": %d, \"rps\": %.2f, " \
+		"\"p50_ms\": %.2f, \"p90_ms\": %.2f, \"p99_ms\": %.2f, \"max_ms\": %.2f, \"bytes_mean\": %.1f}"
+#define LOAD_JSON_SCAN "    {\"route\": \"%31[^\"]\", \"requests\": %d, \"errors\": %d, \"rps\": %lf, " \
+		"\"p50_ms\": %lf, \"p90_ms\": %lf, \"p99_ms\": %lf, \"max_ms\": %lf, \"bytes_mean\": %lf}"
+
+static int _load_save(const char *path, const char *targetName, int nclients, double seconds) {
+	FILE *f = fopen(path, "w");
+	struct LoadResult res;
+	int i, total = 0, errors = 0, first = 1;
+
+	if (f == NULL) {
+		fprintf(stderr, "load: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < nroutes; i++) {
+		total += routes[i].count;
+		errors += routes[i].errors;
+	}
+
+	fprintf(f, "{\n  \"target\": \"%s\",\n  \"clients\": %d,\n  \"duration_s\": %.2f,\n"
+			"  \"requests\": %d,\n  \"errors\": %d,\n  \"throughput_rps\": %.2f,\n  \"routes\": [\n",
+			targetName, nclients, seconds, total, errors, total / seconds);
+
+	for (i = 0; i < nroutes; i++) {
+		if (routes[i].weight == 0) continue;
+
+		_load_result(&routes[i], seconds, &res);
+		fprintf(f, "%s" LOAD_JSON_ROUTE, first ? "" : ",\n", res.route, res.requests, res.errors,
+				res.rps, res.p50, res.p90, res.p99, res.max, res.bytes);
+		first = 0;
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+	return 0;
+}
+
+/*
+ * @brief Compares this run with a saved one. A route fails if its p90 grew,
+ * or its throughput dropped, by more than tolerance percent. Returns the
+ * number of failed routes.
+ */
+
+static int _load_compare(const char *path, double seconds, double tolerance) {
+	FILE *f = fopen(path, "r");
+	char line[512];
+	int failed = 0;
+
+	if (f == NULL) {
+		fprintf(stderr, "load: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	printf("\n%-10s %12s %12s %12s %12s\n", "vs base", "p90_ms", "base", "rps", "base");
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct LoadResult base, res;
+		struct LoadRoute *r;
+		const char *verdict = "";
+
+		if (sscanf(line, LOAD_JSON_SCAN, base.route, &base.requests, &base.errors, &base.rps,
+				&base.p50, &base.p90, &base.p99, &base.max, &base.bytes) != 9) continue;
+
+		r = _load_find(base.route);
+		if (r == NULL || r->weight == 0) continue;
+
+		_load_result(r, seconds, &res);
+
+		if (res.p90 > base.p90 * (1 + tolerance / 100) || res.rps < base.rps * (1 - tolerance / 100)) {
+			verdict = "  REGRESSION";
+			failed++;
+		}
+
+		printf("%-10s %12.2f %12.2f %12.2f %12.2f%s\n", res.route, res.p90, base.p90, res.rps, base.rps, verdict);
+	}
+
+	fclose(f);
+	return failed;
+}
+
+static void _usage(const char *name) {
+	fprintf(stderr, "usage: %s [-u host[:port]] [-c clients] [-t seconds] [-n requests] [-k]\n"
+			"          [-m route=weight,...] [-o results.json] [-b baseline.json] [-x tolerance%%]\n"
+			"routes: index static relay wifiscan metrics, or a path like /settings.tpl\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	const char *targetName = "127.0.0.1:8080";
+	const char *out = NULL, *baseline = NULL;
+	struct pollfd fds[LOAD_MAX_CLIENTS];
+	struct LoadClient *pending[LOAD_MAX_CLIENTS];
+	struct LoadResult res;
+	unsigned long long start, end;
+	double seconds = 10, tolerance = 20, elapsed;
+	int nclients = 4, maxRequests = 0, issued = 0;
+	int c, i, total = 0, errors = 0;
+
+	while ((c = getopt(argc, argv, "u:c:t:n:m:o:b:x:k")) != -1) {
+		switch (c) {
+			case 'u': targetName = optarg; break;
+			case 'c': nclients = atoi(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'n': maxRequests = atoi(optarg); break;
+			case 'm': if (_load_parse_mix(optarg)) _usage(argv[0]); break;
+			case 'o': out = optarg; break;
+			case 'b': baseline = optarg; break;
+			case 'x': tolerance = atof(optarg); break;
+			case 'k': keepAlive = 1; break;
+			default: _usage(argv[0]);
+		}
+	}
+
+	if (nclients < 1 || nclients > LOAD_MAX_CLIENTS) _usage(argv[0]);
+
+	if (_load_parse_target(targetName)) {
+		fprintf(stderr, "load: cannot resolve %s\n", targetName);
+		return 1;
+	}
+
+	for (i = 0; i < nroutes; i++) {
+		totalWeight += routes[i].weight;
+		routes[i].latency = malloc(LOAD_MAX_SAMPLES * sizeof(unsigned long));
+	}
+
+	if (totalWeight <= 0) _usage(argv[0]);
+
+	for (i = 0; i < nclients; i++) {
+		clients[i].fd = -1;
+		clients[i].state = LOAD_IDLE;
+	}
+
+	printf("load: %d clients against %s for %s%.1f s\n", nclients, targetName,
+			maxRequests ? "at most " : "", seconds);
+
+	start = _now_us();
+	end = start + (unsigned long long)(seconds * 1000000);
+
+	for (;;) {
+		unsigned long long now = _now_us();
+		int n = 0;
+
+		for (i = 0; i < nclients; i++) {
+			struct LoadClient *cl = &clients[i];
+
+			if (cl->state != LOAD_IDLE && now - cl->start > LOAD_TIMEOUT_MS * 1000ULL) _load_record(cl, 0);
+
+			if (cl->state == LOAD_IDLE && now < end && (!maxRequests || issued < maxRequests)) {
+				_load_start(cl);
+				issued++;
+			}
+
+			if (cl->state == LOAD_IDLE) continue;
+
+			fds[n].fd = cl->fd;
+			fds[n].events = cl->state == LOAD_RECEIVING ? POLLIN : POLLOUT;
+			pending[n++] = cl;
+		}
+
+		if (n == 0) break;
+
+		if (poll(fds, n, 100) < 0 && errno != EINTR) break;
+
+		for (i = 0; i < n; i++) {
+			if (fds[i].revents) _load_event(pending[i], fds[i].revents);
+		}
+	}
+
+	elapsed = (_now_us() - start) / 1000000.0;
+
+	printf("%-10s %8s %6s %8s %9s %9s %9s %9s %9s\n",
+			"route", "requests", "errors", "req/s", "p50_ms", "p90_ms", "p99_ms", "max_ms", "bytes");
+
+	for (i = 0; i < nroutes; i++) {
+		if (routes[i].weight == 0) continue;
+
+		qsort(routes[i].latency, routes[i].count, sizeof(unsigned long), _cmp_ul);
+		_load_result(&routes[i], elapsed, &res);
+		total += res.requests;
+		errors += res.errors;
+		printf("%-10s %8d %6d %8.2f %9.2f %9.2f %9.2f %9.2f %9.0f\n", res.route, res.requests, res.errors,
+				res.rps, res.p50, res.p90, res.p99, res.max, res.bytes);
+	}
+
+	printf("total: %d requests, %d errors, %.2f req/s in %.2f s\n", total, errors, total / elapsed, elapsed);
+	if (keepAlive) printf("%d requests on kept alive connections\n", reused);
+
+	if (out != NULL && _load_save(out, targetName, nclients, elapsed)) return 1;
+
+	if (baseline != NULL && _load_compare(baseline, elapsed, tolerance)) return 1;
+
+	return 0;
+}
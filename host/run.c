@@ -0,0 +1,2437 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file run.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Unit tests and micro-benchmarks of the host build.
+ *
+ * "run test" runs every test in its own process, so each one starts from a
+ * freshly booted device. "run bench" prints one "name value unit" line per
+ * measure and fails if a measure is over its budget.
+ */
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "config.h"
+#include "dht.h"
+#include "io.h"
+#include "itoa.h"
+#include "boot.h"
+#include "rtcstate.h"
+#include "action.h"
+#include "mqtt.h"
+#include "history.h"
+#include "telemetry.h"
+#include "box_telemetry.h"
+#include "flashlog.h"
+#include "series.h"
+#include "rollup.h"
+#include "args.h"
+#include "wifi.h"
+#include "heap.h"
+#include "pool.h"
+#include "stack.h"
+#include "pagecache.h"
+#include "ui.h"
+#include "admit.h"
+#include "web.h"
+#include "sampler.h"
+#include "crit.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * @brief Cold boots the simulated device with the given sensor values.
+ */
+
+static void _boot(float temperature, float humidity) {
+	sim_quiet = 1;
+	sim_reset(REASON_DEFAULT_RST);
+	sim_dht_set(temperature, humidity);
+	sim_boot();
+}
+
+static int _get(const char *url, struct SimResponse *resp) {
+	return sim_http("GET", url, NULL, resp);
+}
+
+static int _contains(struct SimResponse *resp, const char *text) {
+	return resp->data != NULL && strstr(resp->data, text) != NULL;
+}
+
+static int _mem_find(const char *data, int len, const char *text) {
+	int n = strlen(text);
+	int i;
+
+	for (i = 0; i + n <= len; i++) {
+		if (!memcmp(data + i, text, n)) return 1;
+	}
+
+	return 0;
+}
+
+static int _mem_count(const char *data, int len, const char *text) {
+	int n = strlen(text);
+	int i, count = 0;
+
+	for (i = 0; i + n <= len; i++) {
+		if (!memcmp(data + i, text, n)) count++;
+	}
+
+	return count;
+}
+
+/*
+ * @brief Fake MQTT broker on a loopback socket. It records everything the
+ * device sends and answers pings.
+ */
+
+struct Broker {
+	int listenFd;
+	int fd;
+	char data[16384];
+	int len;
+	int parsed;
+};
+
+static int _broker_listen(struct Broker *b) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	memset(b, 0, sizeof(*b));
+	b->fd = -1;
+	b->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(b->listenFd, (struct sockaddr *)&addr, sizeof(addr));
+	listen(b->listenFd, 4);
+	fcntl(b->listenFd, F_SETFL, O_NONBLOCK);
+	getsockname(b->listenFd, (struct sockaddr *)&addr, &len);
+	return ntohs(addr.sin_port);
+}
+
+static int _broker_accept(struct Broker *b) {
+	int i;
+
+	for (i = 0; i < 200 && b->fd < 0; i++) {
+		sim_net_poll(5);
+		b->fd = accept(b->listenFd, NULL, NULL);
+	}
+
+	b->len = b->parsed = 0;
+	return b->fd >= 0;
+}
+
+static void _broker_poll(struct Broker *b) {
+	int i, n;
+
+	for (i = 0; i < 5; i++) {
+		sim_net_poll(2);
+
+		while ((n = recv(b->fd, b->data + b->len, sizeof(b->data) - 1 - b->len, MSG_DONTWAIT)) > 0) {
+			b->len += n;
+		}
+	}
+
+	b->data[b->len] = 0;
+
+	while (b->parsed + 2 <= b->len) {
+		int rem = 0, mult = 1, p = b->parsed + 1;
+		uint8 c;
+
+		do {
+			c = b->data[p++];
+			rem += (c & 0x7f) * mult;
+			mult *= 128;
+		} while ((c & 0x80) && p < b->len);
+
+		if (p + rem > b->len) break;
+
+		if ((uint8)b->data[b->parsed] == 0xc0) send(b->fd, "\xd0\x00", 2, MSG_NOSIGNAL);
+
+		b->parsed = p + rem;
+	}
+}
+
+static void _broker_send(struct Broker *b, const char *data, int len) {
+	send(b->fd, data, len, MSG_NOSIGNAL);
+	_broker_poll(b);
+}
+
+static void _broker_run(struct Broker *b, int seconds) {
+	while (seconds-- > 0) {
+		sim_run(1000000);
+		_broker_poll(b);
+	}
+}
+
+/*
+ * @brief Minimal CoAP client on a loopback socket.
+ */
+
+struct CoapMsg {
+	int type;
+	int code;
+	int mid;
+	int observe;
+	int block2;
+	char payload[1024];
+	int plen;
+};
+
+static int _coap_opt(uint8 *p, int *last, int num, const void *val, int len) {
+	p[0] = ((num - *last) << 4) | len;
+	memcpy(p + 1, val, len);
+	*last = num;
+	return len + 1;
+}
+
+/*
+ * @brief Waits for a CoAP message on fd and splits it. Returns its code,
+ * or -1 if nothing came.
+ */
+
+static int _coap_reply(int fd, struct CoapMsg *resp) {
+	uint8 msg[256];
+	int last = 0, i, n = 0;
+
+	for (i = 0; i < 100; i++) {
+		sim_net_poll(5);
+		n = recv(fd, msg, sizeof(msg), MSG_DONTWAIT);
+
+		if (n > 0) break;
+	}
+
+	memset(resp, 0, sizeof(*resp));
+	resp->observe = resp->block2 = -1;
+
+	if (n < 4) return -1;
+
+	resp->type = (msg[0] >> 4) & 3;
+	resp->code = msg[1];
+	resp->mid = (msg[2] << 8) | msg[3];
+	last = 0;
+
+	for (i = 4 + (msg[0] & 0xf); i < n && msg[i] != 0xff; ) {
+		int num = last + (msg[i] >> 4);
+		int olen = msg[i] & 0xf;
+		int v = 0, j;
+
+		for (j = 0; j < olen; j++) v = (v << 8) | msg[i + 1 + j];
+
+		if (num == 6) resp->observe = v;
+		if (num == 23) resp->block2 = v;
+
+		last = num;
+		i += 1 + olen;
+	}
+
+	if (i < n) {
+		resp->plen = n - i - 1;
+		memcpy(resp->payload, msg + i + 1, resp->plen);
+	}
+
+	resp->payload[resp->plen] = 0;
+	return resp->code;
+}
+
+/*
+ * @brief Sends msg as it is and waits for the reply.
+ */
+
+static int _coap_raw(int fd, const char *msg, int len, struct CoapMsg *resp) {
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(COAP_PORT);
+	sendto(fd, msg, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+
+	return _coap_reply(fd, resp);
+}
+
+static int _coap_request(int fd, int code, const char *path, int observe, int block2, const char *payload,
+		struct CoapMsg *resp) {
+	static int mid = 0x100;
+	uint8 msg[256], b;
+	char segs[64], *seg;
+	int len = 0, last = 0;
+
+	msg[len++] = 0x40 | 2;
+	msg[len++] = code;
+	msg[len++] = ++mid >> 8;
+	msg[len++] = mid & 0xff;
+	msg[len++] = 0xbe;
+	msg[len++] = 0xef;
+
+	if (observe >= 0) {
+		b = observe;
+		len += _coap_opt(msg + len, &last, 6, &b, observe ? 1 : 0);
+	}
+
+	snprintf(segs, sizeof(segs), "%s", path);
+
+	for (seg = strtok(segs, "/"); seg != NULL; seg = strtok(NULL, "/")) {
+		len += _coap_opt(msg + len, &last, 11, seg, strlen(seg));
+	}
+
+	if (block2 >= 0) {
+		b = block2;
+		len += _coap_opt(msg + len, &last, 23, &b, 1);
+	}
+
+	if (payload != NULL) {
+		msg[len++] = 0xff;
+		memcpy(msg + len, payload, strlen(payload));
+		len += strlen(payload);
+	}
+
+	return _coap_raw(fd, (char *)msg, len, resp);
+}
+
+
+static int _coap_wait(int fd, struct CoapMsg *resp) {
+	uint8 msg[256];
+	int n;
+
+	sim_net_poll(5);
+	n = recv(fd, msg, sizeof(msg), MSG_DONTWAIT);
+
+	if (n < 4) return -1;
+
+	resp->type = (msg[0] >> 4) & 3;
+	resp->code = msg[1];
+	resp->plen = n;
+	memcpy(resp->payload, msg, n);
+	resp->payload[n] = 0;
+	return resp->code;
+}
+
+/*
+ * @brief Returns the body of a response, after the headers.
+ */
+
+static const uint8 *_body(struct SimResponse *resp, int *len) {
+	char *end = resp->data != NULL ? strstr(resp->data, "\r\n\r\n") : NULL;
+
+	if (end == NULL) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = resp->len - (end + 4 - resp->data);
+	return (const uint8 *)end + 4;
+}
+
+/*
+ * @brief Fills out with n samples like those of a DHT22 read every 30 s
+ * indoors: a daily swing, sensor noise, timer jitter and a few failed reads.
+ */
+
+static void _dht22_trace(struct HistorySample *out, int n) {
+	uint32 up = 2;
+	int i;
+
+	srand(1);
+
+	for (i = 0; i < n; i++) {
+		double day = sin(2 * M_PI * i / 2880.0);
+		int r = rand() % 100;
+
+		out[i].up = up;
+		out[i].temp = (sint16)lrint(215 + 30 * day + (r < 20 ? 1 : 0));
+		out[i].hum = (sint16)lrint(550 - 80 * day + (rand() % 5 - 2));
+
+		up += r < 3 ? 29 : r < 6 ? 31 : r < 7 ? 60 : 30;
+	}
+}
+
+static uint64 _host_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Tests */
+
+static void test_itoa(void) {
+	char b[12];
+
+	CHECK(!strcmp(itoa(0, b), "0"));
+	CHECK(!strcmp(itoa(42, b), "42"));
+	CHECK(!strcmp(itoa(-40, b), "-40"));
+	CHECK(!strcmp(itoa(1234567, b), "1234567"));
+}
+
+static void test_dht_decode(void) {
+	struct DhtReading *r;
+
+	_boot(23.4, 55.1);
+	r = dht_read(1);
+	CHECK(r->success);
+	CHECK(r->temperature > 23.35 && r->temperature < 23.45);
+	CHECK(r->humidity > 55.05 && r->humidity < 55.15);
+
+	// The start pulse runs with interrupts on, only the frame is timed
+	CHECK(crit_stats(CRIT_INTR)->max < 16000);
+
+	// Too far from the last reading to be believed at once, a second frame
+	// that agrees with it is
+	sim_dht_set(-12.5, 99.9);
+	r = dht_read(1);
+	CHECK(r->success);
+	CHECK(r->temperature > 23.35 && r->temperature < 23.45);
+	CHECK(dht_stats()->outliers == 1);
+	r = dht_read(1);
+	CHECK(r->temperature < -12.45 && r->temperature > -12.55);
+	CHECK(r->humidity > 99.85 && r->humidity < 99.95);
+}
+
+static void test_dht_faults(void) {
+	struct DhtReading *r;
+
+	_boot(20, 50);
+	sim_dht_fault(SIM_DHT_BAD_CHECKSUM, 1);
+	r = dht_read(1);
+	CHECK(!r->success);
+	CHECK(dht_stats()->errors == 1);
+
+	sim_dht_fault(SIM_DHT_SHORT_FRAME, 1);
+	r = dht_read(1);
+	CHECK(!r->success);
+	CHECK(dht_stats()->checksums == 1 && dht_stats()->shortFrames == 1);
+
+	r = dht_read(1);
+	CHECK(r->success);
+}
+
+/*
+ * @brief Runs the device up to the end of the next DHT frame.
+ */
+
+static void _next_frame(void) {
+	uint32 reads = dht_stats()->reads;
+
+	while (dht_stats()->reads == reads) sim_run(100000);
+}
+
+static void test_dht_retry(void) {
+	struct SimResponse resp;
+	struct config conf;
+	char *last;
+
+	_boot(20, 50);
+	sampler_init(POOLTIME, POOLTIME);
+	conf = config_read();
+	conf.ch[0].hum = 60;
+	conf.ch[0].temp = 40;
+	conf.ch[0].off = 0;
+	config_save(conf);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(dht_read(0)->success);
+
+	// A bad frame is read again DHT_RETRY_MS later, the last reading stands
+	// until then
+	sim_dht_fault(SIM_DHT_BAD_CHECKSUM, 1);
+	sim_run(POOLTIME * 1000ULL);
+	CHECK(dht_stats()->checksums == 1 && dht_stats()->retries == 1);
+	CHECK(dht_read(0)->success);
+	sim_run(DHT_RETRY_MS * 1000ULL);
+	CHECK(dht_read(0)->success && dht_stats()->failures == 0);
+
+	// A sensor that does not answer fails the poll after its retries, each
+	// try waits for it for 46 ms
+	sim_dht_fault(SIM_DHT_NO_RESPONSE, 0);
+	sim_run((POOLTIME + DHT_RETRIES * DHT_RETRY_MS + 500) * 1000ULL);
+	CHECK(!dht_read(0)->success);
+	CHECK(dht_stats()->timeouts == DHT_RETRIES + 1 && dht_stats()->failures == 1);
+	CHECK(dht_stats()->errors == DHT_RETRIES + 2 && dht_stats()->shortFrames == 0);
+	sim_dht_fault(SIM_DHT_OK, 0);
+	sim_run(POOLTIME * 1000ULL);
+	CHECK(dht_read(0)->success);
+
+	// A frame with a good checksum and 25.6 % too much humidity is dropped
+	// and read again, it never reaches the relay
+	sim_dht_fault(SIM_DHT_GLITCH, 1);
+	_next_frame();
+	CHECK(dht_stats()->outliers == 1);
+	_next_frame();
+	CHECK(dht_read(0)->success && dht_read(0)->humidity < 50.05);
+	CHECK(io_get_status(0) == 0);
+
+	// One that could be real is outvoted by the median and its retry
+	sim_dht_set(20, 62);
+	_next_frame();
+	sim_dht_set(20, 50);
+	CHECK(dht_read(0)->humidity < 50.05);
+	_next_frame();
+	CHECK(dht_read(0)->humidity < 50.05);
+	CHECK(io_get_status(0) == 0 && dht_stats()->outliers == 1);
+
+	// A real step is confirmed by the retry, 2 s later
+	sim_dht_set(20, 62);
+	_next_frame();
+	_next_frame();
+	CHECK(dht_read(0)->humidity > 61.95 && io_get_status(0) == 1);
+
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "dht_bad_checksums 1\n") && _contains(&resp, "dht_outliers 1\n"));
+	CHECK(_contains(&resp, "dht_failures 1\n"));
+	// More than one send buffer, and nothing cut off at the end
+	last = resp.data != NULL ? strstr(resp.data, "\ncrit_uart_max_us{") : NULL;
+	CHECK(resp.len > 2048 && last != NULL && resp.data[resp.len - 1] == '\n');
+	CHECK(last != NULL && strchr(last + 1, '\n') == resp.data + resp.len - 1);
+	sim_response_free(&resp);
+	CHECK(dht_stats()->failures == 1);
+}
+
+static void test_crit(void) {
+	struct CritStats *s = crit_stats(CRIT_UART);
+	struct CritStats before;
+	struct SimResponse resp;
+	const char *site;
+
+	// Flash erases at boot take UART sections too, counted from here
+	_boot(20, 50);
+	before = *s;
+	CHECK(before.max < 60000);
+
+	// A section at a bucket limit is counted in that bucket
+	CRIT_UART_DISABLE();
+	os_delay_us(64);
+	CRIT_UART_ENABLE();
+	CRIT_UART_DISABLE();
+	os_delay_us(65);
+	CRIT_UART_ENABLE();
+	CHECK(s->buckets[1] == before.buckets[1] + 1 && s->buckets[2] == before.buckets[2] + 1);
+	CHECK(s->count == before.count + 2 && s->total == before.total + 129);
+
+	// The alarm threshold is set through /metrics
+	CHECK(_get("/metrics?crit_alarm_us=500", &resp) == 200);
+	CHECK(_contains(&resp, "crit_alarm_us 500\n"));
+	sim_response_free(&resp);
+	CRIT_UART_DISABLE();
+	os_delay_us(499);
+	CRIT_UART_ENABLE();
+	CHECK(s->alarms == before.alarms);
+	CRIT_UART_DISABLE();
+	os_delay_us(500);
+	CRIT_UART_ENABLE();
+	CHECK(s->alarms == before.alarms + 1);
+
+	// 0 turns it off
+	CHECK(_get("/metrics?crit_alarm_us=0", &resp) == 200);
+	CHECK(crit_get_alarm() == 0);
+	sim_response_free(&resp);
+
+	// Nested sections are one, timed from where the outer one started, and
+	// the longest is kept with its site
+	site = CRIT_SITE; CRIT_UART_DISABLE();
+	os_delay_us(30000);
+	CRIT_UART_DISABLE();
+	os_delay_us(30000);
+	CRIT_UART_ENABLE();
+	CRIT_UART_ENABLE();
+	CHECK(s->count == before.count + 5 && s->alarms == before.alarms + 1);
+	CHECK(s->buckets[CRIT_BUCKETS - 2] == before.buckets[CRIT_BUCKETS - 2] + 1);
+	CHECK(s->max == 60000 && s->maxSite != NULL && !strcmp(s->maxSite, site));
+
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "crit_uart_max_us{site=\"") && _contains(&resp, "run.c:"));
+	CHECK(_contains(&resp, "\"} 60000\n"));
+	sim_response_free(&resp);
+}
+
+static void test_uptime_wrap(void) {
+	uint32 up;
+
+	_boot(20, 50);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(dht_read(0)->success);
+
+	// No good reading for longer than system_get_time() takes to wrap
+	sim_dht_fault(SIM_DHT_NO_RESPONSE, 0);
+	sim_run(100 * 60 * 1000000ULL);
+	CHECK(!dht_read(0)->success);
+	up = boot_uptime();
+	CHECK(up == sim_now_us() / 1000000);
+	CHECK(up > 100 * 60);
+}
+
+static void test_first_sample(void) {
+	_boot(20, 50);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(dht_read(0)->success);
+	CHECK(boot_time(BOOT_FIRST_SAMPLE) > 0);
+	CHECK(boot_time(BOOT_FIRST_SAMPLE) < (DHT_STARTUP_MS + 100) * 1000);
+}
+
+static void test_config_roundtrip(void) {
+	struct config conf;
+	uint32 erases, word, zero = 0;
+	int i, torn = 0;
+
+	_boot(20, 50);
+	conf = config_read();
+	CHECK(conf.ch[0].hum == DEFAULT_HUM && conf.ch[0].time == DEFAULT_TIME);
+	conf.ch[0].hum = 70;
+	conf.ch[0].temp = 30;
+	erases = sim_flash_total_erases();
+	CHECK(config_save(conf) == 0);
+	CHECK(sim_flash_total_erases() == erases);
+
+	// Reboot and read it back from flash
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	CHECK(config_read().ch[0].hum == 70);
+	CHECK(config_read().ch[0].temp == 30);
+
+	// A save cut short leaves the one before
+	conf.ch[0].hum = 71;
+	CHECK(config_save(conf) == 0);
+	for (i = 0x7B * SPI_FLASH_SEC_SIZE; i < 0x7D * SPI_FLASH_SEC_SIZE; i += 4) {
+		spi_flash_read(i, &word, 4);
+		// Sequence, checksum and the humidity of the newest record
+		if ((word >> 16) != 71) continue;
+		spi_flash_write(i + 4, &zero, 4);
+		torn++;
+	}
+	CHECK(torn == 1);
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	CHECK(config_read().ch[0].hum == 70);
+
+	// Sectors are erased in turn, one erase per sector of saves
+	erases = sim_flash_total_erases();
+	for (i = 0; i < 1000; i++) {
+		conf.ch[0].hum = i % 100;
+		CHECK(config_save(conf) == 0);
+	}
+	CHECK(sim_flash_total_erases() - erases <= 1000 * 16 / SPI_FLASH_SEC_SIZE + 1);
+	CHECK(sim_flash_erases(0x7B) > 0 && sim_flash_erases(0x7C) > 0);
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	CHECK(config_read().ch[0].hum == 99);
+
+	// Limits of the form
+	conf = config_read();
+	CHECK(config_set(&conf.ch[0], 0, 100) == 1);
+	CHECK(config_set(&conf.ch[0], 1, -41) == 1);
+	CHECK(config_set(&conf.ch[0], 2, 0) == 1);
+	CHECK(config_set(&conf.ch[0], 3, 2) == 1);
+	CHECK(config_check(&conf) == 0);
+	CHECK(config_set(&conf.ch[0], 1, -40) == 0 && conf.ch[0].temp == -40);
+	conf.ch[0].time = 121;
+	CHECK(config_check(&conf) == 1);
+}
+
+static void test_config_endpoint(void) {
+	struct SimResponse resp;
+	uint32 saves;
+
+	_boot(20, 50);
+
+	CHECK(_get("/config", &resp) == 200);
+	CHECK(_contains(&resp, "\r\n\r\n[{\"hum\":60,\"temp\":40,\"time\":10,\"off\":0}]"));
+	sim_response_free(&resp);
+
+	// Fields left out keep their value, the answer is the config saved
+	CHECK(sim_http("POST", "/config", " [ {\"temp\": -5, \"off\": true} ] ", &resp) == 200);
+	CHECK(_contains(&resp, "[{\"hum\":60,\"temp\":-5,\"time\":10,\"off\":1}]"));
+	sim_response_free(&resp);
+	CHECK(config_read().ch[0].temp == -5 && config_read().ch[0].off == 1);
+
+	// One bad field and nothing is saved
+	saves = sim_flash_total_writes();
+	CHECK(sim_http("POST", "/config", "[{\"hum\":70,\"time\":0}]", &resp) == 400);
+	CHECK(_contains(&resp, "{\"error\":\"[0].time out of range\"}"));
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[{\"hum\":70,\"colour\":1}]", &resp) == 400);
+	CHECK(_contains(&resp, "[0].colour unknown field"));
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[{\"hum\":70}", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[null,{}]", &resp) == 400);
+	CHECK(_contains(&resp, "too many channels"));
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[{\"hum\":\"70\"}]", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", NULL, &resp) == 400);
+	CHECK(_contains(&resp, "{\"error\":\"missing body\"}"));
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[{\"hum\":70,}]", &resp) == 400);
+	CHECK(_contains(&resp, "expected a field name"));
+	sim_response_free(&resp);
+	CHECK(sim_http("POST", "/config", "[{\"hum\":70 , }]", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(config_read().ch[0].hum == 60);
+
+	// The same config is not written again
+	CHECK(sim_http("POST", "/config", "[null]", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(sim_flash_total_writes() == saves);
+
+	// The form is checked against the same limits
+	CHECK(_get("/relayconfig.cgi?channel=0&humidity=100&temperature=20", &resp) == 400);
+	CHECK(_contains(&resp, "humidity must be 0 to 99"));
+	sim_response_free(&resp);
+	CHECK(config_read().ch[0].temp == -5);
+	CHECK(_get("/relayconfig.cgi?channel=0&humidity=abc", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(_get("/relayconfig.cgi?channel=0&humidity=&temperature=20", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(_get("/relayconfig.cgi?channel=0&time=5x", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(config_read().ch[0].hum == 60 && config_read().ch[0].temp == -5 && config_read().ch[0].time == 10);
+	CHECK(_get("/relayconfig.cgi?channel=0&relay=on&humidity=99&temperature=20", &resp) == 302);
+	sim_response_free(&resp);
+	CHECK(config_read().ch[0].hum == 99 && config_read().ch[0].temp == 20 && config_read().ch[0].off == 0);
+
+	// And survives a reboot
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	CHECK(_get("/config", &resp) == 200);
+	CHECK(_contains(&resp, "[{\"hum\":99,\"temp\":20,\"time\":10,\"off\":0}]"));
+	sim_response_free(&resp);
+}
+
+static void test_io_batch(void) {
+	_boot(20, 50);
+	io_apply(1, 1);
+	CHECK(io_get_status(0) == 1);
+	CHECK(sim_gpio_out() & (1 << 2));
+	io_apply(1, 0);
+	CHECK(io_get_status(0) == 0);
+	CHECK(!(sim_gpio_out() & (1 << 2)));
+	// Channels out of range are ignored
+	io_enable(IO_CHANNELS, 1);
+	CHECK(io_get_mask() == 0);
+}
+
+static void test_action_threshold(void) {
+	struct config conf;
+
+	_boot(20, 50);
+	conf = config_read();
+	conf.ch[0].hum = 60;
+	conf.ch[0].temp = 40;
+	conf.ch[0].off = 0;
+	conf.ch[0].time = 10;
+	config_save(conf);
+
+	sim_run(40 * 1000000ULL);
+	CHECK(io_get_status(0) == 0);
+
+	sim_dht_set(20, 75);
+	sim_run(60 * 1000000ULL);
+	CHECK(io_get_status(0) == 1);
+
+	sim_dht_set(20, 50);
+	sim_run(60 * 1000000ULL);
+	CHECK(io_get_status(0) == 0);
+}
+
+/*
+ * @brief Runs the device up to the end of the next reading, and of the
+ * frame read again to confirm a step.
+ */
+
+static void _next_reading(void) {
+	_next_frame();
+	sim_run((DHT_RETRY_MS + 100) * 1000);
+}
+
+static void test_sampler(void) {
+	struct SimResponse resp;
+	struct config conf;
+	uint32 reads;
+
+	_boot(20, 50);
+	conf = config_read();
+	conf.ch[0].hum = 60;
+	conf.ch[0].temp = 40;
+	conf.ch[0].off = 0;
+	config_save(conf);
+
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(sampler_stats()->reason == SAMPLE_START && sampler_stats()->interval == POOLTIME);
+
+	// Flat and far from the thresholds, readings move apart to the limit
+	sim_run(10 * 60 * 1000000ULL);
+	CHECK(sampler_stats()->reason == SAMPLE_STABLE && sampler_stats()->interval == SAMPLE_MAX_MS);
+	CHECK(sampler_stats()->lengthened > 0 && sampler_stats()->shortened == 0);
+	reads = dht_stats()->reads;
+	sim_run(60 * 60 * 1000000ULL);
+	CHECK(dht_stats()->reads - reads == 3600000 / SAMPLE_MAX_MS);
+
+	// A step of 5 %, confirmed 2 s later, is one step of 1 % every 24.4 s
+	sim_dht_set(20, 55);
+	_next_reading();
+	CHECK(sampler_stats()->reason == SAMPLE_CHANGE && sampler_stats()->interval == 24400);
+	CHECK(sampler_stats()->rate == 245 && sampler_stats()->margin == 500);
+
+	// Moving fast half a step from the threshold
+	sim_dht_set(20, 59.5);
+	_next_reading();
+	CHECK(sampler_stats()->reason == SAMPLE_THRESHOLD && sampler_stats()->interval == SAMPLE_MIN_MS);
+	CHECK(sampler_stats()->shortened == 2);
+
+	// Flat near the threshold, never slower than POOLTIME
+	sim_run(10 * 60 * 1000000ULL);
+	CHECK(sampler_stats()->reason == SAMPLE_THRESHOLD && sampler_stats()->interval == POOLTIME);
+
+	// Crossing it is seen at the next reading, 1 step away at 2.8 steps per
+	// minute the reading after comes 5.3 s later
+	CHECK(io_get_status(0) == 0);
+	sim_dht_set(20, 61);
+	_next_reading();
+	CHECK(io_get_status(0) == 1);
+
+	CHECK(_get("/state.json", &resp) == 200);
+	CHECK(_contains(&resp, "\"sample\":{\"ms\":5300,\"why\":\"threshold\"}"));
+	sim_response_free(&resp);
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "sample_interval_ms{reason=\"threshold\"} 5300\n"));
+	sim_response_free(&resp);
+
+	// Channels that are off have no threshold
+	conf.ch[0].off = 1;
+	config_save(conf);
+	sim_run(10 * 60 * 1000000ULL);
+	CHECK(sampler_stats()->reason == SAMPLE_STABLE && sampler_stats()->margin == -1);
+
+	// Equal limits give a fixed interval, from now on
+	sampler_init(5000, 5000);
+	reads = dht_stats()->reads;
+	sim_run(60 * 1000000ULL + 1000);
+	CHECK(dht_stats()->reads - reads == 12);
+}
+
+static void test_web_index(void) {
+	struct SimResponse resp;
+
+	_boot(21.5, 40);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	CHECK(_contains(&resp, "21.5"));
+	CHECK(_contains(&resp, "sensor is operating"));
+	sim_response_free(&resp);
+
+	// Browsers without gzip are sent to the template pages
+	CHECK(_get("/", &resp) == 406);
+	CHECK(_contains(&resp, "/index.tpl"));
+	sim_response_free(&resp);
+}
+
+static void test_ui(void) {
+	struct SimResponse resp;
+	struct station_config stconf;
+	char headers[96], etag[32];
+	char *p, *body;
+	const char *json;
+	FILE *f;
+	long size = 0;
+	int len;
+
+	f = fopen(SIM_HTMLDIR "/app.html.gz", "rb");
+	CHECK(f != NULL);
+	if (f != NULL) {
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fclose(f);
+	}
+
+	_boot(21.5, 40);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+
+	// The bundle goes out as stored, in several calls
+	sim_http_headers("Accept-Encoding: gzip, deflate\r\n\r\n");
+	CHECK(_get("/", &resp) == 200);
+	CHECK(_contains(&resp, "Content-Encoding: gzip"));
+	CHECK(_contains(&resp, "Cache-Control: max-age="));
+	body = strstr(resp.data, "\r\n\r\n");
+	CHECK(body != NULL);
+	if (body != NULL) {
+		body += 4;
+		CHECK((uint8)body[0] == 0x1f && (uint8)body[1] == 0x8b);
+		CHECK(resp.data + resp.len - body == size);
+	}
+	CHECK(size > UI_CHUNK);
+	printf("  %ld bytes of UI\n", size);
+
+	p = strstr(resp.data, "ETag: ");
+	CHECK(p != NULL);
+	if (p != NULL) sscanf(p + 6, "%31s", etag);
+	sim_response_free(&resp);
+
+	snprintf(headers, sizeof(headers), "Accept-Encoding: gzip\r\nIf-None-Match: %s\r\n\r\n", etag);
+	sim_http_headers(headers);
+	CHECK(_get("/", &resp) == 304);
+	CHECK(!_contains(&resp, "Content-Encoding"));
+	sim_response_free(&resp);
+
+	CHECK(web_get_hits() == 2);
+
+	// Everything the UI shows in one call
+	CHECK(_get("/state.json", &resp) == 200);
+	CHECK(_contains(&resp, "Cache-Control: no-cache"));
+	CHECK(_contains(&resp, "\"t\":21.5,\"h\":40.0,\"ok\":1"));
+	CHECK(_contains(&resp, "\"relays\":[{\"on\":0,"));
+	CHECK(_contains(&resp, "\"wifi\":{\"mode\":"));
+	CHECK(_contains(&resp, "}}"));
+	sim_response_free(&resp);
+
+	CHECK(_get("/relay.cgi?relay=on", &resp) == 302);
+	sim_response_free(&resp);
+	CHECK(_get("/state.json", &resp) == 200);
+	CHECK(_contains(&resp, "\"relays\":[{\"on\":1,"));
+	sim_response_free(&resp);
+
+	// The longest SSID, every character escaped, still fits
+	memset(&stconf, 0, sizeof(stconf));
+	memset(stconf.ssid, '"', sizeof(stconf.ssid));
+	wifi_station_set_config_current(&stconf);
+	CHECK(_get("/state.json", &resp) == 200);
+	json = (const char *)_body(&resp, &len);
+	CHECK(len < UI_STATE_MAX && json[len - 1] == '}');
+	CHECK(_mem_count(json, len, "\\\"") == 32);
+	sim_response_free(&resp);
+}
+
+/*
+ * @brief GET from a connection on remote port port, kept alive if keep.
+ */
+
+static int _get_from(int port, int keep, const char *url) {
+	struct SimResponse resp;
+	int status;
+
+	if (keep) sim_http_headers("Connection: keep-alive\r\n\r\n");
+	sim_http_from(port);
+	status = _get(url, &resp);
+	if (status == 503) CHECK(_contains(&resp, "Retry-After: "));
+	sim_response_free(&resp);
+	return status;
+}
+
+static void test_admit(void) {
+	struct AdmitStats *stats = admit_stats();
+	struct SimResponse resp;
+	int port;
+
+	_boot(20, 50);
+
+	// Dashboards keep their connections, assets fill all but the reserve
+	for (port = 1000; port < 1000 + ADMIT_CONNS - ADMIT_RESERVE; port++) {
+		CHECK(_get_from(port, 1, "/style.css") == 200);
+	}
+	CHECK(_get_from(port, 1, "/style.css") == 503);
+	CHECK(_get_from(port, 1, "/index.tpl") == 200);
+	port++;
+	CHECK(_get_from(port, 1, "/state.json") == 503);
+	CHECK(_get_from(port, 1, "/relay.cgi?relay=on") == 302);
+	CHECK(io_get_status(0) == 1);
+	port++;
+	CHECK(stats->open == ADMIT_CONNS);
+	CHECK(_get_from(port, 0, "/relay.cgi?relay=off") == 503);
+	CHECK(io_get_status(0) == 1);
+
+	// Open connections are held to the same limits, and give back their slot
+	CHECK(_get_from(1000, 1, "/index.tpl") == 503);
+	CHECK(_get_from(1001, 1, "/relay.cgi?relay=off") == 302);
+	CHECK(io_get_status(0) == 0);
+	CHECK(_get_from(1002, 1, "/index.tpl") == 200);
+	CHECK(_get_from(1003, 1, "/style.css") == 503);
+	CHECK(_get_from(1004, 1, "/style.css") == 200);
+	CHECK(stats->open == ADMIT_CONNS - ADMIT_RESERVE);
+	CHECK(stats->reused == 3);
+	CHECK(stats->rejected[ADMIT_ASSET] == 2 && stats->rejected[ADMIT_PAGE] == 2);
+	CHECK(stats->rejected[ADMIT_CONTROL] == 1);
+	CHECK(stats->peak == ADMIT_CONNS);
+
+	// A kept alive connection frees its slot as soon as it closes
+	sim_http_close(1002);
+	CHECK(stats->open == ADMIT_CONNS - ADMIT_RESERVE - 1);
+	sim_http_close(1004);
+	CHECK(_get_from(1004, 1, "/style.css") == 200);
+	CHECK(stats->reused == 3);
+
+	// Browsers ask for keep-alive on every page load
+	for (port = 2000; port < 2000 + 4 * ADMIT_CONNS; port++) {
+		CHECK(_get_from(port, 1, "/index.tpl") == 200);
+		sim_http_close(port);
+	}
+	CHECK(admit_stats()->open == ADMIT_CONNS - ADMIT_RESERVE - 1);
+
+	// Idle connections are closed by the SDK, closed ones free their slot
+	sim_run((ADMIT_IDLE_MS + 100) * 1000ULL);
+	CHECK(admit_stats()->open == 0);
+	for (port = 0; port < 2 * ADMIT_CONNS; port++) {
+		CHECK(_get_from(0, 0, "/style.css") == 200);
+	}
+	CHECK(admit_stats()->open == 0);
+
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "http_conn_reused 3\n"));
+	CHECK(_contains(&resp, "http_rejected_control 1\n"));
+	sim_response_free(&resp);
+}
+
+static void test_web_relay_timer(void) {
+	struct SimResponse resp;
+	struct config conf;
+
+	_boot(20, 50);
+	conf = config_read();
+	conf.ch[0].time = 2;
+	conf.ch[0].off = 1;
+	config_save(conf);
+
+	// A channel that does not exist switches nothing
+	CHECK(_get("/relay.cgi?channel=7&relay=on", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(_get("/relay.cgi?channel=x&relay=on", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(_get("/relayconfig.cgi?channel=-1&relay=on", &resp) == 400);
+	sim_response_free(&resp);
+	CHECK(io_get_mask() == 0 && config_read().ch[0].off == 1);
+
+	CHECK(_get("/relay.cgi?relay=on", &resp) == 302);
+	sim_response_free(&resp);
+	CHECK(io_get_status(0) == 1);
+
+	sim_run(60 * 1000000ULL);
+	CHECK(io_get_status(0) == 1);
+	sim_run(61 * 1000000ULL);
+	CHECK(io_get_status(0) == 0);
+}
+
+static void test_warm_boot(void) {
+	struct SimResponse resp;
+
+	_boot(25, 45);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(_get("/relay.cgi?relay=on", &resp) == 302);
+	sim_response_free(&resp);
+
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	CHECK(dht_read(0)->success);
+	CHECK(io_get_status(0) == 1);
+	CHECK(sim_gpio_out() & (1 << 2));
+	CHECK(rtcstate_warm());
+
+	// After a power cycle nothing is restored
+	sim_reset(REASON_DEFAULT_RST);
+	sim_boot();
+	CHECK(!rtcstate_warm());
+}
+
+static void test_warm_boot_rule(void) {
+	struct config conf;
+
+	_boot(20, 80);
+	conf = config_read();
+	conf.ch[0].hum = 70;
+	conf.ch[0].off = 0;
+	config_save(conf);
+	sim_run(40 * 1000000ULL);
+	CHECK(io_get_status(0) == 1);
+
+	// RAM does not survive the reset on the device, only RTC memory
+	sim_reset(REASON_SOFT_RESTART);
+	action_restore(0);
+	sim_boot();
+	CHECK(io_get_status(0) == 1);
+
+	// The relay the rule turned on is still turned off by it
+	sim_dht_set(20, 50);
+	sim_run(60 * 1000000ULL);
+	CHECK(io_get_status(0) == 0);
+}
+
+static void test_mqtt(void) {
+	struct Broker b;
+	struct config conf;
+	char cmd[64];
+	uint32 heap;
+	int port, n, i;
+
+	_boot(21, 50);
+	// Readings every POOLTIME, the queue is counted in them
+	sampler_init(POOLTIME, POOLTIME);
+	// The relay switched on below stays on through the outage
+	conf = config_read();
+	conf.ch[0].time = 120;
+	config_save(conf);
+	port = _broker_listen(&b);
+
+	// Without a broker the client takes no RAM
+	heap = system_get_free_heap_size();
+	mqtt_init("", port);
+	CHECK(system_get_free_heap_size() == heap);
+	mqtt_init("127.0.0.1", port);
+	CHECK(system_get_free_heap_size() < heap - MQTT_QUEUE * 16);
+
+	CHECK(_broker_accept(&b));
+	_broker_poll(&b);
+	CHECK(b.len > 0 && b.data[0] == 0x10 && _mem_find(b.data, b.len, "MQTT"));
+
+	b.len = b.parsed = 0;
+	_broker_send(&b, "\x20\x02\x00\x00", 4);
+	CHECK(mqtt_connected());
+	CHECK(_mem_find(b.data, b.len, "box/00c0ffee/relay/+/set"));
+	CHECK(_mem_find(b.data, b.len, "online"));
+
+	// Samples go out in a batch when the flush timer fires
+	b.len = b.parsed = 0;
+	_broker_run(&b, MQTT_BATCH_MS / 1000 + 1);
+	CHECK(_mem_find(b.data, b.len, "box/00c0ffee/samples"));
+	CHECK(_mem_find(b.data, b.len, ",21.0,50.0]"));
+	CHECK(mqtt_queued() == 0);
+
+	// A channel that is not a number or does not exist switches nothing
+	for (i = 0; i < 4; i++) {
+		const char *bad[] = {"abc", "", "7", "0x"};
+
+		n = sprintf(cmd + 4, "box/00c0ffee/relay/%s/set", bad[i]);
+		cmd[0] = 0x30;
+		cmd[1] = n + 4;
+		cmd[2] = 0;
+		cmd[3] = n;
+		memcpy(cmd + 4 + n, "on", 2);
+		_broker_send(&b, cmd, n + 6);
+	}
+	_broker_poll(&b);
+	CHECK(io_get_status(0) == 0 && mqtt_stats()->commands == 0);
+
+	// Relay command, the change is published at once
+	b.len = b.parsed = 0;
+	n = sprintf(cmd + 2, "%c%cbox/00c0ffee/relay/0/seton", 0, 24);
+	cmd[0] = 0x30;
+	cmd[1] = n;
+	_broker_send(&b, cmd, n + 2);
+	_broker_poll(&b);
+	CHECK(io_get_status(0) == 1);
+	CHECK(mqtt_stats()->commands == 1);
+	CHECK(_mem_find(b.data, b.len, "box/00c0ffee/relays"));
+	CHECK(_mem_find(b.data, b.len, ",0,1]]"));
+
+	// Broker outage, samples are queued and sent in bulk on reconnect
+	close(b.fd);
+	b.fd = -1;
+	sim_net_poll(10);
+	CHECK(!mqtt_connected());
+	sim_run(10 * 60 * 1000000ULL);
+	n = mqtt_queued();
+	CHECK(n >= 19);
+
+	CHECK(_broker_accept(&b));
+	_broker_poll(&b);
+	CHECK(b.len > 0 && b.data[0] == 0x10);
+	b.len = b.parsed = 0;
+	_broker_send(&b, "\x20\x02\x00\x00", 4);
+	_broker_poll(&b);
+	CHECK(mqtt_queued() == 0);
+	CHECK(_mem_count(b.data, b.len, ",50.0]") == n);
+	CHECK(mqtt_stats()->connects == 2);
+	CHECK(mqtt_stats()->dropped == 0);
+}
+
+static void test_mqtt_stall(void) {
+	struct Broker b;
+	char buff[16];
+	int port;
+
+	_boot(21, 50);
+	sampler_init(POOLTIME, POOLTIME);
+	port = _broker_listen(&b);
+	mqtt_init("127.0.0.1", port);
+
+	// A broker that takes the connection and never answers is dropped
+	CHECK(_broker_accept(&b));
+	_broker_run(&b, MQTT_CONNACK_MS / 1000 - 1);
+	CHECK(recv(b.fd, buff, sizeof(buff), MSG_DONTWAIT) < 0);
+	_broker_run(&b, 2);
+	CHECK(recv(b.fd, buff, sizeof(buff), MSG_DONTWAIT) == 0);
+	CHECK(!mqtt_connected());
+	close(b.fd);
+	b.fd = -1;
+
+	// And tried again
+	_broker_run(&b, MQTT_RECONNECT_MS / 1000 + 1);
+	CHECK(_broker_accept(&b));
+	_broker_send(&b, "\x20\x02\x00\x00", 4);
+	CHECK(mqtt_connected());
+	CHECK(mqtt_queued() == 0);
+
+	// A buffer the SDK does not take keeps its events for the next one
+	b.len = b.parsed = 0;
+	sim_net_send_fail(1);
+	io_manual(0, 1);
+	CHECK(mqtt_stats()->sendFailures == 1);
+	CHECK(mqtt_queued() == 1);
+	_broker_run(&b, MQTT_KEEPALIVE / 2 + 1);
+	CHECK(_mem_find(b.data, b.len, ",0,1]]"));
+	CHECK(mqtt_connected() && mqtt_stats()->connects == 1);
+}
+
+static void test_coap(void) {
+	struct CoapMsg resp, note;
+	struct sockaddr_in addr;
+	char history[4096];
+	int fd, len, num, lines, i;
+
+	_boot(21, 50);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+	CHECK(_coap_request(fd, 1, "reading", -1, -1, NULL, &resp) == 0x45);
+	CHECK(resp.type == 2);
+	CHECK(strstr(resp.payload, "\"t\":21.0,\"h\":50.0") != NULL);
+
+	CHECK(_coap_request(fd, 1, ".well-known/core", -1, -1, NULL, &resp) == 0x45);
+	CHECK(strstr(resp.payload, "</reading>;ct=50;obs") != NULL);
+
+	CHECK(_coap_request(fd, 4, "reading", -1, -1, NULL, &resp) == 0x85);
+	CHECK(_coap_request(fd, 1, "nothing", -1, -1, NULL, &resp) == 0x84);
+
+	// Observe the reading, the next sample is pushed
+	CHECK(_coap_request(fd, 1, "reading", 0, -1, NULL, &resp) == 0x45);
+	CHECK(resp.observe == 0);
+	sim_dht_set(23.5, 60);
+	sim_run(POOLTIME * 1000ULL);
+	CHECK(_coap_wait(fd, &note) == 0x45);
+	CHECK(_mem_find(note.payload, note.plen, "23.5"));
+	CHECK(_coap_request(fd, 1, "reading", 1, -1, NULL, &resp) == 0x45);
+	sim_run(POOLTIME * 1000ULL);
+	CHECK(_coap_wait(fd, &note) < 0);
+
+	// Relay set goes through io_manual(), like relay.cgi
+	CHECK(_coap_request(fd, 3, "relay/0", -1, -1, "on", &resp) == 0x44);
+	CHECK(io_get_status(0) == 1);
+	CHECK(_coap_request(fd, 1, "relay", -1, -1, NULL, &resp) == 0x45);
+	CHECK(!strcmp(resp.payload, "[1]"));
+	CHECK(_coap_request(fd, 3, "relay/0", -1, -1, "maybe", &resp) == 0x80);
+	CHECK(_coap_request(fd, 3, "relay/9", -1, -1, "on", &resp) == 0x84);
+
+	// History in 64 byte blocks
+	sim_run(30 * 60 * 1000000ULL);
+	CHECK(_coap_request(fd, 1, "history", -1, -1, NULL, &resp) == 0x45);
+	CHECK(resp.block2 == 0x0b);
+	CHECK(resp.plen == 128);
+
+	len = 0;
+
+	for (num = 0; num < 60; num++) {
+		CHECK(_coap_request(fd, 1, "history", -1, (num << 4) | 2, NULL, &resp) == 0x45);
+		CHECK((resp.block2 >> 4) == num);
+		memcpy(history + len, resp.payload, resp.plen);
+		len += resp.plen;
+
+		if (!(resp.block2 & 8)) break;
+
+		CHECK(resp.plen == 64);
+	}
+
+	history[len] = 0;
+
+	for (i = 0, lines = 0; i < len; i++) lines += history[i] == '\n';
+
+	CHECK(lines == history_count() + 1);
+	CHECK(history_count() > 20);
+	CHECK(strstr(history, "uptime_s,temperature,humidity\n") == history);
+
+	// Second 256 byte block, in one of ours from the same offset
+	CHECK(len > 384);
+	CHECK(_coap_request(fd, 1, "history", -1, (1 << 4) | 4, NULL, &resp) == 0x45);
+	CHECK(resp.block2 == ((2 << 4) | 8 | 3));
+	CHECK(resp.plen == 128 && !memcmp(resp.payload, history + 256, 128));
+
+	// Datagram ending inside the extended delta of an option
+	CHECK(_coap_raw(fd, "\x40\x01\x12\x34\xd0", 5, &resp) == 0x80);
+	CHECK(_coap_raw(fd, "\x40\x01\x12\x35\x1e\x01", 6, &resp) == 0x80);
+	close(fd);
+}
+
+static void test_telemetry(void) {
+	struct SimResponse resp;
+	struct box_telemetry t;
+	const uint8 *body;
+	uint8 bad[TELEMETRY_SIZE];
+	int len;
+
+	_boot(-3.5, 40);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	_get("/relay.cgi?relay=on", &resp);
+	sim_response_free(&resp);
+
+	// Binary form through content negotiation
+	sim_http_headers("Host: box\r\nAccept: application/octet-stream\r\n\r\n");
+	CHECK(_get("/telemetry", &resp) == 200);
+	CHECK(_contains(&resp, "Content-Type: application/octet-stream"));
+	CHECK(_contains(&resp, "Vary: Accept"));
+	body = _body(&resp, &len);
+	CHECK(len == TELEMETRY_SIZE);
+	CHECK(box_telemetry_decode(body, len, &t) == TELEMETRY_SIZE);
+	CHECK(t.version == TELEMETRY_VERSION);
+	CHECK(t.temperature == -3.5f);
+	CHECK(t.humidity == 40.0f);
+	CHECK(t.ok == 1);
+	CHECK(t.channels == IO_CHANNELS);
+	CHECK(box_telemetry_relay(&t, 0) == 1);
+	CHECK(t.dht_reads == dht_stats()->reads);
+	CHECK(t.heap_free > 0);
+
+	// Corrupted and truncated records are rejected
+	memcpy(bad, body, TELEMETRY_SIZE);
+	CHECK(box_telemetry_decode(bad, TELEMETRY_SIZE - 1, &t) == BOX_TELEMETRY_ESHORT);
+	bad[0] = 'X';
+	CHECK(box_telemetry_decode(bad, TELEMETRY_SIZE, &t) == BOX_TELEMETRY_EMAGIC);
+	sim_response_free(&resp);
+
+	// JSON by default, and the format argument wins over the Accept header
+	CHECK(_get("/telemetry", &resp) == 200);
+	CHECK(_contains(&resp, "Content-Type: application/json"));
+	CHECK(_contains(&resp, "\"t\":-3.5,\"h\":40.0,\"ok\":1,\"relays\":[1]"));
+	sim_response_free(&resp);
+
+	sim_http_headers("Accept: application/octet-stream\r\n\r\n");
+	CHECK(_get("/telemetry?format=json", &resp) == 200);
+	CHECK(_contains(&resp, "\"v\":1"));
+	sim_response_free(&resp);
+
+	CHECK(_get("/telemetry?format=bin", &resp) == 200);
+	body = _body(&resp, &len);
+	CHECK(box_telemetry_decode(body, len, &t) == TELEMETRY_SIZE);
+	sim_response_free(&resp);
+}
+
+static void test_flashlog(void) {
+	struct SimResponse resp;
+	struct FlashLogRecord r;
+	uint32 min = 0xffffffff, max = 0, total = 0;
+	uint32 first, config;
+	char url[64];
+	int i, lines;
+
+	_boot(20.5, 50);
+	if (flashlog_sectors() == 0) return;
+	sampler_init(POOLTIME, POOLTIME);
+
+	sim_run((DHT_STARTUP_MS + 100) * 1000 + 20 * POOLTIME * 1000ULL);
+	CHECK(flashlog_stats()->samples == 21);
+	CHECK(flashlog_stats()->writes == 21 / FLASHLOG_BATCH);
+
+	// Samples in flash and those still in RAM are all exported
+	CHECK(_get("/log.csv", &resp) == 200);
+	CHECK(_contains(&resp, "X-Log-Time: "));
+	CHECK(_contains(&resp, "time_s,boot,temperature,humidity\n"));
+	CHECK(_mem_count(resp.data, resp.len, ",0,20.5,50.0\n") == 21);
+	sim_response_free(&resp);
+
+	// Only samples written to flash survive a reset, in a new boot
+	sim_reset(REASON_DEFAULT_RST);
+	sim_boot();
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	CHECK(_get("/log.csv", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, ",0,20.5,50.0\n") == 16);
+	CHECK(_mem_count(resp.data, resp.len, ",1,20.5,50.0\n") == 1);
+	sim_response_free(&resp);
+
+	// A range starts at the right sample
+	first = flashlog_now() - 5 * POOLTIME / 1000;
+	snprintf(url, sizeof(url), "/log.csv?last=%d", 5 * POOLTIME / 1000);
+	CHECK(_get(url, &resp) == 200);
+	lines = _mem_count(resp.data, resp.len, "\n") - 7;
+	CHECK(lines == 1);
+	sim_response_free(&resp);
+	snprintf(url, sizeof(url), "/log.csv?from=0&to=%u", (unsigned int)first);
+	CHECK(_get(url, &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, ",0,20.5,50.0\n") == 16);
+	sim_response_free(&resp);
+
+	// A million samples wear every log sector the same, one erase per
+	// 496 samples, and nothing else is touched
+	config = sim_flash_erases(0x7B) + sim_flash_erases(0x7C);
+	r.time = flashlog_now();
+	r.temp = 215;
+	r.hum = 600;
+	for (i = 0; i < 1000000; i++) {
+		r.time++;
+		flashlog_add(&r);
+	}
+
+	for (i = 0; i < sim_flash_sectors(); i++) {
+		uint32 e = sim_flash_erases(i);
+
+		if (i == 0x7B || i == 0x7C) continue;
+		total += e;
+		if (e == 0) continue;
+		if (e < min) min = e;
+		if (e > max) max = e;
+	}
+
+	printf("  %u erases per million samples over %d sectors\n", (unsigned int)total, flashlog_sectors());
+	CHECK(total <= 1000000 / 496 + 2);
+	CHECK(max - min <= 1);
+	CHECK(sim_flash_erases(0x7B) + sim_flash_erases(0x7C) == config);
+	CHECK(flashlog_stats()->errors == 0);
+
+	// The newest samples are found after many trips round the ring
+	snprintf(url, sizeof(url), "/log.csv?from=%u", (unsigned int)(r.time - 9));
+	CHECK(_get(url, &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, ",21.5,60.0\n") == 10);
+	sim_response_free(&resp);
+}
+
+static void test_flashlog_empty_page(void) {
+	struct FlashLogRecord r;
+	uint32 last;
+
+	_boot(20.5, 50);
+	if (flashlog_sectors() == 0) return;
+	sampler_init(POOLTIME, POOLTIME);
+	sim_run((DHT_STARTUP_MS + 100) * 1000 + 20 * POOLTIME * 1000ULL);
+	flashlog_flush();
+	last = flashlog_now();
+
+	// The next boot writes the header of its page, but not its samples
+	sim_reset(REASON_DEFAULT_RST);
+	sim_boot();
+	sim_run(1000);
+	r.time = flashlog_now();
+	r.temp = 205;
+	r.hum = 500;
+	flashlog_add(&r);
+	sim_flash_fail(1, 1);
+	flashlog_flush();
+	CHECK(flashlog_stats()->errors == 1);
+
+	// Log time goes on from the last sample of the first boot. The host
+	// clock is not reset, so the uptime is taken off.
+	sim_reset(REASON_DEFAULT_RST);
+	sim_boot();
+	sim_run(1000);
+	CHECK(flashlog_now() - boot_uptime() + POOLTIME / 1000 >= last);
+}
+
+static void test_series(void) {
+	static struct HistorySample trace[5000];
+	struct HistorySample edge[] = {
+		{100, 215, 550}, {130, 216, 548}, {160, -400, 1000}, {4000000000u, 800, 0},
+		{4000000030u, -32768, 32767}, {4000000031u, 32767, -32768}, {4000000031u, 0, 0}
+	};
+	struct SeriesState enc, dec;
+	struct HistorySample s;
+	uint8 buff[5000 * SERIES_MAX_BYTES];
+	int i, len = 0, pos = 0, n;
+
+	// Edge cases and a realistic trace come back exactly
+	series_start(&enc, &edge[0]);
+	for (i = 1; i < 7; i++) len += series_encode(&enc, &edge[i], buff + len);
+
+	series_start(&dec, &edge[0]);
+	for (i = 1; i < 7; i++) {
+		n = series_decode(&dec, buff + pos, len - pos, &s);
+		CHECK(n > 0);
+		CHECK(s.up == edge[i].up && s.temp == edge[i].temp && s.hum == edge[i].hum);
+		pos += n;
+	}
+	CHECK(pos == len);
+
+	_dht22_trace(trace, 5000);
+	series_start(&enc, &trace[0]);
+	for (i = 1, len = 0; i < 5000; i++) len += series_encode(&enc, &trace[i], buff + len);
+	CHECK(len < 5000 * 3 / 2);
+
+	// A stream cut in the middle of a sample is resumed once more bytes come
+	series_start(&dec, &trace[0]);
+	for (i = 1, pos = 0; i < 5000; i++) {
+		CHECK(series_decode(&dec, buff + pos, 0, &s) == 0);
+		n = series_decode(&dec, buff + pos, len - pos, &s);
+		CHECK(n > 0);
+		CHECK(s.up == trace[i].up && s.temp == trace[i].temp && s.hum == trace[i].hum);
+		pos += n;
+	}
+
+	// The history holds several times the 128 raw samples it used to
+	_boot(20, 50);
+	for (i = 0; i < 5000; i++) history_add(&trace[i]);
+	printf("  %d samples in the history\n", history_count());
+	CHECK(history_count() > 5 * 128);
+
+	n = history_count();
+	for (i = 0; i < n; i++) {
+		CHECK(history_get(i, &s) == 0);
+		CHECK(s.up == trace[5000 - n + i].up && s.hum == trace[5000 - n + i].hum);
+	}
+	CHECK(history_get(n, &s) == 1);
+	CHECK(history_get(n / 2, &s) == 0 && s.temp == trace[5000 - n + n / 2].temp);
+	CHECK(history_get(3, &s) == 0 && s.temp == trace[5000 - n + 3].temp);
+}
+
+static void test_rollup(void) {
+	struct SimResponse resp;
+	struct RollupBucket b;
+	uint32 start, up = 0;
+	int i;
+
+	_boot(20, 50);
+
+	// All tiers together stay well under 2 KB of RAM
+	CHECK(sizeof(struct RollupBucket) == 14);
+	CHECK(sizeof(struct RollupBucket) * (ROLLUP_MINUTES + ROLLUP_QUARTERS + ROLLUP_HOURS) < 1600);
+
+	// Eight days of readings, the temperature ramps up within each hour
+	for (i = 0; i < 8 * 24 * 120; i++) {
+		up = i * 30;
+		rollup_add(up, 200 + (i % 120) / 12, 500);
+	}
+
+	CHECK(rollup_count(ROLLUP_1M) == ROLLUP_MINUTES);
+	CHECK(rollup_count(ROLLUP_15M) == ROLLUP_QUARTERS);
+	CHECK(rollup_count(ROLLUP_1H) == ROLLUP_HOURS);
+
+	CHECK(rollup_get(ROLLUP_1H, ROLLUP_HOURS - 1, &start, &b) == 0);
+	CHECK(start == up / 3600 * 3600);
+	CHECK(b.count == 120 && b.tmin == 200 && b.tmax == 209 && b.hmin == 500 && b.hmax == 500);
+	CHECK(rollup_get(ROLLUP_1H, ROLLUP_HOURS, &start, &b) == 1);
+	CHECK(rollup_get(ROLLUP_15M, 0, &start, &b) == 0 && b.count == 30);
+	CHECK(rollup_get(ROLLUP_1M, 0, &start, &b) == 0 && b.count == 2);
+
+	// A day at 1 hour resolution is a few hundred bytes
+	CHECK(_get("/rollup?res=1h&n=24", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, ",120,20.0,20.5,20.9,50.0,50.0,50.0\n") == 24);
+	printf("  %d bytes for a day of hourly buckets\n", resp.len);
+	CHECK(resp.len < 1200);
+	sim_response_free(&resp);
+
+	CHECK(_get("/rollup", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, "\n") - 6 == ROLLUP_QUARTERS);
+	sim_response_free(&resp);
+
+	CHECK(_get("/rollup?res=2h", &resp) == 400);
+	sim_response_free(&resp);
+
+	// Periods without readings are cleared and left out
+	rollup_add(up + 3 * 3600, 300, 600);
+	CHECK(rollup_count(ROLLUP_1H) == ROLLUP_HOURS);
+	CHECK(rollup_get(ROLLUP_1H, ROLLUP_HOURS - 2, &start, &b) == 0 && b.count == 0);
+	CHECK(_get("/rollup?res=1h&n=4", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, "\n") - 6 == 2);
+	CHECK(_contains(&resp, ",1,30.0,30.0,30.0,60.0,60.0,60.0\n"));
+	sim_response_free(&resp);
+}
+
+static void test_chart(void) {
+	static struct HistorySample trace[1000];
+	struct SimResponse resp;
+	char etag[32], headers[64];
+	const char *p;
+	int i;
+
+	_boot(20, 50);
+
+	// No readings yet, still a valid image
+	CHECK(_get("/chart.svg", &resp) == 200);
+	CHECK(_contains(&resp, "<svg ") && _contains(&resp, "</svg>\n"));
+	CHECK(!_contains(&resp, "polyline"));
+	sim_response_free(&resp);
+
+	_dht22_trace(trace, 1000);
+	for (i = 0; i < 200; i++) history_add(&trace[i]);
+
+	CHECK(_get("/chart.svg", &resp) == 200);
+	CHECK(_contains(&resp, "Content-Type: image/svg+xml"));
+	CHECK(_mem_count(resp.data, resp.len, "<polyline") == 2);
+	// One point per sample and line, each point ends with a space
+	CHECK(_mem_count(resp.data, resp.len, " ") - _mem_count(resp.data, resp.len, "\" ") > 2 * 120);
+	CHECK(_mem_count(resp.data, resp.len, ",") < 2 * 130);
+	CHECK(_contains(&resp, "C</text>") && _contains(&resp, "%</text>"));
+	CHECK(_contains(&resp, "</svg>\n"));
+	printf("  %d bytes for a chart of 120 samples\n", resp.len);
+
+	p = strstr(resp.data, "ETag: ");
+	CHECK(p != NULL);
+	if (p != NULL) sscanf(p + 6, "%31s", etag);
+	sim_response_free(&resp);
+
+	// Nothing new, nothing sent
+	snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n\r\n", etag);
+	sim_http_headers(headers);
+	CHECK(_get("/chart.svg", &resp) == 304);
+	CHECK(!_contains(&resp, "<svg"));
+	sim_response_free(&resp);
+
+	history_add(&trace[200]);
+	sim_http_headers(headers);
+	CHECK(_get("/chart.svg", &resp) == 200);
+	sim_response_free(&resp);
+
+	// Long spans are thinned to the width of the chart
+	for (i = 201; i < 1000; i++) history_add(&trace[i]);
+	CHECK(_get("/chart.svg?n=1000", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, ",") <= 2 * 302 + 4);
+	CHECK(_contains(&resp, " 299,"));
+	sim_response_free(&resp);
+}
+
+static void test_args(void) {
+	struct Args a;
+	char q[512], copy[512], want[ARGS_MAX][2][32];
+	int i, k, round;
+
+	strcpy(q, "channel=2&relay=on&humidity=55&temperature=-3&time=10");
+	CHECK(args_parse(&a, q) == 5);
+	CHECK(args_int(&a, "channel", 0) == 2);
+	CHECK(!strcmp(args_get(&a, "relay"), "on"));
+	CHECK(args_int(&a, "temperature", 0) == -3);
+	CHECK(args_get(&a, "missing") == NULL && args_int(&a, "missing", 7) == 7);
+	i = 7;
+	CHECK(args_num(&a, "temperature", &i) == 0 && i == -3);
+	CHECK(args_num(&a, "missing", &i) == 0 && i == -3);
+	CHECK(args_num(&a, "relay", &i) == -1 && i == -3);
+
+	strcpy(q, "essid=My+Net%21&passwd=a%26b%3Dc&flag&&empty=&bad=%zz%4");
+	CHECK(args_parse(&a, q) == 5);
+	CHECK(!strcmp(args_get(&a, "essid"), "My Net!"));
+	CHECK(!strcmp(args_get(&a, "passwd"), "a&b=c"));
+	CHECK(!strcmp(args_get(&a, "flag"), ""));
+	CHECK(!strcmp(args_get(&a, "empty"), ""));
+	CHECK(!strcmp(args_get(&a, "bad"), "%zz%4"));
+
+	strcpy(q, "a=1&b=2&c=3&d=4&e=5&f=6&g=7&h=8&i=9&j=10");
+	CHECK(args_parse(&a, q) == ARGS_MAX);
+	CHECK(args_get(&a, "i") == NULL);
+	CHECK(args_parse(&a, NULL) == 0);
+
+	// Random bytes never make it read or write outside the string
+	srand(7);
+	for (round = 0; round < 200000; round++) {
+		int len = rand() % 64;
+		const char alphabet[] = "ab=&%+1F\r\n\xff";
+
+		for (i = 0; i < len; i++) q[i] = rand() % 4 ? alphabet[rand() % (sizeof(alphabet) - 1)] : rand() % 255 + 1;
+		q[len] = 0;
+		memset(q + len + 1, 0x55, 16);
+
+		k = args_parse(&a, q);
+		CHECK(k >= 0 && k <= ARGS_MAX);
+		for (i = 0; i < k; i++) {
+			CHECK(a.key[i] >= q && a.key[i] + strlen(a.key[i]) <= q + len);
+			CHECK(a.val[i] >= q && a.val[i] + strlen(a.val[i]) <= q + len);
+		}
+		CHECK(q[len + 1] == 0x55 && q[len + 16] == 0x55);
+		if (failures) return;
+	}
+
+	// Encoded random pairs come back as they were
+	for (round = 0; round < 20000; round++) {
+		int n = rand() % ARGS_MAX + 1, len = 0;
+
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < 2; i++) {
+				int l = rand() % 8 + (i == 0);
+				int j;
+
+				for (j = 0; j < l; j++) want[k][i][j] = rand() % 254 + 1;
+				want[k][i][l] = 0;
+				if (i == 0) want[k][0][0] = 'k' + k;
+
+				for (j = 0; j < l; j++) len += sprintf(copy + len, "%%%02X", (unsigned char)want[k][i][j]);
+				copy[len++] = i == 0 ? '=' : '&';
+			}
+		}
+		copy[len] = 0;
+		strcpy(q, copy);
+
+		CHECK(args_parse(&a, q) == n);
+		for (k = 0; k < n; k++) CHECK(args_get(&a, want[k][0]) != NULL && !strcmp(args_get(&a, want[k][0]), want[k][1]));
+		if (failures) return;
+	}
+}
+
+/*
+ * @brief Runs the device until the station connects, returns the time it
+ * took in milliseconds, or -1 after limit_ms.
+ */
+
+static int _wifi_wait(int limit_ms) {
+	int ms;
+
+	for (ms = 0; ms <= limit_ms; ms += 10) {
+		if (wifi_connected()) return ms;
+		sim_run(10000);
+	}
+
+	return -1;
+}
+
+static void test_wifi(void) {
+	struct SimResponse resp;
+	int ms;
+
+	// No access point on boot, the box turns its own on and keeps trying
+	sim_wifi_ap(0, 0);
+	_boot(20, 50);
+	sim_run(4900000);
+	CHECK(!wifi_connected() && wifi_get_opmode() == STATION_MODE);
+	sim_run(200000);
+	CHECK(wifi_get_opmode() == STATIONAP_MODE && wifi_stats()->fallbacks == 1);
+
+	sim_wifi_ap(1, 0);
+	ms = _wifi_wait(WIFI_BACKOFF_MAX_MS + 4000);
+	CHECK(ms >= 0 && wifi_get_opmode() == STATION_MODE);
+
+	// A short drop reconnects to the cached access point without a scan
+	sim_run(60000000);
+	sim_wifi_ap(0, 0);
+	sim_run(100000);
+	sim_wifi_ap(1, 0);
+	ms = _wifi_wait(5000);
+	printf("  %d ms to reconnect after a short drop\n", ms);
+	CHECK(ms >= 0 && ms < 1000);
+	CHECK(wifi_stats()->fastConnects == 1 && wifi_stats()->disconnects == 1);
+	CHECK(wifi_stats()->outageMs < 1000 && wifi_get_opmode() == STATION_MODE);
+
+	// Access point reboot, it comes back on another channel
+	sim_run(60000000);
+	sim_wifi_ap(0, 0);
+	sim_run(45000000);
+	CHECK(!wifi_connected() && wifi_get_opmode() == STATIONAP_MODE);
+	sim_wifi_ap(1, 11);
+	ms = _wifi_wait(WIFI_BACKOFF_MAX_MS + WIFI_FAST_MS + 4000);
+	printf("  %d ms to reconnect after the access point is back\n", ms);
+	CHECK(ms >= 0 && ms < WIFI_BACKOFF_MAX_MS + WIFI_FAST_MS + 4000);
+	CHECK(wifi_get_channel() == 11 && wifi_get_opmode() == STATION_MODE);
+	CHECK(wifi_stats()->fallbacks == 2 && wifi_stats()->failures > 4);
+
+	// Now cached on the new channel
+	sim_run(60000000);
+	sim_wifi_ap(0, 0);
+	sim_run(100000);
+	sim_wifi_ap(1, 0);
+	CHECK(_wifi_wait(5000) < 1000 && wifi_stats()->fastConnects == 2);
+
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "wifi_connected 1\n") && _contains(&resp, "wifi_fast_connects 2\n"));
+	sim_response_free(&resp);
+
+	// The access point is never saved
+	sim_wifi_ap(0, 0);
+	sim_run(10000000);
+	CHECK(wifi_get_opmode() == STATIONAP_MODE);
+	sim_reset(REASON_SOFT_RESTART);
+	CHECK(wifi_get_opmode() == STATION_MODE);
+}
+
+/*
+ * @brief Runs the device until the WiFi is connected in mode, returns the
+ * time it took in milliseconds, or -1 after limit_ms.
+ */
+
+static int _wifi_wait_mode(int mode, int limit_ms) {
+	int ms;
+
+	for (ms = 0; ms <= limit_ms; ms += 10) {
+		if (wifi_connected() && wifi_get_opmode() == mode) return ms;
+		sim_run(10000);
+	}
+
+	return -1;
+}
+
+static void test_wifi_lost(void) {
+	_boot(20, 50);
+	CHECK(_wifi_wait(5000) >= 0);
+
+	// Dropped by the access point with the reason we leave with ourselves
+	sim_wifi_drop(REASON_ASSOC_LEAVE);
+	sim_run(100000);
+	CHECK(_wifi_wait(5000) >= 0);
+	CHECK(wifi_stats()->disconnects == 1 && wifi_stats()->connects == 2);
+
+	// The event is lost, the link check finds it
+	sim_wifi_drop(0);
+	sim_run((WIFI_CHECK_MS + 3000) * 1000);
+	CHECK(wifi_connected());
+	CHECK(wifi_stats()->disconnects == 2 && wifi_stats()->connects == 3);
+
+	// Our own disconnects are still not counted
+	CHECK(wifi_switch(STATION_MODE, NULL) == 0);
+	sim_run(5000000);
+	CHECK(wifi_connected() && wifi_stats()->disconnects == 2);
+
+	// Booted without a mode, the station can be turned on later
+	wifi_set_opmode(0);
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	sim_run(100000);
+	CHECK(wifi_get_opmode() == SOFTAP_MODE);
+	CHECK(wifi_switch(STATION_MODE, NULL) == 0);
+	sim_run(WIFI_CONNECT_MS / 2 * 1000);
+	CHECK(wifi_connected() && wifi_get_opmode() == STATION_MODE);
+}
+
+static void test_wifi_switch(void) {
+	struct station_config cfg;
+	struct SimResponse resp;
+	int ms;
+
+	_boot(20, 50);
+	sim_run(100000);
+	CHECK(wifi_connected() && wifi_stats()->connects == 1);
+
+	// Adding the access point to a connected station is immediate
+	CHECK(_get("/wifi/setmode.cgi?mode=3", &resp) == 302);
+	sim_response_free(&resp);
+	CHECK(_wifi_wait_mode(STATIONAP_MODE, 1100) >= 1000);
+	CHECK(wifi_stats()->switchMs == 0);
+
+	CHECK(_get("/wifi/setmode.cgi?mode=2", &resp) == 302);
+	sim_response_free(&resp);
+	sim_run(1100000);
+	CHECK(wifi_get_opmode() == SOFTAP_MODE && !wifi_connected());
+
+	// From AP only back to station, the access point stays up until the
+	// station has an IP
+	CHECK(_get("/wifi/setmode.cgi?mode=1", &resp) == 302);
+	sim_response_free(&resp);
+	sim_run(1100000);
+	CHECK(wifi_get_opmode() == STATIONAP_MODE && !wifi_connected());
+	ms = _wifi_wait_mode(STATION_MODE, 10000);
+	printf("  %d ms from setmode.cgi to station only\n", ms + 1100);
+	CHECK(ms >= 0);
+	CHECK(_get("/wifi/setmode.cgi?mode=9", &resp) == 302);
+	sim_response_free(&resp);
+
+	// Credentials that do not work are rolled back
+	CHECK(sim_http("POST", "/wifi/connect.cgi", "essid=other-net&passwd=box-password", &resp) == 302);
+	sim_response_free(&resp);
+	sim_run(1100000);
+	CHECK(wifi_get_opmode() == STATIONAP_MODE);
+	CHECK(_get("/metrics", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(_wifi_wait_mode(STATION_MODE, 10000) >= 0);
+	CHECK(wifi_stats()->switchFailures == 1);
+	wifi_station_get_config(&cfg);
+	CHECK(!strcmp((char *)cfg.ssid, "box-test"));
+
+	CHECK(sim_http("POST", "/wifi/connect.cgi", "essid=box-test&passwd=wrong", &resp) == 302);
+	sim_response_free(&resp);
+	sim_run(1100000);
+	CHECK(_wifi_wait_mode(STATION_MODE, 10000) >= 0);
+	CHECK(wifi_stats()->switchFailures == 2);
+
+	// New credentials from the fallback access point, saved once connected
+	strcpy((char *)cfg.ssid, "old-net");
+	wifi_station_set_config(&cfg);
+	sim_reset(REASON_SOFT_RESTART);
+	sim_boot();
+	sim_run(10000000);
+	CHECK(!wifi_connected() && wifi_get_opmode() == STATIONAP_MODE);
+
+	CHECK(sim_http("POST", "/wifi/connect.cgi", "essid=box-test&passwd=box-password", &resp) == 302);
+	sim_response_free(&resp);
+	ms = _wifi_wait_mode(STATION_MODE, 10000);
+	printf("  %d ms from connect.cgi to station only\n", ms);
+	CHECK(ms >= 0 && wifi_stats()->switches == 1);
+
+	sim_reset(REASON_SOFT_RESTART);
+	wifi_station_get_config(&cfg);
+	CHECK(!strcmp((char *)cfg.ssid, "box-test") && wifi_get_opmode() == STATION_MODE);
+}
+
+static void test_heap(void) {
+	struct SimResponse resp;
+	void *blocks[POOL_CURSORS + 1];
+	uint32 bytes;
+	char *p;
+	int i;
+
+	_boot(20, 50);
+	bytes = heap_stats()->bytes;
+
+	// Every allocation is counted against its call site
+	p = os_malloc(1000);
+	CHECK(p != NULL && heap_stats()->bytes == bytes + 1000);
+	CHECK(heap_largest_free() == sim_heap_largest_free());
+	os_free(p);
+	CHECK(heap_stats()->bytes == bytes && heap_stats()->peak >= bytes + 1000);
+	CHECK(os_malloc(100000) == NULL && heap_stats()->failures == 1);
+
+	CHECK(_get("/heap", &resp) == 200);
+	CHECK(_contains(&resp, "heap_site_peak{site=\"run.c:"));
+	CHECK(_contains(&resp, "heap_site_bytes{site=\"httpd.c:0\"} 2200\n"));
+	CHECK(_contains(&resp, "heap_alloc_failures 1\n"));
+	CHECK(_contains(&resp, "pool_blocks{pool=\"cursor\"} 8\n"));
+	sim_response_free(&resp);
+
+	// Streaming CGIs take their cursor from the pool, not the heap
+	CHECK(_get("/chart.svg", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(_get("/rollup", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(_get("/log.csv?last=10", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(pool_stats(POOL_CURSOR)->allocs == 3 && pool_stats(POOL_CURSOR)->used == 0);
+	CHECK(heap_stats()->bytes == bytes);
+
+	for (i = 0; i < POOL_CURSORS + 1; i++) blocks[i] = pool_alloc(POOL_CURSOR, POOL_CURSOR_SIZE);
+	CHECK(blocks[POOL_CURSORS - 1] != NULL && blocks[POOL_CURSORS] == NULL);
+	CHECK(pool_stats(POOL_CURSOR)->failures == 1);
+	CHECK(pool_alloc(POOL_AP, POOL_AP_SIZE + 1) == NULL);
+	pool_free(POOL_CURSOR, blocks[3]);
+	pool_free(POOL_CURSOR, blocks[3]);
+	pool_free(POOL_CURSOR, (uint8 *)blocks[2] + 1);
+	CHECK(pool_stats(POOL_CURSOR)->used == POOL_CURSORS - 1);
+	CHECK(pool_alloc(POOL_CURSOR, 1) == blocks[3]);
+
+	// Scans keep the strongest access points in the pool
+	sim_wifi_aps(POOL_APS + 9);
+	CHECK(_get("/wifi/wifiscan.cgi", &resp) == 200);
+	sim_response_free(&resp);
+	sim_run(2000000);
+	CHECK(_get("/wifi/wifiscan.cgi", &resp) == 200);
+	CHECK(_mem_count(resp.data, resp.len, "\"essid\"") == POOL_APS);
+	CHECK(_contains(&resp, "\"sim-ap-15\"") && !_contains(&resp, "\"sim-ap-16\""));
+	sim_response_free(&resp);
+	CHECK(pool_stats(POOL_AP)->used == POOL_APS);
+
+	sim_wifi_aps(3);
+	sim_run(2000000);
+	CHECK(pool_stats(POOL_AP)->used == 3);
+	CHECK(heap_stats()->bytes == bytes);
+}
+
+struct Test {
+	const char *name;
+	void (*fn)(void);
+};
+
+static int _stack_find(const char *name) {
+	int i;
+
+	for (i = 0; i < stack_site_count(); i++) {
+		if (!strcmp(stack_site(i)->name, name)) return i;
+	}
+
+	return -1;
+}
+
+static void __attribute__((noinline)) _stack_use(int bytes) {
+	char buff[bytes];
+
+	memset(buff, 1, bytes);
+	// Keeps the stores, buff is never read
+	__asm__ volatile("" : : "r"(buff) : "memory");
+}
+
+static void __attribute__((noinline)) _stack_nested(void) {
+	_stack_use(256);
+	STACK_CALL("test_inner", _stack_use(1024));
+}
+
+static void test_stack(void) {
+	struct SimResponse resp;
+	int i;
+
+	_boot(20, 50);
+	CHECK(stack_stats()->size == STACK_HOST_BYTES);
+
+	// The use of a handler is found in the paint it overwrote
+	STACK_CALL("test_use", _stack_use(2000));
+	CHECK(stack_site(_stack_find("test_use"))->calls == 1);
+	CHECK(stack_site(_stack_find("test_use"))->peak >= 2000);
+	CHECK(stack_site(_stack_find("test_use"))->peak < 2200);
+
+	// Nested handlers, the outer one counts the inner one
+	STACK_CALL("test_outer", _stack_nested());
+	CHECK(stack_site(_stack_find("test_inner"))->peak >= 1024);
+	CHECK(stack_site(_stack_find("test_inner"))->peak < 1200);
+	CHECK(stack_site(_stack_find("test_outer"))->peak > stack_site(_stack_find("test_inner"))->peak);
+
+	// Paint is put back, a smaller use is measured as such
+	STACK_CALL("test_small", _stack_use(100));
+	CHECK(stack_site(_stack_find("test_small"))->peak < 300);
+
+	CHECK(_get("/index.tpl", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(_get("/wifi/wifi.tpl", &resp) == 200);
+	sim_response_free(&resp);
+	sim_run((uint64)POOLTIME * 1000);
+	CHECK(_stack_find("web_tpl_index") >= 0 && _stack_find("webwifi_tpl") >= 0);
+	CHECK(stack_site(_stack_find("cgiEspFsTemplate"))->calls >= 1);
+	CHECK(stack_site(_stack_find("pagecache_cgi"))->calls >= 1);
+	CHECK(stack_site(_stack_find("dht_poll"))->calls >= 1);
+
+	// Ranked, deepest first
+	for (i = 1; i < stack_site_count(); i++) {
+		CHECK(stack_site(stack_site_ranked(i - 1))->peak >= stack_site(stack_site_ranked(i))->peak);
+	}
+
+	CHECK(_get("/stack", &resp) == 200);
+	CHECK(_contains(&resp, "stack_handler_peak{handler=\"test_outer\"}"));
+	CHECK(_contains(&resp, "stack_handler_calls{handler=\"dht_poll\"}"));
+	CHECK(strstr(resp.data, "\"test_outer\"") < strstr(resp.data, "\"test_small\""));
+	sim_response_free(&resp);
+	CHECK(stack_site(_stack_find("metrics_stack_cgi"))->calls >= 2);
+
+	// Going past the end of the paint is flagged
+	CHECK(stack_stats()->exhausted == 0);
+	STACK_CALL("test_deep", _stack_use(STACK_HOST_BYTES + 1024));
+	CHECK(stack_stats()->exhausted == 1 && stack_stats()->peak == stack_stats()->size);
+}
+
+static void test_pagecache(void) {
+	struct SimResponse first, resp;
+	struct config conf;
+	char url[64];
+
+	_boot(21.5, 40);
+	sampler_init(POOLTIME, POOLTIME);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+
+	// Rendered once per generation, then served as it was
+	CHECK(_get("/index.tpl", &first) == 200);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	CHECK(pagecache_stats()->misses == 1 && pagecache_stats()->hits == 1);
+	CHECK(resp.len == first.len && !memcmp(resp.data, first.data, resp.len));
+	CHECK(_contains(&resp, "21.5") && _contains(&resp, "Relay 0 status: <b>off</b>"));
+	sim_response_free(&first);
+	sim_response_free(&resp);
+
+	// A relay change
+	CHECK(_get("/relay.cgi?relay=on", &resp) == 302);
+	sim_response_free(&resp);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	CHECK(_contains(&resp, "Relay 0 status: <b>on</b>"));
+	sim_response_free(&resp);
+	CHECK(pagecache_stats()->misses == 2);
+
+	// A new reading, and a failed one
+	sim_dht_set(23.5, 40);
+	sim_run((uint64)POOLTIME * 1000);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	CHECK(_contains(&resp, "23.5") && _contains(&resp, "sensor is operating"));
+	sim_response_free(&resp);
+	// Failed with its retries
+	sim_dht_fault(SIM_DHT_NO_RESPONSE, DHT_RETRIES + 1);
+	sim_run((uint64)(POOLTIME + DHT_RETRIES * DHT_RETRY_MS) * 1000);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	CHECK(_contains(&resp, "sensor isn't operating"));
+	sim_response_free(&resp);
+	CHECK(pagecache_stats()->misses == 4);
+
+	// A config save, pages are kept per query string
+	conf = config_read();
+	conf.ch[0].time = 25;
+	config_save(conf);
+	CHECK(_get("/relayconfig.tpl?channel=0", &resp) == 200);
+	CHECK(_contains(&resp, "name=\"time\" value=\"25\""));
+	sim_response_free(&resp);
+	conf.ch[0].time = 30;
+	config_save(conf);
+	CHECK(_get("/relayconfig.tpl?channel=0", &resp) == 200);
+	CHECK(_contains(&resp, "name=\"time\" value=\"30\""));
+	sim_response_free(&resp);
+	CHECK(_get("/index.tpl", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(_get("/relayconfig.tpl?channel=0", &resp) == 200);
+	sim_response_free(&resp);
+	CHECK(pagecache_stats()->hits == 2);
+
+	// Queries too long for a key go to cgiEspFsTemplate
+	snprintf(url, sizeof(url), "/index.tpl?x=%040d", 0);
+	CHECK(_get(url, &resp) == 200);
+	CHECK(_contains(&resp, "23.5"));
+	sim_response_free(&resp);
+	CHECK(pagecache_stats()->bypassed == 1);
+
+	CHECK(_get("/metrics", &resp) == 200);
+	CHECK(_contains(&resp, "pagecache_hits 2\n") && _contains(&resp, "pagecache_hit_rate_pct 20\n"));
+	sim_response_free(&resp);
+}
+
+static const struct Test tests[] = {
+	{"itoa", test_itoa},
+	{"dht_decode", test_dht_decode},
+	{"dht_faults", test_dht_faults},
+	{"dht_retry", test_dht_retry},
+	{"crit", test_crit},
+	{"uptime_wrap", test_uptime_wrap},
+	{"first_sample", test_first_sample},
+	{"config_roundtrip", test_config_roundtrip},
+	{"config_endpoint", test_config_endpoint},
+	{"io_batch", test_io_batch},
+	{"action_threshold", test_action_threshold},
+	{"sampler", test_sampler},
+	{"web_index", test_web_index},
+	{"web_relay_timer", test_web_relay_timer},
+	{"warm_boot", test_warm_boot},
+	{"warm_boot_rule", test_warm_boot_rule},
+	{"mqtt", test_mqtt},
+	{"mqtt_stall", test_mqtt_stall},
+	{"coap", test_coap},
+	{"telemetry", test_telemetry},
+	{"flashlog", test_flashlog},
+	{"flashlog_empty_page", test_flashlog_empty_page},
+	{"series", test_series},
+	{"rollup", test_rollup},
+	{"chart", test_chart},
+	{"args", test_args},
+	{"wifi", test_wifi},
+	{"wifi_lost", test_wifi_lost},
+	{"wifi_switch", test_wifi_switch},
+	{"heap", test_heap},
+	{"stack", test_stack},
+	{"pagecache", test_pagecache},
+	{"ui", test_ui},
+	{"admit", test_admit},
+	{NULL, NULL}
+};
+
+static int run_tests(const char *only) {
+	int failed = 0;
+	int i, status;
+
+	for (i = 0; tests[i].name != NULL; i++) {
+		pid_t pid;
+
+		if (only != NULL && strcmp(only, tests[i].name)) continue;
+
+		fflush(stdout);
+		pid = fork();
+
+		if (pid == 0) {
+			tests[i].fn();
+			// No response of any test may lose data to the send buffer
+			CHECK(sim_http_overflows() == 0);
+			exit(failures ? 1 : 0);
+		}
+
+		waitpid(pid, &status, 0);
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			printf("PASS %s\n", tests[i].name);
+		} else {
+			printf("FAIL %s\n", tests[i].name);
+			failed++;
+		}
+	}
+
+	printf("%d tests failed\n", failed);
+	return failed ? 1 : 0;
+}
+
+/* Micro-benchmarks */
+
+// Budgets, a measure over its budget fails the run
+#define BUDGET_INDEX_NS      200000
+#define BUDGET_INDEX_BYTES   2048
+#define BUDGET_HEAP_PEAK     4096
+#define BUDGET_FIRST_SAMPLE  (DHT_STARTUP_MS * 1000 + 100000)
+
+static int over;
+
+static void _report(const char *name, double value, const char *unit, double budget) {
+	printf("%-28s %12.1f %s", name, value, unit);
+
+	if (budget > 0 && value > budget) {
+		printf("  OVER BUDGET (%.0f)", budget);
+		over++;
+	}
+
+	printf("\n");
+}
+
+static int run_bench(void) {
+	struct SimResponse resp;
+	struct Telemetry t;
+	struct box_telemetry decoded;
+	uint8 record[TELEMETRY_SIZE];
+	char json[TELEMETRY_JSON_MAX];
+	uint64 start, vstart;
+	int i, n;
+	char b[12];
+	long bytes = 0;
+
+	_boot(22.3, 48.7);
+	sim_run((DHT_STARTUP_MS + 100) * 1000);
+	_report("time_to_first_sample", boot_time(BOOT_FIRST_SAMPLE), "us", BUDGET_FIRST_SAMPLE);
+
+	n = 200000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) itoa(i - n / 2, b);
+	_report("itoa", (double)(_host_ns() - start) / n, "ns", 0);
+
+	n = 200;
+	vstart = sim_now_us();
+	start = _host_ns();
+	for (i = 0; i < n; i++) dht_read(1);
+	_report("dht_read_host", (double)(_host_ns() - start) / n, "ns", 0);
+	_report("dht_read_device", (double)(sim_now_us() - vstart) / n, "us", 0);
+
+	n = 2000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) {
+		_get("/index.tpl", &resp);
+		bytes = resp.len;
+		sim_response_free(&resp);
+	}
+	_report("index_render", (double)(_host_ns() - start) / n, "ns", BUDGET_INDEX_NS);
+	_report("index_bytes", bytes, "B", BUDGET_INDEX_BYTES);
+
+	// Every request in a new generation, as without the page cache
+	n = 2000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) {
+		pagecache_bump();
+		_get("/index.tpl", &resp);
+		sim_response_free(&resp);
+	}
+	_report("index_render_miss", (double)(_host_ns() - start) / n, "ns", 0);
+
+	// Home, relay settings and WiFi, as pages and as the single page UI
+	{
+		static const char *pages[] = {"/index.tpl", "/style.css", "/relayconfig.tpl", "/style.css",
+				"/wifi/wifi.tpl", "/style.css", "/wifi/wifi.js", NULL};
+
+		bytes = 0;
+		for (i = 0; pages[i] != NULL; i++) {
+			_get(pages[i], &resp);
+			bytes += resp.len;
+			sim_response_free(&resp);
+		}
+		_report("pages_session_bytes", bytes, "B", 0);
+
+		sim_http_headers("Accept-Encoding: gzip\r\n\r\n");
+		_get("/", &resp);
+		bytes = resp.len;
+		sim_response_free(&resp);
+		_get("/state.json", &resp);
+		bytes += resp.len;
+		_report("ui_session_bytes", bytes, "B", 0);
+		_report("state_json_wire", resp.len, "B", 0);
+		sim_response_free(&resp);
+	}
+
+	n = 2000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) {
+		_get(i & 1 ? "/relay.cgi?relay=on" : "/relay.cgi?relay=off", &resp);
+		sim_response_free(&resp);
+	}
+	_report("relay_cgi", (double)(_host_ns() - start) / n, "ns", 0);
+
+	// Series codec on a day of DHT22 samples, against 8 raw bytes each
+	{
+		static struct HistorySample trace[2880], out;
+		static uint8 coded[2880 * SERIES_MAX_BYTES];
+		struct SeriesState st;
+		int len = 0, pos, rounds = 100, k;
+
+		_dht22_trace(trace, 2880);
+
+		start = _host_ns();
+		for (k = 0; k < rounds; k++) {
+			series_start(&st, &trace[0]);
+			for (i = 1, len = 0; i < 2880; i++) len += series_encode(&st, &trace[i], coded + len);
+		}
+		_report("series_encode", (double)(_host_ns() - start) / rounds / 2879, "ns", 0);
+
+		start = _host_ns();
+		for (k = 0; k < rounds; k++) {
+			series_start(&st, &trace[0]);
+			for (i = 1, pos = 0; i < 2880; i++) pos += series_decode(&st, coded + pos, len - pos, &out);
+		}
+		_report("series_decode", (double)(_host_ns() - start) / rounds / 2879, "ns", 0);
+		_report("series_bytes_per_sample", (double)len / 2879, "B", 0);
+		_report("series_ratio", 2879.0 * sizeof(struct HistorySample) / len, "x", 0);
+	}
+
+	{
+		static struct HistorySample trace[HISTORY_BYTES];
+
+		_dht22_trace(trace, HISTORY_BYTES);
+		for (i = 0; i < HISTORY_BYTES; i++) history_add(&trace[i]);
+
+		n = 1000;
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			_get("/chart.svg", &resp);
+			bytes = resp.len;
+			sim_response_free(&resp);
+		}
+		_report("chart_render", (double)(_host_ns() - start) / n, "ns", 0);
+		_report("chart_bytes", bytes, "B", 0);
+	}
+
+	// One pass over a relayconfig.cgi query against httpdFindArg() per argument
+	{
+		const char *query = "channel=0&relay=on&humidity=60&temperature=40&time=10";
+		const char *keys[] = {"channel", "relay", "humidity", "temperature", "time"};
+		struct Args a;
+		char q[64], buff[16];
+		int k, sum = 0;
+
+		n = 1000000;
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			strcpy(q, query);
+			args_parse(&a, q);
+			for (k = 0; k < 5; k++) sum += args_get(&a, keys[k])[0];
+		}
+		_report("args_parse_5", (double)(_host_ns() - start) / n, "ns", 0);
+
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			strcpy(q, query);
+			for (k = 0; k < 5; k++) sum += httpdFindArg(q, (char *)keys[k], buff, sizeof(buff));
+		}
+		_report("httpd_find_arg_5", (double)(_host_ns() - start) / n, "ns", 0);
+		if (sum == 0) printf("\n");
+	}
+
+	// Cost of the heap monitor on top of the allocator, and of a pool
+	{
+		void *p;
+
+		n = 1000000;
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			p = os_malloc(48);
+			os_free(p);
+		}
+		_report("os_malloc_free", (double)(_host_ns() - start) / n, "ns", 0);
+
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			p = sim_malloc(48);
+			sim_free(p);
+		}
+		_report("sim_malloc_free", (double)(_host_ns() - start) / n, "ns", 0);
+
+		start = _host_ns();
+		for (i = 0; i < n; i++) {
+			p = pool_alloc(POOL_CURSOR, 48);
+			pool_free(POOL_CURSOR, p);
+		}
+		_report("pool_alloc_free", (double)(_host_ns() - start) / n, "ns", 0);
+	}
+
+	// Cost the stack monitor adds to a handler that uses 512 bytes, most of
+	// it is the scan of the paint
+	n = 100000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) STACK_CALL("bench", _stack_use(512));
+	_report("stack_enter_exit", (double)(_host_ns() - start) / n, "ns", 0);
+
+	n = 1000000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) rollup_add(i * 30, 215 + (i & 7), 550 - (i & 3));
+	_report("rollup_add", (double)(_host_ns() - start) / n, "ns", 0);
+
+	// Binary telemetry against JSON, body and whole response
+	telemetry_collect(&t);
+	n = 200000;
+	start = _host_ns();
+	for (i = 0; i < n; i++) bytes = telemetry_encode(&t, record);
+	_report("telemetry_bin_encode", (double)(_host_ns() - start) / n, "ns", 0);
+	_report("telemetry_bin_bytes", bytes, "B", 0);
+
+	start = _host_ns();
+	for (i = 0; i < n; i++) box_telemetry_decode(record, sizeof(record), &decoded);
+	_report("telemetry_bin_decode", (double)(_host_ns() - start) / n, "ns", 0);
+
+	start = _host_ns();
+	for (i = 0; i < n; i++) bytes = telemetry_json(&t, json);
+	_report("telemetry_json_encode", (double)(_host_ns() - start) / n, "ns", 0);
+	_report("telemetry_json_bytes", bytes, "B", 0);
+
+	_get("/telemetry?format=bin", &resp);
+	_report("telemetry_bin_wire", resp.len, "B", 0);
+	sim_response_free(&resp);
+	_get("/telemetry", &resp);
+	_report("telemetry_json_wire", resp.len, "B", 0);
+	sim_response_free(&resp);
+
+	if (flashlog_sectors() > 0) {
+		struct FlashLogRecord r = {flashlog_now(), 225, 550};
+		uint32 erases = sim_flash_total_erases();
+
+		n = 1000000;
+		vstart = sim_now_us();
+		for (i = 0; i < n; i++) {
+			r.time++;
+			flashlog_add(&r);
+		}
+		_report("flashlog_add_device", (double)(sim_now_us() - vstart) / n, "us", 0);
+		_report("flashlog_erases_per_1M", sim_flash_total_erases() - erases, "erases", 0);
+
+		start = _host_ns();
+		_get("/log.csv", &resp);
+		_report("flashlog_export_all", (double)(_host_ns() - start) / 1000000, "ms", 0);
+		_report("flashlog_export_bytes", resp.len, "B", 0);
+		sim_response_free(&resp);
+	}
+
+	n = 50;
+	vstart = sim_now_us();
+	for (i = 0; i < n; i++) config_save(config_read());
+	_report("config_save_device", (double)(sim_now_us() - vstart) / n, "us", 0);
+
+	_report("heap_peak", sim_heap_peak(), "B", BUDGET_HEAP_PEAK);
+
+	return over ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	const char *mode = argc > 1 ? argv[1] : "test";
+
+	if (!strcmp(mode, "test")) return run_tests(argc > 2 ? argv[2] : NULL);
+	if (!strcmp(mode, "bench")) return run_bench();
+
+	fprintf(stderr, "usage: %s test [name] | bench\n", argv[0]);
+	return 2;
+}
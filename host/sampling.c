@@ -0,0 +1,223 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file sampling.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Detection latency against number of readings, fixed and adaptive.
+ *
+ * Runs the firmware on the virtual clock through the same days of a
+ * bathroom: a slow daily swing, sensor noise and showers that push the
+ * humidity over the relay threshold for some minutes. The run is repeated
+ * with fixed intervals and with the adaptive sampler, and for each one it
+ * prints the readings per day and how long the relay took to follow every
+ * crossing of the threshold, up and down. Crossings the relay never saw
+ * because the signal went back first are counted as missed.
+ *
+ * Every run sees the same signal, noise comes from the time and not from
+ * rand(), and each run is in its own process so it starts from a cold boot.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "config.h"
+#include "dht.h"
+#include "io.h"
+#include "sampler.h"
+
+#define US_PER_DAY (86400ULL * 1000000)
+#define TICK_US    100000
+#define MAX_EVENTS 256
+#define MAX_CROSSINGS 4096
+#define THRESHOLD_HUM 70
+
+struct SamplingOptions {
+	double days;
+	double showers_per_day;
+	unsigned int seed;
+};
+
+// Start of every shower, in microseconds of device time
+static uint64 showers[MAX_EVENTS];
+static int showerCount;
+
+static struct SamplingOptions opt = {1, 4, 1};
+
+/*
+ * @brief Humidity added by the showers at time now.
+ *
+ * Rises 25 % in 3 minutes, holds for 5 and decays with a 10 minute time
+ * constant.
+ */
+
+static double _shower(uint64 now) {
+	double total = 0;
+	int i;
+
+	for (i = 0; i < showerCount; i++) {
+		double t = ((double)now - (double)showers[i]) / 60e6;
+
+		if (t < 0) continue;
+
+		if (t < 3) total += 25 * t / 3;
+		else if (t < 8) total += 25;
+		else total += 25 * exp(-(t - 8) / 10);
+	}
+
+	return total;
+}
+
+/*
+ * @brief Noise of the sensor, up to 0.2 either way, the same for every run.
+ */
+
+static double _noise(uint64 now, int salt) {
+	uint32 h = (uint32)(now / TICK_US) * 2654435761u + salt * 40503u;
+
+	h ^= h >> 15;
+	h *= 2246822519u;
+	h ^= h >> 13;
+	return (int)(h % 5 - 2) / 10.0;
+}
+
+static int _cmp_u32(const void *a, const void *b) {
+	uint32 x = *(const uint32 *)a;
+	uint32 y = *(const uint32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * @brief Runs the days with readings every min to max milliseconds and
+ * prints one line of results.
+ */
+
+static void _run(uint32 min, uint32 max) {
+	static uint32 latency[MAX_CROSSINGS];
+	struct config conf;
+	uint64 end, changed = 0;
+	int count = 0, missed = 0, above = 0, pending = 0;
+	double sum = 0;
+	char name[32];
+
+	sim_quiet = 1;
+	sim_reset(REASON_DEFAULT_RST);
+	sim_dht_set(22, 55);
+	sim_boot();
+
+	conf = config_read();
+	conf.ch[0].hum = THRESHOLD_HUM;
+	conf.ch[0].temp = 40;
+	conf.ch[0].off = 0;
+	config_save(conf);
+	sampler_init(min, max);
+
+	end = sim_now_us() + (uint64)(opt.days * US_PER_DAY);
+
+	while (sim_now_us() < end) {
+		uint64 now = sim_now_us();
+		double day = 2 * M_PI * (double)now / US_PER_DAY;
+		double hum = 55 + 8 * cos(day) + _shower(now);
+		double temp = 22 + 3 * sin(day);
+		// Crossings are those of the signal, the sensor adds noise to it
+		int over = hum > THRESHOLD_HUM;
+
+		sim_dht_set(temp + _noise(now, 2), hum + _noise(now, 1));
+
+		if (over != above) {
+			// Went back before the relay followed it
+			if (pending) missed++;
+			pending = !pending;
+			above = over;
+			changed = now;
+		}
+
+		sim_run(TICK_US);
+
+		if (pending && io_get_status(0) == above) {
+			pending = 0;
+			if (count < MAX_CROSSINGS) latency[count++] = (uint32)((sim_now_us() - changed) / 1000);
+			sum += (sim_now_us() - changed) / 1e6;
+		}
+	}
+
+	qsort(latency, count, sizeof(uint32), _cmp_u32);
+
+	if (min == max) sprintf(name, "fixed %u s", (unsigned int)(min / 1000));
+	else sprintf(name, "adaptive %u-%u s", (unsigned int)(min / 1000), (unsigned int)(max / 1000));
+
+	printf("%-20s %10.0f %9d %9.1f %9.1f %9.1f %7d\n", name, dht_stats()->reads / opt.days, count,
+			count ? sum / count : 0, count ? latency[(int)(0.95 * (count - 1) + 0.5)] / 1000.0 : 0,
+			count ? latency[count - 1] / 1000.0 : 0, missed);
+	fflush(stdout);
+}
+
+static void _run_child(uint32 min, uint32 max) {
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid == 0) {
+		_run(min, max);
+		exit(0);
+	}
+
+	waitpid(pid, NULL, 0);
+}
+
+static void _usage(const char *name) {
+	fprintf(stderr, "usage: %s [-d days] [-e showers_per_day] [-S seed]\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	static const uint32 fixed[] = {2000, 5000, 10000, POOLTIME, 60000, SAMPLE_MAX_MS};
+	uint64 span;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "d:e:S:")) != -1) {
+		switch (c) {
+			case 'd': opt.days = atof(optarg); break;
+			case 'e': opt.showers_per_day = atof(optarg); break;
+			case 'S': opt.seed = atoi(optarg); break;
+			default: _usage(argv[0]);
+		}
+	}
+
+	// Showers at random times, after the first reading
+	srand(opt.seed);
+	span = (uint64)(opt.days * US_PER_DAY);
+	showerCount = (int)(opt.days * opt.showers_per_day + 0.5);
+	if (showerCount > MAX_EVENTS) showerCount = MAX_EVENTS;
+	for (i = 0; i < showerCount; i++) showers[i] = 60000000ULL + (uint64)((double)rand() / RAND_MAX * span);
+
+	printf("sampling: %.1f days, %d showers, humidity threshold %d %%, seed %u\n",
+			opt.days, showerCount, THRESHOLD_HUM, opt.seed);
+	printf("%-20s %10s %9s %9s %9s %9s %7s\n", "interval", "reads/day", "crossings", "mean_s", "p95_s", "max_s", "missed");
+
+	for (i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); i++) _run_child(fixed[i], fixed[i]);
+	_run_child(SAMPLE_MIN_MS, SAMPLE_MAX_MS);
+
+	return 0;
+}
@@ -0,0 +1,356 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file serve.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Serves the host build over real TCP, as a stand-in for the device.
+ *
+ * Requests are read from sockets and run through the CGIs of builtInUrls one
+ * at a time, like the single core of the device does. The virtual clock
+ * follows the wall clock, and a response is not written before the device
+ * would have finished it: DHT reads, flash erases and the send cost of the
+ * simulated TCP stack all delay it. With -f responses go out as soon as the
+ * host has them.
+ *
+ * Connections over the libesphttpd pool size are closed on accept. A
+ * connection serves one request, unless the request has "Connection:
+ * keep-alive". Then it stays open for the next one, and is closed after
+ * ADMIT_IDLE_MS without requests, as the SDK does on the device. Kept
+ * alive responses get a Content-Length, where libesphttpd would send them
+ * chunked.
+ *
+ * With -m the MQTT client connects to a broker on the build machine, for
+ * example "serve -m 127.0.0.1:1883" with mosquitto running.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "admit.h"
+#include "mqtt.h"
+
+// Connection pool of libesphttpd
+#define SERVE_MAX_CONN 8
+#define SERVE_REQ_SIZE 2048
+
+struct ServeConn {
+	int fd;
+	int port;
+	char req[SERVE_REQ_SIZE];
+	int len;
+	// Wall clock time of the last response on a kept alive connection
+	uint64 idle;
+};
+
+static struct ServeConn conns[SERVE_MAX_CONN];
+static uint64 wallStart;
+static uint64 simStart;
+static int paced = 1;
+static uint32 served;
+static uint32 reused;
+static uint32 refused;
+
+static uint64 _wall_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * @brief Runs the device up to the current wall clock time.
+ */
+
+static void _serve_sync(void) {
+	uint64 now = _wall_us() - wallStart + simStart;
+
+	if (sim_now_us() < now) sim_run(now - sim_now_us());
+}
+
+/*
+ * @brief Waits until the wall clock catches up with the device, so the host
+ * is never faster than the device would be.
+ */
+
+static void _serve_wait_device(void) {
+	uint64 wall = _wall_us() - wallStart + simStart;
+
+	if (paced && sim_now_us() > wall) usleep(sim_now_us() - wall);
+}
+
+static void _serve_close(struct ServeConn *c) {
+	sim_http_close(c->port);
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+	c->idle = 0;
+}
+
+/*
+ * @brief Returns 1 if the buffer holds a whole request, headers and body.
+ */
+
+static int _serve_complete(struct ServeConn *c, char **body) {
+	char *end = strstr(c->req, "\r\n\r\n");
+	char *cl;
+	int length = 0;
+
+	if (end == NULL) return 0;
+
+	cl = strcasestr(c->req, "\r\nContent-Length:");
+	if (cl != NULL && cl < end) length = atoi(cl + 17);
+
+	*body = end + 4;
+	return c->len - (end + 4 - c->req) >= length;
+}
+
+static void _serve_write(int fd, const char *data, int len) {
+	while (len > 0) {
+		int n = send(fd, data, len, MSG_NOSIGNAL);
+
+		if (n <= 0) return;
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * @brief Writes a response that leaves the connection open, with the
+ * length of its body in the headers.
+ */
+
+static void _serve_write_kept(int fd, struct SimResponse *resp) {
+	char *line = strstr(resp->data, "\r\n") + 2;
+	char *body = strstr(resp->data, "\r\n\r\n") + 4;
+	char *out = malloc(resp->len + 64);
+	int n = line - resp->data;
+
+	// In one write, like the send buffer of libesphttpd
+	memcpy(out, resp->data, n);
+	n += sprintf(out + n, "Connection: keep-alive\r\n");
+	if (strcasestr(resp->data, "\r\nContent-Length:") == NULL) {
+		n += sprintf(out + n, "Content-Length: %d\r\n", (int)(resp->data + resp->len - body));
+	}
+	memcpy(out + n, line, resp->data + resp->len - line);
+	n += resp->data + resp->len - line;
+
+	_serve_write(fd, out, n);
+	free(out);
+}
+
+static void _serve_request(struct ServeConn *c, char *body) {
+	struct SimResponse resp;
+	char method[8], url[512];
+	char *headers = strstr(c->req, "\r\n") + 2;
+	char *conn = strcasestr(headers - 1, "\nConnection:");
+	int status, keep;
+
+	if (sscanf(c->req, "%7s %511s", method, url) != 2) {
+		_serve_close(c);
+		return;
+	}
+
+	keep = conn != NULL && strncasecmp(conn + 12 + strspn(conn + 12, " "), "keep-alive", 10) == 0;
+	if (c->idle) reused++;
+
+	_serve_wait_device();
+	_serve_sync();
+
+	sim_http_headers(headers);
+	sim_http_from(c->port);
+	status = sim_http(method, url, strcmp(method, "POST") ? NULL : body, &resp);
+
+	_serve_wait_device();
+
+	keep = keep && resp.len > 0 && status != 503 && strstr(resp.data, "\r\n\r\n") != NULL;
+
+	if (keep) {
+		_serve_write_kept(c->fd, &resp);
+	} else if (resp.len > 0) {
+		_serve_write(c->fd, resp.data, resp.len);
+	} else if (status == 404) {
+		_serve_write(c->fd, "HTTP/1.0 404 Not Found\r\n\r\n", 26);
+	} else {
+		_serve_write(c->fd, "HTTP/1.0 503 Service Unavailable\r\n\r\n", 36);
+	}
+
+	sim_response_free(&resp);
+	served++;
+
+	if (keep) {
+		c->len = 0;
+		c->idle = _wall_us();
+	} else {
+		_serve_close(c);
+	}
+}
+
+static void _serve_accept(int listenFd) {
+	struct sockaddr_in peer;
+	socklen_t peerLen = sizeof(peer);
+	int fd = accept(listenFd, (struct sockaddr *)&peer, &peerLen);
+	int i;
+
+	if (fd < 0) return;
+
+	for (i = 0; i < SERVE_MAX_CONN; i++) {
+		if (conns[i].fd < 0) {
+			conns[i].fd = fd;
+			conns[i].port = ntohs(peer.sin_port);
+			conns[i].len = 0;
+			conns[i].idle = 0;
+			return;
+		}
+	}
+
+	// Pool is full, libesphttpd drops the connection
+	refused++;
+	close(fd);
+}
+
+static void _serve_read(struct ServeConn *c) {
+	char *body;
+	int n = recv(c->fd, c->req + c->len, SERVE_REQ_SIZE - 1 - c->len, 0);
+
+	if (n <= 0) {
+		_serve_close(c);
+		return;
+	}
+
+	c->len += n;
+	c->req[c->len] = 0;
+
+	if (_serve_complete(c, &body)) {
+		_serve_request(c, body);
+	} else if (c->len >= SERVE_REQ_SIZE - 1) {
+		_serve_close(c);
+	}
+}
+
+static volatile sig_atomic_t stop;
+
+static void _serve_stop(int sig) {
+	stop = 1;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in addr;
+	struct pollfd fds[SERVE_MAX_CONN + 1];
+	int port = 8080;
+	char *broker = NULL;
+	int listenFd, one = 1;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "p:fqm:")) != -1) {
+		switch (c) {
+			case 'p': port = atoi(optarg); break;
+			case 'f': paced = 0; break;
+			case 'q': sim_quiet = 1; break;
+			case 'm': broker = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-f] [-q] [-m broker_ip[:port]]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listenFd, SERVE_MAX_CONN)) {
+		fprintf(stderr, "serve: port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+
+	signal(SIGINT, _serve_stop);
+	signal(SIGTERM, _serve_stop);
+
+	for (i = 0; i < SERVE_MAX_CONN; i++) conns[i].fd = -1;
+
+	sim_reset(REASON_DEFAULT_RST);
+	sim_dht_set(22, 55);
+	sim_boot();
+
+	if (broker != NULL) {
+		char *colon = strchr(broker, ':');
+
+		if (colon != NULL) *colon++ = 0;
+		mqtt_init(broker, colon != NULL ? atoi(colon) : 1883);
+	}
+
+	wallStart = _wall_us();
+	simStart = sim_now_us();
+
+	fprintf(stderr, "serve: listening on 127.0.0.1:%d%s\n", port, paced ? "" : ", not paced");
+
+	while (!stop) {
+		int n = 0;
+
+		fds[n].fd = listenFd;
+		fds[n++].events = POLLIN;
+
+		for (i = 0; i < SERVE_MAX_CONN; i++) {
+			if (conns[i].fd < 0) continue;
+			fds[n].fd = conns[i].fd;
+			fds[n++].events = POLLIN;
+		}
+
+		// Wake up often enough to keep the device timers on time
+		if (poll(fds, n, 10) < 0 && errno != EINTR) break;
+
+		_serve_sync();
+		sim_net_poll(0);
+
+		for (i = 0; i < SERVE_MAX_CONN; i++) {
+			if (conns[i].fd < 0) continue;
+
+			if (conns[i].idle && conns[i].len == 0 && _wall_us() - conns[i].idle > ADMIT_IDLE_MS * 1000ULL) {
+				_serve_close(&conns[i]);
+				continue;
+			}
+
+			for (c = 1; c < n; c++) {
+				if (fds[c].fd == conns[i].fd && (fds[c].revents & (POLLIN | POLLHUP | POLLERR))) {
+					_serve_read(&conns[i]);
+					break;
+				}
+			}
+		}
+
+		if (fds[0].revents & POLLIN) _serve_accept(listenFd);
+	}
+
+	fprintf(stderr, "serve: %u requests served, %u on kept alive connections, %u connections refused, heap peak %u\n",
+			served, reused, refused, (unsigned int)sim_heap_peak());
+	close(listenFd);
+	return 0;
+}
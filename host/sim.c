@@ -0,0 +1,1751 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file sim.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Simulated SDK layer for host builds.
+ *
+ * Everything runs on a virtual clock: os_delay_us() and GPIO reads advance it
+ * and timers fire when sim_run() moves it forward, so hours of device time
+ * take milliseconds. The DHT sensor is simulated at waveform level on GPIO0,
+ * flash is an array of sectors with erase counters and the web server is an
+ * in-memory stand-in that calls the CGIs from builtInUrls.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include <httpdespfs.h>
+#include <espfs.h>
+
+#ifndef ESP_SPI_FLASH_SIZE_K
+#define ESP_SPI_FLASH_SIZE_K 1024
+#endif
+
+#ifndef SIM_HTMLDIR
+#define SIM_HTMLDIR "html"
+#endif
+
+#define SIM_DHT_PIN 0
+#define SIM_FLASH_SIZE (ESP_SPI_FLASH_SIZE_K * 1024)
+#define SIM_FLASH_SECTORS (SIM_FLASH_SIZE / SPI_FLASH_SEC_SIZE)
+#define SIM_RTC_MEM_SIZE 768
+#define SIM_HEAP_SIZE (40 * 1024)
+// Memory libesphttpd allocates for each connection: HttpdConnData, header
+// and send buffers
+#define SIM_CONN_ALLOC 2200
+// MAX_SENDBUFF_LEN of libesphttpd, what one CGI call can send
+#define SIM_SENDBUFF_LEN 2048
+// Connections the web server stand-in keeps open
+#define SIM_HTTP_CONNS 16
+#define SIM_MAX_APS 32
+// Cost of handing data to the TCP stack: per httpdSend() call and per byte
+#define SIM_SEND_CALL_NS 100000
+#define SIM_SEND_BYTE_NS 1000
+// One RTC clock cycle is about 5.75us, cali is given in Q12
+#define SIM_RTC_CALI 23552
+
+void user_init(void);
+static void _sim_wifi_reset(void);
+
+int sim_quiet = 0;
+char webpages_espfs_start[1];
+
+static uint64 simNs;
+static ETSTimer *timers;
+static struct rst_info rstInfo;
+
+static uint32 gpioOut;
+static uint32 gpioEnable;
+static uint64 dhtReleasedNs;
+static uint8 dhtFrame[5];
+static enum SimDhtFault dhtFault;
+static int dhtFaultFrames;
+static int dhtFaultUsed;
+
+static uint8 *flash;
+static uint32 flashErases[SIM_FLASH_SECTORS];
+static uint32 flashWrites;
+// Writes to let through, and then to fail, see sim_flash_fail()
+static int flashFailSkip;
+static int flashFailWrites;
+static uint8 rtcMem[SIM_RTC_MEM_SIZE];
+
+static size_t heapUsed;
+static size_t heapPeak;
+static uint32 heapFailures;
+
+static HttpdBuiltInUrl *urls;
+static const char *reqHeaders;
+static int reqPort;
+static int nextPort = 49152;
+
+/*
+ * Connections of the web server stand-in, by remote port. Like libesphttpd
+ * does, one is closed once answered unless the request asked for
+ * keep-alive, and then by sim_http_close().
+ */
+struct SimHttpConn {
+	struct espconn conn;
+	esp_tcp tcp;
+	int used;
+};
+
+static struct SimHttpConn httpConns[SIM_HTTP_CONNS];
+
+/* Console */
+
+int os_printf(const char *fmt, ...) {
+	va_list ap;
+	int ret;
+
+	if (sim_quiet) return 0;
+
+	va_start(ap, fmt);
+	ret = vprintf(fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void os_install_putc1(void *p) {
+}
+
+void stdout_init(void) {
+}
+
+/*
+ * Heap, a first-fit allocator over an arena as big as the free heap of an
+ * ESP-01 running the web server, so fragmentation shows up like on the
+ * device. Blocks carry an 8 byte header and are 8 byte aligned.
+ */
+
+struct SimBlock {
+	uint32 size;
+	uint32 used;
+};
+
+static uint64 heapArena[SIM_HEAP_SIZE / 8];
+
+static struct SimBlock *_sim_heap_first(void) {
+	struct SimBlock *b = (struct SimBlock *)heapArena;
+
+	if (b->size == 0) {
+		b->size = SIM_HEAP_SIZE;
+		b->used = 0;
+	}
+
+	return b;
+}
+
+static struct SimBlock *_sim_heap_next(struct SimBlock *b) {
+	struct SimBlock *n = (struct SimBlock *)((uint8 *)b + b->size);
+
+	return (uint8 *)n < (uint8 *)heapArena + SIM_HEAP_SIZE ? n : NULL;
+}
+
+void *sim_malloc(size_t size) {
+	uint32 need = ((size + 7) & ~7) + sizeof(struct SimBlock);
+	struct SimBlock *b;
+
+	for (b = _sim_heap_first(); b != NULL; b = _sim_heap_next(b)) {
+		if (b->used || b->size < need) continue;
+
+		// Split unless the rest is too small to hold anything
+		if (b->size - need >= 2 * sizeof(struct SimBlock)) {
+			struct SimBlock *rest = (struct SimBlock *)((uint8 *)b + need);
+
+			rest->size = b->size - need;
+			rest->used = 0;
+			b->size = need;
+		}
+
+		b->used = 1;
+		heapUsed += b->size;
+		if (heapUsed > heapPeak) heapPeak = heapUsed;
+
+		return b + 1;
+	}
+
+	heapFailures++;
+	return NULL;
+}
+
+void *sim_zalloc(size_t size) {
+	void *ptr = sim_malloc(size);
+
+	if (ptr != NULL) memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void sim_free(void *ptr) {
+	struct SimBlock *b, *n;
+
+	if (ptr == NULL) return;
+
+	b = (struct SimBlock *)ptr - 1;
+	b->used = 0;
+	heapUsed -= b->size;
+
+	// Merge adjacent free blocks
+	for (b = _sim_heap_first(); b != NULL; b = _sim_heap_next(b)) {
+		while (!b->used && (n = _sim_heap_next(b)) != NULL && !n->used) {
+			b->size += n->size;
+		}
+	}
+}
+
+// user/heap.c
+void *__wrap_pvPortMalloc(size_t size, const char *file, unsigned line, bool iram);
+void __wrap_vPortFree(void *ptr, const char *file, unsigned line);
+
+void *pvPortMalloc(size_t size, const char *file, unsigned line, bool iram) {
+	return sim_malloc(size);
+}
+
+void *pvPortZalloc(size_t size, const char *file, unsigned line, bool iram) {
+	return sim_zalloc(size);
+}
+
+void *pvPortRealloc(void *ptr, size_t size, const char *file, unsigned line) {
+	struct SimBlock *b = (struct SimBlock *)ptr - 1;
+	void *n;
+
+	if (size == 0) {
+		sim_free(ptr);
+		return NULL;
+	}
+
+	n = sim_malloc(size);
+	if (n != NULL && ptr != NULL) {
+		memcpy(n, ptr, b->size - sizeof(*b) < size ? b->size - sizeof(*b) : size);
+		sim_free(ptr);
+	}
+
+	return n;
+}
+
+void vPortFree(void *ptr, const char *file, unsigned line) {
+	sim_free(ptr);
+}
+
+uint32 system_get_free_heap_size(void) {
+	return SIM_HEAP_SIZE - heapUsed;
+}
+
+size_t sim_heap_used(void) {
+	return heapUsed;
+}
+
+size_t sim_heap_peak(void) {
+	return heapPeak;
+}
+
+void sim_heap_reset_peak(void) {
+	heapPeak = heapUsed;
+}
+
+size_t sim_heap_largest_free(void) {
+	struct SimBlock *b;
+	size_t largest = 0;
+
+	for (b = _sim_heap_first(); b != NULL; b = _sim_heap_next(b)) {
+		if (!b->used && b->size - sizeof(struct SimBlock) > largest) largest = b->size - sizeof(struct SimBlock);
+	}
+
+	return largest;
+}
+
+uint32 sim_heap_failures(void) {
+	return heapFailures;
+}
+
+/* Time and timers */
+
+uint64 sim_now_us(void) {
+	return simNs / 1000;
+}
+
+void os_delay_us(uint32 us) {
+	simNs += (uint64)us * 1000;
+}
+
+uint32 system_get_time(void) {
+	return (uint32)(simNs / 1000);
+}
+
+uint32 system_get_rtc_time(void) {
+	return (uint32)((simNs / 1000) * 4096 / SIM_RTC_CALI);
+}
+
+uint32 system_rtc_clock_cali_proc(void) {
+	return SIM_RTC_CALI;
+}
+
+void os_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *arg) {
+	os_timer_disarm(t);
+	t->timer_func = fn;
+	t->timer_arg = arg;
+}
+
+void os_timer_disarm(ETSTimer *t) {
+	ETSTimer **p;
+
+	for (p = &timers; *p != NULL; p = &(*p)->timer_next) {
+		if (*p == t) {
+			*p = t->timer_next;
+			break;
+		}
+	}
+
+	t->timer_armed = 0;
+}
+
+// Timers are kept sorted by expiry time, equal times fire in arming order.
+static void _sim_timer_insert(ETSTimer *t) {
+	ETSTimer **p = &timers;
+
+	while (*p != NULL && (*p)->timer_expire <= t->timer_expire) p = &(*p)->timer_next;
+
+	t->timer_next = *p;
+	*p = t;
+	t->timer_armed = 1;
+}
+
+void os_timer_arm(ETSTimer *t, uint32 ms, bool repeat) {
+	os_timer_disarm(t);
+	t->timer_period = repeat ? ms : 0;
+	t->timer_expire = simNs + (uint64)ms * 1000000;
+	_sim_timer_insert(t);
+}
+
+/*
+ * @brief Fires the next timer if it expires before limit.
+ */
+
+static int _sim_fire(uint64 limit) {
+	ETSTimer *t = timers;
+
+	if (t == NULL || t->timer_expire > limit) return 0;
+
+	timers = t->timer_next;
+	t->timer_armed = 0;
+
+	if (t->timer_expire > simNs) simNs = t->timer_expire;
+
+	if (t->timer_period) {
+		t->timer_expire += (uint64)t->timer_period * 1000000;
+		_sim_timer_insert(t);
+	}
+
+	if (t->timer_func != NULL) t->timer_func(t->timer_arg);
+
+	return 1;
+}
+
+void sim_run(uint64 us) {
+	uint64 limit = simNs + us * 1000;
+
+	while (_sim_fire(limit));
+
+	if (simNs < limit) simNs = limit;
+}
+
+int sim_run_next(void) {
+	return _sim_fire((uint64)-1);
+}
+
+/*
+ * @brief Fires the next timer due before limit_us, or moves the clock to
+ * limit_us if there is none. Returns 1 if a timer fired.
+ */
+
+int sim_step(uint64 limit_us) {
+	uint64 limit = limit_us * 1000;
+
+	if (_sim_fire(limit)) return 1;
+
+	if (simNs < limit) simNs = limit;
+
+	return 0;
+}
+
+/* Reset and RTC */
+
+struct rst_info *system_get_rst_info(void) {
+	return &rstInfo;
+}
+
+bool system_rtc_mem_read(uint8 addr, void *dst, uint16 size) {
+	if (addr < 64 || addr * 4 + size > SIM_RTC_MEM_SIZE) return false;
+
+	memcpy(dst, rtcMem + addr * 4, size);
+	return true;
+}
+
+bool system_rtc_mem_write(uint8 addr, const void *src, uint16 size) {
+	if (addr < 64 || addr * 4 + size > SIM_RTC_MEM_SIZE) return false;
+
+	memcpy(rtcMem + addr * 4, src, size);
+	return true;
+}
+
+void system_restart(void) {
+	os_printf("sim: system_restart\n");
+}
+
+void system_init_done_cb(void (*cb)(void)) {
+	static ETSTimer initDoneTimer;
+
+	os_timer_setfn(&initDoneTimer, (ETSTimerFunc *)cb, NULL);
+	os_timer_arm(&initDoneTimer, 0, 0);
+}
+
+/*
+ * @brief Simulates a reset, timers and GPIOs are cleared.
+ *
+ * Flash always survives, RTC memory only survives soft resets. The virtual
+ * clock keeps running, like the RTC counter does.
+ */
+
+void sim_reset(uint32 reason) {
+	int i;
+
+	while (timers != NULL) os_timer_disarm(timers);
+
+	sim_net_reset();
+
+	if (flash == NULL) {
+		flash = malloc(SIM_FLASH_SIZE);
+		memset(flash, 0xff, SIM_FLASH_SIZE);
+	}
+
+	if (reason == REASON_DEFAULT_RST) {
+		for (i = 0; i < SIM_RTC_MEM_SIZE; i++) rtcMem[i] = rand();
+	}
+
+	memset(&rstInfo, 0, sizeof(rstInfo));
+	rstInfo.reason = reason;
+	gpioOut = 0;
+	gpioEnable = 0;
+	_sim_wifi_reset();
+}
+
+void sim_boot(void) {
+	user_init();
+}
+
+/* Interrupts */
+
+void ets_intr_lock(void) {
+}
+
+void ets_intr_unlock(void) {
+}
+
+void sim_uart_intr(int enable) {
+}
+
+/* GPIO and DHT sensor */
+
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask) {
+	gpioOut = (gpioOut | set_mask) & ~clear_mask;
+
+	// Releasing the DHT line starts a frame
+	if ((disable_mask & (1 << SIM_DHT_PIN)) && (gpioEnable & (1 << SIM_DHT_PIN))) {
+		dhtReleasedNs = simNs;
+
+		if (dhtFault != SIM_DHT_OK && dhtFaultFrames && dhtFaultUsed++ >= dhtFaultFrames) {
+			sim_dht_fault(SIM_DHT_OK, 0);
+		}
+	}
+
+	gpioEnable = (gpioEnable | enable_mask) & ~disable_mask;
+}
+
+uint32 sim_gpio_reg_read(uint32 reg) {
+	switch (reg) {
+		case GPIO_OUT_ADDRESS:
+			return gpioOut;
+		case GPIO_ENABLE_ADDRESS:
+			return gpioEnable;
+		default:
+			return 0;
+	}
+}
+
+void sim_gpio_reg_write(uint32 reg, uint32 value) {
+	if (reg == GPIO_OUT_ADDRESS) gpioOut = value;
+	if (reg == GPIO_ENABLE_ADDRESS) gpioEnable = value;
+}
+
+uint32 sim_gpio_out(void) {
+	return gpioOut;
+}
+
+/*
+ * @brief Level of the DHT data line t ns after the host released it.
+ *
+ * 30us pull-up, 80us low and 80us high response, then 40 bits of 50us low
+ * followed by 27us (0) or 70us (1) high, and the line goes back high.
+ */
+
+static int _sim_dht_level(uint64 t) {
+	int bits = 40;
+	int i;
+
+	if (dhtFault == SIM_DHT_NO_RESPONSE) return 1;
+	if (dhtFault == SIM_DHT_SHORT_FRAME) bits = 20;
+
+	if (t < 30000) return 1;
+	t -= 30000;
+	if (t < 80000) return 0;
+	t -= 80000;
+	if (t < 80000) return 1;
+	t -= 80000;
+
+	for (i = 0; i < bits; i++) {
+		uint64 high = (dhtFrame[i / 8] & (0x80 >> (i % 8))) ? 70000 : 27000;
+
+		if (t < 50000) return 0;
+		t -= 50000;
+		if (t < high) return 1;
+		t -= high;
+	}
+
+	if (t < 50000) return 0;
+
+	return 1;
+}
+
+uint32 sim_gpio_input(uint32 gpio) {
+	// A register read takes a few cycles
+	simNs += 200;
+
+	if (gpioEnable & (1 << gpio)) return (gpioOut >> gpio) & 1;
+
+	if (gpio == SIM_DHT_PIN) return _sim_dht_level(simNs - dhtReleasedNs);
+
+	return 1;
+}
+
+/*
+ * @brief Flips the lowest bit of the humidity high byte, 25.6 %, and fixes
+ * the checksum so the frame still decodes. Calling it again undoes it.
+ */
+
+static void _sim_dht_glitch(void) {
+	dhtFrame[0] ^= 0x01;
+	dhtFrame[4] = (dhtFrame[0] + dhtFrame[1] + dhtFrame[2] + dhtFrame[3]) & 0xff;
+}
+
+void sim_dht_set(float temperature, float humidity) {
+	int t = (int)(temperature * 10 + (temperature < 0 ? -0.5 : 0.5));
+	int h = (int)(humidity * 10 + 0.5);
+
+	dhtFrame[0] = h >> 8;
+	dhtFrame[1] = h & 0xff;
+	dhtFrame[2] = ((t < 0 ? -t : t) >> 8) | (t < 0 ? 0x80 : 0);
+	dhtFrame[3] = (t < 0 ? -t : t) & 0xff;
+	dhtFrame[4] = (dhtFrame[0] + dhtFrame[1] + dhtFrame[2] + dhtFrame[3]) & 0xff;
+
+	if (dhtFault == SIM_DHT_BAD_CHECKSUM) dhtFrame[4] ^= 0x01;
+	if (dhtFault == SIM_DHT_GLITCH) _sim_dht_glitch();
+}
+
+/*
+ * @brief Makes the next frames faulty, SIM_DHT_OK clears the fault.
+ *
+ * The fault is cleared again after the given number of frames, 0 keeps it.
+ */
+
+void sim_dht_fault(enum SimDhtFault fault, int frames) {
+	if (dhtFault == SIM_DHT_BAD_CHECKSUM) dhtFrame[4] ^= 0x01;
+	if (dhtFault == SIM_DHT_GLITCH) _sim_dht_glitch();
+
+	dhtFault = fault;
+	dhtFaultFrames = frames;
+	dhtFaultUsed = 0;
+
+	if (dhtFault == SIM_DHT_BAD_CHECKSUM) dhtFrame[4] ^= 0x01;
+	if (dhtFault == SIM_DHT_GLITCH) _sim_dht_glitch();
+}
+
+/* SPI flash */
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+	if (sec >= SIM_FLASH_SECTORS) return SPI_FLASH_RESULT_ERR;
+
+	memset(flash + sec * SPI_FLASH_SEC_SIZE, 0xff, SPI_FLASH_SEC_SIZE);
+	flashErases[sec]++;
+	// Erasing a sector takes tens of milliseconds
+	simNs += 30000000;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+	uint8 *src = (uint8 *)src_addr;
+	uint32 i;
+
+	if ((des_addr & 3) || des_addr + size > SIM_FLASH_SIZE) return SPI_FLASH_RESULT_ERR;
+
+	if (flashFailSkip > 0) {
+		flashFailSkip--;
+	} else if (flashFailWrites > 0) {
+		flashFailWrites--;
+		return SPI_FLASH_RESULT_ERR;
+	}
+
+	// NOR flash can only clear bits
+	for (i = 0; i < size; i++) flash[des_addr + i] &= src[i];
+	flashWrites++;
+
+	simNs += (uint64)size * 1000;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+	if ((src_addr & 3) || src_addr + size > SIM_FLASH_SIZE) return SPI_FLASH_RESULT_ERR;
+
+	memcpy(des_addr, flash + src_addr, size);
+	simNs += (uint64)size * 100;
+	return SPI_FLASH_RESULT_OK;
+}
+
+/*
+ * @brief Fails the next writes flash writes, after letting skip more go
+ * through. Failed writes leave flash as it is.
+ */
+
+void sim_flash_fail(int skip, int writes) {
+	flashFailSkip = skip;
+	flashFailWrites = writes;
+}
+
+uint32 sim_flash_erases(uint16 sector) {
+	return sector < SIM_FLASH_SECTORS ? flashErases[sector] : 0;
+}
+
+int sim_flash_sectors(void) {
+	return SIM_FLASH_SECTORS;
+}
+
+uint32 sim_flash_total_erases(void) {
+	uint32 total = 0;
+	int i;
+
+	for (i = 0; i < SIM_FLASH_SECTORS; i++) total += flashErases[i];
+
+	return total;
+}
+
+uint32 sim_flash_total_writes(void) {
+	return flashWrites;
+}
+
+/*
+ * WiFi, one access point the station connects to with the right SSID and
+ * password, and the station starts configured for it. A connection to the
+ * BSSID and channel of the access point skips the scan and is fast, any
+ * other connection scans all channels first. Events are delivered from a
+ * timer, like the SDK delivers them from its own task.
+ */
+
+#define SIM_AP_CHANNEL 6
+#define SIM_CONNECT_FAST_MS 300
+#define SIM_CONNECT_SCAN_MS 2800
+#define SIM_WIFI_EVENTS 4
+
+#define SIM_AP_SSID "box-test"
+#define SIM_AP_PASSWORD "box-password"
+
+static const uint8 apBssid[6] = {0x02, 0x42, 0x6f, 0x78, 0x00, 0x01};
+static int apUp = 1;
+static uint8 apChannel = SIM_AP_CHANNEL;
+static uint8 channelHint;
+
+static uint8 wifiSavedMode = STATION_MODE;
+static uint8 wifiMode = STATION_MODE;
+static struct station_config wifiSavedConfig = {SIM_AP_SSID, SIM_AP_PASSWORD};
+static struct station_config wifiConfig = {SIM_AP_SSID, SIM_AP_PASSWORD};
+static uint8 wifiStatus = STATION_GOT_IP;
+static wifi_event_handler_cb_t eventCb;
+static System_Event_t events[SIM_WIFI_EVENTS];
+static int eventCount;
+static ETSTimer eventTimer;
+static ETSTimer connectTimer;
+static scan_done_cb_t scanCb;
+static int scanAps = 3;
+static ETSTimer scanTimer;
+
+static void _sim_wifi_events(void *arg) {
+	System_Event_t copy[SIM_WIFI_EVENTS];
+	int i, n = eventCount;
+
+	memcpy(copy, events, sizeof(copy));
+	eventCount = 0;
+
+	for (i = 0; i < n; i++) {
+		if (eventCb != NULL) eventCb(&copy[i]);
+	}
+}
+
+static void _sim_wifi_event(uint32 event, uint8 reason) {
+	System_Event_t *e;
+
+	if (eventCount == SIM_WIFI_EVENTS) return;
+
+	e = &events[eventCount++];
+	memset(e, 0, sizeof(*e));
+	e->event = event;
+
+	if (event == EVENT_STAMODE_CONNECTED) {
+		memcpy(e->event_info.connected.ssid, wifiConfig.ssid, 32);
+		memcpy(e->event_info.connected.bssid, apBssid, 6);
+		e->event_info.connected.channel = apChannel;
+	} else if (event == EVENT_STAMODE_DISCONNECTED) {
+		memcpy(e->event_info.disconnected.ssid, wifiConfig.ssid, 32);
+		e->event_info.disconnected.reason = reason;
+	} else if (event == EVENT_STAMODE_GOT_IP) {
+		e->event_info.got_ip.ip = htonl(0xc0a80132);
+	}
+
+	os_timer_setfn(&eventTimer, _sim_wifi_events, NULL);
+	os_timer_arm(&eventTimer, 0, 0);
+}
+
+static int _sim_wifi_found(void) {
+	return apUp && !strncmp((char *)wifiConfig.ssid, SIM_AP_SSID, 32) &&
+			(!wifiConfig.bssid_set || !memcmp(wifiConfig.bssid, apBssid, 6));
+}
+
+static void _sim_wifi_connected(void *arg) {
+	int found = _sim_wifi_found();
+
+	if (found && strncmp((char *)wifiConfig.password, SIM_AP_PASSWORD, 64)) {
+		wifiStatus = STATION_WRONG_PASSWORD;
+		_sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_4WAY_HANDSHAKE_TIMEOUT);
+	} else if (found) {
+		wifiStatus = STATION_GOT_IP;
+		_sim_wifi_event(EVENT_STAMODE_CONNECTED, 0);
+		_sim_wifi_event(EVENT_STAMODE_GOT_IP, 0);
+	} else {
+		wifiStatus = STATION_NO_AP_FOUND;
+		_sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_NO_AP_FOUND);
+	}
+}
+
+/*
+ * @brief Called from sim_reset(), the SDK connects with the saved
+ * configuration on boot.
+ */
+
+static void _sim_wifi_reset(void) {
+	eventCount = 0;
+	eventCb = NULL;
+	channelHint = 0;
+	wifiMode = wifiSavedMode;
+	wifiConfig = wifiSavedConfig;
+
+	if (!(wifiMode & STATION_MODE)) {
+		wifiStatus = STATION_IDLE;
+	} else if (_sim_wifi_found() && !strncmp((char *)wifiConfig.password, SIM_AP_PASSWORD, 64)) {
+		wifiStatus = STATION_GOT_IP;
+		_sim_wifi_event(EVENT_STAMODE_CONNECTED, 0);
+		_sim_wifi_event(EVENT_STAMODE_GOT_IP, 0);
+	} else {
+		wifiStatus = STATION_CONNECTING;
+		os_timer_setfn(&connectTimer, _sim_wifi_connected, NULL);
+		os_timer_arm(&connectTimer, SIM_CONNECT_SCAN_MS, 0);
+	}
+}
+
+/*
+ * @brief Turns the access point off or on, and moves it to another channel
+ * if channel is not 0.
+ */
+
+void sim_wifi_ap(int up, int channel) {
+	apUp = up;
+	if (channel > 0) apChannel = channel;
+
+	if (!up && wifiStatus == STATION_GOT_IP) {
+		wifiStatus = STATION_IDLE;
+		_sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_BEACON_TIMEOUT);
+	}
+}
+
+/*
+ * @brief The access point drops the station with reason, and takes it back
+ * when it tries again. With reason 0 the event is lost.
+ */
+
+void sim_wifi_drop(int reason) {
+	if (wifiStatus != STATION_GOT_IP) return;
+
+	wifiStatus = STATION_IDLE;
+	if (reason) _sim_wifi_event(EVENT_STAMODE_DISCONNECTED, reason);
+}
+
+uint8 wifi_get_opmode(void) {
+	return wifiMode;
+}
+
+bool wifi_set_opmode_current(uint8 mode) {
+	wifiMode = mode;
+
+	if (!(mode & STATION_MODE)) {
+		os_timer_disarm(&connectTimer);
+		wifiStatus = STATION_IDLE;
+	}
+
+	return true;
+}
+
+bool wifi_set_opmode(uint8 mode) {
+	wifiSavedMode = mode;
+	return wifi_set_opmode_current(mode);
+}
+
+bool wifi_station_get_config(struct station_config *config) {
+	*config = wifiConfig;
+	return true;
+}
+
+bool wifi_station_set_config(struct station_config *config) {
+	wifiConfig = *config;
+	wifiSavedConfig = *config;
+	return true;
+}
+
+bool wifi_station_set_config_current(struct station_config *config) {
+	wifiConfig = *config;
+	return true;
+}
+
+bool wifi_station_connect(void) {
+	int fast = wifiConfig.bssid_set && channelHint == apChannel;
+
+	wifiStatus = STATION_CONNECTING;
+	os_timer_setfn(&connectTimer, _sim_wifi_connected, NULL);
+	os_timer_arm(&connectTimer, fast ? SIM_CONNECT_FAST_MS : SIM_CONNECT_SCAN_MS, 0);
+	return true;
+}
+
+bool wifi_station_disconnect(void) {
+	os_timer_disarm(&connectTimer);
+
+	if (wifiStatus == STATION_GOT_IP) {
+		_sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_ASSOC_LEAVE);
+	}
+
+	wifiStatus = STATION_IDLE;
+	return true;
+}
+
+uint8 wifi_station_get_connect_status(void) {
+	return wifiStatus;
+}
+
+bool wifi_station_set_reconnect_policy(bool set) {
+	return true;
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb) {
+	eventCb = cb;
+}
+
+sint8 wifi_station_get_rssi(void) {
+	return -60;
+}
+
+uint8 wifi_get_channel(void) {
+	if (wifiStatus == STATION_GOT_IP || channelHint == 0) return apChannel;
+
+	return channelHint;
+}
+
+bool wifi_set_channel(uint8 channel) {
+	channelHint = channel;
+	return true;
+}
+
+static void _sim_scan_done(void *arg) {
+	static struct bss_info aps[SIM_MAX_APS];
+	int i;
+
+	for (i = 0; i < scanAps; i++) {
+		memset(&aps[i], 0, sizeof(aps[i]));
+		sprintf((char *)aps[i].ssid, "sim-ap-%d", i);
+		aps[i].bssid[5] = i;
+		aps[i].channel = 1 + i % 13;
+		aps[i].rssi = -40 - 3 * i;
+		aps[i].next.stqe_next = i < scanAps - 1 ? &aps[i + 1] : NULL;
+	}
+
+	scanCb(scanAps ? &aps[0] : NULL, OK);
+}
+
+/*
+ * @brief Number of access points the next scans find.
+ */
+
+uint32 system_get_chip_id(void) {
+	return 0x00c0ffee;
+}
+
+void sim_wifi_aps(int n) {
+	scanAps = n < 0 ? 0 : n > SIM_MAX_APS ? SIM_MAX_APS : n;
+}
+
+bool wifi_station_scan(void *config, scan_done_cb_t cb) {
+	scanCb = cb;
+	os_timer_setfn(&scanTimer, _sim_scan_done, NULL);
+	os_timer_arm(&scanTimer, 1500, 0);
+	return true;
+}
+
+/*
+ * Network. Every espconn gets a non blocking host socket, and callbacks run
+ * from sim_net_poll(), like the SDK runs them from its own task. UDP
+ * servers listen on the loopback interface only.
+ */
+
+#define SIM_NET_MAX 16
+
+struct SimSock {
+	struct espconn *conn;
+	int fd;
+	int connecting;
+	int sentPending;
+	int closing;
+	remot_info remote;
+};
+
+static struct SimSock socks[SIM_NET_MAX];
+static int localPort = 4000;
+// TCP sends still to be refused, as when the SDK is out of memory
+static int sendFailures;
+
+static struct SimSock *_sim_sock(struct espconn *conn) {
+	int i;
+
+	for (i = 0; i < SIM_NET_MAX; i++) {
+		if (socks[i].conn == conn && socks[i].fd >= 0) return &socks[i];
+	}
+
+	return NULL;
+}
+
+static void _sim_sock_close(struct SimSock *s) {
+	close(s->fd);
+	s->fd = -1;
+	s->conn->state = ESPCONN_CLOSE;
+	s->conn = NULL;
+}
+
+uint32 ipaddr_addr(const char *cp) {
+	return inet_addr(cp);
+}
+
+uint32 espconn_port(void) {
+	return localPort++;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback cb) {
+	espconn->proto.tcp->connect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback cb) {
+	espconn->proto.tcp->reconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback cb) {
+	espconn->proto.tcp->disconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback cb) {
+	espconn->recv_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback cb) {
+	espconn->sent_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_connect(struct espconn *espconn) {
+	struct sockaddr_in addr;
+	int i;
+
+	if (_sim_sock(espconn) != NULL) return ESPCONN_ISCONN;
+
+	for (i = 0; i < SIM_NET_MAX && socks[i].conn != NULL; i++);
+
+	if (i == SIM_NET_MAX) return ESPCONN_MEM;
+
+	memset(&socks[i], 0, sizeof(socks[i]));
+	socks[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+	fcntl(socks[i].fd, F_SETFL, O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(espconn->proto.tcp->remote_port);
+	memcpy(&addr.sin_addr, espconn->proto.tcp->remote_ip, 4);
+
+	// Failures are reported through the reconnect callback, as on the device
+	connect(socks[i].fd, (struct sockaddr *)&addr, sizeof(addr));
+	socks[i].conn = espconn;
+	socks[i].connecting = 1;
+	espconn->state = ESPCONN_WAIT;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_create(struct espconn *espconn) {
+	struct sockaddr_in addr;
+	int i;
+
+	if (espconn->type != ESPCONN_UDP || _sim_sock(espconn) != NULL) return ESPCONN_ARG;
+
+	for (i = 0; i < SIM_NET_MAX && socks[i].conn != NULL; i++);
+
+	if (i == SIM_NET_MAX) return ESPCONN_MEM;
+
+	memset(&socks[i], 0, sizeof(socks[i]));
+	socks[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+	fcntl(socks[i].fd, F_SETFL, O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(espconn->proto.udp->local_port);
+
+	if (bind(socks[i].fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(socks[i].fd);
+		socks[i].fd = -1;
+		return ESPCONN_ISCONN;
+	}
+
+	socks[i].conn = espconn;
+	espconn->state = ESPCONN_LISTEN;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_delete(struct espconn *espconn) {
+	struct SimSock *s = _sim_sock(espconn);
+
+	if (s == NULL) return ESPCONN_ARG;
+
+	_sim_sock_close(s);
+	return ESPCONN_OK;
+}
+
+sint16 espconn_sendto(struct espconn *espconn, uint8 *psent, uint16 length) {
+	struct SimSock *s = _sim_sock(espconn);
+	struct sockaddr_in addr;
+
+	if (s == NULL || espconn->type != ESPCONN_UDP) return ESPCONN_ARG;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(espconn->proto.udp->remote_port);
+	memcpy(&addr.sin_addr, espconn->proto.udp->remote_ip, 4);
+
+	simNs += SIM_SEND_CALL_NS + (uint64)length * SIM_SEND_BYTE_NS;
+
+	if (sendto(s->fd, psent, length, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) return ESPCONN_CONN;
+
+	return ESPCONN_OK;
+}
+
+/*
+ * @brief Sender of the last UDP datagram received.
+ */
+
+sint8 espconn_get_connection_info(struct espconn *pespconn, remot_info **pcon_info, uint8 typeflags) {
+	struct SimSock *s = _sim_sock(pespconn);
+
+	if (s == NULL) return ESPCONN_ARG;
+
+	*pcon_info = &s->remote;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn) {
+	struct SimSock *s = _sim_sock(espconn);
+
+	if (s == NULL) return ESPCONN_ARG;
+
+	s->closing = 1;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+	struct SimSock *s = _sim_sock(espconn);
+	int sent = 0;
+
+	if (s == NULL || s->connecting || s->closing) return ESPCONN_ARG;
+
+	// The SDK takes one buffer at a time, the next one after the sent callback
+	if (s->sentPending) return ESPCONN_INPROGRESS;
+
+	if (sendFailures > 0) {
+		sendFailures--;
+		return ESPCONN_MEM;
+	}
+
+	while (sent < length) {
+		struct pollfd p = {s->fd, POLLOUT, 0};
+		int n = send(s->fd, psent + sent, length - sent, MSG_NOSIGNAL);
+
+		if (n < 0 && errno != EAGAIN) return ESPCONN_CONN;
+		if (n < 0) poll(&p, 1, 100);
+		else sent += n;
+	}
+
+	simNs += SIM_SEND_CALL_NS + (uint64)length * SIM_SEND_BYTE_NS;
+	s->sentPending = 1;
+	return ESPCONN_OK;
+}
+
+/*
+ * @brief Refuses the next sends TCP connections make.
+ */
+
+void sim_net_send_fail(int sends) {
+	sendFailures = sends;
+}
+
+/*
+ * @brief Runs the espconn callbacks that are due, waiting up to timeout_ms
+ * for socket activity. Returns the number of callbacks run.
+ */
+
+int sim_net_poll(int timeout_ms) {
+	struct pollfd fds[SIM_NET_MAX];
+	struct SimSock *polled[SIM_NET_MAX];
+	int i, n = 0, events = 0;
+
+	for (i = 0; i < SIM_NET_MAX; i++) {
+		struct SimSock *s = &socks[i];
+		struct espconn *conn = s->conn;
+
+		if (conn == NULL) continue;
+
+		if (s->closing) {
+			_sim_sock_close(s);
+			if (conn->proto.tcp->disconnect_callback) conn->proto.tcp->disconnect_callback(conn);
+			events++;
+		} else if (s->sentPending) {
+			s->sentPending = 0;
+			if (conn->sent_callback) conn->sent_callback(conn);
+			events++;
+		}
+	}
+
+	if (events) timeout_ms = 0;
+
+	for (i = 0; i < SIM_NET_MAX; i++) {
+		if (socks[i].conn == NULL) continue;
+
+		fds[n].fd = socks[i].fd;
+		fds[n].events = socks[i].connecting ? POLLOUT : POLLIN;
+		polled[n++] = &socks[i];
+	}
+
+	if (n == 0 || poll(fds, n, timeout_ms) <= 0) return events;
+
+	for (i = 0; i < n; i++) {
+		struct SimSock *s = polled[i];
+		struct espconn *conn = s->conn;
+		char buff[1460];
+		int len, err = 0;
+		socklen_t errLen = sizeof(err);
+
+		if (!fds[i].revents || conn == NULL || s->fd != fds[i].fd) continue;
+
+		events++;
+
+		if (conn->type == ESPCONN_UDP) {
+			struct sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+
+			len = recvfrom(s->fd, buff, sizeof(buff), 0, (struct sockaddr *)&from, &fromLen);
+
+			if (len < 0) continue;
+
+			memcpy(s->remote.remote_ip, &from.sin_addr, 4);
+			s->remote.remote_port = ntohs(from.sin_port);
+			memcpy(conn->proto.udp->remote_ip, s->remote.remote_ip, 4);
+			conn->proto.udp->remote_port = s->remote.remote_port;
+			if (conn->recv_callback) conn->recv_callback(conn, buff, len);
+			continue;
+		}
+
+		if (s->connecting) {
+			getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+
+			if (err) {
+				_sim_sock_close(s);
+				if (conn->proto.tcp->reconnect_callback) conn->proto.tcp->reconnect_callback(conn, ESPCONN_CONN);
+				continue;
+			}
+
+			s->connecting = 0;
+			conn->state = ESPCONN_CONNECT;
+			if (conn->proto.tcp->connect_callback) conn->proto.tcp->connect_callback(conn);
+			continue;
+		}
+
+		len = recv(s->fd, buff, sizeof(buff), 0);
+
+		if (len > 0) {
+			if (conn->recv_callback) conn->recv_callback(conn, buff, len);
+		} else if (len == 0) {
+			_sim_sock_close(s);
+			if (conn->proto.tcp->disconnect_callback) conn->proto.tcp->disconnect_callback(conn);
+		} else if (errno != EAGAIN) {
+			_sim_sock_close(s);
+			if (conn->proto.tcp->reconnect_callback) conn->proto.tcp->reconnect_callback(conn, ESPCONN_RST);
+		}
+	}
+
+	return events;
+}
+
+/*
+ * @brief Drops every connection without callbacks, like a reset does.
+ */
+
+void sim_net_reset(void) {
+	int i;
+
+	for (i = 0; i < SIM_NET_MAX; i++) {
+		if (socks[i].conn != NULL) _sim_sock_close(&socks[i]);
+		socks[i].fd = -1;
+	}
+
+	for (i = 0; i < SIM_HTTP_CONNS; i++) httpConns[i].used = 0;
+
+	sendFailures = 0;
+}
+
+/* Web server stand-in */
+
+struct HttpdPriv {
+	struct SimResponse *resp;
+	// Bytes sent in this CGI call
+	int sendLen;
+};
+
+static uint32 sendOverflows;
+
+/*
+ * @brief Idle timeout of one connection. Kept alive connections of the
+ * stand-in are closed by the caller with sim_http_close(), serve.c does
+ * after the timeout.
+ */
+
+sint8 espconn_regist_time(struct espconn *espconn, uint32 interval, uint8 type_flag) {
+	return ESPCONN_OK;
+}
+
+// Where libesphttpd retires the connection, nothing to do in the stand-in
+static void _sim_httpd_discon_cb(void *arg) {
+}
+
+static void _sim_httpd_recon_cb(void *arg, sint8 err) {
+}
+
+/*
+ * @brief Returns the connection from remote port port, opening it with
+ * the callbacks of libesphttpd if it is not open. NULL if all are open.
+ */
+
+static struct SimHttpConn *_sim_http_conn(int port) {
+	struct SimHttpConn *free = NULL;
+	int i;
+
+	for (i = 0; i < SIM_HTTP_CONNS; i++) {
+		if (httpConns[i].used && httpConns[i].tcp.remote_port == port) return &httpConns[i];
+		if (!httpConns[i].used && free == NULL) free = &httpConns[i];
+	}
+
+	if (free == NULL) return NULL;
+
+	memset(free, 0, sizeof(*free));
+	free->used = 1;
+	free->conn.type = ESPCONN_TCP;
+	free->conn.state = ESPCONN_CONNECT;
+	free->conn.proto.tcp = &free->tcp;
+	free->tcp.remote_port = port;
+	memcpy(free->tcp.remote_ip, (uint8[]){192, 168, 4, 2}, 4);
+	espconn_regist_disconcb(&free->conn, _sim_httpd_discon_cb);
+	espconn_regist_reconcb(&free->conn, _sim_httpd_recon_cb);
+
+	return free;
+}
+
+static void _sim_http_close(struct SimHttpConn *h) {
+	h->used = 0;
+	h->conn.state = ESPCONN_CLOSE;
+	if (h->tcp.disconnect_callback) h->tcp.disconnect_callback(&h->conn);
+}
+
+/*
+ * @brief Closes the kept alive connection from remote port port, the way
+ * the client or the idle timeout of the SDK do.
+ */
+
+void sim_http_close(int port) {
+	int i;
+
+	for (i = 0; i < SIM_HTTP_CONNS; i++) {
+		if (httpConns[i].used && httpConns[i].tcp.remote_port == port) _sim_http_close(&httpConns[i]);
+	}
+}
+
+int espFsInit(void *flashAddress) {
+	return 0;
+}
+
+void httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
+	urls = fixedUrls;
+}
+
+int httpdSend(HttpdConnData *conn, const char *data, int len) {
+	struct SimResponse *resp = conn->priv->resp;
+
+	if (len < 0) len = strlen(data);
+
+	// Like libesphttpd, data that does not fit the send buffer is dropped
+	if (conn->priv->sendLen + len > SIM_SENDBUFF_LEN) {
+		sendOverflows++;
+		return 0;
+	}
+	conn->priv->sendLen += len;
+
+	simNs += SIM_SEND_CALL_NS + (uint64)len * SIM_SEND_BYTE_NS;
+
+	if (resp->len + len + 1 > resp->cap) {
+		resp->cap = (resp->len + len + 1) * 2;
+		resp->data = realloc(resp->data, resp->cap);
+	}
+
+	memcpy(resp->data + resp->len, data, len);
+	resp->len += len;
+	resp->data[resp->len] = 0;
+	return 1;
+}
+
+void httpdStartResponse(HttpdConnData *conn, int code) {
+	char buff[64];
+
+	conn->priv->resp->status = code;
+	sprintf(buff, "HTTP/1.0 %d OK\r\nServer: esp8266-httpd/" HTTPDVER "\r\n", code);
+	httpdSend(conn, buff, -1);
+}
+
+void httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
+	httpdSend(conn, field, -1);
+	httpdSend(conn, ": ", 2);
+	httpdSend(conn, val, -1);
+	httpdSend(conn, "\r\n", 2);
+}
+
+void httpdEndHeaders(HttpdConnData *conn) {
+	httpdSend(conn, "\r\n", 2);
+}
+
+int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+	const char *p = reqHeaders;
+	int n = strlen(header);
+
+	// Headers end at the first empty line
+	while (p != NULL && *p && *p != '\r' && *p != '\n') {
+		if (!strncasecmp(p, header, n) && p[n] == ':') {
+			const char *v = p + n + 1;
+			int len = 0;
+
+			while (*v == ' ') v++;
+			while (v[len] && v[len] != '\r' && v[len] != '\n' && len < retLen - 1) {
+				ret[len] = v[len];
+				len++;
+			}
+			ret[len] = 0;
+			return 1;
+		}
+
+		p = strchr(p, '\n');
+		if (p != NULL) p++;
+	}
+
+	return 0;
+}
+
+void httpdRedirect(HttpdConnData *conn, char *newUrl) {
+	conn->priv->resp->status = 302;
+	httpdSend(conn, "HTTP/1.0 302 Found\r\nLocation: ", -1);
+	httpdSend(conn, newUrl, -1);
+	httpdSend(conn, "\r\n\r\n", 4);
+}
+
+int cgiRedirect(HttpdConnData *connData) {
+	if (connData->conn == NULL) return HTTPD_CGI_DONE;
+
+	httpdRedirect(connData, (char *)connData->cgiArg);
+	return HTTPD_CGI_DONE;
+}
+
+int httpdUrlDecode(char *val, int valLen, char *ret, int retLen) {
+	int s = 0, d = 0;
+	int esced = 0, escVal = 0;
+
+	while (s < valLen && d < retLen) {
+		if (esced == 1) {
+			escVal = strtol((char[]){val[s], 0}, NULL, 16) << 4;
+			esced = 2;
+		} else if (esced == 2) {
+			escVal += strtol((char[]){val[s], 0}, NULL, 16);
+			ret[d++] = escVal;
+			esced = 0;
+		} else if (val[s] == '%') {
+			esced = 1;
+		} else if (val[s] == '+') {
+			ret[d++] = ' ';
+		} else {
+			ret[d++] = val[s];
+		}
+		s++;
+	}
+
+	if (d < retLen) ret[d] = 0;
+
+	return d;
+}
+
+int httpdFindArg(char *line, char *arg, char *buff, int buffLen) {
+	char *p, *e;
+
+	if (line == NULL) return -1;
+
+	p = line;
+
+	while (p != NULL && *p != '\n' && *p != '\r' && *p != 0) {
+		if (strncmp(p, arg, strlen(arg)) == 0 && p[strlen(arg)] == '=') {
+			p += strlen(arg) + 1;
+			e = strstr(p, "&");
+			if (e == NULL) e = p + strlen(p);
+			return httpdUrlDecode(p, (e - p), buff, buffLen);
+		}
+
+		p = strstr(p, "&");
+		if (p != NULL) p += 1;
+	}
+
+	return -1;
+}
+
+const char *httpdGetMimetype(char *url) {
+	char *ext = strrchr(url, '.');
+
+	if (ext == NULL) return "text/html";
+	if (!strcmp(ext, ".css")) return "text/css";
+	if (!strcmp(ext, ".js")) return "text/javascript";
+	if (!strcmp(ext, ".png")) return "image/png";
+	if (!strcmp(ext, ".svg")) return "image/svg+xml";
+
+	return "text/html";
+}
+
+static char *_sim_read_file(const char *url, long *size) {
+	char path[256];
+	FILE *f;
+	char *data;
+
+	snprintf(path, sizeof(path), "%s%s", SIM_HTMLDIR, url);
+	f = fopen(path, "rb");
+
+	if (f == NULL) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(*size + 1);
+	*size = fread(data, 1, *size, f);
+	data[*size] = 0;
+	fclose(f);
+	return data;
+}
+
+struct EspFsFile {
+	char *data;
+	long size;
+	long pos;
+};
+
+EspFsFile *espFsOpen(char *fileName) {
+	EspFsFile *fh = malloc(sizeof(*fh));
+
+	fh->data = _sim_read_file(fileName, &fh->size);
+	fh->pos = 0;
+
+	if (fh->data == NULL) {
+		free(fh);
+		return NULL;
+	}
+
+	return fh;
+}
+
+int espFsRead(EspFsFile *fh, char *buff, int len) {
+	if (len > fh->size - fh->pos) len = fh->size - fh->pos;
+
+	memcpy(buff, fh->data + fh->pos, len);
+	fh->pos += len;
+	return len;
+}
+
+void espFsClose(EspFsFile *fh) {
+	if (fh == NULL) return;
+
+	free(fh->data);
+	free(fh);
+}
+
+int cgiEspFsHook(HttpdConnData *connData) {
+	long size;
+	char *data;
+
+	if (connData->conn == NULL) return HTTPD_CGI_DONE;
+
+	data = _sim_read_file(connData->url, &size);
+
+	if (data == NULL) return HTTPD_CGI_NOTFOUND;
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+	httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+	httpdEndHeaders(connData);
+	httpdSend(connData, data, size);
+	free(data);
+	return HTTPD_CGI_DONE;
+}
+
+int cgiEspFsTemplate(HttpdConnData *connData) {
+	TplCallback tpl = (TplCallback)connData->cgiArg;
+	void *arg = NULL;
+	char token[64];
+	char *data, *p, *e;
+	long size;
+
+	if (connData->conn == NULL) {
+		tpl(connData, NULL, &arg);
+		return HTTPD_CGI_DONE;
+	}
+
+	data = _sim_read_file(connData->url, &size);
+
+	if (data == NULL) return HTTPD_CGI_NOTFOUND;
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+	httpdEndHeaders(connData);
+
+	for (p = data; (e = strchr(p, '%')) != NULL; p = e + 1) {
+		char *end = strchr(e + 1, '%');
+		int len;
+
+		httpdSend(connData, p, e - p);
+
+		if (end == NULL || end - e - 1 >= (int)sizeof(token)) {
+			httpdSend(connData, "%", 1);
+			continue;
+		}
+
+		len = end - e - 1;
+
+		if (len == 0) {
+			httpdSend(connData, "%", 1);
+		} else {
+			memcpy(token, e + 1, len);
+			token[len] = 0;
+			tpl(connData, token, &arg);
+		}
+
+		e = end;
+	}
+
+	httpdSend(connData, p, -1);
+	tpl(connData, NULL, &arg);
+	free(data);
+	return HTTPD_CGI_DONE;
+}
+
+static int _sim_url_match(const char *pattern, const char *url) {
+	size_t len = strlen(pattern);
+
+	if (!strcmp(pattern, url)) return 1;
+
+	return len > 0 && pattern[len - 1] == '*' && !strncmp(pattern, url, len - 1);
+}
+
+/*
+ * @brief Sets the request headers of the next sim_http call, as
+ * "Name: value" lines separated by CRLF.
+ */
+
+void sim_http_headers(const char *headers) {
+	reqHeaders = headers;
+}
+
+/*
+ * @brief Sends the next request from remote port port, like a connection
+ * that is kept open. Otherwise every request comes from a new port.
+ */
+
+void sim_http_from(int port) {
+	reqPort = port;
+}
+
+/*
+ * @brief Returns 1 if the request asked to keep the connection open.
+ */
+
+static int _sim_http_keep(HttpdConnData *conn) {
+	char buff[24];
+
+	return httpdGetHeader(conn, "Connection", buff, sizeof(buff)) && strcasecmp(buff, "keep-alive") == 0;
+}
+
+/*
+ * @brief Runs one request through the CGIs, the way libesphttpd does.
+ *
+ * Returns the HTTP status, 404 if no CGI handled the URL.
+ */
+
+int sim_http(const char *method, const char *url, const char *post, struct SimResponse *resp) {
+	HttpdConnData conn;
+	HttpdPostData postData;
+	struct HttpdPriv priv;
+	struct SimHttpConn *http;
+	char path[256];
+	// Writable like the post buffer of libesphttpd, CGIs decode it in place
+	char body[1024];
+	char *args;
+	void *connMem;
+	int i, r;
+
+	memset(resp, 0, sizeof(*resp));
+
+	// The connection itself needs heap, like on the device. libesphttpd is
+	// a library of its own there, so its calls go through the wrapper too.
+	connMem = __wrap_pvPortMalloc(SIM_CONN_ALLOC, "libesphttpd/core/httpd.c", 0, false);
+	http = _sim_http_conn(reqPort ? reqPort : nextPort++);
+	if (nextPort > 65535) nextPort = 49152;
+
+	if (connMem == NULL || http == NULL) {
+		if (connMem != NULL) __wrap_vPortFree(connMem, "libesphttpd/core/httpd.c", 0);
+		if (http != NULL) _sim_http_close(http);
+		resp->status = 503;
+		reqHeaders = NULL;
+		reqPort = 0;
+		return 503;
+	}
+
+	memset(&conn, 0, sizeof(conn));
+	memset(&postData, 0, sizeof(postData));
+
+	snprintf(path, sizeof(path), "%s", url);
+	args = strchr(path, '?');
+	if (args != NULL) *args++ = 0;
+
+	priv.resp = resp;
+	conn.conn = &http->conn;
+	conn.priv = &priv;
+	conn.url = path;
+	conn.getArgs = args;
+	conn.requestType = strcmp(method, "POST") ? HTTPD_METHOD_GET : HTTPD_METHOD_POST;
+	conn.post = &postData;
+	memcpy(conn.remote_ip, (uint8[]){192, 168, 4, 2}, 4);
+	conn.remote_port = http->tcp.remote_port;
+	reqPort = 0;
+
+	if (post != NULL) {
+		snprintf(body, sizeof(body), "%s", post);
+		postData.buff = body;
+		postData.len = postData.buffLen = postData.received = strlen(body);
+	}
+
+	for (i = 0; urls != NULL && urls[i].url != NULL; i++) {
+		if (!_sim_url_match(urls[i].url, path)) continue;
+
+		conn.cgi = urls[i].cgiCb;
+		conn.cgiArg = urls[i].cgiArg;
+		conn.cgiData = NULL;
+
+		do {
+			// The send buffer goes out after every call
+			priv.sendLen = 0;
+			r = conn.cgi(&conn);
+		} while (r == HTTPD_CGI_MORE);
+
+		if (r == HTTPD_CGI_DONE) {
+			if (resp->status == 0) resp->status = 200;
+			if (resp->status == 503 || !_sim_http_keep(&conn)) _sim_http_close(http);
+			__wrap_vPortFree(connMem, "libesphttpd/core/httpd.c", 0);
+			reqHeaders = NULL;
+			return resp->status;
+		}
+
+		resp->len = 0;
+		resp->status = 0;
+	}
+
+	_sim_http_close(http);
+	__wrap_vPortFree(connMem, "libesphttpd/core/httpd.c", 0);
+	reqHeaders = NULL;
+	resp->status = 404;
+	return 404;
+}
+
+/*
+ * @brief Times a CGI sent more in one call than the send buffer of
+ * libesphttpd holds, and lost the rest.
+ */
+
+uint32 sim_http_overflows(void) {
+	return sendOverflows;
+}
+
+void sim_response_free(struct SimResponse *resp) {
+	free(resp->data);
+	memset(resp, 0, sizeof(*resp));
+}
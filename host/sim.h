@@ -0,0 +1,71 @@
+/**
+ * @file sim.h
+ * @brief Control interface of the simulated SDK layer.
+ *
+ * Used by the host runners to drive the virtual clock, the DHT waveform,
+ * the flash and the web server stand-in.
+ */
+
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <esp8266.h>
+#include <httpd.h>
+
+// Faults the simulated DHT sensor can produce on the next frames
+enum SimDhtFault {
+	SIM_DHT_OK,
+	SIM_DHT_NO_RESPONSE,
+	SIM_DHT_SHORT_FRAME,
+	SIM_DHT_BAD_CHECKSUM,
+	// Good checksum over a wrong humidity
+	SIM_DHT_GLITCH
+};
+
+// Response of the web server stand-in
+struct SimResponse {
+	int status;
+	char *data;
+	int len;
+	int cap;
+};
+
+void sim_reset(uint32 reason);
+uint64 sim_now_us(void);
+void sim_run(uint64 us);
+int sim_run_next(void);
+int sim_step(uint64 limit_us);
+void sim_boot(void);
+
+void sim_dht_set(float temperature, float humidity);
+void sim_dht_fault(enum SimDhtFault fault, int frames);
+uint32 sim_gpio_out(void);
+
+void sim_wifi_aps(int n);
+void sim_wifi_ap(int up, int channel);
+void sim_wifi_drop(int reason);
+
+int sim_net_poll(int timeout_ms);
+void sim_net_send_fail(int sends);
+void sim_net_reset(void);
+
+void sim_flash_fail(int skip, int writes);
+uint32 sim_flash_erases(uint16 sector);
+uint32 sim_flash_total_erases(void);
+uint32 sim_flash_total_writes(void);
+int sim_flash_sectors(void);
+
+size_t sim_heap_used(void);
+size_t sim_heap_peak(void);
+void sim_heap_reset_peak(void);
+size_t sim_heap_largest_free(void);
+uint32 sim_heap_failures(void);
+
+void sim_http_headers(const char *headers);
+void sim_http_from(int port);
+void sim_http_close(int port);
+int sim_http(const char *method, const char *url, const char *post, struct SimResponse *resp);
+uint32 sim_http_overflows(void);
+void sim_response_free(struct SimResponse *resp);
+
+#endif
@@ -0,0 +1,302 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file soak.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Accelerated soak test of the host build.
+ *
+ * Runs the firmware on the virtual clock for days or months of device time:
+ * DHT polling and relay actions run from their own timers, while HTTP
+ * requests, WiFi scans and config saves arrive at random times at the given
+ * rates. Every report period it prints heap high-water and fragmentation,
+ * request latency percentiles and sample timing drift, and at the end the
+ * flash erase count of every sector that was erased.
+ *
+ * Request latency is device time from arrival to the end of the CGI, so it
+ * includes waiting for DHT reads and flash erases that block the CPU.
+ */
+
+#include <getopt.h>
+#include <math.h>
+
+#include "sim.h"
+#include "config.h"
+#include "dht.h"
+#include "sampler.h"
+
+#define US_PER_DAY (86400ULL * 1000000)
+// Rated erase cycles of the SPI flash used on ESP-01 boards
+#define FLASH_ENDURANCE 100000
+#define MAX_LATENCIES (1 << 21)
+
+struct SoakOptions {
+	double days;
+	double report_days;
+	double http_per_min;
+	double scans_per_hour;
+	double saves_per_day;
+	unsigned int seed;
+};
+
+struct SoakWindow {
+	uint32 latency[MAX_LATENCIES];
+	int count;
+	uint32 failed;
+	size_t heap_high;
+	size_t largest_free_low;
+	uint32 reads;
+	uint64 max_late;
+	// Heap samples taken, none since the last report means nothing to show
+	uint32 samples;
+};
+
+static struct SoakWindow window;
+
+/*
+ * @brief Exponential inter-arrival time, in microseconds, for rate events
+ * per period_us.
+ */
+
+static uint64 _next_arrival(double rate, uint64 period_us) {
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+	if (rate <= 0) return (uint64)-1;
+
+	return (uint64)(-log(u) * period_us / rate);
+}
+
+static int _cmp_u32(const void *a, const void *b) {
+	uint32 x = *(const uint32 *)a;
+	uint32 y = *(const uint32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32 _percentile(uint32 *v, int n, double p) {
+	int i;
+
+	if (n == 0) return 0;
+
+	i = (int)(p * (n - 1) + 0.5);
+	return v[i];
+}
+
+static void _window_sample_heap(void) {
+	size_t largest = sim_heap_largest_free();
+
+	if (sim_heap_peak() > window.heap_high) window.heap_high = sim_heap_peak();
+	if (largest < window.largest_free_low) window.largest_free_low = largest;
+	window.samples++;
+}
+
+static void _window_report(double day) {
+	size_t free = system_get_free_heap_size();
+	size_t largest = sim_heap_largest_free();
+
+	if (!window.samples) return;
+
+	qsort(window.latency, window.count, sizeof(uint32), _cmp_u32);
+
+	printf("day %7.1f  heap_hw %5u  largest_free %5u/%5u (low %5u) frag %4.1f%%  "
+			"req %6d fail %4u  lat_ms p50 %6.2f p95 %6.2f p99 %6.2f max %7.2f  "
+			"reads %6u late_max_ms %.1f\n",
+			day, (unsigned int)window.heap_high, (unsigned int)largest, (unsigned int)free,
+			(unsigned int)window.largest_free_low, free ? 100.0 * (1.0 - (double)largest / free) : 0,
+			window.count, window.failed,
+			_percentile(window.latency, window.count, 0.50) / 1000.0,
+			_percentile(window.latency, window.count, 0.95) / 1000.0,
+			_percentile(window.latency, window.count, 0.99) / 1000.0,
+			window.count ? window.latency[window.count - 1] / 1000.0 : 0,
+			window.reads, window.max_late / 1000.0);
+	fflush(stdout);
+
+	memset(&window, 0, sizeof(window));
+	window.largest_free_low = (size_t)-1;
+	sim_heap_reset_peak();
+}
+
+static const char *_pick_url(void) {
+	static const char *urls[] = {
+		"/index.tpl", "/index.tpl", "/index.tpl", "/index.tpl",
+		"/style.css", "/style.css",
+		"/relay.cgi?relay=on", "/relay.cgi?relay=off",
+		"/relayconfig.tpl", "/metrics"
+	};
+
+	return urls[rand() % (sizeof(urls) / sizeof(urls[0]))];
+}
+
+static void _request(const char *url, uint64 arrival) {
+	struct SimResponse resp;
+	int status;
+
+	status = sim_http("GET", url, NULL, &resp);
+	sim_response_free(&resp);
+
+	if (status >= 500) window.failed++;
+
+	if (window.count < MAX_LATENCIES) window.latency[window.count++] = (uint32)(sim_now_us() - arrival);
+}
+
+static void _config_save(void) {
+	struct SimResponse resp;
+	char url[96];
+
+	sprintf(url, "/relayconfig.cgi?relay=on&humidity=%d&temperature=%d&time=%d",
+			50 + rand() % 40, 25 + rand() % 20, 1 + rand() % 30);
+	sim_http("GET", url, NULL, &resp);
+	sim_response_free(&resp);
+}
+
+static void _usage(const char *name, int status) {
+	fprintf(stderr, "usage: %s [-d days] [-r report_days] [-h http_per_min] [-s scans_per_hour]\n"
+			"          [-c config_saves_per_day] [-S seed]\n"
+			"defaults: -d 90 -r 7 -h 2 -s 6 -c 1 -S 1, -? shows this\n", name);
+	exit(status);
+}
+
+int main(int argc, char **argv) {
+	struct SoakOptions opt = {90, 7, 2, 6, 1, 1};
+	uint64 end, nextReport, nextHttp, nextScan, nextSave, firstRead = 0, lastRead = 0;
+	// Time the sampler set to the next reading, and the sum of them
+	uint64 expected = 0, scheduled = 0;
+	uint32 reads = 0;
+	int c, sector;
+
+	// -h is taken by the request rate, -? asks for the usage
+	opterr = 0;
+	while ((c = getopt(argc, argv, "d:r:h:s:c:S:")) != -1) {
+		switch (c) {
+			case 'd': opt.days = atof(optarg); break;
+			case 'r': opt.report_days = atof(optarg); break;
+			case 'h': opt.http_per_min = atof(optarg); break;
+			case 's': opt.scans_per_hour = atof(optarg); break;
+			case 'c': opt.saves_per_day = atof(optarg); break;
+			case 'S': opt.seed = atoi(optarg); break;
+			default:
+				if (optopt != '?') fprintf(stderr, "%s: bad option -%c\n", argv[0], optopt);
+				_usage(argv[0], optopt == '?' ? 0 : 2);
+		}
+	}
+
+	srand(opt.seed);
+	sim_quiet = 1;
+	sim_reset(REASON_DEFAULT_RST);
+	sim_dht_set(22, 55);
+	sim_boot();
+	memset(&window, 0, sizeof(window));
+	window.largest_free_low = (size_t)-1;
+
+	printf("soak: %.1f days, %.1f req/min, %.1f scans/h, %.1f config saves/day, seed %u\n",
+			opt.days, opt.http_per_min, opt.scans_per_hour, opt.saves_per_day, opt.seed);
+
+	end = sim_now_us() + (uint64)(opt.days * US_PER_DAY);
+	nextReport = sim_now_us() + (uint64)(opt.report_days * US_PER_DAY);
+	nextHttp = sim_now_us() + _next_arrival(opt.http_per_min, 60000000ULL);
+	nextScan = sim_now_us() + _next_arrival(opt.scans_per_hour, 3600000000ULL);
+	nextSave = sim_now_us() + _next_arrival(opt.saves_per_day, US_PER_DAY);
+
+	while (sim_now_us() < end) {
+		uint64 next = end;
+		uint64 now;
+
+		if (nextHttp < next) next = nextHttp;
+		if (nextScan < next) next = nextScan;
+		if (nextSave < next) next = nextSave;
+		if (nextReport < next) next = nextReport;
+
+		if (sim_step(next)) {
+			// A timer fired, see if it was a DHT read
+			if (dht_stats()->reads != reads) {
+				now = sim_now_us();
+
+				if (reads == 0) firstRead = now;
+
+				if (reads > 0 && now - lastRead > expected) {
+					uint64 late = now - lastRead - expected;
+
+					if (late > window.max_late) window.max_late = late;
+				}
+
+				if (reads > 0) scheduled += expected;
+				expected = sampler_stats()->interval * 1000ULL;
+				reads = dht_stats()->reads;
+				lastRead = now;
+				window.reads++;
+
+				// Slow daily temperature and humidity cycle
+				sim_dht_set(22 + 4 * sin(now * 2 * M_PI / US_PER_DAY), 55 + 15 * cos(now * 2 * M_PI / US_PER_DAY));
+			}
+
+			_window_sample_heap();
+			continue;
+		}
+
+		now = sim_now_us();
+
+		if (now >= nextHttp) {
+			_request(_pick_url(), nextHttp);
+			nextHttp += _next_arrival(opt.http_per_min, 60000000ULL);
+		}
+
+		if (now >= nextScan) {
+			// Each poll of the wifi page finds a different number of APs
+			sim_wifi_aps(rand() % 20);
+			_request("/wifi/wifiscan.cgi", nextScan);
+			nextScan += _next_arrival(opt.scans_per_hour, 3600000000ULL);
+		}
+
+		if (now >= nextSave) {
+			_config_save();
+			nextSave += _next_arrival(opt.saves_per_day, US_PER_DAY);
+		}
+
+		_window_sample_heap();
+
+		if (now >= nextReport) {
+			_window_report((double)now / US_PER_DAY);
+			nextReport += (uint64)(opt.report_days * US_PER_DAY);
+		}
+	}
+
+	_window_report((double)sim_now_us() / US_PER_DAY);
+
+	printf("heap: %u in use at the end, allocation failures %u\n", (unsigned int)sim_heap_used(), sim_heap_failures());
+
+	if (reads > 1) {
+		double drift = (double)(lastRead - firstRead) - (double)scheduled;
+
+		printf("dht: %u reads, %u errors, %u outliers, %u retries, schedule drift %.1f ms over the run\n",
+				reads, dht_stats()->errors, dht_stats()->outliers, dht_stats()->retries, drift / 1000.0);
+	}
+
+	printf("flash erases:\n");
+
+	for (sector = 0; sector < sim_flash_sectors(); sector++) {
+		uint32 erases = sim_flash_erases(sector);
+
+		if (!erases) continue;
+
+		printf("  sector 0x%03x: %8u erases, %.1f per day, worn out in %.1f years\n",
+				sector, erases, erases / opt.days, FLASH_ENDURANCE / (erases / opt.days) / 365.0);
+	}
+
+	return sim_heap_failures() ? 1 : 0;
+}
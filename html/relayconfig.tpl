@@ -15,8 +15,9 @@
 	</head>
 	<body onload="changeState()">
 		<div id="main">
-			<h1>Relay settings</h1>
+			<h1>Relay %channel% settings</h1>
 			<form name="config" action="relayconfig.cgi" method="get" style="display: inline;">
+			<input type="hidden" name="channel" value="%channel%">
 			<p>Relay: <label><input type="radio" name="relay" id="on" value="on" checked>On</label>
 				<label><input type="radio" name="relay" id="off" value="off">Off</label> </p>
 			<p>Maximun humidity to trigger realy <input type="number" name="humidity" value="%humidity%" min="0" max="99"> &#37;</p>
@@ -1 +1,3 @@
 void action_init(void);
+uint32 action_get_latched(void);
+void action_restore(uint32 latched);
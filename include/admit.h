@@ -0,0 +1,34 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include "httpd.h"
+
+// Connections followed, the same as the pool of libesphttpd, and how many
+// of them only control routes can take
+#define ADMIT_CONNS   8
+#define ADMIT_RESERVE 2
+// A kept alive connection left idle this long is closed by the SDK
+#define ADMIT_IDLE_MS 5000
+
+// Routes by priority, highest first
+enum AdmitClass {
+	ADMIT_CONTROL,
+	ADMIT_PAGE,
+	ADMIT_ASSET,
+	ADMIT_CLASSES
+};
+
+struct AdmitStats {
+	uint32 admitted[ADMIT_CLASSES];
+	uint32 rejected[ADMIT_CLASSES];
+	// Requests on a connection that had already been answered
+	uint32 reused;
+	uint32 open;
+	uint32 peak;
+};
+
+int admit_begin(HttpdConnData *connData, enum AdmitClass cls);
+void admit_end(HttpdConnData *connData, int done);
+struct AdmitStats *admit_stats(void);
+
+#endif
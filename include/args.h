@@ -0,0 +1,14 @@
+// Arguments kept by args_parse(), later ones are ignored
+#define ARGS_MAX 8
+
+// Query string or form body split into decoded key/value pairs
+struct Args {
+	int n;
+	char *key[ARGS_MAX];
+	char *val[ARGS_MAX];
+};
+
+int args_parse(struct Args *a, char *query);
+const char *args_get(struct Args *a, const char *key);
+int args_int(struct Args *a, const char *key, int def);
+int args_num(struct Args *a, const char *key, int *value);
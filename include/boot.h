@@ -0,0 +1,18 @@
+enum BootPhase {
+	BOOT_START,
+	BOOT_CONFIG,
+	BOOT_IO,
+	BOOT_DHT,
+	BOOT_HTTPD,
+	BOOT_READY,
+	BOOT_DEFERRED,
+	BOOT_FIRST_SAMPLE,
+	BOOT_FIRST_RESPONSE,
+	BOOT_PHASES
+};
+
+void boot_init(void);
+void boot_mark(enum BootPhase phase);
+uint32 boot_time(enum BootPhase phase);
+const char *boot_phase_name(enum BootPhase phase);
+uint32 boot_uptime(void);
@@ -0,0 +1,8 @@
+#ifndef CHART_H
+#define CHART_H
+
+#include "httpd.h"
+
+int chart_cgi(HttpdConnData *connData);
+
+#endif
@@ -0,0 +1,8 @@
+struct CoapStats {
+	uint32 requests;
+	uint32 notifications;
+	uint32 observers;
+};
+
+void coap_init(int port);
+struct CoapStats *coap_stats(void);
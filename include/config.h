@@ -8,18 +8,93 @@
 #define DEFAULT_OFF   0
 // Valid values are: 'SENSOR_DHT22' or 'SENSOR_DHT11'
 #define SENSORTYPE    SENSOR_DHT22
-// Time between readings of sensor
+// Time between readings of sensor, until the sampler has two to compare
 #define POOLTIME  30000
+// Readings are then taken every SAMPLE_MIN_MS to SAMPLE_MAX_MS, more often
+// while the signal changes or is near a relay threshold, see sampler.c. A
+// DHT22 can not be read more often than every 2 s, a DHT11 every 1 s. Equal
+// values give a fixed interval
+#define SAMPLE_MIN_MS 2000
+#define SAMPLE_MAX_MS 120000
+// A failed or doubtful frame is read again this many times, DHT_RETRY_MS
+// apart, before the poll gives up
+#define DHT_RETRIES  2
+#define DHT_RETRY_MS 2000
+// Time after boot before the first reading, the sensor needs it to settle
+#define DHT_STARTUP_MS 2000
+// Critical sections longer than this, in microseconds, are logged. 0 = never
+#define CRIT_ALARM_US 10000
+// Number of relays/SSRs driven by the board, GPIOs are listed in io.c
+#define IO_CHANNELS   1
+// MQTT broker IP address, leave it empty to disable MQTT
+#define MQTT_HOST     ""
+#define MQTT_PORT     1883
+// Topics are <MQTT_TOPIC>/<chip id>/samples, /relays, /status and /relay/<n>/set
+#define MQTT_TOPIC    "box"
+// Events are published in batches of this many, or every MQTT_BATCH_MS
+#define MQTT_BATCH    8
+#define MQTT_BATCH_MS 60000
+// Events kept while the broker can not be reached, then the oldest are dropped
+#define MQTT_QUEUE    64
+#define MQTT_KEEPALIVE 60
+#define MQTT_RECONNECT_MS 5000
+// A broker that does not answer CONNECT in this time is dropped
+#define MQTT_CONNACK_MS 10000
+// UDP port of the CoAP server, 0 disables it
+#define COAP_PORT     5683
+// RAM for the samples of the history resources, they are compressed to
+// about one byte each
+#define HISTORY_BYTES 1024
+// Buckets kept by each rollup tier: 1 minute, 15 minutes and 1 hour, 14
+// bytes each
+#define ROLLUP_MINUTES  30
+#define ROLLUP_QUARTERS 32
+#define ROLLUP_HOURS    48
+// Samples kept in RAM before they are written to the flash log together
+#define FLASHLOG_BATCH 8
+// A lost WiFi connection is retried at once on the last access point and
+// channel, then with full scans every WIFI_BACKOFF_MIN_MS, doubling up to
+// WIFI_BACKOFF_MAX_MS. The access point is turned on after WIFI_FALLBACK_MS
+// without connection, and off again when the station connects
+#define WIFI_FAST_MS        1500
+#define WIFI_CONNECT_MS     8000
+#define WIFI_BACKOFF_MIN_MS 1000
+#define WIFI_BACKOFF_MAX_MS 16000
+#define WIFI_FALLBACK_MS    5000
+// The link is checked this often while connected, in case an event is missed
+#define WIFI_CHECK_MS       10000
 
-struct config {
-	short int checksum;
+// Rule for one relay channel
+struct config_channel {
 	short int hum;
 	short int temp;
 	short int time;
 	short int off;
 };
 
+struct config {
+	short int checksum;
+	struct config_channel ch[IO_CHANNELS];
+};
+
+// One field of a rule: its name in JSON and in the relay config form, NULL
+// if the form has none, its limits and where it is in struct config_channel
+struct ConfigField {
+	const char *name;
+	const char *arg;
+	short int min;
+	short int max;
+	uint8 offset;
+};
+
+#define CONFIG_FIELDS 4
+
+extern const struct ConfigField configFields[CONFIG_FIELDS];
+
 
 void config_init(void); 
 int config_save(struct config save); 
 struct config config_read(void);
+short int *config_field(struct config_channel *rule, int i);
+int config_set(struct config_channel *rule, int i, int value);
+int config_check(struct config *conf);
@@ -0,0 +1,42 @@
+#ifndef CRIT_H
+#define CRIT_H
+
+enum CritKind {
+	CRIT_INTR,
+	CRIT_UART,
+	CRIT_KINDS
+};
+
+// Upper bound, in microseconds and included, of each histogram bucket, last
+// one is open
+#define CRIT_BUCKETS 8
+#define CRIT_BUCKET_LIMITS {16, 64, 256, 1000, 4000, 16000, 64000, 0}
+
+struct CritStats {
+	uint32 count;
+	uint32 total;
+	uint32 max;
+	const char *maxSite;
+	uint32 alarms;
+	uint32 buckets[CRIT_BUCKETS];
+};
+
+#define CRIT_STR2(x) #x
+#define CRIT_STR(x) CRIT_STR2(x)
+#define CRIT_SITE __FILE__ ":" CRIT_STR(__LINE__)
+
+// Use these instead of ets_intr_lock()/ets_intr_unlock() and
+// ETS_UART_INTR_DISABLE()/ETS_UART_INTR_ENABLE()
+#define CRIT_LOCK() crit_enter(CRIT_INTR, CRIT_SITE)
+#define CRIT_UNLOCK() crit_exit(CRIT_INTR)
+#define CRIT_UART_DISABLE() crit_enter(CRIT_UART, CRIT_SITE)
+#define CRIT_UART_ENABLE() crit_exit(CRIT_UART)
+
+void crit_enter(enum CritKind kind, const char *site);
+void crit_exit(enum CritKind kind);
+struct CritStats *crit_stats(enum CritKind kind);
+const char *crit_kind_name(enum CritKind kind);
+void crit_set_alarm(uint32 us);
+uint32 crit_get_alarm(void);
+
+#endif
@@ -9,7 +9,29 @@ struct DhtReading {
 	BOOL success;
 };
 
+struct DhtStats {
+	// Frames read, and those that did not decode
+	uint32 reads;
+	uint32 errors;
+	// Failed decodes by cause: no answer, too few bits and bad checksum
+	uint32 timeouts;
+	uint32 shortFrames;
+	uint32 checksums;
+	// Frames that decoded but were dropped by the slew rate check
+	uint32 outliers;
+	// Frames read again at once, and polls without a good frame
+	uint32 retries;
+	uint32 failures;
+};
+
+// Called with every good reading
+typedef void (*DhtListener)(struct DhtReading *r);
+
 
 void ICACHE_FLASH_ATTR dht(void);
 struct DhtReading * ICACHE_FLASH_ATTR dht_read(int force);
+struct DhtStats * ICACHE_FLASH_ATTR dht_stats(void);
+void dht_restore(struct DhtReading *r, struct DhtStats *s);
 void dht_init(enum EDhtType, uint32_t polltime);
+void dht_interval(uint32_t polltime);
+int dht_subscribe(DhtListener cb);
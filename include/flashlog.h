@@ -0,0 +1,28 @@
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include "httpd.h"
+
+// One sample in the flash log, temperature and humidity in tenths
+struct FlashLogRecord {
+	uint32 time;
+	sint16 temp;
+	sint16 hum;
+};
+
+struct FlashLogStats {
+	uint32 samples;
+	uint32 writes;
+	uint32 erases;
+	uint32 errors;
+};
+
+void flashlog_init(void);
+void flashlog_add(struct FlashLogRecord *r);
+void flashlog_flush(void);
+uint32 flashlog_now(void);
+int flashlog_sectors(void);
+struct FlashLogStats *flashlog_stats(void);
+int flashlog_cgi(HttpdConnData *connData);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+// Call sites followed, the last one collects everything once they are full,
+// and live blocks whose size is known
+#define HEAP_SITES  16
+#define HEAP_BLOCKS 96
+
+struct HeapSite {
+	const char *file;
+	uint32 line;
+	uint32 allocs;
+	uint32 failures;
+	uint32 bytes;
+	uint32 peak;
+};
+
+struct HeapStats {
+	uint32 allocs;
+	uint32 failures;
+	uint32 bytes;
+	uint32 peak;
+	// Blocks that did not fit in the table, their size is not counted
+	uint32 untracked;
+};
+
+struct HeapStats *heap_stats(void);
+int heap_site_count(void);
+struct HeapSite *heap_site(int i);
+void heap_site_name(int i, char *buff, int len);
+uint32 heap_largest_free(void);
+
+#endif
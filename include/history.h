@@ -0,0 +1,12 @@
+// One good DHT reading, temperature and humidity in tenths
+struct HistorySample {
+	uint32 up;
+	sint16 temp;
+	sint16 hum;
+};
+
+void history_init(void);
+void history_add(struct HistorySample *s);
+int history_count(void);
+int history_get(int i, struct HistorySample *s);
+uint32 history_generation(void);
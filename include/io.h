@@ -1,4 +1,13 @@
-void io_enable(short int ena);
+// Called when a channel changes state
+typedef void (*IoListener)(short int ch, int status);
+
 void io_init(void);
-int io_get_status(void);
-void io_timer(short int enable);
+void io_enable(short int ch, short int ena);
+void io_apply(uint32 mask, uint32 values);
+void io_manual(short int ch, short int ena);
+int io_get_status(short int ch);
+uint32 io_get_mask(void);
+void io_timer(short int ch, short int enable);
+uint32 io_timer_deadline(short int ch);
+void io_restore(uint32 mask, uint32 *deadline);
+int io_subscribe(IoListener cb);
@@ -1,2 +1,3 @@
 char* itoa(int i, char b[]);
-
+int itoa_tenths(int i, char b[]);
+int round_tenths(float v);
@@ -0,0 +1,10 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "httpd.h"
+
+int metrics_cgi(HttpdConnData *connData);
+int metrics_heap_cgi(HttpdConnData *connData);
+int metrics_stack_cgi(HttpdConnData *connData);
+
+#endif
@@ -0,0 +1,13 @@
+struct MqttStats {
+	uint32 published;
+	uint32 dropped;
+	uint32 connects;
+	uint32 commands;
+	// Buffers the SDK did not take, their events were kept
+	uint32 sendFailures;
+};
+
+void mqtt_init(const char *host, int port);
+int mqtt_connected(void);
+int mqtt_queued(void);
+struct MqttStats *mqtt_stats(void);
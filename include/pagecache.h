@@ -0,0 +1,28 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "httpd.h"
+
+// Rendered pages kept, the largest body that is cached, the longest url
+// with its query string, and tokens rendered again on every request
+#define PAGECACHE_PAGES 2
+#define PAGECACHE_BYTES 1536
+#define PAGECACHE_KEY   40
+#define PAGECACHE_LIVE  2
+
+struct PageCacheStats {
+	uint32 hits;
+	uint32 misses;
+	// Served by cgiEspFsTemplate, too large or with a long url
+	uint32 bypassed;
+	uint32 generation;
+};
+
+void pagecache_init(void);
+void pagecache_bump(void);
+int pagecache_cgi(HttpdConnData *connData);
+int pagecache_send(HttpdConnData *connData, const char *data, int len);
+int pagecache_live(HttpdConnData *connData, const char *token);
+struct PageCacheStats *pagecache_stats(void);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+enum PoolKind {
+	POOL_CURSOR,
+	POOL_AP,
+	POOL_KINDS
+};
+
+// Block size and count of each pool, at most 32 blocks. Cursors are the
+// per connection state of the streaming CGIs, one per httpd connection.
+#define POOL_CURSOR_SIZE 48
+#define POOL_CURSORS     8
+// Scan results of the /wifi page
+#define POOL_AP_SIZE     48
+#define POOL_APS         16
+
+struct PoolStats {
+	uint32 used;
+	uint32 peak;
+	uint32 allocs;
+	uint32 failures;
+};
+
+void pool_init(void);
+void *pool_alloc(enum PoolKind kind, int size);
+void pool_free(enum PoolKind kind, void *ptr);
+struct PoolStats *pool_stats(enum PoolKind kind);
+const char *pool_kind_name(enum PoolKind kind);
+int pool_blocks(enum PoolKind kind);
+
+#endif
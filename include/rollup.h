@@ -0,0 +1,31 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "httpd.h"
+
+enum RollupTier {
+	ROLLUP_1M,
+	ROLLUP_15M,
+	ROLLUP_1H,
+	ROLLUP_TIERS
+};
+
+// Summary of the samples of one period, temperature and humidity in tenths
+struct RollupBucket {
+	uint16 count;
+	sint16 tmin;
+	sint16 tmean;
+	sint16 tmax;
+	sint16 hmin;
+	sint16 hmean;
+	sint16 hmax;
+};
+
+void rollup_init(void);
+void rollup_add(uint32 up, sint16 temp, sint16 hum);
+int rollup_count(enum RollupTier tier);
+int rollup_get(enum RollupTier tier, int i, uint32 *start, struct RollupBucket *b);
+uint32 rollup_period(enum RollupTier tier);
+int rollup_cgi(HttpdConnData *connData);
+
+#endif
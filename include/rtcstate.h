@@ -0,0 +1,5 @@
+void rtcstate_init(void);
+void rtcstate_save(void);
+uint32 rtcstate_deadline(uint32 ms);
+uint32 rtcstate_remaining(uint32 deadline);
+int rtcstate_warm(void);
@@ -0,0 +1,33 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Why the interval to the next reading was chosen
+enum SampleReason {
+	// Not enough readings yet, POOLTIME is used
+	SAMPLE_START,
+	// Signal is flat and far from every threshold
+	SAMPLE_STABLE,
+	// Signal changes by more than a step between readings
+	SAMPLE_CHANGE,
+	// Signal could reach a threshold before the next readings
+	SAMPLE_THRESHOLD,
+	SAMPLE_REASONS
+};
+
+struct SamplerStats {
+	// Milliseconds to the next reading, and why
+	uint32 interval;
+	enum SampleReason reason;
+	// Steps per minute, and steps to the nearest threshold or -1 if no
+	// channel is on automatic, in hundredths
+	uint32 rate;
+	sint32 margin;
+	uint32 shortened;
+	uint32 lengthened;
+};
+
+void sampler_init(uint32 min, uint32 max);
+struct SamplerStats *sampler_stats(void);
+const char *sampler_reason_name(enum SampleReason reason);
+
+#endif
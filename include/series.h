@@ -0,0 +1,15 @@
+// Longest encoding of one sample: tag, then three 5 byte varints at most
+#define SERIES_MAX_BYTES 16
+
+// Last sample seen by an encoder or a decoder, the next one is coded
+// against it
+struct SeriesState {
+	uint32 up;
+	sint32 delta;
+	sint16 temp;
+	sint16 hum;
+};
+
+void series_start(struct SeriesState *st, const struct HistorySample *first);
+int series_encode(struct SeriesState *st, const struct HistorySample *s, uint8 *out);
+int series_decode(struct SeriesState *st, const uint8 *in, int len, struct HistorySample *s);
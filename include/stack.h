@@ -0,0 +1,37 @@
+#ifndef STACK_H
+#define STACK_H
+
+// Handlers followed, the first one collects what runs between them, and
+// how deep handlers can be nested in each other
+#define STACK_SITES  24
+#define STACK_LEVELS 4
+// Bytes painted below user_init() by the host build, on the device the
+// whole stack is
+#define STACK_HOST_BYTES 16384
+
+struct StackSite {
+	const char *name;
+	uint32 calls;
+	// Deepest use below the entry of the handler, in bytes
+	uint32 peak;
+};
+
+struct StackStats {
+	uint32 size;
+	uint32 peak;
+	// Times the paint was found used up to its end
+	uint32 exhausted;
+};
+
+// Runs call as a handler named name
+#define STACK_CALL(name, call) do { stack_enter(name); call; stack_exit(); } while (0)
+
+void stack_init(void);
+void stack_enter(const char *name);
+void stack_exit(void);
+struct StackStats *stack_stats(void);
+int stack_site_count(void);
+struct StackSite *stack_site(int i);
+int stack_site_ranked(int rank);
+
+#endif
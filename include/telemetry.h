@@ -0,0 +1,29 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "httpd.h"
+
+#define TELEMETRY_MAGIC    0x42
+#define TELEMETRY_VERSION  1
+#define TELEMETRY_SIZE     34
+#define TELEMETRY_JSON_MAX 192
+
+struct Telemetry {
+	uint32 uptime;
+	sint16 temp;
+	uint16 hum;
+	uint8 ok;
+	uint8 channels;
+	uint32 relays;
+	uint32 reads;
+	uint32 errors;
+	uint32 heap;
+	uint32 hits;
+};
+
+void telemetry_collect(struct Telemetry *t);
+int telemetry_encode(struct Telemetry *t, uint8 *buff);
+int telemetry_json(struct Telemetry *t, char *buff);
+int telemetry_cgi(HttpdConnData *connData);
+
+#endif
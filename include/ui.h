@@ -0,0 +1,15 @@
+#ifndef UI_H
+#define UI_H
+
+#include "httpd.h"
+
+// Bytes of the bundle read from the filesystem and sent at once
+#define UI_CHUNK     512
+// Longest /state.json: readings and sampler, one rule per relay, and the
+// WiFi with every SSID character escaped. IO_CHANNELS is in config.h.
+#define UI_STATE_MAX (144 + IO_CHANNELS * 60 + 112)
+
+int ui_cgi(HttpdConnData *connData);
+int ui_cgi_state(HttpdConnData *connData);
+
+#endif
@@ -1 +1,19 @@
+struct WifiStats {
+	uint32 connects;
+	uint32 disconnects;
+	uint32 attempts;
+	uint32 failures;
+	uint32 fastConnects;
+	uint32 fallbacks;
+	uint32 lastMs;
+	uint32 maxMs;
+	uint32 outageMs;
+	uint32 switches;
+	uint32 switchFailures;
+	uint32 switchMs;
+};
+
 void ICACHE_FLASH_ATTR wifi_init(void);
+int wifi_switch(int mode, struct station_config *cfg);
+int wifi_connected(void);
+struct WifiStats *wifi_stats(void);
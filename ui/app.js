@@ -0,0 +1,165 @@
+// Whole UI of the device: pages are shown from the location hash, data
+// comes from state.json and changes go to the CGIs, whose redirects are
+// not followed.
+
+var MODES = ["", "Client", "AP only", "Client + AP"];
+var state = null;
+var scanTimer = null;
+
+function $(id) {
+	return document.getElementById(id);
+}
+
+function get(url) {
+	return fetch(url, {redirect: "manual", cache: "no-store"});
+}
+
+function load() {
+	return get("state.json").then(function(r) {
+		return r.json();
+	}).then(function(s) {
+		state = s;
+		render();
+	});
+}
+
+function relayButton(ch, on) {
+	var b = document.createElement("button");
+
+	b.id = "button";
+	b.textContent = on ? "off" : "on";
+	b.onclick = function() {
+		get("relay.cgi?channel=" + ch + "&relay=" + (on ? "off" : "on")).then(load);
+	};
+	return b;
+}
+
+function render() {
+	var relays = $("relays"), channel = $("channel");
+	var i, p;
+
+	$("ok").textContent = state.ok ? "is" : "isn't";
+	$("t").textContent = state.t;
+	$("h").textContent = state.h;
+	$("chart").src = "chart.svg?r=" + state.reads;
+	$("sample").textContent = "Next reading in " + state.sample.ms / 1000 + " s (" + state.sample.why + ").";
+
+	relays.innerHTML = "";
+	for (i = 0; i < state.relays.length; i++) {
+		p = document.createElement("p");
+		p.textContent = "Relay " + i + " status: " + (state.relays[i].on ? "on" : "off") + ". ";
+		p.appendChild(relayButton(i, state.relays[i].on));
+		relays.appendChild(p);
+	}
+
+	if (channel.options.length != state.relays.length) {
+		channel.innerHTML = "";
+		for (i = 0; i < state.relays.length; i++) channel.add(new Option(i, i));
+	}
+	renderConfig();
+
+	$("mode").textContent = MODES[state.wifi.mode] || "Unknown";
+	$("modes").innerHTML = "";
+	for (i = 1; i < MODES.length; i++) {
+		if (i == state.wifi.mode) continue;
+		$("modes").appendChild(modeButton(i));
+	}
+	$("wifiform").style.display = state.wifi.mode == 2 ? "none" : "block";
+}
+
+function renderConfig() {
+	var rule = state.relays[$("channel").value || 0];
+	var form = $("configform").elements;
+
+	$(rule.off ? "off" : "on").checked = true;
+	form.humidity.value = rule.hum;
+	form.temperature.value = rule.temp;
+	form.time.value = rule.time;
+}
+
+function modeButton(mode) {
+	var b = document.createElement("button");
+
+	b.id = "button";
+	b.textContent = MODES[mode];
+	b.onclick = function() {
+		get("wifi/setmode.cgi?mode=" + mode).then(function() {
+			$("wifimsg").textContent = "Changing mode...";
+			window.setTimeout(load, 5000);
+		});
+	};
+	return b;
+}
+
+function scan() {
+	get("wifi/wifiscan.cgi").then(function(r) {
+		return r.json();
+	}).then(function(data) {
+		var aps = $("aps"), i, ap, div;
+
+		if (data.result.inProgress != "0") return;
+
+		aps.innerHTML = "";
+		for (i = 0; i < data.result.APs.length; i++) {
+			ap = data.result.APs[i];
+			if (ap.essid == "") continue;
+
+			div = document.createElement("div");
+			div.id = "apdiv";
+			div.innerHTML = "<label><input type=\"radio\" name=\"essid\"></label>";
+			div.firstChild.firstChild.value = ap.essid;
+			div.firstChild.firstChild.checked = ap.essid == state.wifi.ssid;
+			div.firstChild.appendChild(document.createTextNode(ap.essid + " (rssi " + ap.rssi + ")"));
+			aps.appendChild(div);
+		}
+	});
+}
+
+function show() {
+	var page = location.hash.substring(1) || "home";
+	var pages = document.getElementsByClassName("page");
+	var i;
+
+	for (i = 0; i < pages.length; i++) pages[i].className = pages[i].id == page ? "page shown" : "page";
+
+	window.clearInterval(scanTimer);
+	if (page == "wifi") {
+		scan();
+		scanTimer = window.setInterval(scan, 5000);
+	}
+}
+
+$("channel").onchange = renderConfig;
+
+$("configform").onsubmit = function(e) {
+	var form = $("configform").elements;
+	var rules = [], ch = $("channel").value;
+	var i;
+
+	e.preventDefault();
+	for (i = 0; i < state.relays.length; i++) rules.push(null);
+	rules[ch] = {hum: +form.humidity.value, temp: +form.temperature.value, time: +form.time.value, off: $("off").checked};
+
+	fetch("config", {method: "POST", body: JSON.stringify(rules)}).then(function(r) {
+		return r.json();
+	}).then(function(data) {
+		$("configmsg").textContent = data.error ? "Not saved: " + data.error : "Saved";
+		load();
+	});
+};
+
+$("wifiform").onsubmit = function(e) {
+	var form = $("wifiform");
+
+	e.preventDefault();
+	fetch("wifi/connect.cgi", {method: "POST", redirect: "manual", body: new URLSearchParams(new FormData(form))}).then(function() {
+		$("wifimsg").textContent = "Connecting...";
+		window.setTimeout(load, 8000);
+	});
+};
+
+window.onhashchange = show;
+show();
+load();
+// Readings change every POOLTIME
+window.setInterval(load, 30000);
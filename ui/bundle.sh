@@ -0,0 +1,32 @@
+#!/bin/sh
+# Builds the single page UI: ui/app.html with its style sheets and scripts
+# inlined, leading blanks and blank lines removed, gzipped.
+#
+# usage: bundle.sh <ui dir> <output .gz>
+
+set -e
+
+dir=$1
+out=$2
+
+awk -v dir="$dir" '
+function inline(file, head, tail) {
+	print head
+	while ((getline line < file) > 0) print line
+	close(file)
+	print tail
+}
+/<link rel="stylesheet"/ {
+	match($0, /href="[^"]*"/)
+	inline(dir "/" substr($0, RSTART + 6, RLENGTH - 7), "<style>", "</style>")
+	next
+}
+/<script .*src="/ {
+	match($0, /src="[^"]*"/)
+	inline(dir "/" substr($0, RSTART + 5, RLENGTH - 6), "<script>", "</script>")
+	next
+}
+{ print }
+' "$dir/app.html" | sed -e 's/^[[:space:]]*//' -e '/^$/d' -e '/^\/\//d' | gzip -9 -n > "$out.tmp"
+
+mv "$out.tmp" "$out"
@@ -24,7 +24,8 @@
  * @brief File containing basic actions based on DTH readings and configuration.
  *
  * Ralay is turned on and off depending on DHT readins and the parameters set 
- * into the configuration. SLEEP_TIME Defines the time between sensor readings.
+ * into the configuration. Rules are checked on every good reading, so relays
+ * react as soon as the sampler reads the sensor.
  */
 
 #include <esp8266.h>
@@ -32,40 +33,71 @@
 #include <dht.h>
 #include <io.h>
 #include <config.h>
+#include <stack.h>
 
-/**
- * milliseconds between checks 
- */
-#define SLEEP_TIME 30000  
-
-static ETSTimer actionTimer;
-
-static int maxReached = 0;
+// Channels a rule turned on, kept in RTC memory with the relays
+static uint32 maxReached = 0;
 
 /**
  * @brief Turn on and off realy, based on DHT readings and configutation.
  *
+ * Every channel is checked against its own rule, channels changing in the same
+ * round are switched together.
  */
 
-static void _action_task(void *arg) {
+static void _action_run(void) {
 	struct config currConfig = config_read();
 	struct DhtReading *r = dht_read(0);
 	float temp = r->temperature;
 	float hum  = r->humidity;
+	uint32 mask = 0;
+	uint32 values = 0;
+	short int ch;
+
+	if (!r->success) return;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		struct config_channel *rule = &currConfig.ch[ch];
 
-	if (r->success && !currConfig.off) {
-		if (hum > currConfig.hum || temp > currConfig.temp) {
-			if (!maxReached) {
-				os_printf("Max humidity/temperature exceeded.\n");
-				maxReached = 1;
-        			io_enable(1);
+		if (rule->off) continue;
+
+		if (hum > rule->hum || temp > rule->temp) {
+			if (!(maxReached & (1 << ch))) {
+				os_printf("Max humidity/temperature exceeded on channel %d.\n", ch);
+				maxReached |= 1 << ch;
+				mask |= 1 << ch;
+				values |= 1 << ch;
 			}
-		} else if (maxReached) {
-			os_printf("Humidity/temperature is back to nomal levels.\n");
-			maxReached = 0;
-			io_enable(0);
+		} else if (maxReached & (1 << ch)) {
+			os_printf("Humidity/temperature is back to nomal levels on channel %d.\n", ch);
+			maxReached &= ~(1 << ch);
+			mask |= 1 << ch;
 		}
 	}
+
+	io_apply(mask, values);
+}
+
+static void _action_reading(struct DhtReading *r) {
+	STACK_CALL("action", _action_run());
+}
+
+/**
+ * @brief Channels turned on by their rule, to be turned off when readings
+ * are back to normal.
+ */
+
+uint32 action_get_latched(void) {
+	return maxReached;
+}
+
+/**
+ * @brief Restores the channels turned on by their rule after a soft reset,
+ * or a relay left on by a rule would never be turned off.
+ */
+
+void action_restore(uint32 latched) {
+	maxReached = latched & ((1 << IO_CHANNELS) - 1);
 }
 
 /**
@@ -75,8 +107,12 @@ static void _action_task(void *arg) {
 
 void action_init(void) {
 	struct config currConfig = config_read();
-	os_printf("Initializing relay trigger Max humidity allowed: %d, Max temperature allowed: %d\n", (int)currConfig.hum, (int)currConfig.temp);
-        os_timer_disarm(&actionTimer);
-	os_timer_setfn(&actionTimer, _action_task, NULL);
-        os_timer_arm(&actionTimer, SLEEP_TIME, 1);
+	short int ch;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		os_printf("Initializing relay %d trigger Max humidity allowed: %d, Max temperature allowed: %d\n",
+				ch, (int)currConfig.ch[ch].hum, (int)currConfig.ch[ch].temp);
+	}
+
+	dht_subscribe(_action_reading);
 }
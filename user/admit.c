@@ -0,0 +1,251 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file admit.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the admission control of the web server.
+ *
+ * Every route of builtInUrls runs through admit_begin() and admit_end().
+ * Connections are told apart by remote address and port, so a request on
+ * a connection that was kept alive finds the slot of the previous one and
+ * is counted as reused. A connection holds its slot while a response is
+ * being sent and, if the client asked for keep-alive, until it is closed.
+ * The disconnect and reconnect callbacks libesphttpd registered on such a
+ * connection are wrapped to free the slot first, whether libesphttpd closes
+ * it after the response or the client or the SDK, after ADMIT_IDLE_MS idle,
+ * do. Other connections are closed by libesphttpd once answered and free
+ * their slot at once.
+ *
+ * New connections are admitted by class: static assets while less than
+ * ADMIT_CONNS - ADMIT_RESERVE are open, pages up to one less than all of
+ * them, and control routes like relay.cgi up to ADMIT_CONNS. The last
+ * slots are left for control, so a relay can still be switched when
+ * dashboards fill the libesphttpd pool. The same limits apply to requests
+ * on open connections, so a connection that got in for relay.cgi can not
+ * keep a reserved slot to load pages. A request that is not admitted gets
+ * a 503 with Retry-After and its connection is closed.
+ */
+
+#include <esp8266.h>
+#include "admit.h"
+
+struct AdmitConn {
+	uint8 ip[4];
+	int port;
+	uint32 last;
+	uint8 used;
+	uint8 busy;
+	uint8 keep;
+};
+
+static struct AdmitConn conns[ADMIT_CONNS];
+static struct AdmitStats stats;
+
+static const uint8 limits[ADMIT_CLASSES] = {
+	ADMIT_CONNS,
+	ADMIT_CONNS - 1,
+	ADMIT_CONNS - ADMIT_RESERVE
+};
+
+// Callbacks of libesphttpd on the connections admit.c wraps
+static espconn_connect_callback httpdDisconCb;
+static espconn_reconnect_callback httpdReconCb;
+
+/*
+ * @brief Frees the slots of kept alive connections idle for longer than
+ * the SDK keeps them, in case their close went by unseen. Returns the
+ * number of open connections.
+ */
+
+static int ICACHE_FLASH_ATTR _admit_expire(void) {
+	uint32 now = system_get_time();
+	int i, open = 0;
+
+	for (i = 0; i < ADMIT_CONNS; i++) {
+		if (conns[i].used && !conns[i].busy && now - conns[i].last > ADMIT_IDLE_MS * 1000) {
+			conns[i].used = 0;
+		}
+		open += conns[i].used;
+	}
+
+	return open;
+}
+
+static struct AdmitConn *ICACHE_FLASH_ATTR _admit_slot(const uint8 *ip, int port) {
+	int i;
+
+	for (i = 0; i < ADMIT_CONNS; i++) {
+		if (conns[i].used && conns[i].port == port && !os_memcmp(conns[i].ip, ip, 4)) {
+			return &conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct AdmitConn *ICACHE_FLASH_ATTR _admit_find(HttpdConnData *connData) {
+	return _admit_slot(connData->remote_ip, connData->remote_port);
+}
+
+/*
+ * @brief Frees the slot of a connection that has been closed.
+ */
+
+static void ICACHE_FLASH_ATTR _admit_closed(struct espconn *conn) {
+	struct AdmitConn *c = _admit_slot(conn->proto.tcp->remote_ip, conn->proto.tcp->remote_port);
+
+	if (c != NULL) c->used = 0;
+	stats.open = _admit_expire();
+}
+
+static void ICACHE_FLASH_ATTR _admit_discon_cb(void *arg) {
+	_admit_closed((struct espconn *)arg);
+	if (httpdDisconCb != NULL) httpdDisconCb(arg);
+}
+
+static void ICACHE_FLASH_ATTR _admit_recon_cb(void *arg, sint8 err) {
+	_admit_closed((struct espconn *)arg);
+	if (httpdReconCb != NULL) httpdReconCb(arg, err);
+}
+
+/*
+ * @brief Hooks admit.c in front of libesphttpd on a kept alive connection,
+ * so its slot is freed as soon as the connection closes.
+ */
+
+static void ICACHE_FLASH_ATTR _admit_hook(struct espconn *conn) {
+	esp_tcp *tcp = conn->proto.tcp;
+
+	if (tcp->disconnect_callback != _admit_discon_cb) {
+		httpdDisconCb = tcp->disconnect_callback;
+		espconn_regist_disconcb(conn, _admit_discon_cb);
+	}
+
+	if (tcp->reconnect_callback != _admit_recon_cb) {
+		httpdReconCb = tcp->reconnect_callback;
+		espconn_regist_reconcb(conn, _admit_recon_cb);
+	}
+}
+
+/*
+ * @brief Returns 1 if the request asked to keep the connection open.
+ */
+
+static int ICACHE_FLASH_ATTR _admit_keep_alive(HttpdConnData *connData) {
+	char buff[24];
+
+	if (!httpdGetHeader(connData, "Connection", buff, sizeof(buff))) return 0;
+
+	return os_strstr(buff, "keep-alive") != NULL || os_strstr(buff, "Keep-Alive") != NULL;
+}
+
+static void ICACHE_FLASH_ATTR _admit_reject(HttpdConnData *connData, enum AdmitClass cls) {
+	stats.rejected[cls]++;
+
+	httpdStartResponse(connData, 503);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdHeader(connData, "Retry-After", "1");
+	httpdHeader(connData, "Connection", "close");
+	httpdEndHeaders(connData);
+	httpdSend(connData, "Busy\n", -1);
+}
+
+/**
+ * @brief Called before the route of every request. Returns 0 if the
+ * request was not admitted and has been answered already.
+ */
+
+int ICACHE_FLASH_ATTR admit_begin(HttpdConnData *connData, enum AdmitClass cls) {
+	struct AdmitConn *c = _admit_find(connData);
+	int open, i;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		if (c != NULL) c->used = 0;
+		stats.open = _admit_expire();
+		return 1;
+	}
+
+	// Still sending the response
+	if (c != NULL && c->busy) return 1;
+
+	open = _admit_expire();
+
+	if (c != NULL) {
+		// Over the limit of the class, the connection gives its slot back
+		if (open > limits[cls]) {
+			c->used = 0;
+			stats.open = open - 1;
+			_admit_reject(connData, cls);
+			return 0;
+		}
+		stats.reused++;
+	} else if (open >= limits[cls]) {
+		_admit_reject(connData, cls);
+		return 0;
+	} else {
+		for (i = 0; conns[i].used; i++);
+		c = &conns[i];
+		os_memcpy(c->ip, connData->remote_ip, 4);
+		c->port = connData->remote_port;
+		c->used = 1;
+		open++;
+	}
+
+	stats.admitted[cls]++;
+	stats.open = open;
+	if (open > stats.peak) stats.peak = open;
+
+	c->busy = 1;
+	c->keep = _admit_keep_alive(connData);
+	if (c->keep) {
+		espconn_regist_time(connData->conn, ADMIT_IDLE_MS / 1000, 1);
+		_admit_hook(connData->conn);
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Called after the route, done is 0 while the response goes on.
+ */
+
+void ICACHE_FLASH_ATTR admit_end(HttpdConnData *connData, int done) {
+	struct AdmitConn *c;
+
+	if (!done || connData->conn == NULL) return;
+
+	c = _admit_find(connData);
+	if (c == NULL) return;
+
+	c->busy = 0;
+	c->last = system_get_time();
+	if (!c->keep) c->used = 0;
+	stats.open = _admit_expire();
+}
+
+/**
+ * @brief Admission counters since boot.
+ */
+
+struct AdmitStats *ICACHE_FLASH_ATTR admit_stats(void) {
+	stats.open = _admit_expire();
+	return &stats;
+}
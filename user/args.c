@@ -0,0 +1,170 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file args.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Query string and form body parser for the CGIs.
+ *
+ * httpdFindArg() scans the whole string for every argument and copies the
+ * value out. args_parse() goes over it once instead: keys and values are
+ * URL decoded in place, ended with a NUL, and pointed at from a small array,
+ * so looking an argument up needs no buffer.
+ *
+ * The string is modified, so it can only be parsed once. Templates, which
+ * run their callback once per token, keep what they need in their arg.
+ */
+
+#include <esp8266.h>
+
+#include "args.h"
+
+static int ICACHE_FLASH_ATTR _args_hex(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * @brief Decodes one key or value in place, up to the end of the argument
+ * or to stop. Returns the character it stopped at.
+ */
+
+static char ICACHE_FLASH_ATTR _args_token(char **in, char **out, char stop) {
+	char *i = *in, *o = *out;
+	char c;
+
+	for (;;) {
+		c = *i;
+
+		// Every separator and escape sorts before '=', most text after it
+		if ((uint8)c > '=') {
+			*o++ = c;
+			i++;
+			continue;
+		}
+
+		if (c == 0 || c == '&' || c == '\r' || c == '\n' || c == stop) break;
+
+		if (c == '+') {
+			c = ' ';
+		} else if (c == '%' && _args_hex(i[1]) >= 0 && _args_hex(i[2]) >= 0) {
+			c = (_args_hex(i[1]) << 4) | _args_hex(i[2]);
+			i += 2;
+		}
+
+		*o++ = c;
+		i++;
+	}
+
+	*in = i;
+	*out = o;
+	return c;
+}
+
+/*
+ * @brief Splits query at '&' and '=' and decodes it in place. Returns the
+ * number of arguments found.
+ *
+ * A key without '=' gets an empty value. Broken escapes are kept as they
+ * are. Parsing stops at the end of the string or of the line.
+ */
+
+int ICACHE_FLASH_ATTR args_parse(struct Args *a, char *query) {
+	char *in = query, *out = query;
+	char c;
+
+	a->n = 0;
+
+	if (query == NULL) return 0;
+
+	while (a->n < ARGS_MAX) {
+		while (*in == '&') in++;
+		if (*in == 0 || *in == '\r' || *in == '\n') break;
+
+		// The separator is passed before it can be overwritten by the NUL
+		a->key[a->n] = out;
+		c = _args_token(&in, &out, '=');
+		if (c == '=' || c == '&') in++;
+		*out++ = 0;
+
+		if (c == '=') {
+			a->val[a->n] = out;
+			c = _args_token(&in, &out, 0);
+			if (c == '&') in++;
+			*out++ = 0;
+		} else {
+			a->val[a->n] = out - 1;
+		}
+
+		a->n++;
+		if (c != '&') break;
+	}
+
+	return a->n;
+}
+
+/*
+ * @brief Value of key, NULL if it is not there.
+ */
+
+const char * ICACHE_FLASH_ATTR args_get(struct Args *a, const char *key) {
+	int i;
+
+	for (i = 0; i < a->n; i++) {
+		if (!os_strcmp(a->key[i], key)) return a->val[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Value of key as a number, def if it is not there.
+ */
+
+int ICACHE_FLASH_ATTR args_int(struct Args *a, const char *key, int def) {
+	const char *val = args_get(a, key);
+
+	return val != NULL ? atoi(val) : def;
+}
+
+/*
+ * @brief Value of key as a decimal number in value. Returns -1 if it is
+ * there but is not a number, value is left as it is if it is missing.
+ */
+
+int ICACHE_FLASH_ATTR args_num(struct Args *a, const char *key, int *value) {
+	const char *val = args_get(a, key);
+	const char *p;
+	int n = 0;
+
+	if (val == NULL) return 0;
+
+	p = val + (*val == '-');
+	if (*p == 0) return -1;
+
+	for (; *p; p++) {
+		if (*p < '0' || *p > '9' || n > 100000) return -1;
+		n = n * 10 + *p - '0';
+	}
+
+	*value = *val == '-' ? -n : n;
+	return 0;
+}
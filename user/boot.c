@@ -0,0 +1,122 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file boot.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing boot phase timestamps.
+ *
+ * Each phase of user_init() and the first sample and first HTTP response are
+ * stamped with system_get_time(), in microseconds since the CPU started.
+ */
+
+#include <esp8266.h>
+
+#include "boot.h"
+
+// How often the uptime is read, well under the 71 minutes it takes
+// system_get_time() to wrap
+#define BOOT_UPTIME_MS (10 * 60 * 1000)
+
+static uint32 bootTime[BOOT_PHASES];
+static uint8 bootDone[BOOT_PHASES];
+static uint32 upLast;
+static uint32 upHigh;
+static ETSTimer upTimer;
+
+static const char *bootNames[BOOT_PHASES] = {
+	"start",
+	"config",
+	"io",
+	"dht",
+	"httpd",
+	"ready",
+	"deferred",
+	"first_sample",
+	"first_response"
+};
+
+/**
+ * @brief Stamps a boot phase, only the first call for each phase counts.
+ */
+
+void ICACHE_FLASH_ATTR boot_mark(enum BootPhase phase) {
+	if (phase >= BOOT_PHASES || bootDone[phase]) return;
+
+	bootTime[phase] = system_get_time();
+	bootDone[phase] = 1;
+
+	if (phase >= BOOT_READY) {
+		os_printf("Boot phase %s reached at %d us\n", bootNames[phase], (int)bootTime[phase]);
+	}
+}
+
+/**
+ * @brief Microseconds since CPU start when phase was reached, 0 if not yet.
+ */
+
+uint32 ICACHE_FLASH_ATTR boot_time(enum BootPhase phase) {
+	if (phase >= BOOT_PHASES || !bootDone[phase]) return 0;
+
+	return bootTime[phase];
+}
+
+/**
+ * @brief Phase name used by the metrics page.
+ */
+
+const char * ICACHE_FLASH_ATTR boot_phase_name(enum BootPhase phase) {
+	if (phase >= BOOT_PHASES) return "unknown";
+
+	return bootNames[phase];
+}
+
+/**
+ * @brief Seconds since the CPU started.
+ *
+ * system_get_time() wraps every 71 minutes, so this must be called at least
+ * that often to see every wrap. The timer armed by boot_init() makes sure
+ * it is, even when there are no readings to stamp.
+ */
+
+uint32 ICACHE_FLASH_ATTR boot_uptime(void) {
+	uint32 now = system_get_time();
+
+	if (now < upLast) upHigh++;
+
+	upLast = now;
+	return (uint32)((((uint64)upHigh << 32) | now) / 1000000);
+}
+
+static void ICACHE_FLASH_ATTR _boot_uptime_cb(void *arg) {
+	boot_uptime();
+}
+
+/**
+ * @brief Stamps the start of the boot and starts following the uptime.
+ */
+
+void ICACHE_FLASH_ATTR boot_init(void) {
+	boot_mark(BOOT_START);
+	boot_uptime();
+
+	os_timer_disarm(&upTimer);
+	os_timer_setfn(&upTimer, _boot_uptime_cb, NULL);
+	os_timer_arm(&upTimer, BOOT_UPTIME_MS, 1);
+}
@@ -0,0 +1,245 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file chart.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the /chart.svg page.
+ *
+ * A sparkline of the recent readings in the history, temperature in red
+ * and humidity in blue, each scaled to its own range. The SVG is written a
+ * point at a time into a CHART_BUFF_SIZE buffer that is sent whenever it
+ * fills up, so a chart of any length needs no more RAM than that. At most
+ * CHART_WIDTH points are drawn per line, longer spans are thinned.
+ *
+ * The ETag is the history generation, a browser asking again before the
+ * next reading gets a 304 with no body.
+ */
+
+#include <esp8266.h>
+#include "chart.h"
+
+#include "args.h"
+#include "history.h"
+#include "itoa.h"
+#include "pool.h"
+
+#define CHART_WIDTH 300
+#define CHART_HEIGHT 100
+// Room above the lines for the ranges
+#define CHART_TOP 14
+#define CHART_BUFF_SIZE 256
+// Longest piece written at once, a point or a tag
+#define CHART_PIECE 160
+#define CHART_DEFAULT_N 120
+
+enum ChartPhase {
+	CHART_HEAD,
+	CHART_TEMP,
+	CHART_MIDDLE,
+	CHART_HUM,
+	CHART_TAIL,
+	CHART_DONE
+};
+
+// State of one /chart.svg response, between calls of the CGI
+struct ChartCursor {
+	enum ChartPhase phase;
+	int first;
+	int last;
+	int step;
+	int i;
+	uint32 up0;
+	uint32 span;
+	sint16 tmin, tmax;
+	sint16 hmin, hmax;
+};
+
+/*
+ * @brief Finds the samples to draw and the range of each line.
+ */
+
+static void ICACHE_FLASH_ATTR _chart_scan(struct ChartCursor *c, int n) {
+	struct HistorySample s;
+	int i;
+
+	c->last = history_count() - 1;
+	c->first = c->last - n + 1 > 0 ? c->last - n + 1 : 0;
+	c->step = (c->last - c->first) / CHART_WIDTH + 1;
+	c->tmin = c->hmin = 0x7fff;
+	c->tmax = c->hmax = -0x7fff;
+
+	for (i = c->first; !history_get(i, &s) && i <= c->last; i++) {
+		if (i == c->first) c->up0 = s.up;
+		c->span = s.up - c->up0;
+		if (s.temp < c->tmin) c->tmin = s.temp;
+		if (s.temp > c->tmax) c->tmax = s.temp;
+		if (s.hum < c->hmin) c->hmin = s.hum;
+		if (s.hum > c->hmax) c->hmax = s.hum;
+	}
+}
+
+static int ICACHE_FLASH_ATTR _chart_y(sint16 v, sint16 min, sint16 max) {
+	if (max == min) return (CHART_TOP + CHART_HEIGHT) / 2;
+
+	return CHART_HEIGHT - 1 - (int)(v - min) * (CHART_HEIGHT - 1 - CHART_TOP) / (max - min);
+}
+
+/*
+ * @brief Writes the next point of the current line, returns its length or 0
+ * at the end of the line.
+ */
+
+static int ICACHE_FLASH_ATTR _chart_point(struct ChartCursor *c, char *buff) {
+	struct HistorySample s;
+	int x, y;
+
+	if (c->i > c->last || history_get(c->i, &s)) return 0;
+
+	// Always end on the newest sample
+	c->i = c->i < c->last && c->i + c->step > c->last ? c->last : c->i + c->step;
+
+	x = c->span ? (int)((uint64)(s.up - c->up0) * (CHART_WIDTH - 1) / c->span) : 0;
+	if (c->phase == CHART_TEMP) {
+		y = _chart_y(s.temp, c->tmin, c->tmax);
+	} else {
+		y = _chart_y(s.hum, c->hmin, c->hmax);
+	}
+
+	return os_sprintf(buff, "%d,%d ", x, y);
+}
+
+/*
+ * @brief Writes the range of a line as a label.
+ */
+
+static int ICACHE_FLASH_ATTR _chart_label(char *buff, int x, const char *color, sint16 min, sint16 max, const char *unit) {
+	int len;
+
+	len = os_sprintf(buff, "<text x=\"%d\" y=\"11\" font-size=\"11\" fill=\"%s\">", x, color);
+	len += itoa_tenths(min, buff + len);
+	buff[len++] = '-';
+	len += itoa_tenths(max, buff + len);
+	len += os_sprintf(buff + len, "%s</text>", unit);
+	return len;
+}
+
+/*
+ * @brief Writes the next piece of the chart, returns its length.
+ */
+
+static int ICACHE_FLASH_ATTR _chart_piece(struct ChartCursor *c, char *buff) {
+	int len;
+
+	switch (c->phase) {
+		case CHART_HEAD:
+			len = os_sprintf(buff, "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"0 0 %d %d\" width=\"%d\" height=\"%d\">",
+					CHART_WIDTH, CHART_HEIGHT, CHART_WIDTH, CHART_HEIGHT);
+			if (c->last < 0) {
+				c->phase = CHART_TAIL;
+				return len;
+			}
+			len += os_sprintf(buff + len, "<polyline fill=\"none\" stroke=\"#c33\" points=\"");
+			c->phase = CHART_TEMP;
+			c->i = c->first;
+			return len;
+		case CHART_TEMP:
+			if ((len = _chart_point(c, buff)) > 0) return len;
+			c->phase = CHART_MIDDLE;
+			return os_sprintf(buff, "\"/>");
+		case CHART_MIDDLE:
+			c->phase = CHART_HUM;
+			c->i = c->first;
+			return os_sprintf(buff, "<polyline fill=\"none\" stroke=\"#36c\" points=\"");
+		case CHART_HUM:
+			if ((len = _chart_point(c, buff)) > 0) return len;
+			c->phase = CHART_TAIL;
+			len = os_sprintf(buff, "\"/>");
+			len += _chart_label(buff + len, 2, "#c33", c->tmin, c->tmax, "C");
+			len += _chart_label(buff + len, CHART_WIDTH / 2, "#36c", c->hmin, c->hmax, "%");
+			return len;
+		case CHART_TAIL:
+			c->phase = CHART_DONE;
+			return os_sprintf(buff, "</svg>\n");
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Streams /chart.svg.
+ *
+ * "n" is the number of newest samples to draw, CHART_DEFAULT_N by default.
+ */
+
+int ICACHE_FLASH_ATTR chart_cgi(HttpdConnData *connData) {
+	struct ChartCursor *c = connData->cgiData;
+	char buff[CHART_BUFF_SIZE];
+	int len = 0;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		if (c != NULL) pool_free(POOL_CURSOR, c);
+		return HTTPD_CGI_DONE;
+	}
+
+	if (c == NULL) {
+		struct Args args;
+		char etag[16], match[16];
+		int n;
+
+		os_sprintf(etag, "\"%x\"", (unsigned int)history_generation());
+
+		if (httpdGetHeader(connData, "If-None-Match", match, sizeof(match)) && !os_strcmp(match, etag)) {
+			httpdStartResponse(connData, 304);
+			httpdHeader(connData, "ETag", etag);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
+		c = pool_alloc(POOL_CURSOR, sizeof(struct ChartCursor));
+		if (c == NULL) {
+			httpdStartResponse(connData, 503);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		connData->cgiData = c;
+
+		args_parse(&args, connData->getArgs);
+		n = args_int(&args, "n", CHART_DEFAULT_N);
+		_chart_scan(c, n > 1 ? n : CHART_DEFAULT_N);
+
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "image/svg+xml");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdHeader(connData, "ETag", etag);
+		httpdEndHeaders(connData);
+	}
+
+	while (c->phase != CHART_DONE && len + CHART_PIECE <= CHART_BUFF_SIZE) {
+		len += _chart_piece(c, buff + len);
+	}
+
+	if (len > 0) httpdSend(connData, buff, len);
+	if (c->phase != CHART_DONE) return HTTPD_CGI_MORE;
+
+	pool_free(POOL_CURSOR, c);
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
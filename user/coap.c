@@ -0,0 +1,627 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file coap.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief CoAP server (RFC 7252) on UDP, next to the web server.
+ *
+ * Resources:
+ *
+ *   /.well-known/core  GET, link format
+ *   /reading           GET, observable, {"t":22.5,"h":55.0,"ok":1}
+ *   /relay             GET, observable, [1,0,...] one entry per channel
+ *   /relay/<n>         PUT or POST "on" or "off", like relay.cgi
+ *   /config            GET, rules of every channel
+ *   /history           GET, CSV of the samples in RAM, with an ETag
+ *
+ * Responses longer than one block, or requests with a Block2 option, are
+ * sent in blocks of up to COAP_BLOCK_SIZE bytes (RFC 7959). Every resource
+ * is rendered in small chunks, so a block never needs the whole
+ * representation in RAM.
+ *
+ * Observers (RFC 7641) get a notification with every new reading or relay
+ * change. Every COAP_CON_EVERY-th notification is confirmable, and an
+ * observer that did not acknowledge the last one, or that answers with a
+ * reset, is removed.
+ */
+
+#include <esp8266.h>
+#include "coap.h"
+
+#include "config.h"
+#include "dht.h"
+#include "io.h"
+#include "itoa.h"
+#include "history.h"
+#include "stack.h"
+
+#define COAP_BLOCK_SZX 3
+#define COAP_BLOCK_SIZE (1 << (COAP_BLOCK_SZX + 4))
+#define COAP_BUF_SIZE (COAP_BLOCK_SIZE + 64)
+#define COAP_CHUNK_SIZE 64
+#define COAP_PATH_SIZE 32
+#define COAP_OBSERVERS 4
+#define COAP_CON_EVERY 8
+
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+
+#define COAP_EMPTY 0x00
+#define COAP_GET 0x01
+#define COAP_POST 0x02
+#define COAP_PUT 0x03
+#define COAP_CHANGED 0x44
+#define COAP_CONTENT 0x45
+#define COAP_BAD_REQUEST 0x80
+#define COAP_BAD_OPTION 0x82
+#define COAP_NOT_FOUND 0x84
+#define COAP_NOT_ALLOWED 0x85
+
+#define COAP_OPT_ETAG 4
+#define COAP_OPT_OBSERVE 6
+#define COAP_OPT_URI_PATH 11
+#define COAP_OPT_FORMAT 12
+#define COAP_OPT_URI_QUERY 15
+#define COAP_OPT_ACCEPT 17
+#define COAP_OPT_BLOCK2 23
+
+#define COAP_FORMAT_TEXT 0
+#define COAP_FORMAT_LINK 40
+#define COAP_FORMAT_JSON 50
+
+// Writes chunk i of a representation, returns its length or 0 at the end
+typedef int (*CoapRender)(int i, char *chunk);
+
+struct coap_resource {
+	const char *path;
+	CoapRender render;
+	uint8 format;
+	uint8 observable;
+};
+
+struct coap_request {
+	uint8 type;
+	uint8 code;
+	uint16 mid;
+	uint8 tkl;
+	uint8 token[8];
+	char path[COAP_PATH_SIZE];
+	int observe;
+	int block2;
+	uint8 *payload;
+	int plen;
+};
+
+struct coap_observer {
+	uint8 used;
+	uint8 ip[4];
+	int port;
+	uint8 tkl;
+	uint8 token[8];
+	uint8 resource;
+	uint8 unacked;
+	uint16 lastMid;
+	uint32 seq;
+};
+
+static int _coap_core(int i, char *chunk);
+static int _coap_reading(int i, char *chunk);
+static int _coap_relay(int i, char *chunk);
+static int _coap_config(int i, char *chunk);
+static int _coap_history(int i, char *chunk);
+
+enum CoapResourceId {
+	COAP_RES_CORE,
+	COAP_RES_READING,
+	COAP_RES_RELAY,
+	COAP_RES_CONFIG,
+	COAP_RES_HISTORY,
+	COAP_RESOURCES
+};
+
+static const struct coap_resource resources[COAP_RESOURCES] = {
+	{".well-known/core", _coap_core, COAP_FORMAT_LINK, 0},
+	{"reading", _coap_reading, COAP_FORMAT_JSON, 1},
+	{"relay", _coap_relay, COAP_FORMAT_JSON, 1},
+	{"config", _coap_config, COAP_FORMAT_JSON, 0},
+	{"history", _coap_history, COAP_FORMAT_TEXT, 0},
+};
+
+static struct espconn conn;
+static esp_udp udp;
+static struct coap_observer observers[COAP_OBSERVERS];
+static struct CoapStats stats;
+static uint8 txBuf[COAP_BUF_SIZE];
+static uint16 nextMid;
+static uint32 notifyCount;
+
+/* Representations */
+
+static int ICACHE_FLASH_ATTR _coap_core(int i, char *chunk) {
+	if (i >= COAP_RESOURCES - 1) return 0;
+
+	return os_sprintf(chunk, "%s</%s>;ct=%d%s", i ? "," : "", resources[i + 1].path,
+			resources[i + 1].format, resources[i + 1].observable ? ";obs" : "");
+}
+
+static int ICACHE_FLASH_ATTR _coap_reading(int i, char *chunk) {
+	struct DhtReading *r = dht_read(0);
+	int len;
+
+	if (i > 0) return 0;
+
+	len = os_sprintf(chunk, "{\"t\":");
+	len += itoa_tenths(round_tenths(r->temperature), chunk + len);
+	len += os_sprintf(chunk + len, ",\"h\":");
+	len += itoa_tenths(round_tenths(r->humidity), chunk + len);
+	len += os_sprintf(chunk + len, ",\"ok\":%d}", r->success ? 1 : 0);
+	return len;
+}
+
+static int ICACHE_FLASH_ATTR _coap_relay(int i, char *chunk) {
+	if (i > IO_CHANNELS) return 0;
+	if (i == IO_CHANNELS) return os_sprintf(chunk, "]");
+
+	return os_sprintf(chunk, "%s%d", i ? "," : "[", io_get_status(i));
+}
+
+static int ICACHE_FLASH_ATTR _coap_config(int i, char *chunk) {
+	struct config conf;
+
+	if (i > IO_CHANNELS) return 0;
+	if (i == IO_CHANNELS) return os_sprintf(chunk, "]");
+
+	conf = config_read();
+	return os_sprintf(chunk, "%s{\"hum\":%d,\"temp\":%d,\"time\":%d,\"off\":%d}", i ? "," : "[",
+			conf.ch[i].hum, conf.ch[i].temp, conf.ch[i].time, conf.ch[i].off);
+}
+
+static int ICACHE_FLASH_ATTR _coap_history(int i, char *chunk) {
+	struct HistorySample s;
+	int len;
+
+	if (i == 0) return os_sprintf(chunk, "uptime_s,temperature,humidity\n");
+	if (history_get(i - 1, &s)) return 0;
+
+	len = os_sprintf(chunk, "%u,", (unsigned int)s.up);
+	len += itoa_tenths(s.temp, chunk + len);
+	chunk[len++] = ',';
+	len += itoa_tenths(s.hum, chunk + len);
+	chunk[len++] = '\n';
+	return len;
+}
+
+/*
+ * @brief Renders size bytes of a representation from offset. more is set if
+ * the representation goes on after them.
+ */
+
+static int ICACHE_FLASH_ATTR _coap_render(CoapRender render, int offset, char *out, int size, int *more) {
+	char chunk[COAP_CHUNK_SIZE];
+	int pos = 0, len = 0;
+	int i, n;
+
+	for (i = 0; pos <= offset + size && (n = render(i, chunk)) > 0; i++) {
+		int start = offset > pos ? offset - pos : 0;
+		int end = offset + size - pos < n ? offset + size - pos : n;
+
+		if (start < end) {
+			os_memcpy(out + len, chunk + start, end - start);
+			len += end - start;
+		}
+
+		pos += n;
+	}
+
+	*more = pos > offset + size;
+	return len;
+}
+
+/* Messages */
+
+static int ICACHE_FLASH_ATTR _coap_header(uint8 *p, uint8 type, uint8 code, uint16 mid, uint8 *token, uint8 tkl) {
+	p[0] = 0x40 | (type << 4) | tkl;
+	p[1] = code;
+	p[2] = mid >> 8;
+	p[3] = mid & 0xff;
+	os_memcpy(p + 4, token, tkl);
+	return 4 + tkl;
+}
+
+/*
+ * @brief Appends an option, options must be added in increasing order.
+ */
+
+static int ICACHE_FLASH_ATTR _coap_option(uint8 *p, int *last, int num, const uint8 *val, int len) {
+	int delta = num - *last;
+	int n = 1;
+
+	*last = num;
+
+	if (delta < 13) {
+		p[0] = delta << 4;
+	} else {
+		p[0] = 13 << 4;
+		p[n++] = delta - 13;
+	}
+
+	if (len < 13) {
+		p[0] |= len;
+	} else {
+		p[0] |= 13;
+		p[n++] = len - 13;
+	}
+
+	os_memcpy(p + n, val, len);
+	return n + len;
+}
+
+static int ICACHE_FLASH_ATTR _coap_uint_option(uint8 *p, int *last, int num, uint32 v) {
+	uint8 b[4];
+	int len = 0;
+
+	if (v > 0xffffff) b[len++] = v >> 24;
+	if (v > 0xffff) b[len++] = v >> 16;
+	if (v > 0xff) b[len++] = v >> 8;
+	if (v > 0) b[len++] = v;
+
+	return _coap_option(p, last, num, b, len);
+}
+
+static void ICACHE_FLASH_ATTR _coap_send(uint8 *ip, int port, int len) {
+	os_memcpy(udp.remote_ip, ip, 4);
+	udp.remote_port = port;
+	espconn_sendto(&conn, txBuf, len);
+}
+
+/*
+ * @brief Parses a request. Returns 0, or the error code to answer with.
+ */
+
+static int ICACHE_FLASH_ATTR _coap_parse(uint8 *data, int len, struct coap_request *req) {
+	int pos, num = 0, plen = 0;
+
+	os_memset(req, 0, sizeof(*req));
+	req->observe = -1;
+	req->block2 = -1;
+
+	if (len < 4 || (data[0] >> 6) != 1 || (data[0] & 0x0f) > 8) return COAP_BAD_REQUEST;
+
+	req->type = (data[0] >> 4) & 3;
+	req->tkl = data[0] & 0x0f;
+	req->code = data[1];
+	req->mid = (data[2] << 8) | data[3];
+	pos = 4 + req->tkl;
+
+	if (pos > len) return COAP_BAD_REQUEST;
+
+	os_memcpy(req->token, data + 4, req->tkl);
+
+	while (pos < len && data[pos] != 0xff) {
+		int delta = data[pos] >> 4;
+		int olen = data[pos] & 0x0f;
+		uint32 v = 0;
+		int i, ext;
+
+		pos++;
+
+		// Extended delta and length bytes must be in the datagram too
+		ext = (delta == 13 ? 1 : delta == 14 ? 2 : 0) + (olen == 13 ? 1 : olen == 14 ? 2 : 0);
+		if (pos + ext > len) return COAP_BAD_REQUEST;
+
+		if (delta == 13) delta = 13 + data[pos++];
+		else if (delta == 14) { delta = 269 + ((data[pos] << 8) | data[pos + 1]); pos += 2; }
+		else if (delta == 15) return COAP_BAD_REQUEST;
+
+		if (olen == 13) olen = 13 + data[pos++];
+		else if (olen == 14) { olen = 269 + ((data[pos] << 8) | data[pos + 1]); pos += 2; }
+		else if (olen == 15) return COAP_BAD_REQUEST;
+
+		if (pos + olen > len) return COAP_BAD_REQUEST;
+
+		num += delta;
+
+		for (i = 0; i < olen && i < 4; i++) v = (v << 8) | data[pos + i];
+
+		switch (num) {
+			case COAP_OPT_URI_PATH:
+				if (plen + olen + 2 > COAP_PATH_SIZE) return COAP_NOT_FOUND;
+				if (plen) req->path[plen++] = '/';
+				os_memcpy(req->path + plen, data + pos, olen);
+				plen += olen;
+				req->path[plen] = 0;
+				break;
+			case COAP_OPT_OBSERVE: req->observe = v; break;
+			case COAP_OPT_BLOCK2: req->block2 = v; break;
+			case COAP_OPT_URI_QUERY:
+			case COAP_OPT_ACCEPT:
+				break;
+			default:
+				// Unknown critical options must be rejected
+				if (num & 1) return COAP_BAD_OPTION;
+		}
+
+		pos += olen;
+	}
+
+	if (pos < len) {
+		req->payload = data + pos + 1;
+		req->plen = len - pos - 1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Adds, updates or removes the observer of a resource.
+ */
+
+static struct coap_observer *ICACHE_FLASH_ATTR _coap_observe(struct coap_request *req, int res, uint8 *ip, int port) {
+	struct coap_observer *o, *found = NULL, *empty = NULL;
+	int i;
+
+	for (i = 0; i < COAP_OBSERVERS; i++) {
+		o = &observers[i];
+
+		if (!o->used) {
+			if (empty == NULL) empty = o;
+		} else if (o->resource == res && o->port == port && !os_memcmp(o->ip, ip, 4)) {
+			found = o;
+		}
+	}
+
+	if (req->observe != 0) {
+		if (found != NULL) {
+			found->used = 0;
+			stats.observers--;
+		}
+
+		return NULL;
+	}
+
+	if (found == NULL) {
+		if (empty == NULL) return NULL;
+
+		found = empty;
+		found->used = 1;
+		stats.observers++;
+	}
+
+	os_memcpy(found->ip, ip, 4);
+	found->port = port;
+	found->tkl = req->tkl;
+	os_memcpy(found->token, req->token, req->tkl);
+	found->resource = res;
+	found->unacked = 0;
+	return found;
+}
+
+/*
+ * @brief Appends options and payload of a GET response.
+ */
+
+static int ICACHE_FLASH_ATTR _coap_content(int len, int res, int observe, uint32 seq, int block2) {
+	char payload[COAP_BLOCK_SIZE];
+	int last = 0, more, plen, szx, num;
+
+	szx = block2 >= 0 && (block2 & 7) < COAP_BLOCK_SZX ? block2 & 7 : COAP_BLOCK_SZX;
+	num = block2 >= 0 ? block2 >> 4 : 0;
+	// Blocks larger than ours are split, at the same offset (RFC 7959 2.3)
+	if (block2 >= 0) num <<= (block2 & 7) - szx;
+	plen = _coap_render(resources[res].render, num << (szx + 4), payload, 1 << (szx + 4), &more);
+
+	if (res == COAP_RES_HISTORY) {
+		uint32 gen = history_generation();
+		uint8 etag[4] = {gen >> 24, gen >> 16, gen >> 8, gen};
+
+		len += _coap_option(txBuf + len, &last, COAP_OPT_ETAG, etag, 4);
+	}
+
+	if (observe) len += _coap_uint_option(txBuf + len, &last, COAP_OPT_OBSERVE, seq & 0xffffff);
+
+	len += _coap_uint_option(txBuf + len, &last, COAP_OPT_FORMAT, resources[res].format);
+
+	if (block2 >= 0 || more) {
+		len += _coap_uint_option(txBuf + len, &last, COAP_OPT_BLOCK2, (num << 4) | (more << 3) | szx);
+	}
+
+	if (plen > 0) {
+		txBuf[len++] = 0xff;
+		os_memcpy(txBuf + len, payload, plen);
+		len += plen;
+	}
+
+	return len;
+}
+
+/*
+ * @brief Relay command, same semantics as relay.cgi.
+ */
+
+static int ICACHE_FLASH_ATTR _coap_relay_set(struct coap_request *req) {
+	char v[8];
+	int ch;
+
+	if (req->code != COAP_PUT && req->code != COAP_POST) return COAP_NOT_ALLOWED;
+
+	ch = atoi(req->path + 6);
+
+	if (ch < 0 || ch >= IO_CHANNELS || req->path[6] < '0' || req->path[6] > '9') return COAP_NOT_FOUND;
+
+	if (req->plen <= 0 || req->plen >= (int)sizeof(v)) return COAP_BAD_REQUEST;
+
+	os_memcpy(v, req->payload, req->plen);
+	v[req->plen] = 0;
+
+	if (os_strcmp(v, "on") && os_strcmp(v, "off")) return COAP_BAD_REQUEST;
+
+	io_manual(ch, !os_strcmp(v, "on"));
+	return COAP_CHANGED;
+}
+
+static void ICACHE_FLASH_ATTR _coap_recv(char *data, unsigned short length) {
+	struct coap_request req;
+	struct coap_observer *o = NULL;
+	remot_info *remote = NULL;
+	uint8 ip[4];
+	int port, code, res, len, i;
+
+	if (espconn_get_connection_info(&conn, &remote, 0) != ESPCONN_OK) return;
+
+	os_memcpy(ip, remote->remote_ip, 4);
+	port = remote->remote_port;
+	code = _coap_parse((uint8 *)data, length, &req);
+
+	// Answers to notifications
+	if (!code && (req.type == COAP_ACK || req.type == COAP_RST)) {
+		for (i = 0; i < COAP_OBSERVERS; i++) {
+			if (!observers[i].used || observers[i].lastMid != req.mid) continue;
+
+			if (req.type == COAP_RST) {
+				observers[i].used = 0;
+				stats.observers--;
+			} else {
+				observers[i].unacked = 0;
+			}
+		}
+
+		return;
+	}
+
+	if (!code && req.code == COAP_EMPTY) {
+		// CoAP ping
+		if (req.type == COAP_CON) _coap_send(ip, port, _coap_header(txBuf, COAP_RST, 0, req.mid, NULL, 0));
+		return;
+	}
+
+	stats.requests++;
+
+	len = _coap_header(txBuf, req.type == COAP_CON ? COAP_ACK : COAP_NON, 0,
+			req.type == COAP_CON ? req.mid : nextMid++, req.token, req.tkl);
+
+	if (code) {
+		txBuf[1] = code;
+		_coap_send(ip, port, len);
+		return;
+	}
+
+	if (!os_strncmp(req.path, "relay/", 6)) {
+		txBuf[1] = _coap_relay_set(&req);
+		_coap_send(ip, port, len);
+		return;
+	}
+
+	for (res = 0; res < COAP_RESOURCES; res++) {
+		if (!os_strcmp(req.path, resources[res].path)) break;
+	}
+
+	if (res == COAP_RESOURCES) {
+		txBuf[1] = COAP_NOT_FOUND;
+		_coap_send(ip, port, len);
+		return;
+	}
+
+	if (req.code != COAP_GET) {
+		txBuf[1] = COAP_NOT_ALLOWED;
+		_coap_send(ip, port, len);
+		return;
+	}
+
+	if (resources[res].observable && req.observe >= 0) o = _coap_observe(&req, res, ip, port);
+
+	txBuf[1] = COAP_CONTENT;
+	len = _coap_content(len, res, o != NULL, o != NULL ? o->seq : 0, req.block2);
+	_coap_send(ip, port, len);
+}
+
+static void ICACHE_FLASH_ATTR _coap_recv_cb(void *arg, char *data, unsigned short length) {
+	STACK_CALL("coap_recv", _coap_recv(data, length));
+}
+
+/*
+ * @brief Sends the new representation of res to its observers.
+ */
+
+static void ICACHE_FLASH_ATTR _coap_notify(int res) {
+	struct coap_observer *o;
+	int i, len, type;
+
+	for (i = 0; i < COAP_OBSERVERS; i++) {
+		o = &observers[i];
+
+		if (!o->used || o->resource != res) continue;
+
+		type = ++notifyCount % COAP_CON_EVERY ? COAP_NON : COAP_CON;
+
+		if (type == COAP_CON && o->unacked) {
+			// The last confirmable notification was never acknowledged
+			o->used = 0;
+			stats.observers--;
+			continue;
+		}
+
+		o->seq++;
+		o->lastMid = nextMid++;
+		o->unacked = type == COAP_CON;
+
+		len = _coap_header(txBuf, type, COAP_CONTENT, o->lastMid, o->token, o->tkl);
+		len = _coap_content(len, res, 1, o->seq, -1);
+		_coap_send(o->ip, o->port, len);
+		stats.notifications++;
+	}
+}
+
+static void ICACHE_FLASH_ATTR _coap_reading_changed(struct DhtReading *r) {
+	_coap_notify(COAP_RES_READING);
+}
+
+static void ICACHE_FLASH_ATTR _coap_relay_changed(short int ch, int status) {
+	_coap_notify(COAP_RES_RELAY);
+}
+
+/*
+ * @brief Starts the CoAP server on the given UDP port, 0 disables it.
+ */
+
+void ICACHE_FLASH_ATTR coap_init(int port) {
+	if (port == 0) return;
+
+	os_memset(&conn, 0, sizeof(conn));
+	conn.type = ESPCONN_UDP;
+	conn.state = ESPCONN_NONE;
+	conn.proto.udp = &udp;
+	udp.local_port = port;
+	espconn_regist_recvcb(&conn, _coap_recv_cb);
+
+	if (espconn_create(&conn) != ESPCONN_OK) {
+		os_printf("CoAP: cannot listen on port %d\n", port);
+		return;
+	}
+
+	nextMid = system_get_time();
+	dht_subscribe(_coap_reading_changed);
+	io_subscribe(_coap_relay_changed);
+}
+
+struct CoapStats *ICACHE_FLASH_ATTR coap_stats(void) {
+	return &stats;
+}
@@ -24,28 +24,78 @@
  * @brief File containing configuration save/recover functions.
  *
  * Ralay is turned on and off depending on DHT readins and the parameters set 
+ *
+ * Every save appends a record with a sequence number and a checksum to the
+ * current config sector, and the newest valid record is the config. A save
+ * is a single flash write: if it is cut short the record fails its checksum
+ * and the previous one is still there. When a sector is full the other one
+ * is erased and written, so a good record is always left in flash. Boards
+ * under 1 MB have a single sector, which is erased when full.
  */
 
 #include <esp8266.h> 
 #include <config.h> 
+#include <crit.h> 
+#include <pagecache.h>
 
 // https://github.com/esp8266/esp8266-wiki/wiki/Memory-Map
-// Acording to this map we wave 4k free starting on 0x7B00
+// Acording to this map we wave 4k free starting on 0x7B00, and the next
+// sector is free on 1 MB boards and up, see flashlog.c. The SDK keeps its
+// init data and parameters in the last 4 sectors of the flash, where
+// Makefile.ota writes them, so on 512 KB boards 0x7C is its own.
 #define CONFIG_SECTOR 0x7B
+#if ESP_SPI_FLASH_SIZE_K >= 1024
+#define CONFIG_SECTOR2 0x7C
+#else
+#define CONFIG_SECTOR2 CONFIG_SECTOR
+#endif
+
+#if defined(ESP_SPI_FLASH_SIZE_K) && CONFIG_SECTOR2 >= ESP_SPI_FLASH_SIZE_K / 4 - 4
+#error "The config sectors overlap the SDK data at the end of the flash"
+#endif
+
+struct ConfigRecord {
+	uint32 seq;
+	struct config conf;
+};
+
+#define CONFIG_SLOTS (SPI_FLASH_SEC_SIZE / sizeof(struct ConfigRecord))
 
 // To write , you need the sector address. 
-#define CONFIG_ADDRESS (SPI_FLASH_SEC_SIZE * CONFIG_SECTOR)
+#define CONFIG_ADDRESS(sector, slot) (SPI_FLASH_SEC_SIZE * (sector) + (slot) * sizeof(struct ConfigRecord))
+
+#define FIELD(name) __builtin_offsetof(struct config_channel, name)
+
+// Limits of the rule fields, the same the relay config form advertises
+const struct ConfigField configFields[CONFIG_FIELDS] = {
+	{"hum", "humidity", 0, 99, FIELD(hum)},
+	{"temp", "temperature", -40, 80, FIELD(temp)},
+	{"time", "time", 1, 120, FIELD(time)},
+	{"off", NULL, 0, 1, FIELD(off)}
+};
+
+static const uint8 sectors[2] = {CONFIG_SECTOR, CONFIG_SECTOR2};
 
 void _read(void);
 int _write(struct config conf);
 void _default_data(void); 
 
 struct config confRead;
+// Sequence number of the newest record, where the next one goes
+static uint32 seq;
+static int sector;
+static int slot;
 
 // Get saved config on startup
 void config_init() {
+	short int ch;
+
 	_read();
-	os_printf("Initial config; Humidity %d, Temperature: %d, Off: %d\n", confRead.hum, confRead.temp, confRead.off);
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		os_printf("Initial config channel %d; Humidity %d, Temperature: %d, Off: %d\n", ch,
+				confRead.ch[ch].hum, confRead.ch[ch].temp, confRead.ch[ch].off);
+	}
 }
 
 // Save config and check if it is correctly stored.
@@ -55,10 +105,7 @@ int config_save(struct config save) {
 	}
 
 	confRead = save;
-
-	if (memcmp(&confRead, &save, sizeof(struct config)) != 0) {
-		return 1;
-	}
+	pagecache_bump();
 
 	return 0;
 }
@@ -68,67 +115,176 @@ struct config config_read() {
 	return confRead;
 }
 
-// Read stored config
-void _read() {
-	
-	int sum1 = 0; 
+// Field i of a rule
+short int *config_field(struct config_channel *rule, int i) {
+	return (short int *)((uint8 *)rule + configFields[i].offset);
+}
+
+// Sets field i of a rule, returns 1 if value is out of its range
+int config_set(struct config_channel *rule, int i, int value) {
+	if (value < configFields[i].min || value > configFields[i].max) return 1;
+
+	*config_field(rule, i) = value;
+	return 0;
+}
+
+// Returns 0 if every field of every rule is in range
+int config_check(struct config *conf) {
+	short int ch;
+	int i, value;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		for (i = 0; i < CONFIG_FIELDS; i++) {
+			value = *config_field(&conf->ch[ch], i);
+			if (value < configFields[i].min || value > configFields[i].max) return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Fletcher-16 of a record but its checksum, never 0xffff so erased flash
+// does not pass
+short int _checksum(struct ConfigRecord *r) {
+	unsigned char *vector = (unsigned char *)r;
+	int sum1 = 0;
 	int sum2 = 0;
 	short int i;
-	unsigned char *vector;
+
+	for (i = 0; i < sizeof(*r); i++) {
+		if (i == __builtin_offsetof(struct ConfigRecord, conf.checksum)) {
+			i += sizeof(r->conf.checksum) - 1;
+			continue;
+		}
+		sum1 = (sum1 + vector[i])%255;
+		sum2 = (sum2 + sum1)%255;
+	}
+
+	return (sum2<<8)|sum1;
+}
+
+// Returns 1 if the slot has never been written
+int _empty(struct ConfigRecord *r) {
+	uint32 *words = (uint32 *)r;
+	short int i;
+
+	for (i = 0; i < sizeof(*r) / 4; i++) {
+		if (words[i] != 0xffffffff) return 0;
+	}
+
+	return 1;
+}
+
+// Read stored config, the valid record with the highest sequence number
+void _read() {
+	struct ConfigRecord r;
+	int found = 0;
+	int s, i;
 	
 	os_printf("Reading initial config\n");
 
-	if (spi_flash_read(CONFIG_ADDRESS, (uint32*) &confRead, sizeof(struct config)) != SPI_FLASH_RESULT_OK) {
-		os_printf("Error reading stored data from address: %x.\n", CONFIG_ADDRESS);
-		_default_data();
-	}
+	for (s = 0; s < 2; s++) {
+		for (i = 0; i < CONFIG_SLOTS; i++) {
+			if (spi_flash_read(CONFIG_ADDRESS(sectors[s], i), (uint32*) &r, sizeof(r)) != SPI_FLASH_RESULT_OK) {
+				os_printf("Error reading stored data from address: %x.\n", (unsigned int)CONFIG_ADDRESS(sectors[s], i));
+				break;
+			}
 
-	vector = (unsigned char *) os_malloc(sizeof(confRead));
-	os_memcpy(vector, &confRead, sizeof(confRead));
+			// Records are appended, the rest of the sector is empty
+			if (_empty(&r)) break;
 
-	for (i = 2; i < sizeof(confRead); i++) {
-		sum1 = (sum1 + vector[i])%255;
-		sum2 = (sum2 + sum1)%255;
+			if (r.conf.checksum != _checksum(&r) || config_check(&r.conf)) continue;
+
+			if (!found || r.seq > seq) {
+				found = 1;
+				seq = r.seq;
+				sector = s;
+				confRead = r.conf;
+			}
+		}
+
+		if (found && sector == s) slot = i;
 	}
 
-	os_free(vector);	
+	if (found) {
+		os_printf("Config record %u\n", (unsigned int)seq);
+		return;
+	}
 
-	os_printf("Checksum: %d\n",((sum2<<8)|sum1));
-/*	
-	if (((sum2<<8)|sum1) != confRead.checksum) {
-		os_printf("Checksum error.\n");
-		_default_data();
+	// Written whole at the start of the sector by older firmware, unchecked
+	sector = 0;
+	slot = CONFIG_SLOTS;
+	if (spi_flash_read(CONFIG_ADDRESS(CONFIG_SECTOR, 0), (uint32*) &r, sizeof(r)) == SPI_FLASH_RESULT_OK) {
+		os_memcpy(&confRead, &r, sizeof(confRead));
+		if (config_check(&confRead) == 0) {
+			os_printf("Config of older firmware kept\n");
+			if (config_save(confRead)) os_printf ("Error saving config\n");
+			return;
+		}
 	}
-*/
+
+	os_printf("No valid config.\n");
+	_default_data();
 }
 
-// Write config
+// Write config, as the next record
 int _write(struct config conf) {
-	ETS_UART_INTR_DISABLE();
+	struct ConfigRecord r, check;
+	uint32 addr;
+
+	// Sector full, start over in the other one
+	if (slot >= CONFIG_SLOTS) {
+		sector ^= 1;
+		slot = 0;
 
-	if (spi_flash_erase_sector(CONFIG_SECTOR) != SPI_FLASH_RESULT_OK) {
-		os_printf("Error erasing sector CONFIG_SECTOR.\n");
-		ETS_UART_INTR_ENABLE();
+		CRIT_UART_DISABLE();
+		if (spi_flash_erase_sector(sectors[sector]) != SPI_FLASH_RESULT_OK) {
+			os_printf("Error erasing sector %x.\n", sectors[sector]);
+			CRIT_UART_ENABLE();
+			return 1;
+		}
+		CRIT_UART_ENABLE();
+	}
+
+	os_memset(&r, 0, sizeof(r));
+	r.seq = seq + 1;
+	r.conf = conf;
+	r.conf.checksum = _checksum(&r);
+	addr = CONFIG_ADDRESS(sectors[sector], slot);
+	// Used even if the write fails, it may have cleared bits
+	slot++;
+
+	CRIT_UART_DISABLE();
+
+	if (spi_flash_write(addr, (uint32*) &r, sizeof(r)) != SPI_FLASH_RESULT_OK) {
+		os_printf("Error writing data to sector: %d\n", sectors[sector]);
+		CRIT_UART_ENABLE();
 		return 1;
 	}
 
-	if (spi_flash_write(CONFIG_ADDRESS, (uint32*) &conf, sizeof(struct config)) != SPI_FLASH_RESULT_OK) {
-		os_printf("Error writing data to sector: %d\n", CONFIG_SECTOR);
-		ETS_UART_INTR_ENABLE();
+	CRIT_UART_ENABLE();
+
+	if (spi_flash_read(addr, (uint32*) &check, sizeof(check)) != SPI_FLASH_RESULT_OK ||
+			os_memcmp(&check, &r, sizeof(r)) != 0) {
+		os_printf("Error verifying data at: %x\n", (unsigned int)addr);
 		return 1;
 	}
 
+	seq = r.seq;
 	os_printf("Data saved correctly.\n");
-	ETS_UART_INTR_ENABLE();
 	return 0;
 }
 
 // Set default data 
 void _default_data() {
-	confRead.hum = DEFAULT_HUM;
-	confRead.temp = DEFAULT_TEMP;
-	confRead.time = DEFAULT_TIME;
-	confRead.off = DEFAULT_OFF;
+	short int ch;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		confRead.ch[ch].hum = DEFAULT_HUM;
+		confRead.ch[ch].temp = DEFAULT_TEMP;
+		confRead.ch[ch].time = DEFAULT_TIME;
+		confRead.ch[ch].off = DEFAULT_OFF;
+	}
 
 	if (config_save(confRead)) os_printf ("Error saving default data\n");
 }
@@ -0,0 +1,138 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file crit.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the critical section monitor.
+ *
+ * While interrupts are disabled the WiFi stack cannot run, long critical
+ * sections make the ESP drop its connection. Every section opened with the
+ * CRIT_* macros is timed, its duration goes to a histogram and the longest
+ * one is kept with the file and line that opened it. Sections longer than
+ * the alarm threshold are logged once interrupts are back on.
+ */
+
+#include <esp8266.h>
+
+#include "crit.h"
+#include "config.h"
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+
+static struct CritStats stats[CRIT_KINDS];
+static const uint32 bucketLimits[CRIT_BUCKETS] = CRIT_BUCKET_LIMITS;
+static const char *kindNames[CRIT_KINDS] = {"intr", "uart"};
+
+static uint32 startTime[CRIT_KINDS];
+static const char *startSite[CRIT_KINDS];
+static uint8 depth[CRIT_KINDS];
+static uint32 alarmUs = CRIT_ALARM_US;
+
+/**
+ * @brief Opens a critical section.
+ *
+ * Nested sections of the same kind are timed as one.
+ */
+
+void ICACHE_FLASH_ATTR crit_enter(enum CritKind kind, const char *site) {
+	if (kind == CRIT_INTR) {
+		ets_intr_lock();
+	} else {
+		ETS_UART_INTR_DISABLE();
+	}
+
+	if (depth[kind]++ == 0) {
+		startSite[kind] = site;
+		startTime[kind] = system_get_time();
+	}
+}
+
+/**
+ * @brief Closes a critical section and records how long it lasted.
+ */
+
+void ICACHE_FLASH_ATTR crit_exit(enum CritKind kind) {
+	struct CritStats *s = &stats[kind];
+	uint32 elapsed;
+	int i;
+
+	if (depth[kind] == 0 || --depth[kind] > 0) {
+		if (kind == CRIT_INTR) {
+			ets_intr_unlock();
+		} else {
+			ETS_UART_INTR_ENABLE();
+		}
+
+		return;
+	}
+
+	elapsed = system_get_time() - startTime[kind];
+
+	if (kind == CRIT_INTR) {
+		ets_intr_unlock();
+	} else {
+		ETS_UART_INTR_ENABLE();
+	}
+
+	for (i = 0; i < CRIT_BUCKETS - 1 && elapsed > bucketLimits[i]; i++);
+
+	s->buckets[i]++;
+	s->count++;
+	s->total += elapsed;
+
+	if (elapsed > s->max) {
+		s->max = elapsed;
+		s->maxSite = startSite[kind];
+	}
+
+	if (alarmUs && elapsed >= alarmUs) {
+		s->alarms++;
+		os_printf("Critical section (%s) at %s took %d us\n", kindNames[kind], startSite[kind], (int)elapsed);
+	}
+}
+
+/**
+ * @brief Returns the statistics of one kind of critical section.
+ */
+
+struct CritStats * ICACHE_FLASH_ATTR crit_stats(enum CritKind kind) {
+	return &stats[kind];
+}
+
+/**
+ * @brief Name used by the metrics page.
+ */
+
+const char * ICACHE_FLASH_ATTR crit_kind_name(enum CritKind kind) {
+	return kindNames[kind];
+}
+
+/**
+ * @brief Changes the alarm threshold, 0 disables the alarm.
+ */
+
+void ICACHE_FLASH_ATTR crit_set_alarm(uint32 us) {
+	alarmUs = us;
+}
+
+uint32 ICACHE_FLASH_ATTR crit_get_alarm() {
+	return alarmUs;
+}
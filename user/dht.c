@@ -47,10 +47,27 @@
 #include <esp8266.h>
 
 #include <dht.h>
+#include <config.h>
+#include <rtcstate.h>
+#include <boot.h>
+#include <crit.h>
+#include <stack.h>
 
 #define MAXTIMINGS 10000
 #define DHT_MAXCOUNT 32000
 #define BREAKTIME 32
+#define DHT_LISTENERS 8
+// Frames in the median filter
+#define DHT_MEDIAN 3
+// A frame further from the last reading than this, plus the slew rate for
+// every second since then, is an outlier
+#define DHT_SLEW_HUM_MIN  5.0f
+#define DHT_SLEW_TEMP_MIN 2.0f
+#define DHT_SLEW_HUM      0.5f
+#define DHT_SLEW_TEMP     0.1f
+// A frame this far from the median is read again before it counts
+#define DHT_CONFIRM_HUM   1.0f
+#define DHT_CONFIRM_TEMP  0.5f
 
 //Debug 1 = on
 #define DEBUG 0
@@ -58,18 +75,45 @@
 
 enum EDhtType SENSOR;
 
-void ets_intr_lock(void);
-void ets_intr_unlock(void);
-
 static struct DhtReading reading = {
 	.success = 0
 };
 
+static struct DhtStats stats;
+static ETSTimer dhtTimer;
+static uint32 pollTime;
+// Set once the periodic poll has started
+static int polling;
+static DhtListener listeners[DHT_LISTENERS];
+
+enum DhtResult {
+	DHT_OK,
+	DHT_TIMEOUT,
+	DHT_SHORT_FRAME,
+	DHT_BAD_CHECKSUM
+};
+
+// Extra frames taken in the current poll
+static ETSTimer retryTimer;
+static int attempts;
+
+// Last good frames, the last reading and the last frame dropped as an
+// outlier
+static float windowT[DHT_MEDIAN];
+static float windowH[DHT_MEDIAN];
+static int windowLen;
+static int windowNext;
+static float lastT, lastH;
+static uint32 lastTime;
+static int dropped;
+static float droppedT, droppedH;
+static uint32 droppedTime;
+
 /*
  * @brief Convert DHT humidity outpunt into % units
  */
 
-static inline float _scale_humidity(int *data) {
+static inline float _scale_humidity(uint8 *data) {
 	if (SENSOR == SENSOR_DHT11) {
 		return data[0];
 	} else {
@@ -82,7 +126,7 @@ static inline float _scale_humidity(int *data) {
  * @brief Convert DHT temterature outpunt into celsious degrees 
  */
 
-static inline float _scale_temperature(int *data) {
+static inline float _scale_temperature(uint8 *data) {
 	if (SENSOR == SENSOR_DHT11) {
 		return data[2];
 	} else {
@@ -96,6 +140,10 @@ static inline float _scale_temperature(int *data) {
 	}
 }
 
+static inline float _dht_abs(float x) {
+	return x < 0 ? -x : x;
+}
+
 /*
  * @brief Wait sleep milliseconds
  *
@@ -113,38 +161,38 @@ static inline void _delay_ms(int sleep) {
  * See http://www.electrodragon.com/w/DHT22_Digital_Humidity_and_Temperature_Sensor_%28AM2302%29 
  */
 
-static	void ICACHE_FLASH_ATTR _poll_dht_cb(void *arg){
+static enum DhtResult ICACHE_FLASH_ATTR _dht_decode(float *temperature, float *humidity) {
 	int counter = 0;
 	int laststate = 1;
 	int i = 0;
 	int bits_in = 0;
-	int data[100];
+	// 40 bits: humidity, temperature and checksum
+	uint8 data[5];
 
 	data[0] = data[1] = data[2] = data[3] = data[4] = 0;
 
-	//disable interrupts, start of critical section
-	ets_intr_lock();
-
-	// Wake up device, 250ms of high
+	// Wake up device, 20ms of high
 	GPIO_OUTPUT_SET(DHT_PIN, 1);
 	_delay_ms(20);
 
-	// Hold low for 20ms
+	// Hold low for 20ms, an interrupt can only make the pulse longer
 	GPIO_OUTPUT_SET(DHT_PIN, 0);
 	_delay_ms(20);
 
-	// High for 40ms
+	//disable interrupts, start of critical section, only the answer is timed
+	CRIT_LOCK();
+
+	// High for 40us
 	GPIO_DIS_OUTPUT(DHT_PIN);
 	os_delay_us(40);
 
 	// wait for pin to drop?
-	while (GPIO_INPUT_GET(DHT_PIN) == 1 && i < DHT_MAXCOUNT) {
-		if (i >= DHT_MAXCOUNT) {
+	while (GPIO_INPUT_GET(DHT_PIN) == 1) {
+		if (++i >= DHT_MAXCOUNT) {
+			CRIT_UNLOCK();
 			os_printf("ERROR: Timeout reading DHT\n");
-			reading.success = 0;
-			return;
+			return DHT_TIMEOUT;
 		}
-		i++;
 	}
 
 #if DEBUG
@@ -167,13 +215,15 @@ static	void ICACHE_FLASH_ATTR _poll_dht_cb(void *arg){
 		if (counter == 1000)
 			break;
 
-		// store data after 3 reads
+		// store data after 3 reads, bits past the 40th are only counted
 		if ((i > 3) && (i % 2 == 0)) {
 			// shove each bit into the storage bytes
-			data[bits_in / 8] <<= 1;
+			if (bits_in < 40) {
+				data[bits_in / 8] <<= 1;
 
-			if (counter > BREAKTIME) {
-				data[bits_in / 8] |= 1;
+				if (counter > BREAKTIME) {
+					data[bits_in / 8] |= 1;
+				}
 			}
 
 			bits_in++;
@@ -181,12 +231,11 @@ static	void ICACHE_FLASH_ATTR _poll_dht_cb(void *arg){
 	}
 
 	//Re-enable interrupts, end of critical section
-	ets_intr_unlock();
+	CRIT_UNLOCK();
 
 	if (bits_in < 40) {
 		os_printf("ERROR: Reading DHT, got too few bits: %d should be at least 40\n", bits_in);
-		reading.success = 0;
-		return;
+		return DHT_SHORT_FRAME;
 	}
 	
 	int checksum = (data[0] + data[1] + data[2] + data[3]) & 0xFF;
@@ -198,15 +247,165 @@ static	void ICACHE_FLASH_ATTR _poll_dht_cb(void *arg){
 	if (data[4] != checksum) {
 		os_printf("ERROR: Reading DHT, Checksum was incorrect after %d bits. Expected %d but got %d\n",
 							bits_in, data[4], checksum);
-		reading.success = 0;
-	} else {
-		reading.temperature = _scale_temperature(data);
-		reading.humidity = _scale_humidity(data);
-		os_printf("Temp = %d *C, Hum = %d %%\n", (int)(reading.temperature * 100),
-						 (int)(reading.humidity * 100));
+		return DHT_BAD_CHECKSUM;
+	}
+
+	*temperature = _scale_temperature(data);
+	*humidity = _scale_humidity(data);
+	os_printf("Temp = %d *C, Hum = %d %%\n", (int)(*temperature * 100), (int)(*humidity * 100));
+	return DHT_OK;
+}
+
+/*
+ * @brief Returns 1 if a frame is close enough to a value seconds older to
+ * be real.
+ */
+
+static int ICACHE_FLASH_ATTR _dht_plausible(float t, float h, float baseT, float baseH, float seconds) {
+	return _dht_abs(h - baseH) <= DHT_SLEW_HUM_MIN + DHT_SLEW_HUM * seconds &&
+			_dht_abs(t - baseT) <= DHT_SLEW_TEMP_MIN + DHT_SLEW_TEMP * seconds;
+}
+
+/*
+ * @brief Adds a decoded frame to the median window, returns 0 if it was
+ * dropped as an outlier.
+ *
+ * A frame out of the range of the sensor, or further from the last reading
+ * than the signal can move since then, is dropped. If the next frame agrees
+ * with the dropped one the signal did move, the window starts again from it.
+ */
+
+static int ICACHE_FLASH_ATTR _dht_accept(float t, float h) {
+	uint32 now = system_get_time();
+
+	if (h < 0 || h > 100 || t < -40 || t > 80) {
+		stats.outliers++;
+		return 0;
+	}
+
+	if (windowLen > 0 && !_dht_plausible(t, h, lastT, lastH, (now - lastTime) / 1e6f)) {
+		if (!dropped || !_dht_plausible(t, h, droppedT, droppedH, (now - droppedTime) / 1e6f)) {
+			stats.outliers++;
+			dropped = 1;
+			droppedT = t;
+			droppedH = h;
+			droppedTime = now;
+			return 0;
+		}
+
+		windowLen = 0;
+	}
+
+	windowT[windowNext] = t;
+	windowH[windowNext] = h;
+	windowNext = (windowNext + 1) % DHT_MEDIAN;
+	if (windowLen < DHT_MEDIAN) windowLen++;
+	dropped = 0;
+	return 1;
+}
+
+/*
+ * @brief Median of the window, the newest frame until it is full.
+ */
+
+static float ICACHE_FLASH_ATTR _dht_median(float *window, float newest) {
+	float v[DHT_MEDIAN], x;
+	int i, j;
+
+	if (windowLen < DHT_MEDIAN) return newest;
+
+	for (i = 0; i < DHT_MEDIAN; i++) {
+		x = window[i];
+		for (j = i; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+		v[j] = x;
+	}
+
+	return v[DHT_MEDIAN / 2];
+}
+
+/*
+ * @brief Reads a frame, filters it and hands the reading to the listeners.
+ *
+ * A frame that fails to decode, is dropped as an outlier or is a step away
+ * from the median of the last frames is read again DHT_RETRY_MS later, up
+ * to DHT_RETRIES times, and the periodic poll waits for it. A step that is
+ * still there is then the median, a single bad frame is outvoted. The
+ * reading is only marked failed when no frame of the poll was good.
+ */
+
+static void ICACHE_FLASH_ATTR _dht_poll(void) {
+	float t = 0, h = 0, mt = 0, mh = 0;
+	enum DhtResult result;
+	int accepted, confirm = 0;
+	int i;
+
+	stats.reads++;
+	result = _dht_decode(&t, &h);
+
+	if (result != DHT_OK) stats.errors++;
+	if (result == DHT_TIMEOUT) stats.timeouts++;
+	if (result == DHT_SHORT_FRAME) stats.shortFrames++;
+	if (result == DHT_BAD_CHECKSUM) stats.checksums++;
+
+	accepted = result == DHT_OK && _dht_accept(t, h);
+
+	if (accepted) {
+		mt = _dht_median(windowT, t);
+		mh = _dht_median(windowH, h);
+		confirm = _dht_abs(h - mh) > DHT_CONFIRM_HUM || _dht_abs(t - mt) > DHT_CONFIRM_TEMP;
+
+		// Close to the median the frame is taken as it is, so a trend is
+		// not one frame late
+		if (!confirm) {
+			mt = t;
+			mh = h;
+		}
+	}
+
+	if ((!accepted || confirm) && attempts < DHT_RETRIES) {
+		attempts++;
+		stats.retries++;
+		if (polling) os_timer_disarm(&dhtTimer);
+		os_timer_disarm(&retryTimer);
+		os_timer_arm(&retryTimer, DHT_RETRY_MS, 0);
+		rtcstate_save();
+		return;
+	}
+
+	// Back to the periodic poll, counted from this frame
+	if (attempts && polling) {
+		os_timer_disarm(&dhtTimer);
+		os_timer_arm(&dhtTimer, pollTime, 1);
+	}
+	attempts = 0;
+
+	if (accepted) {
+		reading.temperature = lastT = mt;
+		reading.humidity = lastH = mh;
+		lastTime = system_get_time();
 		reading.success = 1;
-        }
-	return;
+		boot_mark(BOOT_FIRST_SAMPLE);
+	} else {
+		reading.success = 0;
+		stats.failures++;
+	}
+
+	rtcstate_save();
+
+	for (i = 0; reading.success && i < DHT_LISTENERS && listeners[i] != NULL; i++) {
+		listeners[i](&reading);
+	}
+}
+
+static void ICACHE_FLASH_ATTR _poll_dht_cb(void *arg) {
+	// A new poll, a retry still pending is not needed any more
+	os_timer_disarm(&retryTimer);
+	attempts = 0;
+	STACK_CALL("dht_poll", _dht_poll());
+}
+
+static void ICACHE_FLASH_ATTR _retry_dht_cb(void *arg) {
+	STACK_CALL("dht_poll", _dht_poll());
 }
 
 /*
@@ -223,6 +422,76 @@ struct DhtReading *ICACHE_FLASH_ATTR dht_read(int force) {
 	return &reading;
 }
 
+/*
+ * @brief Returns DHT read and error counters
+ */
+
+struct DhtStats *ICACHE_FLASH_ATTR dht_stats() {
+	return &stats;
+}
+
+/*
+ * @brief Restores last sample and counters saved before a reset
+ */
+
+void ICACHE_FLASH_ATTR dht_restore(struct DhtReading *r, struct DhtStats *s) {
+	reading = *r;
+	stats = *s;
+}
+
+/*
+ * @brief Registers a function called with every good reading
+ *
+ * Returns 1 if there is no room for another listener.
+ */
+
+int ICACHE_FLASH_ATTR dht_subscribe(DhtListener cb) {
+	int i;
+
+	for (i = 0; i < DHT_LISTENERS; i++) {
+		if (listeners[i] == NULL || listeners[i] == cb) {
+			listeners[i] = cb;
+			return 0;
+		}
+	}
+
+	os_printf("ERROR: no room for another DHT listener\n");
+	return 1;
+}
+
+/*
+ * @brief First reading after boot
+ *
+ * Starts the periodic poll and reads the sensor at once, instead of waiting a
+ * full poll interval for the first sample.
+ */
+
+static void ICACHE_FLASH_ATTR _dht_start_cb(void *arg) {
+	os_timer_disarm(&dhtTimer);
+	os_timer_setfn(&dhtTimer, _poll_dht_cb, NULL);
+	os_timer_arm(&dhtTimer, pollTime, 1);
+	polling = 1;
+	_poll_dht_cb(arg);
+}
+
+/*
+ * @brief Changes the time between readings, counted from now
+ *
+ * Called by listeners, the next reading is then polltime after this one.
+ * Before the first reading it only changes the interval used after it.
+ */
+
+void ICACHE_FLASH_ATTR dht_interval(uint32_t polltime) {
+	if (polltime == pollTime) return;
+
+	pollTime = polltime;
+
+	if (!polling) return;
+
+	os_timer_disarm(&dhtTimer);
+	os_timer_arm(&dhtTimer, pollTime, 1);
+}
+
 /*
  * @brief Init DHT
  *
@@ -230,12 +499,19 @@ struct DhtReading *ICACHE_FLASH_ATTR dht_read(int force) {
 
 void dht_init(enum EDhtType DhtType, uint32_t polltime) {
         SENSOR = DhtType;
+	pollTime = polltime;
+	polling = 0;
+	attempts = 0;
+	windowLen = 0;
+	dropped = 0;
+	os_timer_disarm(&retryTimer);
+	os_timer_setfn(&retryTimer, _retry_dht_cb, NULL);
 	// Set GPIO to output mode for DHT22
 	PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0);
 	
 	os_printf("Starting readings of DHT type %d, poll interval of %d\n", SENSOR, (int)polltime);
 	
-	static ETSTimer dhtTimer;
-	os_timer_setfn(&dhtTimer, _poll_dht_cb, NULL);
-	os_timer_arm(&dhtTimer, polltime, 1);
+	os_timer_disarm(&dhtTimer);
+	os_timer_setfn(&dhtTimer, _dht_start_cb, NULL);
+	os_timer_arm(&dhtTimer, DHT_STARTUP_MS, 0);
 }
@@ -0,0 +1,512 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file flashlog.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Sample log in the spare SPI flash sectors, kept across resets.
+ *
+ * The sectors are used as a ring of 256 byte pages, the program page size of
+ * the flash. The first 8 bytes of a page are a header with the page
+ * sequence number and the boot it belongs to, the other 31 slots hold one
+ * 8 byte sample each. Pages are filled in order and a sector is erased only
+ * when the ring comes back to it, so every sector wears at the same rate:
+ * one erase per 496 samples spread over all of them.
+ *
+ * Samples are kept in RAM until FLASHLOG_BATCH of them are ready and then
+ * programmed together into the erased end of the current page, never across
+ * a page boundary. Up to FLASHLOG_BATCH - 1 samples are lost on a reset.
+ *
+ * There is no wall clock, so samples are stamped with the log time: seconds
+ * of device uptime, carried over from the last sample of the previous boot.
+ * It never goes back, and /log.csv returns the current log time in the
+ * X-Log-Time header so a collector can map it to its own clock.
+ *
+ * Spare sectors depend on ESP_SPI_FLASH_SIZE_K. On 1 MB boards the log takes
+ * the 4 sectors between the config sectors and the second OTA image:
+ *
+ *   0x00        boot loader
+ *   0x01-0x7A   first OTA image
+ *   0x7B-0x7C   config, see config.c
+ *   0x7D-0x80   this log
+ *   0x81-0xFA   second OTA image
+ *   0xFB-0xFF   RF calibration, RF init data and SDK parameters
+ *
+ * The last ones are where Makefile.ota puts them with a flash map of 1 MB,
+ * at the end of the whole flash. On bigger boards the log takes everything
+ * above the first megabyte but those last 5 sectors. Boards with less flash
+ * have no log.
+ */
+
+#include <esp8266.h>
+#include "flashlog.h"
+
+#include "args.h"
+#include "boot.h"
+#include "config.h"
+#include "crit.h"
+#include "dht.h"
+#include "itoa.h"
+#include "pool.h"
+
+#if ESP_SPI_FLASH_SIZE_K >= 2048
+#define FLASHLOG_FIRST 0x100
+#define FLASHLOG_END (ESP_SPI_FLASH_SIZE_K / 4 - 5)
+#elif ESP_SPI_FLASH_SIZE_K == 1024
+#define FLASHLOG_FIRST 0x7D
+#define FLASHLOG_END 0x81
+#else
+#define FLASHLOG_FIRST 0
+#define FLASHLOG_END 0
+#endif
+
+#define FLASHLOG_SECTORS (FLASHLOG_END - FLASHLOG_FIRST)
+#define FLASHLOG_PAGE_SIZE 256
+#define FLASHLOG_SECTOR_PAGES (SPI_FLASH_SEC_SIZE / FLASHLOG_PAGE_SIZE)
+#define FLASHLOG_PAGES (FLASHLOG_SECTORS * FLASHLOG_SECTOR_PAGES)
+// Never 0, so the ring arithmetic builds on boards without a log
+#define FLASHLOG_RING (FLASHLOG_PAGES > 0 ? FLASHLOG_PAGES : 1)
+#define FLASHLOG_SLOTS (FLASHLOG_PAGE_SIZE / sizeof(struct FlashLogRecord))
+#define FLASHLOG_MAGIC 0x474c
+#define FLASHLOG_EMPTY 0xffffffff
+// CSV lines sent by each call of the export CGI
+#define FLASHLOG_EXPORT_LINES 8
+
+// First slot of every page
+struct FlashLogPage {
+	uint32 seq;
+	uint16 boot;
+	uint16 magic;
+};
+
+// State of one /log.csv export, between calls of the CGI
+struct FlashLogCursor {
+	uint32 seq;
+	int slot;
+	uint16 boot;
+	uint32 from;
+	uint32 to;
+};
+
+static struct FlashLogRecord batch[FLASHLOG_BATCH];
+static int batchLen;
+// Newest page and its next free slot. The page of the previous boot is
+// never written again, each boot starts a new one.
+static uint32 pageSeq;
+static int pageSlot;
+static int logged;
+static uint32 nextSeq;
+static uint16 boot;
+static uint32 base;
+static struct FlashLogStats stats;
+
+static uint32 ICACHE_FLASH_ATTR _flashlog_address(uint32 seq, int slot) {
+	return (FLASHLOG_FIRST + (seq % FLASHLOG_RING) / FLASHLOG_SECTOR_PAGES) * SPI_FLASH_SEC_SIZE
+			+ (seq % FLASHLOG_SECTOR_PAGES) * FLASHLOG_PAGE_SIZE + slot * sizeof(struct FlashLogRecord);
+}
+
+/*
+ * @brief Reads the header of the page that holds seq. Returns 1 if it does
+ * not hold a valid page, or holds another one.
+ */
+
+static int ICACHE_FLASH_ATTR _flashlog_page(uint32 seq, struct FlashLogPage *page) {
+	if (spi_flash_read(_flashlog_address(seq, 0), (uint32 *)page, sizeof(*page)) != SPI_FLASH_RESULT_OK) return 1;
+
+	return page->magic != FLASHLOG_MAGIC || page->seq != seq;
+}
+
+/*
+ * @brief Starts the next page, erasing its sector first if it is the first
+ * page of one.
+ */
+
+static int ICACHE_FLASH_ATTR _flashlog_open(void) {
+	struct FlashLogPage page;
+	uint32 seq = nextSeq;
+
+	if (seq % FLASHLOG_SECTOR_PAGES == 0) {
+		if (spi_flash_erase_sector(FLASHLOG_FIRST + (seq % FLASHLOG_RING) / FLASHLOG_SECTOR_PAGES) != SPI_FLASH_RESULT_OK) {
+			return 1;
+		}
+		stats.erases++;
+	}
+
+	page.seq = seq;
+	page.boot = boot;
+	page.magic = FLASHLOG_MAGIC;
+
+	if (spi_flash_write(_flashlog_address(seq, 0), (uint32 *)&page, sizeof(page)) != SPI_FLASH_RESULT_OK) return 1;
+
+	pageSeq = seq;
+	pageSlot = 1;
+	logged = 1;
+	nextSeq++;
+	return 0;
+}
+
+/*
+ * @brief Writes the samples kept in RAM to flash.
+ */
+
+void ICACHE_FLASH_ATTR flashlog_flush(void) {
+	int done = 0;
+
+	if (FLASHLOG_SECTORS == 0 || batchLen == 0) return;
+
+	CRIT_UART_DISABLE();
+
+	while (done < batchLen) {
+		int n = batchLen - done;
+
+		if (!logged || pageSlot >= FLASHLOG_SLOTS) {
+			if (_flashlog_open()) break;
+		}
+
+		if (n > FLASHLOG_SLOTS - pageSlot) n = FLASHLOG_SLOTS - pageSlot;
+
+		if (spi_flash_write(_flashlog_address(pageSeq, pageSlot), (uint32 *)&batch[done],
+				n * sizeof(struct FlashLogRecord)) != SPI_FLASH_RESULT_OK) {
+			break;
+		}
+
+		stats.writes++;
+		pageSlot += n;
+		done += n;
+	}
+
+	CRIT_UART_ENABLE();
+
+	if (done < batchLen) {
+		os_printf("Error writing flash log, %d samples lost\n", batchLen - done);
+		stats.errors++;
+	}
+
+	batchLen = 0;
+}
+
+/*
+ * @brief Adds a sample to the log. It reaches flash with the next batch.
+ */
+
+void ICACHE_FLASH_ATTR flashlog_add(struct FlashLogRecord *r) {
+	if (FLASHLOG_SECTORS == 0) return;
+
+	batch[batchLen++] = *r;
+	stats.samples++;
+
+	if (batchLen == FLASHLOG_BATCH) flashlog_flush();
+}
+
+static void ICACHE_FLASH_ATTR _flashlog_sample(struct DhtReading *r) {
+	struct FlashLogRecord rec;
+
+	rec.time = flashlog_now();
+	rec.temp = round_tenths(r->temperature);
+	rec.hum = round_tenths(r->humidity);
+	flashlog_add(&rec);
+}
+
+/*
+ * @brief Current log time, in seconds.
+ */
+
+uint32 ICACHE_FLASH_ATTR flashlog_now(void) {
+	return base + boot_uptime();
+}
+
+/*
+ * @brief Time of the last sample in the page seq or, if it has none, in the
+ * pages before it still in the log. Returns 1 if there is none.
+ *
+ * A page is left without samples when its header was written and the batch
+ * after it was not.
+ */
+
+static int ICACHE_FLASH_ATTR _flashlog_last_time(uint32 seq, uint32 *time) {
+	struct FlashLogPage page;
+	struct FlashLogRecord rec;
+	uint32 n;
+	int i;
+
+	for (n = 0; n < FLASHLOG_PAGES && n <= seq && !_flashlog_page(seq - n, &page); n++) {
+		for (i = FLASHLOG_SLOTS - 1; i > 0; i--) {
+			spi_flash_read(_flashlog_address(seq - n, i), (uint32 *)&rec, sizeof(rec));
+
+			if (rec.time != FLASHLOG_EMPTY) {
+				*time = rec.time;
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * @brief Finds the end of the log and starts recording good readings.
+ *
+ * Only the first page of every sector and then the pages of the newest
+ * sector are read, the log is not scanned sample by sample.
+ */
+
+void ICACHE_FLASH_ATTR flashlog_init(void) {
+	struct FlashLogPage page, newest;
+	uint32 last;
+	int found = 0;
+	int i;
+
+	os_memset(&newest, 0, sizeof(newest));
+	batchLen = 0;
+	logged = 0;
+	nextSeq = 0;
+	boot = 0;
+	base = 0;
+
+	if (FLASHLOG_SECTORS == 0) {
+		os_printf("No spare flash for the sample log\n");
+		return;
+	}
+
+	for (i = 0; i < FLASHLOG_SECTORS; i++) {
+		spi_flash_read((FLASHLOG_FIRST + i) * SPI_FLASH_SEC_SIZE, (uint32 *)&page, sizeof(page));
+		if (page.magic != FLASHLOG_MAGIC || (found && page.seq <= newest.seq)) continue;
+
+		newest = page;
+		found = 1;
+	}
+
+	if (found) {
+		for (i = 1; i < FLASHLOG_SECTOR_PAGES && !_flashlog_page(newest.seq + 1, &page); i++) {
+			newest = page;
+		}
+
+		pageSeq = newest.seq;
+		pageSlot = FLASHLOG_SLOTS;
+		logged = 1;
+		nextSeq = newest.seq + 1;
+		boot = newest.boot + 1;
+		// Log time goes on from the last sample, so the log stays sorted
+		base = _flashlog_last_time(newest.seq, &last) ? 0 : last + 1;
+	}
+
+	os_printf("Flash log: %d sectors, boot %d, log time %u\n", FLASHLOG_SECTORS, boot, (unsigned int)base);
+	dht_subscribe(_flashlog_sample);
+}
+
+/*
+ * @brief Number of flash sectors used by the log, 0 if there is none.
+ */
+
+int ICACHE_FLASH_ATTR flashlog_sectors(void) {
+	return FLASHLOG_SECTORS;
+}
+
+struct FlashLogStats * ICACHE_FLASH_ATTR flashlog_stats(void) {
+	return &stats;
+}
+
+/*
+ * @brief Time of the first sample of a page, 0 if there is no such page.
+ */
+
+static uint32 ICACHE_FLASH_ATTR _flashlog_page_time(uint32 seq) {
+	struct FlashLogPage page;
+	struct FlashLogRecord rec;
+
+	if (_flashlog_page(seq, &page)) return 0;
+
+	spi_flash_read(_flashlog_address(seq, 1), (uint32 *)&rec, sizeof(rec));
+	return rec.time == FLASHLOG_EMPTY ? 0 : rec.time;
+}
+
+/*
+ * @brief Binary search of the last page starting at or before from.
+ *
+ * Pages that were erased on the way round are only ever at the old end of
+ * the ring, so they sort first.
+ */
+
+static uint32 ICACHE_FLASH_ATTR _flashlog_seek(uint32 from) {
+	uint32 lo = nextSeq > FLASHLOG_PAGES ? nextSeq - FLASHLOG_PAGES : 0;
+	uint32 hi = nextSeq - 1;
+
+	while (lo < hi) {
+		uint32 mid = lo + (hi - lo + 1) / 2;
+
+		if (_flashlog_page_time(mid) <= from) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * @brief Formats one CSV line, returns its length.
+ */
+
+static int ICACHE_FLASH_ATTR _flashlog_line(char *buff, struct FlashLogRecord *r, uint16 b) {
+	int len;
+
+	len = os_sprintf(buff, "%u,%u,", (unsigned int)r->time, (unsigned int)b);
+	len += itoa_tenths(r->temp, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(r->hum, buff + len);
+	buff[len++] = '\n';
+	return len;
+}
+
+/*
+ * @brief Writes up to FLASHLOG_EXPORT_LINES lines of the export into buff.
+ * Returns their length, *done is set at the end of the range.
+ *
+ * The cursor only holds the position and the next time to send, so samples
+ * that move from RAM to flash between two calls are neither lost nor sent
+ * twice.
+ */
+
+static int ICACHE_FLASH_ATTR _flashlog_export(struct FlashLogCursor *c, char *buff, int *done) {
+	struct FlashLogRecord recs[FLASHLOG_EXPORT_LINES];
+	struct FlashLogPage page;
+	int lines = 0, len = 0;
+	int i, n;
+
+	*done = 0;
+
+	// Samples in flash
+	while (lines < FLASHLOG_EXPORT_LINES && logged && (c->seq < pageSeq || (c->seq == pageSeq && c->slot < pageSlot))) {
+		if (c->slot == 1) {
+			if (_flashlog_page(c->seq, &page)) {
+				// Erased under us, the writer went round the ring
+				c->seq++;
+				continue;
+			}
+			c->boot = page.boot;
+		}
+
+		n = FLASHLOG_EXPORT_LINES - lines;
+		if (n > FLASHLOG_SLOTS - c->slot) n = FLASHLOG_SLOTS - c->slot;
+		if (c->seq == pageSeq && n > pageSlot - c->slot) n = pageSlot - c->slot;
+
+		spi_flash_read(_flashlog_address(c->seq, c->slot), (uint32 *)recs, n * sizeof(struct FlashLogRecord));
+
+		for (i = 0; i < n; i++) {
+			if (recs[i].time == FLASHLOG_EMPTY) {
+				n = FLASHLOG_SLOTS - c->slot;
+				break;
+			}
+			if (recs[i].time > c->to) {
+				*done = 1;
+				return len;
+			}
+			if (recs[i].time < c->from) continue;
+
+			len += _flashlog_line(buff + len, &recs[i], c->boot);
+			c->from = recs[i].time + 1;
+			lines++;
+		}
+
+		c->slot += n;
+		if (c->slot >= FLASHLOG_SLOTS) {
+			c->seq++;
+			c->slot = 1;
+		}
+	}
+
+	if (lines == FLASHLOG_EXPORT_LINES) return len;
+
+	// Samples still in RAM, all newer than those in flash
+	for (i = 0; i < batchLen && lines < FLASHLOG_EXPORT_LINES; i++) {
+		if (batch[i].time > c->to) break;
+		if (batch[i].time < c->from) continue;
+
+		len += _flashlog_line(buff + len, &batch[i], boot);
+		c->from = batch[i].time + 1;
+		lines++;
+	}
+
+	if (lines < FLASHLOG_EXPORT_LINES) *done = 1;
+	return len;
+}
+
+/**
+ * @brief Streams /log.csv, the samples of a log time range.
+ *
+ * Arguments, all in seconds of log time: "from" and "to", or "last" for the
+ * samples of the last given seconds. Without them the whole log is sent.
+ * Only the cursor is kept between calls, the range is read from flash a few
+ * samples at a time.
+ */
+
+int ICACHE_FLASH_ATTR flashlog_cgi(HttpdConnData *connData) {
+	struct FlashLogCursor *c = connData->cgiData;
+	struct Args args;
+	char buff[FLASHLOG_EXPORT_LINES * 48];
+	int len, done;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		if (c != NULL) pool_free(POOL_CURSOR, c);
+		return HTTPD_CGI_DONE;
+	}
+
+	if (c == NULL) {
+		c = pool_alloc(POOL_CURSOR, sizeof(struct FlashLogCursor));
+		if (c == NULL) {
+			httpdStartResponse(connData, 503);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		connData->cgiData = c;
+
+		args_parse(&args, connData->getArgs);
+		c->from = args_int(&args, "from", 0);
+		c->to = args_get(&args, "to") != NULL ? args_int(&args, "to", 0) : FLASHLOG_EMPTY - 1;
+		if (args_get(&args, "last") != NULL) {
+			uint32 last = args_int(&args, "last", 0);
+			uint32 now = flashlog_now();
+
+			c->from = last < now ? now - last : 0;
+		}
+
+		c->seq = logged ? _flashlog_seek(c->from) : 0;
+		c->slot = 1;
+
+		os_sprintf(buff, "%u", (unsigned int)flashlog_now());
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/csv");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdHeader(connData, "X-Log-Time", buff);
+		httpdEndHeaders(connData);
+		httpdSend(connData, "time_s,boot,temperature,humidity\n", -1);
+		return HTTPD_CGI_MORE;
+	}
+
+	len = _flashlog_export(c, buff, &done);
+	if (len > 0) httpdSend(connData, buff, len);
+
+	if (!done) return HTTPD_CGI_MORE;
+
+	pool_free(POOL_CURSOR, c);
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
@@ -0,0 +1,237 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file heap.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the heap monitor.
+ *
+ * The SDK allocator is wrapped at link time (-Wl,--wrap in the Makefile), so
+ * every os_malloc(), os_zalloc() and os_free() goes through here, those of
+ * libesphttpd and the SDK libraries too. The SDK passes the file and line
+ * of each call, allocations are counted per call site with the bytes they
+ * hold now and at most. Sizes are kept in a table of live blocks, a block
+ * freed without being in it, allocated inside the SDK allocator itself or
+ * once the table was full, is just passed on.
+ */
+
+#include <esp8266.h>
+
+#include "heap.h"
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+
+// The last argument is only there on SDKs from 2.2 on, it is passed on as
+// it came and ignored by older ones.
+void *__real_pvPortMalloc(size_t size, const char *file, unsigned line, bool iram);
+void *__real_pvPortZalloc(size_t size, const char *file, unsigned line, bool iram);
+void *__real_pvPortRealloc(void *ptr, size_t size, const char *file, unsigned line);
+void __real_vPortFree(void *ptr, const char *file, unsigned line);
+
+struct HeapBlock {
+	void *ptr;
+	uint16 size;
+	uint16 site;
+};
+
+static struct HeapStats stats;
+static struct HeapSite sites[HEAP_SITES];
+static int siteCount;
+static struct HeapBlock blocks[HEAP_BLOCKS];
+
+/*
+ * @brief Index of the site of file and line, added if it is new.
+ *
+ * File names of the SDK live in flash, only their pointers are compared.
+ */
+
+static int _heap_site(const char *file, unsigned line) {
+	int i;
+
+	for (i = 0; i < siteCount; i++) {
+		if (sites[i].file == file && sites[i].line == line) return i;
+	}
+
+	if (siteCount == HEAP_SITES) return HEAP_SITES - 1;
+
+	sites[siteCount].file = siteCount == HEAP_SITES - 1 ? NULL : file;
+	sites[siteCount].line = siteCount == HEAP_SITES - 1 ? 0 : line;
+	return siteCount++;
+}
+
+/*
+ * @brief Counts an allocation, ptr is NULL if it failed.
+ *
+ * Allocations can come from interrupts, so tables are updated with them
+ * off. The CRIT_* macros are not used, the allocator would fill their
+ * histogram with sections of a few microseconds.
+ */
+
+static void _heap_track(void *ptr, size_t size, const char *file, unsigned line) {
+	struct HeapSite *s;
+	int i;
+
+	ets_intr_lock();
+	s = &sites[_heap_site(file, line)];
+	s->allocs++;
+	stats.allocs++;
+
+	if (ptr == NULL) {
+		s->failures++;
+		stats.failures++;
+		ets_intr_unlock();
+		return;
+	}
+
+	for (i = 0; i < HEAP_BLOCKS && blocks[i].ptr != NULL; i++);
+
+	if (i == HEAP_BLOCKS) {
+		stats.untracked++;
+	} else {
+		blocks[i].ptr = ptr;
+		blocks[i].size = size;
+		blocks[i].site = s - sites;
+		s->bytes += size;
+		if (s->bytes > s->peak) s->peak = s->bytes;
+		stats.bytes += size;
+		if (stats.bytes > stats.peak) stats.peak = stats.bytes;
+	}
+
+	ets_intr_unlock();
+}
+
+static void _heap_untrack(void *ptr) {
+	int i;
+
+	if (ptr == NULL) return;
+
+	ets_intr_lock();
+
+	for (i = 0; i < HEAP_BLOCKS; i++) {
+		if (blocks[i].ptr == ptr) {
+			sites[blocks[i].site].bytes -= blocks[i].size;
+			stats.bytes -= blocks[i].size;
+			blocks[i].ptr = NULL;
+			break;
+		}
+	}
+
+	ets_intr_unlock();
+}
+
+void *__wrap_pvPortMalloc(size_t size, const char *file, unsigned line, bool iram) {
+	void *ptr = __real_pvPortMalloc(size, file, line, iram);
+
+	_heap_track(ptr, size, file, line);
+	return ptr;
+}
+
+void *__wrap_pvPortZalloc(size_t size, const char *file, unsigned line, bool iram) {
+	void *ptr = __real_pvPortZalloc(size, file, line, iram);
+
+	_heap_track(ptr, size, file, line);
+	return ptr;
+}
+
+void *__wrap_pvPortRealloc(void *old, size_t size, const char *file, unsigned line) {
+	void *ptr = __real_pvPortRealloc(old, size, file, line);
+
+	if (ptr != NULL || size == 0) _heap_untrack(old);
+	if (size != 0) _heap_track(ptr, size, file, line);
+	return ptr;
+}
+
+void __wrap_vPortFree(void *ptr, const char *file, unsigned line) {
+	_heap_untrack(ptr);
+	__real_vPortFree(ptr, file, line);
+}
+
+struct HeapStats *ICACHE_FLASH_ATTR heap_stats(void) {
+	return &stats;
+}
+
+int ICACHE_FLASH_ATTR heap_site_count(void) {
+	return siteCount;
+}
+
+struct HeapSite *ICACHE_FLASH_ATTR heap_site(int i) {
+	return &sites[i];
+}
+
+/*
+ * @brief Byte of a string that may be in flash, where only aligned 32 bit
+ * reads work.
+ */
+
+static char ICACHE_FLASH_ATTR _heap_byte(const char *p) {
+	uint32 word = *(const uint32 *)((size_t)p & ~(size_t)3);
+
+	return (word >> (((size_t)p & 3) * 8)) & 0xff;
+}
+
+/*
+ * @brief "file.c:line" of site i, without the directories.
+ */
+
+void ICACHE_FLASH_ATTR heap_site_name(int i, char *buff, int len) {
+	const char *file = sites[i].file;
+	const char *base = file;
+	char c;
+	int n = 0;
+
+	if (file == NULL) {
+		os_strcpy(buff, "other");
+		return;
+	}
+
+	while ((c = _heap_byte(file)) != 0) {
+		if (c == '/') base = file + 1;
+		file++;
+	}
+
+	while (n < len - 12 && (c = _heap_byte(base++)) != 0) buff[n++] = c;
+
+	os_sprintf(buff + n, ":%u", (unsigned int)sites[i].line);
+}
+
+/*
+ * @brief Size of the biggest block that can be allocated now.
+ *
+ * Found by trying allocations, it is only meant for the diagnostics page.
+ */
+
+uint32 ICACHE_FLASH_ATTR heap_largest_free(void) {
+	uint32 lo = 0, hi = system_get_free_heap_size();
+	void *ptr;
+
+	while (lo < hi) {
+		uint32 mid = (lo + hi + 1) / 2;
+
+		ptr = __real_pvPortMalloc(mid, "heap.c", __LINE__, false);
+		if (ptr != NULL) {
+			__real_vPortFree(ptr, "heap.c", __LINE__);
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
@@ -0,0 +1,195 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file history.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Good readings of the last hours, kept in RAM.
+ *
+ * Samples are stamped with boot_uptime() and stored in tenths, compressed
+ * with series.c in blocks of HISTORY_BLOCK_SIZE bytes. The first sample of
+ * a block is stored raw and the rest are coded against it, so when the
+ * history is full the oldest block is dropped as a whole. A DHT22 sample
+ * takes about one byte, HISTORY_BYTES hold around 900 of them. It is lost on
+ * reset.
+ */
+
+#include <esp8266.h>
+
+#include "history.h"
+#include "boot.h"
+#include "config.h"
+#include "dht.h"
+#include "itoa.h"
+#include "series.h"
+
+#define HISTORY_BLOCK_SIZE 64
+#define HISTORY_BLOCKS (HISTORY_BYTES / HISTORY_BLOCK_SIZE)
+#define HISTORY_BLOCK_DATA (HISTORY_BLOCK_SIZE - sizeof(struct HistorySample) - 2)
+
+struct HistoryBlock {
+	struct HistorySample first;
+	uint8 count;
+	uint8 len;
+	uint8 data[HISTORY_BLOCK_DATA];
+};
+
+// Sample decoded last by history_get(), so reading in order is O(1)
+struct HistoryReader {
+	uint32 generation;
+	int block;
+	int base;
+	int k;
+	int pos;
+	struct SeriesState st;
+	struct HistorySample cur;
+};
+
+static struct HistoryBlock blocks[HISTORY_BLOCKS];
+static int head;
+static int used;
+static int count;
+static struct SeriesState enc;
+static uint32 generation;
+static struct HistoryReader reader;
+
+static struct HistoryBlock * ICACHE_FLASH_ATTR _history_block(int i) {
+	return &blocks[(head + i) % HISTORY_BLOCKS];
+}
+
+/*
+ * @brief Appends a sample, dropping the oldest block if there is no room.
+ */
+
+void ICACHE_FLASH_ATTR history_add(struct HistorySample *s) {
+	struct HistoryBlock *b;
+	struct SeriesState st = enc;
+	uint8 buff[SERIES_MAX_BYTES];
+	int n;
+
+	generation++;
+	count++;
+
+	if (used > 0) {
+		b = _history_block(used - 1);
+		n = series_encode(&st, s, buff);
+
+		if (b->len + n <= HISTORY_BLOCK_DATA) {
+			os_memcpy(b->data + b->len, buff, n);
+			b->len += n;
+			b->count++;
+			enc = st;
+			return;
+		}
+	}
+
+	if (used == HISTORY_BLOCKS) {
+		count -= blocks[head].count;
+		head = (head + 1) % HISTORY_BLOCKS;
+		used--;
+	}
+
+	b = _history_block(used++);
+	b->first = *s;
+	b->count = 1;
+	b->len = 0;
+	series_start(&enc, s);
+}
+
+static void ICACHE_FLASH_ATTR _history_sample(struct DhtReading *r) {
+	struct HistorySample s;
+
+	s.up = boot_uptime();
+	s.temp = round_tenths(r->temperature);
+	s.hum = round_tenths(r->humidity);
+	history_add(&s);
+}
+
+/*
+ * @brief Starts recording good readings.
+ */
+
+void ICACHE_FLASH_ATTR history_init(void) {
+	dht_subscribe(_history_sample);
+}
+
+/*
+ * @brief Samples in the history.
+ */
+
+int ICACHE_FLASH_ATTR history_count(void) {
+	return count;
+}
+
+/*
+ * @brief Copies sample i, 0 is the oldest. Returns 1 if there is no such
+ * sample.
+ *
+ * Samples are decoded from the start of their block, unless i comes after
+ * the one returned last.
+ */
+
+int ICACHE_FLASH_ATTR history_get(int i, struct HistorySample *s) {
+	struct HistoryReader *r = &reader;
+	struct HistoryBlock *b;
+	int n;
+
+	if (i < 0 || i >= count) return 1;
+
+	if (r->generation != generation || i < r->base + r->k) {
+		r->generation = generation;
+		r->block = 0;
+		r->base = 0;
+		r->k = -1;
+	}
+
+	while (i >= r->base + _history_block(r->block)->count) {
+		r->base += _history_block(r->block)->count;
+		r->block++;
+		r->k = -1;
+	}
+
+	b = _history_block(r->block);
+
+	if (r->k < 0) {
+		r->k = 0;
+		r->pos = 0;
+		r->cur = b->first;
+		series_start(&r->st, &b->first);
+	}
+
+	while (r->base + r->k < i) {
+		n = series_decode(&r->st, b->data + r->pos, b->len - r->pos, &r->cur);
+		if (n == 0) return 1;
+
+		r->pos += n;
+		r->k++;
+	}
+
+	*s = r->cur;
+	return 0;
+}
+
+/*
+ * @brief Number of samples ever added, changes with every new sample.
+ */
+
+uint32 ICACHE_FLASH_ATTR history_generation(void) {
+	return generation;
+}
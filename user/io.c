@@ -24,26 +24,98 @@
 
 #include "io.h"
 #include "config.h"
+#include "rtcstate.h"
 
-#define REALYGPIO 2 
+/*
+ * Relays/SSRs driven by the board. Add one line per channel and update
+ * IO_CHANNELS in config.h, the order gives the channel number used by the web
+ * interface. GPIO0 is used by the DHT sensor and GPIO1 by the console.
+ */
+
+struct io_channel {
+	uint8 gpio;
+	uint32 mux;
+	uint8 func;
+};
+
+static const struct io_channel channels[] = {
+	{2, PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2},
+//	{3, PERIPHS_IO_MUX_U0RXD_U, FUNC_GPIO3},
+};
+
+// Fails to compile if IO_CHANNELS does not match the table above.
+typedef char _io_channels_check[(sizeof(channels)/sizeof(channels[0]) == IO_CHANNELS) ? 1 : -1];
+
+#define IO_LISTENERS 4
 
 void _io_off (void* arg);
-static int status = 0;
-static ETSTimer ioOffTimer;
+static uint32 status = 0;
+static ETSTimer ioOffTimer[IO_CHANNELS];
+// RTC time when each auto-off timer fires, 0 if not armed
+static uint32 ioDeadline[IO_CHANNELS];
+static IoListener listeners[IO_LISTENERS];
 
 /*
- * @brief Sets I/O port on/off. 
+ * @brief Sets several I/O ports at once. 
  *
+ * mask selects the channels to change (bit n is channel n) and values holds
+ * their new state. All GPIOs are updated with a single write to the GPIO output
+ * register, so channels switching together do it at the same time.
  */
 
-void ICACHE_FLASH_ATTR io_enable(short int ena) {
-	if (ena) {
-		GPIO_OUTPUT_SET(REALYGPIO, 1);
-		status = 1;
-	} else {
-		GPIO_OUTPUT_SET(REALYGPIO, 0);
-		status = 0;
+void ICACHE_FLASH_ATTR io_apply(uint32 mask, uint32 values) {
+	uint32 set = 0;
+	uint32 clear = 0;
+	uint32 changed;
+	short int ch;
+	int i;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		if (!(mask & (1 << ch))) continue;
+
+		if (values & (1 << ch)) {
+			set |= 1 << channels[ch].gpio;
+		} else {
+			clear |= 1 << channels[ch].gpio;
+		}
 	}
+
+	if (!(set | clear)) return;
+
+	GPIO_REG_WRITE(GPIO_OUT_ADDRESS, (GPIO_REG_READ(GPIO_OUT_ADDRESS) & ~clear) | set);
+	changed = (status ^ values) & mask;
+	status = (status & ~mask) | (values & mask);
+	rtcstate_save();
+
+	for (ch = 0; changed && ch < IO_CHANNELS; ch++) {
+		if (!(changed & (1 << ch))) continue;
+
+		for (i = 0; i < IO_LISTENERS && listeners[i] != NULL; i++) {
+			listeners[i](ch, (status >> ch) & 1);
+		}
+	}
+}
+
+/*
+ * @brief Sets I/O port on/off. 
+ *
+ */
+
+void ICACHE_FLASH_ATTR io_enable(short int ch, short int ena) {
+	if (ch < 0 || ch >= IO_CHANNELS) return;
+
+	io_apply(1 << ch, ena ? 1 << ch : 0);
+}
+
+/*
+ * @brief Manual override from the user. 
+ *
+ * Turning a channel on arms its auto-off timer, turning it off cancels it.
+ */
+
+void ICACHE_FLASH_ATTR io_manual(short int ch, short int ena) {
+	io_enable(ch, ena);
+	io_timer(ch, ena);
 }
 
 /*
@@ -51,20 +123,86 @@ void ICACHE_FLASH_ATTR io_enable(short int ena) {
  *
  */
 
-int ICACHE_FLASH_ATTR io_get_status() {
+int ICACHE_FLASH_ATTR io_get_status(short int ch) {
+	if (ch < 0 || ch >= IO_CHANNELS) return 0;
+
+	return (status >> ch) & 1;
+}
+
+/*
+ * @brief Restuns the status of all I/O ports, bit n is channel n. 
+ *
+ */
+
+uint32 ICACHE_FLASH_ATTR io_get_mask() {
 	return status;
 }
 
+/*
+ * @brief Registers a function called when a channel changes state. 
+ *
+ * Returns 1 if there is no room for another listener.
+ */
+
+int ICACHE_FLASH_ATTR io_subscribe(IoListener cb) {
+	int i;
+
+	for (i = 0; i < IO_LISTENERS; i++) {
+		if (listeners[i] == NULL || listeners[i] == cb) {
+			listeners[i] = cb;
+			return 0;
+		}
+	}
+
+	os_printf("ERROR: no room for another I/O listener\n");
+	return 1;
+}
+
+/*
+ * @brief Restores I/O port status and auto-off deadlines after a soft reset. 
+ *
+ * Called before io_init(), which drives the GPIOs to the restored status.
+ */
+
+void ICACHE_FLASH_ATTR io_restore(uint32 mask, uint32 *deadline) {
+	short int ch;
+
+	status = mask & ((1 << IO_CHANNELS) - 1);
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		ioDeadline[ch] = (status & (1 << ch)) ? deadline[ch] : 0;
+	}
+}
+
 /*
  * @brief I/O port init. 
  *
+ * Ports start off, unless a previous status was restored with io_restore().
  */
 
 void io_init() {
+	short int ch;
+	uint32 gpios = 0;
+	uint32 on = 0;
+
 	//Set GPIO to output mode.
-	PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2);
-	GPIO_OUTPUT_SET(REALYGPIO, 0);
-	status = 0;
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		PIN_FUNC_SELECT(channels[ch].mux, channels[ch].func);
+		gpios |= 1 << channels[ch].gpio;
+
+		if (status & (1 << ch)) on |= 1 << channels[ch].gpio;
+	}
+
+	gpio_output_set(on, gpios & ~on, gpios, 0);
+
+	// Re-arm auto-off timers that were running before the reset
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		if (!ioDeadline[ch]) continue;
+
+		os_timer_disarm(&ioOffTimer[ch]);
+		os_timer_setfn(&ioOffTimer[ch], _io_off, (void *)(int)ch);
+		os_timer_arm(&ioOffTimer[ch], rtcstate_remaining(ioDeadline[ch]) + 1, 0);
+	}
 }
 
 /*
@@ -75,17 +213,32 @@ void io_init() {
  *
  */
 
-void ICACHE_FLASH_ATTR io_timer(short int enable) {
+void ICACHE_FLASH_ATTR io_timer(short int ch, short int enable) {
 	struct config conf;
+
+	if (ch < 0 || ch >= IO_CHANNELS) return;
+
 	conf = config_read();	
+	os_timer_disarm(&ioOffTimer[ch]);
+	ioDeadline[ch] = 0;
 
 	if (enable) {
-		os_timer_disarm(&ioOffTimer);
-		os_timer_setfn(&ioOffTimer, _io_off, NULL);
-		os_timer_arm(&ioOffTimer, conf.time*60000, 0);
-	} else {
-		os_timer_disarm(&ioOffTimer);
+		os_timer_setfn(&ioOffTimer[ch], _io_off, (void *)(int)ch);
+		os_timer_arm(&ioOffTimer[ch], conf.ch[ch].time*60000, 0);
+		ioDeadline[ch] = rtcstate_deadline(conf.ch[ch].time*60000);
 	}
+
+	rtcstate_save();
+}
+
+/*
+ * @brief RTC time when the auto-off timer fires, 0 if it is not armed. 
+ */
+
+uint32 ICACHE_FLASH_ATTR io_timer_deadline(short int ch) {
+	if (ch < 0 || ch >= IO_CHANNELS) return 0;
+
+	return ioDeadline[ch];
 }
 
 /*
@@ -93,5 +246,6 @@ void ICACHE_FLASH_ATTR io_timer(short int enable) {
  */
 
 void ICACHE_FLASH_ATTR _io_off (void* arg) {
-	io_enable(0);
+	ioDeadline[(int)arg] = 0;
+	io_enable((short int)(int)arg, 0);
 }
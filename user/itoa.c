@@ -54,3 +54,34 @@ char* itoa(int i, char b[]) {
 
 	return b;
 }
+
+/*
+ * @brief Writes a value in tenths as a decimal number, 225 is "22.5".
+ *
+ * os_sprintf has no %f. Returns the length written.
+ */
+
+int itoa_tenths(int i, char b[]) {
+	int len = 0;
+
+	if (i < 0) {
+		b[len++] = '-';
+		i = -i;
+	}
+
+	itoa(i / 10, b + len);
+	while (b[len]) len++;
+
+	b[len++] = '.';
+	b[len++] = '0' + i % 10;
+	b[len] = '\0';
+	return len;
+}
+
+/*
+ * @brief Rounds a reading to the nearest tenth, 22.46 is 225.
+ */
+
+int round_tenths(float v) {
+	return (int)(v * 10 + (v < 0 ? -0.5f : 0.5f));
+}
@@ -0,0 +1,419 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file metrics.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the /metrics page.
+ *
+ * Plain text page, one "name value" pair per line, so it can be read by
+ * people and scraped by scripts.
+ */
+
+#include <esp8266.h>
+#include "metrics.h"
+
+#include "admit.h"
+#include "args.h"
+#include "boot.h"
+#include "coap.h"
+#include "crit.h"
+#include "dht.h"
+#include "flashlog.h"
+#include "heap.h"
+#include "mqtt.h"
+#include "pagecache.h"
+#include "pool.h"
+#include "rtcstate.h"
+#include "sampler.h"
+#include "stack.h"
+#include "web.h"
+#include "wifi.h"
+
+/**
+ * @brief Sends one "name value" line.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_line(HttpdConnData *connData, const char *name, uint32 value) {
+	char buff[64];
+	int len;
+
+	len = os_sprintf(buff, "%s %u\n", name, (unsigned int)value);
+	httpdSend(connData, buff, len);
+}
+
+/**
+ * @brief Boot phase timestamps and the derived time to first sample and
+ * first response, in microseconds.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_boot(HttpdConnData *connData) {
+	char name[48];
+	int phase;
+
+	for (phase = 0; phase < BOOT_PHASES; phase++) {
+		os_sprintf(name, "boot_%s_us", boot_phase_name(phase));
+		_metrics_line(connData, name, boot_time(phase));
+	}
+
+	_metrics_line(connData, "boot_warm", rtcstate_warm());
+	_metrics_line(connData, "time_to_first_sample_us", boot_time(BOOT_FIRST_SAMPLE));
+	_metrics_line(connData, "time_to_first_response_us", boot_time(BOOT_FIRST_RESPONSE));
+}
+
+/*
+ * @brief Critical section histogram of one kind, longest section and where
+ * it started.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_crit(HttpdConnData *connData, enum CritKind kind) {
+	static const uint32 limits[CRIT_BUCKETS] = CRIT_BUCKET_LIMITS;
+	struct CritStats *s = crit_stats(kind);
+	const char *name = crit_kind_name(kind);
+	char buff[128];
+	int i, len;
+
+	for (i = 0; i < CRIT_BUCKETS; i++) {
+		if (limits[i]) {
+			len = os_sprintf(buff, "crit_%s_bucket{le=\"%u\"} %u\n", name, (unsigned int)limits[i], (unsigned int)s->buckets[i]);
+		} else {
+			len = os_sprintf(buff, "crit_%s_bucket{le=\"inf\"} %u\n", name, (unsigned int)s->buckets[i]);
+		}
+		httpdSend(connData, buff, len);
+	}
+
+	len = os_sprintf(buff, "crit_%s_count %u\ncrit_%s_total_us %u\ncrit_%s_alarms %u\n",
+			name, (unsigned int)s->count, name, (unsigned int)s->total, name, (unsigned int)s->alarms);
+	httpdSend(connData, buff, len);
+	len = os_sprintf(buff, "crit_%s_max_us{site=\"%s\"} %u\n", name, s->maxSite ? s->maxSite : "", (unsigned int)s->max);
+	httpdSend(connData, buff, len);
+}
+
+/**
+ * @brief Interval to the next reading and why it was chosen, rate of change
+ * and distance to the nearest threshold in hundredths of a step.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_sampler(HttpdConnData *connData) {
+	struct SamplerStats *s = sampler_stats();
+	char buff[160];
+	int len;
+
+	len = os_sprintf(buff, "sample_interval_ms{reason=\"%s\"} %u\nsample_rate_per_min_x100 %u\n",
+			sampler_reason_name(s->reason), (unsigned int)s->interval, (unsigned int)s->rate);
+	httpdSend(connData, buff, len);
+	if (s->margin >= 0) _metrics_line(connData, "sample_margin_x100", s->margin);
+	_metrics_line(connData, "sample_shortened", s->shortened);
+	_metrics_line(connData, "sample_lengthened", s->lengthened);
+}
+
+/*
+ * @brief Boot, sensor and sampler lines.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_device(HttpdConnData *connData) {
+	struct DhtStats *stats = dht_stats();
+
+	_metrics_boot(connData);
+	_metrics_line(connData, "uptime_us", system_get_time());
+	_metrics_line(connData, "heap_free", system_get_free_heap_size());
+	_metrics_line(connData, "dht_reads", stats->reads);
+	_metrics_line(connData, "dht_errors", stats->errors);
+	_metrics_line(connData, "dht_timeouts", stats->timeouts);
+	_metrics_line(connData, "dht_short_frames", stats->shortFrames);
+	_metrics_line(connData, "dht_bad_checksums", stats->checksums);
+	_metrics_line(connData, "dht_outliers", stats->outliers);
+	_metrics_line(connData, "dht_retries", stats->retries);
+	_metrics_line(connData, "dht_failures", stats->failures);
+	_metrics_sampler(connData);
+	_metrics_line(connData, "index_hits", web_get_hits());
+}
+
+/*
+ * @brief MQTT, CoAP and flash log lines.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_publish(HttpdConnData *connData) {
+	_metrics_line(connData, "mqtt_connected", mqtt_connected());
+	_metrics_line(connData, "mqtt_queued", mqtt_queued());
+	_metrics_line(connData, "mqtt_published", mqtt_stats()->published);
+	_metrics_line(connData, "mqtt_dropped", mqtt_stats()->dropped);
+	_metrics_line(connData, "mqtt_connects", mqtt_stats()->connects);
+	_metrics_line(connData, "mqtt_commands", mqtt_stats()->commands);
+	_metrics_line(connData, "mqtt_send_failures", mqtt_stats()->sendFailures);
+	_metrics_line(connData, "coap_requests", coap_stats()->requests);
+	_metrics_line(connData, "coap_observers", coap_stats()->observers);
+	_metrics_line(connData, "coap_notifications", coap_stats()->notifications);
+	_metrics_line(connData, "flashlog_sectors", flashlog_sectors());
+	_metrics_line(connData, "flashlog_samples", flashlog_stats()->samples);
+	_metrics_line(connData, "flashlog_writes", flashlog_stats()->writes);
+	_metrics_line(connData, "flashlog_erases", flashlog_stats()->erases);
+	_metrics_line(connData, "flashlog_errors", flashlog_stats()->errors);
+}
+
+/*
+ * @brief WiFi connection lines.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_wifi(HttpdConnData *connData) {
+	_metrics_line(connData, "wifi_connected", wifi_connected());
+	_metrics_line(connData, "wifi_connects", wifi_stats()->connects);
+	_metrics_line(connData, "wifi_disconnects", wifi_stats()->disconnects);
+	_metrics_line(connData, "wifi_attempts", wifi_stats()->attempts);
+	_metrics_line(connData, "wifi_failures", wifi_stats()->failures);
+	_metrics_line(connData, "wifi_fast_connects", wifi_stats()->fastConnects);
+	_metrics_line(connData, "wifi_ap_fallbacks", wifi_stats()->fallbacks);
+	_metrics_line(connData, "wifi_connect_ms", wifi_stats()->lastMs);
+	_metrics_line(connData, "wifi_connect_max_ms", wifi_stats()->maxMs);
+	_metrics_line(connData, "wifi_outage_ms", wifi_stats()->outageMs);
+	_metrics_line(connData, "wifi_switches", wifi_stats()->switches);
+	_metrics_line(connData, "wifi_switch_failures", wifi_stats()->switchFailures);
+	_metrics_line(connData, "wifi_switch_ms", wifi_stats()->switchMs);
+}
+
+/*
+ * @brief Web server lines: page cache, stack and admission.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_http(HttpdConnData *connData) {
+	struct PageCacheStats *pages = pagecache_stats();
+	uint32 pageRequests = pages->hits + pages->misses + pages->bypassed;
+	struct AdmitStats *admit = admit_stats();
+
+	_metrics_line(connData, "pagecache_hits", pages->hits);
+	_metrics_line(connData, "pagecache_misses", pages->misses);
+	_metrics_line(connData, "pagecache_bypassed", pages->bypassed);
+	_metrics_line(connData, "pagecache_hit_rate_pct", pageRequests ? pages->hits * 100 / pageRequests : 0);
+	_metrics_line(connData, "stack_peak", stack_stats()->peak);
+	_metrics_line(connData, "stack_exhausted", stack_stats()->exhausted);
+	_metrics_line(connData, "http_admitted_control", admit->admitted[ADMIT_CONTROL]);
+	_metrics_line(connData, "http_admitted_page", admit->admitted[ADMIT_PAGE]);
+	_metrics_line(connData, "http_admitted_asset", admit->admitted[ADMIT_ASSET]);
+	_metrics_line(connData, "http_rejected_control", admit->rejected[ADMIT_CONTROL]);
+	_metrics_line(connData, "http_rejected_page", admit->rejected[ADMIT_PAGE]);
+	_metrics_line(connData, "http_rejected_asset", admit->rejected[ADMIT_ASSET]);
+	_metrics_line(connData, "http_conn_reused", admit->reused);
+	_metrics_line(connData, "http_conn_open", admit->open);
+	_metrics_line(connData, "http_conn_peak", admit->peak);
+}
+
+static void ICACHE_FLASH_ATTR _metrics_crit_intr(HttpdConnData *connData) {
+	_metrics_line(connData, "crit_alarm_us", crit_get_alarm());
+	_metrics_crit(connData, CRIT_INTR);
+}
+
+static void ICACHE_FLASH_ATTR _metrics_crit_uart(HttpdConnData *connData) {
+	_metrics_crit(connData, CRIT_UART);
+}
+
+// Groups of /metrics, one per call, each well under the send buffer of
+// libesphttpd
+static void (*const groups[])(HttpdConnData *connData) = {
+	_metrics_device,
+	_metrics_publish,
+	_metrics_wifi,
+	_metrics_http,
+	_metrics_crit_intr,
+	_metrics_crit_uart
+};
+
+#define METRICS_GROUPS (int)(sizeof(groups) / sizeof(groups[0]))
+
+/**
+ * @brief Displays /metrics.
+ *
+ * The "crit_alarm_us" argument changes the critical section alarm threshold.
+ * Like /heap, the page is sent one group of lines per call, so it never
+ * outgrows the send buffer of libesphttpd, and the next group is kept in
+ * cgiData.
+ */
+
+int ICACHE_FLASH_ATTR metrics_cgi(HttpdConnData *connData) {
+	int next = (int)connData->cgiData;
+	struct Args args;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	if (next == 0) {
+		args_parse(&args, connData->getArgs);
+		if (args_get(&args, "crit_alarm_us") != NULL) {
+			crit_set_alarm(args_int(&args, "crit_alarm_us", 0));
+		}
+
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdEndHeaders(connData);
+	}
+
+	groups[next++](connData);
+
+	if (next < METRICS_GROUPS) {
+		connData->cgiData = (void *)next;
+		return HTTPD_CGI_MORE;
+	}
+
+	connData->cgiData = NULL;
+	boot_mark(BOOT_FIRST_RESPONSE);
+	return HTTPD_CGI_DONE;
+}
+
+/**
+ * @brief Pool usage, one line per pool and measure.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_pools(HttpdConnData *connData) {
+	char buff[160];
+	int kind, len;
+
+	for (kind = 0; kind < POOL_KINDS; kind++) {
+		struct PoolStats *s = pool_stats(kind);
+		const char *name = pool_kind_name(kind);
+
+		len = os_sprintf(buff, "pool_blocks{pool=\"%s\"} %d\npool_used{pool=\"%s\"} %u\npool_peak{pool=\"%s\"} %u\n",
+				name, pool_blocks(kind), name, (unsigned int)s->used, name, (unsigned int)s->peak);
+		httpdSend(connData, buff, len);
+		len = os_sprintf(buff, "pool_allocs{pool=\"%s\"} %u\npool_failures{pool=\"%s\"} %u\n",
+				name, (unsigned int)s->allocs, name, (unsigned int)s->failures);
+		httpdSend(connData, buff, len);
+	}
+}
+
+/**
+ * @brief Bytes held now and at most, allocations and failures of one call
+ * site.
+ */
+
+static void ICACHE_FLASH_ATTR _metrics_heap_site(HttpdConnData *connData, int i) {
+	struct HeapSite *s = heap_site(i);
+	char site[40], buff[160];
+	int len;
+
+	heap_site_name(i, site, sizeof(site));
+	len = os_sprintf(buff, "heap_site_bytes{site=\"%s\"} %u\nheap_site_peak{site=\"%s\"} %u\n",
+			site, (unsigned int)s->bytes, site, (unsigned int)s->peak);
+	httpdSend(connData, buff, len);
+	len = os_sprintf(buff, "heap_site_allocs{site=\"%s\"} %u\nheap_site_failures{site=\"%s\"} %u\n",
+			site, (unsigned int)s->allocs, site, (unsigned int)s->failures);
+	httpdSend(connData, buff, len);
+}
+
+/**
+ * @brief Displays /heap, the heap and pool diagnostics.
+ *
+ * Call sites are sent HEAP_SITES_PER_CALL at a time, the next one is kept
+ * in cgiData so nothing is allocated.
+ */
+
+#define HEAP_SITES_PER_CALL 4
+
+int ICACHE_FLASH_ATTR metrics_heap_cgi(HttpdConnData *connData) {
+	struct HeapStats *stats = heap_stats();
+	int next = (int)connData->cgiData;
+	int end;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	if (next == 0) {
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdEndHeaders(connData);
+
+		_metrics_line(connData, "heap_free", system_get_free_heap_size());
+		_metrics_line(connData, "heap_largest_free", heap_largest_free());
+		_metrics_line(connData, "heap_tracked_bytes", stats->bytes);
+		_metrics_line(connData, "heap_tracked_peak", stats->peak);
+		_metrics_line(connData, "heap_allocs", stats->allocs);
+		_metrics_line(connData, "heap_alloc_failures", stats->failures);
+		_metrics_line(connData, "heap_untracked", stats->untracked);
+		_metrics_pools(connData);
+		next = 1;
+	}
+
+	end = next - 1 + HEAP_SITES_PER_CALL;
+	for (; next - 1 < end && next - 1 < heap_site_count(); next++) {
+		_metrics_heap_site(connData, next - 1);
+	}
+
+	if (next - 1 < heap_site_count()) {
+		connData->cgiData = (void *)next;
+		return HTTPD_CGI_MORE;
+	}
+
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
+
+/**
+ * @brief Displays /stack, the handlers ranked by the stack they used.
+ *
+ * Like /heap, handlers are sent STACK_SITES_PER_CALL at a time and the
+ * rank of the next one is kept in cgiData.
+ */
+
+#define STACK_SITES_PER_CALL 6
+
+int ICACHE_FLASH_ATTR metrics_stack_cgi(HttpdConnData *connData) {
+	struct StackStats *stats = stack_stats();
+	int next = (int)connData->cgiData;
+	char buff[128];
+	int end, len;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	if (next == 0) {
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdEndHeaders(connData);
+
+		_metrics_line(connData, "stack_size", stats->size);
+		_metrics_line(connData, "stack_peak", stats->peak);
+		_metrics_line(connData, "stack_free", stats->size - stats->peak);
+		_metrics_line(connData, "stack_exhausted", stats->exhausted);
+		next = 1;
+	}
+
+	end = next - 1 + STACK_SITES_PER_CALL;
+	for (; next - 1 < end && next - 1 < stack_site_count(); next++) {
+		struct StackSite *s = stack_site(stack_site_ranked(next - 1));
+
+		len = os_sprintf(buff, "stack_handler_peak{handler=\"%s\"} %u\nstack_handler_calls{handler=\"%s\"} %u\n",
+				s->name, (unsigned int)s->peak, s->name, (unsigned int)s->calls);
+		httpdSend(connData, buff, len);
+	}
+
+	if (next - 1 < stack_site_count()) {
+		connData->cgiData = (void *)next;
+		return HTTPD_CGI_MORE;
+	}
+
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
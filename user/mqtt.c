@@ -0,0 +1,616 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file mqtt.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief MQTT 3.1.1 telemetry client.
+ *
+ * Publishes DHT samples and relay changes to the broker in MQTT_HOST, and
+ * takes relay commands from it. Under <MQTT_TOPIC>/<chip id>:
+ *
+ *   samples        {"now":up,"samples":[[up,temp,hum],...]}
+ *   relays         {"now":up,"relays":[[up,channel,on],...]}
+ *   status         "online", or "offline" from the will, retained
+ *   relay/<n>/set  "on" or "off", handled like relay.cgi
+ *
+ * up is the device uptime in seconds when the event happened, and now the
+ * uptime when the message was sent, see boot_uptime(). Samples are sent in
+ * batches of MQTT_BATCH, or every MQTT_BATCH_MS. Relay changes are sent at
+ * once.
+ *
+ * Events wait in RAM queues while the broker or the WiFi are down, and the
+ * whole queue is sent in as few TCP segments as possible on reconnect. They
+ * leave the queue only once the SDK has taken the buffer they are in. When
+ * a queue is full the oldest event is dropped. Everything is QoS 0.
+ */
+
+#include <esp8266.h>
+#include "mqtt.h"
+
+#include "boot.h"
+#include "config.h"
+#include "dht.h"
+#include "io.h"
+#include "itoa.h"
+#include "stack.h"
+
+#define MQTT_TX_SIZE 1024
+#define MQTT_RX_SIZE 256
+#define MQTT_TOPIC_SIZE 48
+// Longest sample in a batch: [4294967295,-3276.8,-3276.8],
+#define MQTT_SAMPLE_SIZE 30
+
+enum MqttState {
+	MQTT_OFF,
+	MQTT_DISCONNECTED,
+	MQTT_CONNECTING,
+	MQTT_WAIT_CONNACK,
+	MQTT_CONNECTED
+};
+
+struct mqtt_event {
+	uint32 up;
+	sint16 a;
+	sint16 b;
+};
+
+struct mqtt_queue {
+	struct mqtt_event ev[MQTT_QUEUE];
+	uint16 head;
+	uint16 count;
+};
+
+static enum MqttState state = MQTT_OFF;
+static struct espconn conn;
+static esp_tcp tcp;
+static uint32 brokerIp;
+static int brokerPort;
+static char base[MQTT_TOPIC_SIZE];
+
+// Queues and buffers, from the heap once a broker is set, see mqtt_init()
+struct mqtt_buffers {
+	struct mqtt_queue samples;
+	struct mqtt_queue relays;
+	uint8 tx[MQTT_TX_SIZE];
+	uint8 rx[MQTT_RX_SIZE];
+};
+
+static struct mqtt_queue *samples;
+static struct mqtt_queue *relays;
+static struct MqttStats stats;
+
+static uint8 *txBuf;
+static int txLen;
+static int txBusy;
+// Events and messages in txBuf, they are counted as sent when it is taken
+static int txSamples;
+static int txRelays;
+static int txPublished;
+static uint8 *rxBuf;
+static int rxLen;
+
+static int flushAll;
+static int subPending;
+static int pingPending;
+static int pingOutstanding;
+
+static ETSTimer connTimer;
+static ETSTimer dropTimer;
+static ETSTimer flushTimer;
+static ETSTimer pingTimer;
+
+static void _mqtt_pump(void);
+
+static void ICACHE_FLASH_ATTR _mqtt_push(struct mqtt_queue *q, sint16 a, sint16 b) {
+	struct mqtt_event *e;
+
+	if (q->count == MQTT_QUEUE) {
+		q->head = (q->head + 1) % MQTT_QUEUE;
+		q->count--;
+		stats.dropped++;
+	}
+
+	e = &q->ev[(q->head + q->count) % MQTT_QUEUE];
+	e->up = boot_uptime();
+	e->a = a;
+	e->b = b;
+	q->count++;
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_sample(struct DhtReading *r) {
+	_mqtt_push(samples, round_tenths(r->temperature), round_tenths(r->humidity));
+
+	if (samples->count >= MQTT_BATCH) _mqtt_pump();
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_relay(short int ch, int status) {
+	_mqtt_push(relays, ch, status);
+	_mqtt_pump();
+}
+
+/* Packets */
+
+static int ICACHE_FLASH_ATTR _mqtt_header(uint8 *p, uint8 type, int len) {
+	int n = 0;
+
+	p[n++] = type;
+
+	do {
+		uint8 b = len % 128;
+
+		len /= 128;
+		if (len) b |= 0x80;
+		p[n++] = b;
+	} while (len);
+
+	return n;
+}
+
+static int ICACHE_FLASH_ATTR _mqtt_string(uint8 *p, const char *s, int len) {
+	p[0] = len >> 8;
+	p[1] = len & 0xff;
+	os_memcpy(p + 2, s, len);
+	return len + 2;
+}
+
+/*
+ * @brief Appends a QoS 0 PUBLISH to the send buffer. Returns 1 if it does
+ * not fit.
+ */
+
+static int ICACHE_FLASH_ATTR _mqtt_publish(const char *topic, const char *payload, int len, int retain) {
+	int tlen = os_strlen(topic);
+	int rem = 2 + tlen + len;
+
+	if (txLen + 5 + rem > MQTT_TX_SIZE) return 1;
+
+	txLen += _mqtt_header(txBuf + txLen, 0x30 | (retain ? 1 : 0), rem);
+	txLen += _mqtt_string(txBuf + txLen, topic, tlen);
+	os_memcpy(txBuf + txLen, payload, len);
+	txLen += len;
+	txPublished++;
+	return 0;
+}
+
+/*
+ * @brief Appends one batch from the queue to the send buffer, after the
+ * taken events already in it. Returns 1 if it does not fit.
+ */
+
+static int ICACHE_FLASH_ATTR _mqtt_batch(struct mqtt_queue *q, const char *name, int *taken) {
+	char topic[MQTT_TOPIC_SIZE + 16];
+	char payload[MQTT_BATCH * MQTT_SAMPLE_SIZE + 40];
+	int n = q->count - *taken < MQTT_BATCH ? q->count - *taken : MQTT_BATCH;
+	int len, i;
+
+	len = os_sprintf(payload, "{\"now\":%u,\"%s\":[", (unsigned int)boot_uptime(), name);
+
+	for (i = 0; i < n; i++) {
+		struct mqtt_event *e = &q->ev[(q->head + *taken + i) % MQTT_QUEUE];
+
+		len += os_sprintf(payload + len, "%s[%u,", i ? "," : "", (unsigned int)e->up);
+
+		if (q == samples) {
+			len += itoa_tenths(e->a, payload + len);
+			payload[len++] = ',';
+			len += itoa_tenths(e->b, payload + len);
+		} else {
+			len += os_sprintf(payload + len, "%d,%d", e->a, e->b);
+		}
+
+		payload[len++] = ']';
+	}
+
+	len += os_sprintf(payload + len, "]}");
+	os_sprintf(topic, "%s/%s", base, name);
+
+	if (_mqtt_publish(topic, payload, len, 0)) return 1;
+
+	*taken += n;
+	return 0;
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_dequeue(struct mqtt_queue *q, int n) {
+	q->head = (q->head + n) % MQTT_QUEUE;
+	q->count -= n;
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_subscribe(void) {
+	char topic[MQTT_TOPIC_SIZE + 16];
+	int tlen;
+
+	// Commands: <base>/relay/<n>/set
+	tlen = os_sprintf(topic, "%s/relay/+/set", base);
+	txLen += _mqtt_header(txBuf + txLen, 0x82, 2 + 2 + tlen + 1);
+	txBuf[txLen++] = 0;
+	txBuf[txLen++] = 1;
+	txLen += _mqtt_string(txBuf + txLen, topic, tlen);
+	txBuf[txLen++] = 0;
+
+	os_sprintf(topic, "%s/status", base);
+	_mqtt_publish(topic, "online", 6, 1);
+}
+
+/*
+ * @brief Sends whatever is due, if the connection is idle.
+ *
+ * The SDK takes one buffer per connection until the sent callback, so
+ * everything due is packed into one buffer: pending control packets first,
+ * then relay changes and then full sample batches, or every sample after a
+ * reconnect or when the flush timer fires. If the SDK does not take the
+ * buffer everything stays pending, and is packed again on the next pump.
+ */
+
+static void ICACHE_FLASH_ATTR _mqtt_pump(void) {
+	if (state != MQTT_CONNECTED || txBusy) return;
+
+	txLen = 0;
+	txSamples = 0;
+	txRelays = 0;
+	txPublished = 0;
+
+	if (subPending) _mqtt_subscribe();
+
+	if (pingPending) {
+		txBuf[txLen++] = 0xc0;
+		txBuf[txLen++] = 0;
+	}
+
+	while (relays->count > txRelays && !_mqtt_batch(relays, "relays", &txRelays));
+
+	while ((samples->count - txSamples >= MQTT_BATCH || (flushAll && samples->count > txSamples))
+			&& !_mqtt_batch(samples, "samples", &txSamples));
+
+	if (!txLen) return;
+
+	if (espconn_send(&conn, txBuf, txLen) != ESPCONN_OK) {
+		os_printf("MQTT: send failed\n");
+		stats.sendFailures++;
+		return;
+	}
+
+	subPending = 0;
+	pingPending = 0;
+	_mqtt_dequeue(relays, txRelays);
+	_mqtt_dequeue(samples, txSamples);
+	if (!samples->count) flushAll = 0;
+	stats.published += txPublished;
+	txBusy = 1;
+}
+
+/* Connection */
+
+static void ICACHE_FLASH_ATTR _mqtt_connect(void *arg);
+
+static void ICACHE_FLASH_ATTR _mqtt_retry(void) {
+	state = MQTT_DISCONNECTED;
+	txBusy = 0;
+	rxLen = 0;
+	os_timer_disarm(&dropTimer);
+	os_timer_disarm(&pingTimer);
+	os_timer_disarm(&connTimer);
+	os_timer_setfn(&connTimer, _mqtt_connect, NULL);
+	os_timer_arm(&connTimer, MQTT_RECONNECT_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_drop_cb(void *arg) {
+	espconn_disconnect(&conn);
+}
+
+/*
+ * @brief Closes the connection in ms, unless it is closed or the timer
+ * disarmed before. It is reopened after MQTT_RECONNECT_MS.
+ *
+ * espconn_disconnect() must not be called from espconn callbacks, so it
+ * runs from a timer.
+ */
+
+static void ICACHE_FLASH_ATTR _mqtt_drop_in(uint32 ms) {
+	os_timer_disarm(&dropTimer);
+	os_timer_setfn(&dropTimer, _mqtt_drop_cb, NULL);
+	os_timer_arm(&dropTimer, ms, 0);
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_drop(void) {
+	_mqtt_drop_in(0);
+}
+
+/*
+ * @brief Relay command from the broker, same semantics as relay.cgi.
+ */
+
+static void ICACHE_FLASH_ATTR _mqtt_command(uint8 *topic, int tlen, uint8 *payload, int plen) {
+	char t[MQTT_TOPIC_SIZE + 24];
+	char v[8];
+	char *p;
+	int blen = os_strlen(base);
+	int ch;
+
+	if (tlen >= (int)sizeof(t) || plen >= (int)sizeof(v)) return;
+
+	os_memcpy(t, topic, tlen);
+	t[tlen] = 0;
+	os_memcpy(v, payload, plen);
+	v[plen] = 0;
+
+	if (os_strncmp(t, base, blen) || os_strncmp(t + blen, "/relay/", 7)) return;
+
+	// The channel is all digits and exists, anything else is dropped
+	p = t + blen + 7;
+	if (*p < '0' || *p > '9') return;
+	for (ch = 0; *p >= '0' && *p <= '9' && ch < IO_CHANNELS; p++) ch = ch * 10 + *p - '0';
+
+	if (ch >= IO_CHANNELS || os_strcmp(p, "/set")) return;
+
+	stats.commands++;
+	io_manual(ch, !os_strcmp(v, "on"));
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_packet(uint8 type, uint8 *p, int len) {
+	int tlen, off;
+
+	switch (type & 0xf0) {
+		case 0x20:
+			if (len < 2 || p[1] != 0) {
+				os_printf("MQTT: connection refused, code %d\n", len < 2 ? -1 : p[1]);
+				_mqtt_drop();
+				return;
+			}
+
+			os_printf("MQTT: connected\n");
+			os_timer_disarm(&dropTimer);
+			state = MQTT_CONNECTED;
+			stats.connects++;
+			subPending = 1;
+			flushAll = 1;
+			pingOutstanding = 0;
+			os_timer_arm(&pingTimer, MQTT_KEEPALIVE * 500, 1);
+			_mqtt_pump();
+			break;
+
+		case 0xd0:
+			pingOutstanding = 0;
+			break;
+
+		case 0x30:
+			if (len < 2) return;
+
+			tlen = (p[0] << 8) | p[1];
+			off = 2 + tlen + ((type & 0x06) ? 2 : 0);
+
+			if (off > len) return;
+
+			_mqtt_command(p + 2, tlen, p + off, len - off);
+			break;
+	}
+}
+
+/*
+ * @brief Splits the received data into packets.
+ *
+ * Returns the bytes used by the first complete packet, 0 if more data is
+ * needed and -1 if the packet does not fit in the receive buffer.
+ */
+
+static int ICACHE_FLASH_ATTR _mqtt_parse(void) {
+	int rem = 0, mult = 1, i = 1;
+	uint8 b;
+
+	do {
+		if (i >= rxLen) return 0;
+		if (i > 4) return -1;
+
+		b = rxBuf[i++];
+		rem += (b & 0x7f) * mult;
+		mult *= 128;
+	} while (b & 0x80);
+
+	if (i + rem > MQTT_RX_SIZE) return -1;
+	if (i + rem > rxLen) return 0;
+
+	_mqtt_packet(rxBuf[0], rxBuf + i, rem);
+	return i + rem;
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_recv(char *data, unsigned short len) {
+	while (len > 0) {
+		int n = len < MQTT_RX_SIZE - rxLen ? len : MQTT_RX_SIZE - rxLen;
+		int used;
+
+		os_memcpy(rxBuf + rxLen, data, n);
+		rxLen += n;
+		data += n;
+		len -= n;
+
+		while ((used = _mqtt_parse()) > 0) {
+			rxLen -= used;
+			os_memmove(rxBuf, rxBuf + used, rxLen);
+		}
+
+		if (used < 0) {
+			os_printf("MQTT: packet too long\n");
+			_mqtt_drop();
+			return;
+		}
+	}
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_recv_cb(void *arg, char *data, unsigned short len) {
+	STACK_CALL("mqtt_recv", _mqtt_recv(data, len));
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_sent_cb(void *arg) {
+	txBusy = 0;
+	_mqtt_pump();
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_connect_cb(void *arg) {
+	char id[16], topic[MQTT_TOPIC_SIZE + 16];
+	int idLen, tlen;
+
+	idLen = os_sprintf(id, "box-%08x", (unsigned int)system_get_chip_id());
+	tlen = os_sprintf(topic, "%s/status", base);
+
+	espconn_regist_recvcb(&conn, _mqtt_recv_cb);
+	espconn_regist_sentcb(&conn, _mqtt_sent_cb);
+
+	// Clean session, a retained "offline" will, keep alive in seconds
+	txLen = _mqtt_header(txBuf, 0x10, 10 + 2 + idLen + 2 + tlen + 2 + 7);
+	txLen += _mqtt_string(txBuf + txLen, "MQTT", 4);
+	txBuf[txLen++] = 4;
+	txBuf[txLen++] = 0x26;
+	txBuf[txLen++] = MQTT_KEEPALIVE >> 8;
+	txBuf[txLen++] = MQTT_KEEPALIVE & 0xff;
+	txLen += _mqtt_string(txBuf + txLen, id, idLen);
+	txLen += _mqtt_string(txBuf + txLen, topic, tlen);
+	txLen += _mqtt_string(txBuf + txLen, "offline", 7);
+
+	state = MQTT_WAIT_CONNACK;
+
+	if (espconn_send(&conn, txBuf, txLen) == ESPCONN_OK) {
+		txBusy = 1;
+		// A broker that takes the connection but never answers
+		_mqtt_drop_in(MQTT_CONNACK_MS);
+	} else {
+		_mqtt_drop();
+	}
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_disconnect_cb(void *arg) {
+	os_printf("MQTT: disconnected\n");
+	_mqtt_retry();
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_reconnect_cb(void *arg, sint8 err) {
+	os_printf("MQTT: connection error %d\n", err);
+	_mqtt_retry();
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_connect(void *arg) {
+	if (wifi_station_get_connect_status() != STATION_GOT_IP) {
+		_mqtt_retry();
+		return;
+	}
+
+	os_memset(&conn, 0, sizeof(conn));
+	os_memset(&tcp, 0, sizeof(tcp));
+	conn.type = ESPCONN_TCP;
+	conn.state = ESPCONN_NONE;
+	conn.proto.tcp = &tcp;
+	tcp.local_port = espconn_port();
+	tcp.remote_port = brokerPort;
+	os_memcpy(tcp.remote_ip, &brokerIp, 4);
+
+	espconn_regist_connectcb(&conn, _mqtt_connect_cb);
+	espconn_regist_reconcb(&conn, _mqtt_reconnect_cb);
+	espconn_regist_disconcb(&conn, _mqtt_disconnect_cb);
+
+	state = MQTT_CONNECTING;
+
+	if (espconn_connect(&conn) != ESPCONN_OK) _mqtt_retry();
+}
+
+/*
+ * @brief Keep alive. A broker that does not answer a ping before the next
+ * one is due is considered gone.
+ */
+
+static void ICACHE_FLASH_ATTR _mqtt_ping_cb(void *arg) {
+	if (pingOutstanding) {
+		os_printf("MQTT: broker not answering\n");
+		_mqtt_drop();
+		return;
+	}
+
+	pingOutstanding = 1;
+	pingPending = 1;
+	_mqtt_pump();
+}
+
+static void ICACHE_FLASH_ATTR _mqtt_flush_cb(void *arg) {
+	flushAll = 1;
+	_mqtt_pump();
+}
+
+/*
+ * @brief Starts the MQTT client, host is the broker IP address.
+ *
+ * Does nothing if host is empty, and then the queues and buffers take no
+ * RAM. Samples and relay changes are queued from now on, even if the broker
+ * can not be reached yet.
+ */
+
+void ICACHE_FLASH_ATTR mqtt_init(const char *host, int port) {
+	struct mqtt_buffers *buf;
+
+	if (host == NULL || host[0] == 0 || samples != NULL) return;
+
+	brokerIp = ipaddr_addr(host);
+	brokerPort = port;
+
+	if (brokerIp == 0xffffffff) {
+		os_printf("MQTT: %s is not an IP address\n", host);
+		return;
+	}
+
+	buf = (struct mqtt_buffers *)os_zalloc(sizeof(struct mqtt_buffers));
+	if (buf == NULL) {
+		os_printf("MQTT: out of memory\n");
+		return;
+	}
+
+	samples = &buf->samples;
+	relays = &buf->relays;
+	txBuf = buf->tx;
+	rxBuf = buf->rx;
+
+	os_sprintf(base, "%s/%08x", MQTT_TOPIC, (unsigned int)system_get_chip_id());
+
+	dht_subscribe(_mqtt_sample);
+	io_subscribe(_mqtt_relay);
+
+	os_timer_disarm(&pingTimer);
+	os_timer_setfn(&pingTimer, _mqtt_ping_cb, NULL);
+	os_timer_disarm(&flushTimer);
+	os_timer_setfn(&flushTimer, _mqtt_flush_cb, NULL);
+	os_timer_arm(&flushTimer, MQTT_BATCH_MS, 1);
+
+	_mqtt_connect(NULL);
+}
+
+/*
+ * @brief Returns 1 once the broker has accepted the connection.
+ */
+
+int ICACHE_FLASH_ATTR mqtt_connected(void) {
+	return state == MQTT_CONNECTED;
+}
+
+/*
+ * @brief Events waiting to be published.
+ */
+
+int ICACHE_FLASH_ATTR mqtt_queued(void) {
+	return samples != NULL ? samples->count + relays->count : 0;
+}
+
+struct MqttStats *ICACHE_FLASH_ATTR mqtt_stats(void) {
+	return &stats;
+}
@@ -0,0 +1,285 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file pagecache.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the cache of rendered templates.
+ *
+ * pagecache_cgi() is used instead of cgiEspFsTemplate, with the same
+ * template callback as argument. A page is rendered once into RAM, and
+ * requests for the same url and query string are answered from there
+ * until the data it shows changes: a reading, good or not, a relay or a
+ * saved config. Tokens that must be rendered on every request, like the
+ * hit counter, are marked by their callback with pagecache_live().
+ *
+ * Templates call pagecache_send() instead of httpdSend(), so what they
+ * write while the page is rendered goes to the cache. Pages over
+ * PAGECACHE_BYTES are left to cgiEspFsTemplate. Bodies are kept as they
+ * are, there is no deflate on the device to gzip them.
+ */
+
+#include <esp8266.h>
+#include "pagecache.h"
+
+#include <espfs.h>
+#include <httpdespfs.h>
+
+#include "dht.h"
+#include "io.h"
+
+// Longest token of a template
+#define PAGECACHE_TOKEN 32
+
+struct PageCacheEntry {
+	char key[PAGECACHE_KEY];
+	uint32 generation;
+	uint32 used;
+	// Set if the page did not fit, it is bypassed until the next generation
+	uint8 bypass;
+	uint8 lives;
+	uint16 len;
+	uint16 liveAt[PAGECACHE_LIVE];
+	char liveToken[PAGECACHE_LIVE][16];
+	char body[PAGECACHE_BYTES];
+};
+
+static struct PageCacheStats stats;
+static struct PageCacheEntry pages[PAGECACHE_PAGES];
+static uint32 bumps;
+static uint32 useTick;
+// Connection the templates write to while a page is rendered
+static HttpdConnData renderConn;
+static struct PageCacheEntry *rendering;
+static int overflow;
+
+/*
+ * @brief Changes with every reading and with every bump.
+ */
+
+static uint32 ICACHE_FLASH_ATTR _pagecache_generation(void) {
+	return bumps + dht_stats()->reads;
+}
+
+static void ICACHE_FLASH_ATTR _pagecache_relay_changed(short int ch, int status) {
+	pagecache_bump();
+}
+
+/*
+ * @brief Starts following relay changes, readings are seen in the DHT
+ * counters.
+ */
+
+void ICACHE_FLASH_ATTR pagecache_init(void) {
+	io_subscribe(_pagecache_relay_changed);
+}
+
+/*
+ * @brief Drops every rendered page, call it when something they show
+ * changes.
+ */
+
+void ICACHE_FLASH_ATTR pagecache_bump(void) {
+	bumps++;
+}
+
+static void ICACHE_FLASH_ATTR _pagecache_append(const char *data, int len) {
+	if (rendering->len + len > PAGECACHE_BYTES) {
+		overflow = 1;
+		return;
+	}
+
+	os_memcpy(rendering->body + rendering->len, data, len);
+	rendering->len += len;
+}
+
+/*
+ * @brief httpdSend() for template callbacks.
+ */
+
+int ICACHE_FLASH_ATTR pagecache_send(HttpdConnData *connData, const char *data, int len) {
+	if (connData != &renderConn) return httpdSend(connData, data, len);
+
+	if (len < 0) len = os_strlen(data);
+	_pagecache_append(data, len);
+	return !overflow;
+}
+
+/*
+ * @brief Marks token as rendered on every request.
+ *
+ * Returns 1 if the page is being rendered for the cache, the callback must
+ * then return without sending anything.
+ */
+
+int ICACHE_FLASH_ATTR pagecache_live(HttpdConnData *connData, const char *token) {
+	struct PageCacheEntry *e = rendering;
+
+	if (connData != &renderConn) return 0;
+
+	if (e->lives == PAGECACHE_LIVE || os_strlen(token) >= sizeof(e->liveToken[0])) {
+		overflow = 1;
+		return 1;
+	}
+
+	e->liveAt[e->lives] = e->len;
+	os_strcpy(e->liveToken[e->lives++], token);
+	return 1;
+}
+
+/*
+ * @brief Renders the template of connData into e, returns 1 if it did not
+ * fit.
+ *
+ * Same syntax as cgiEspFsTemplate: %token% is replaced by the callback and
+ * %% is a %.
+ */
+
+static int ICACHE_FLASH_ATTR _pagecache_render(struct PageCacheEntry *e, HttpdConnData *connData, char *args) {
+	TplCallback tpl = (TplCallback)connData->cgiArg;
+	char buff[64], token[PAGECACHE_TOKEN];
+	EspFsFile *file = espFsOpen(connData->url);
+	void *arg = NULL;
+	int n, i, t = -1;
+
+	if (file == NULL) return 1;
+
+	renderConn = *connData;
+	renderConn.getArgs = args;
+	rendering = e;
+	overflow = 0;
+	e->len = 0;
+	e->lives = 0;
+
+	while (!overflow && (n = espFsRead(file, buff, sizeof(buff))) > 0) {
+		for (i = 0; i < n && !overflow; i++) {
+			if (t < 0) {
+				if (buff[i] == '%') {
+					t = 0;
+				} else {
+					_pagecache_append(&buff[i], 1);
+				}
+			} else if (buff[i] != '%') {
+				if (t == PAGECACHE_TOKEN - 1) overflow = 1;
+				token[t++] = buff[i];
+			} else if (t == 0) {
+				_pagecache_append("%", 1);
+				t = -1;
+			} else {
+				token[t] = 0;
+				tpl(&renderConn, token, &arg);
+				t = -1;
+			}
+		}
+	}
+
+	espFsClose(file);
+	rendering = NULL;
+
+	// A % left open is not a token
+	if (t >= 0) overflow = 1;
+
+	return overflow;
+}
+
+/*
+ * @brief Entry for key, the one holding it or else the least recently used.
+ */
+
+static struct PageCacheEntry *ICACHE_FLASH_ATTR _pagecache_entry(const char *key) {
+	struct PageCacheEntry *e = &pages[0];
+	int i;
+
+	for (i = 0; i < PAGECACHE_PAGES; i++) {
+		if (!os_strcmp(pages[i].key, key)) return &pages[i];
+		if (pages[i].used < e->used) e = &pages[i];
+	}
+
+	os_strcpy(e->key, key);
+	e->generation = _pagecache_generation() - 1;
+	return e;
+}
+
+static int ICACHE_FLASH_ATTR _pagecache_bypass(HttpdConnData *connData) {
+	stats.bypassed++;
+	connData->cgi = cgiEspFsTemplate;
+	return cgiEspFsTemplate(connData);
+}
+
+/**
+ * @brief Serves a template from the cache, rendering it if it changed.
+ */
+
+int ICACHE_FLASH_ATTR pagecache_cgi(HttpdConnData *connData) {
+	TplCallback tpl = (TplCallback)connData->cgiArg;
+	char key[PAGECACHE_KEY], args[PAGECACHE_KEY];
+	struct PageCacheEntry *e;
+	uint32 generation = _pagecache_generation();
+	void *arg = NULL;
+	int i, pos;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	args[0] = 0;
+	if (connData->getArgs != NULL) {
+		if (os_strlen(connData->getArgs) >= sizeof(args)) return _pagecache_bypass(connData);
+		os_strcpy(args, connData->getArgs);
+	}
+
+	i = os_strlen(connData->url);
+	if (i + 1 + os_strlen(args) >= sizeof(key)) return _pagecache_bypass(connData);
+	os_memcpy(key, connData->url, i);
+	key[i] = '?';
+	os_strcpy(key + i + 1, args);
+
+	e = _pagecache_entry(key);
+	e->used = ++useTick;
+
+	if (e->generation != generation) {
+		stats.misses++;
+		e->generation = generation;
+		e->bypass = _pagecache_render(e, connData, args);
+	} else if (!e->bypass) {
+		stats.hits++;
+	}
+
+	if (e->bypass) return _pagecache_bypass(connData);
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+	httpdEndHeaders(connData);
+
+	for (pos = 0, i = 0; i < e->lives; i++) {
+		if (e->liveAt[i] > pos) httpdSend(connData, e->body + pos, e->liveAt[i] - pos);
+		tpl(connData, e->liveToken[i], &arg);
+		pos = e->liveAt[i];
+	}
+
+	if (e->len > pos) httpdSend(connData, e->body + pos, e->len - pos);
+	tpl(connData, NULL, &arg);
+	return HTTPD_CGI_DONE;
+}
+
+struct PageCacheStats *ICACHE_FLASH_ATTR pagecache_stats(void) {
+	stats.generation = _pagecache_generation();
+	return &stats;
+}
@@ -0,0 +1,126 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file pool.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the fixed size block pools.
+ *
+ * Objects that come and go with connections or scans are taken from static
+ * pools instead of the heap. With only about 40 KB of heap, short lived
+ * allocations between the long lived ones of the SDK and httpd fragment it
+ * until a new connection can not be allocated. Each pool is an array of
+ * equal blocks and a bitmap of the free ones, so allocating and freeing
+ * never fail for lack of a big enough hole and take constant time.
+ */
+
+#include <esp8266.h>
+
+#include "pool.h"
+
+struct Pool {
+	uint8 *mem;
+	uint16 size;
+	uint16 count;
+	// Bit i set if block i is free
+	uint32 free;
+	struct PoolStats stats;
+};
+
+static uint32 cursorMem[POOL_CURSORS * POOL_CURSOR_SIZE / 4];
+static uint32 apMem[POOL_APS * POOL_AP_SIZE / 4];
+
+static struct Pool pools[POOL_KINDS] = {
+	{(uint8 *)cursorMem, POOL_CURSOR_SIZE, POOL_CURSORS},
+	{(uint8 *)apMem, POOL_AP_SIZE, POOL_APS}
+};
+
+static const char *names[POOL_KINDS] = {"cursor", "ap"};
+
+/*
+ * @brief Marks every block free.
+ */
+
+void ICACHE_FLASH_ATTR pool_init(void) {
+	int kind;
+
+	for (kind = 0; kind < POOL_KINDS; kind++) {
+		struct Pool *p = &pools[kind];
+
+		p->free = p->count == 32 ? 0xffffffff : (1u << p->count) - 1;
+		os_memset(&p->stats, 0, sizeof(p->stats));
+	}
+}
+
+/*
+ * @brief Takes a zeroed block of at least size bytes, NULL if the pool is
+ * empty or its blocks are smaller.
+ */
+
+void *ICACHE_FLASH_ATTR pool_alloc(enum PoolKind kind, int size) {
+	struct Pool *p = &pools[kind];
+	int i;
+
+	if (size > p->size || p->free == 0) {
+		if (size > p->size) os_printf("Pool %s: %d bytes asked, blocks are %d\n", names[kind], size, p->size);
+		p->stats.failures++;
+		return NULL;
+	}
+
+	for (i = 0; !(p->free & (1u << i)); i++);
+
+	p->free &= ~(1u << i);
+	p->stats.allocs++;
+	if (++p->stats.used > p->stats.peak) p->stats.peak = p->stats.used;
+
+	os_memset(p->mem + i * p->size, 0, p->size);
+	return p->mem + i * p->size;
+}
+
+/*
+ * @brief Gives a block back. NULL is ignored, like os_free() does.
+ */
+
+void ICACHE_FLASH_ATTR pool_free(enum PoolKind kind, void *ptr) {
+	struct Pool *p = &pools[kind];
+	int offset = (uint8 *)ptr - p->mem;
+	int i = offset / p->size;
+
+	if (ptr == NULL) return;
+
+	if ((uint8 *)ptr < p->mem || i >= p->count || offset % p->size || (p->free & (1u << i))) {
+		os_printf("Pool %s: bad free of %p\n", names[kind], ptr);
+		return;
+	}
+
+	p->free |= 1u << i;
+	p->stats.used--;
+}
+
+struct PoolStats *ICACHE_FLASH_ATTR pool_stats(enum PoolKind kind) {
+	return &pools[kind].stats;
+}
+
+const char *ICACHE_FLASH_ATTR pool_kind_name(enum PoolKind kind) {
+	return names[kind];
+}
+
+int ICACHE_FLASH_ATTR pool_blocks(enum PoolKind kind) {
+	return pools[kind].count;
+}
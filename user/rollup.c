@@ -0,0 +1,292 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file rollup.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Minimum, maximum and mean of the readings over 1 minute, 15 minutes
+ * and 1 hour.
+ *
+ * Each tier is a ring of buckets, one per period of uptime, so the last
+ * ROLLUP_HOURS hours are there at 1 hour resolution, the last
+ * ROLLUP_QUARTERS quarters at 15 minutes and so on. Every good reading
+ * updates the current bucket of each tier in place, and a bucket is cleared
+ * when its ring comes back to it. Nothing is recomputed from raw samples.
+ *
+ * Buckets keep the mean rather than the sum, so they fit in 14 bytes. Only
+ * the newest bucket of a ring still takes readings, and the sums for its
+ * mean are kept once per ring.
+ *
+ * /rollup sends one tier as CSV, a day of hourly buckets is under 1 KB. It
+ * is lost on reset.
+ */
+
+#include <esp8266.h>
+#include "rollup.h"
+
+#include "args.h"
+#include "boot.h"
+#include "config.h"
+#include "dht.h"
+#include "itoa.h"
+#include "pool.h"
+
+// CSV lines sent by each call of the CGI
+#define ROLLUP_CGI_LINES 6
+
+struct RollupRing {
+	uint32 period;
+	int len;
+	struct RollupBucket *buckets;
+	uint32 newest;
+	int used;
+	// Sums of the newest bucket
+	sint32 tsum;
+	sint32 hsum;
+};
+
+// State of one /rollup response, between calls of the CGI
+struct RollupCursor {
+	enum RollupTier tier;
+	int i;
+};
+
+static struct RollupBucket minutes[ROLLUP_MINUTES];
+static struct RollupBucket quarters[ROLLUP_QUARTERS];
+static struct RollupBucket hours[ROLLUP_HOURS];
+
+static struct RollupRing rings[ROLLUP_TIERS] = {
+	{60, ROLLUP_MINUTES, minutes},
+	{900, ROLLUP_QUARTERS, quarters},
+	{3600, ROLLUP_HOURS, hours}
+};
+
+static const char *names[ROLLUP_TIERS] = {"1m", "15m", "1h"};
+
+/*
+ * @brief Moves the ring on to the bucket of period idx, clearing the buckets
+ * of the periods in between.
+ */
+
+static void ICACHE_FLASH_ATTR _rollup_advance(struct RollupRing *r, uint32 idx) {
+	uint32 gap, k;
+
+	if (r->used == 0) {
+		os_memset(&r->buckets[idx % r->len], 0, sizeof(struct RollupBucket));
+		r->newest = idx;
+		r->used = 1;
+		r->tsum = r->hsum = 0;
+		return;
+	}
+
+	if (idx <= r->newest) return;
+
+	r->tsum = r->hsum = 0;
+
+	gap = idx - r->newest;
+	for (k = 1; k <= gap && k <= r->len; k++) {
+		os_memset(&r->buckets[(r->newest + k) % r->len], 0, sizeof(struct RollupBucket));
+	}
+
+	r->newest = idx;
+	r->used = gap >= r->len - r->used ? r->len : r->used + gap;
+}
+
+/*
+ * @brief Mean of sum over count, rounded, in tenths.
+ */
+
+static int ICACHE_FLASH_ATTR _rollup_mean(sint32 sum, int count) {
+	return sum >= 0 ? (sum + count / 2) / count : (sum - count / 2) / count;
+}
+
+/*
+ * @brief Adds one reading to the current bucket of every tier.
+ */
+
+void ICACHE_FLASH_ATTR rollup_add(uint32 up, sint16 temp, sint16 hum) {
+	int tier;
+
+	for (tier = 0; tier < ROLLUP_TIERS; tier++) {
+		struct RollupRing *r = &rings[tier];
+		uint32 idx = up / r->period;
+		struct RollupBucket *b;
+
+		_rollup_advance(r, idx);
+		if (idx < r->newest) continue;
+
+		b = &r->buckets[idx % r->len];
+
+		if (b->count == 0) {
+			b->tmin = b->tmax = temp;
+			b->hmin = b->hmax = hum;
+		}
+
+		if (temp < b->tmin) b->tmin = temp;
+		if (temp > b->tmax) b->tmax = temp;
+		if (hum < b->hmin) b->hmin = hum;
+		if (hum > b->hmax) b->hmax = hum;
+		if (b->count == 0xffff) continue;
+
+		r->tsum += temp;
+		r->hsum += hum;
+		b->count++;
+		b->tmean = _rollup_mean(r->tsum, b->count);
+		b->hmean = _rollup_mean(r->hsum, b->count);
+	}
+}
+
+static void ICACHE_FLASH_ATTR _rollup_sample(struct DhtReading *r) {
+	rollup_add(boot_uptime(), round_tenths(r->temperature), round_tenths(r->humidity));
+}
+
+/*
+ * @brief Starts rolling up good readings.
+ */
+
+void ICACHE_FLASH_ATTR rollup_init(void) {
+	dht_subscribe(_rollup_sample);
+}
+
+/*
+ * @brief Buckets of a tier, including empty ones.
+ */
+
+int ICACHE_FLASH_ATTR rollup_count(enum RollupTier tier) {
+	return rings[tier].used;
+}
+
+/*
+ * @brief Length of the period of a tier, in seconds.
+ */
+
+uint32 ICACHE_FLASH_ATTR rollup_period(enum RollupTier tier) {
+	return rings[tier].period;
+}
+
+/*
+ * @brief Copies bucket i of a tier, 0 is the oldest, and sets start to the
+ * uptime its period starts at. Returns 1 if there is no such bucket.
+ */
+
+int ICACHE_FLASH_ATTR rollup_get(enum RollupTier tier, int i, uint32 *start, struct RollupBucket *b) {
+	struct RollupRing *r = &rings[tier];
+	uint32 idx;
+
+	if (i < 0 || i >= r->used) return 1;
+
+	idx = r->newest - r->used + 1 + i;
+	*start = idx * r->period;
+	*b = r->buckets[idx % r->len];
+	return 0;
+}
+
+static int ICACHE_FLASH_ATTR _rollup_line(char *buff, uint32 start, struct RollupBucket *b) {
+	int len;
+
+	len = os_sprintf(buff, "%u,%u,", (unsigned int)start, (unsigned int)b->count);
+	len += itoa_tenths(b->tmin, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(b->tmean, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(b->tmax, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(b->hmin, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(b->hmean, buff + len);
+	buff[len++] = ',';
+	len += itoa_tenths(b->hmax, buff + len);
+	buff[len++] = '\n';
+	return len;
+}
+
+/**
+ * @brief Streams /rollup, the buckets of one tier as CSV.
+ *
+ * "res" selects the tier, 1m, 15m or 1h (15m by default), and "n" the
+ * number of newest periods to send. Periods without readings are left out.
+ */
+
+int ICACHE_FLASH_ATTR rollup_cgi(HttpdConnData *connData) {
+	struct RollupCursor *c = connData->cgiData;
+	struct RollupBucket b;
+	char buff[ROLLUP_CGI_LINES * 64];
+	uint32 start;
+	int len = 0, lines = 0;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		if (c != NULL) pool_free(POOL_CURSOR, c);
+		return HTTPD_CGI_DONE;
+	}
+
+	if (c == NULL) {
+		struct Args args;
+		const char *res;
+		int tier = ROLLUP_15M;
+		int n;
+
+		args_parse(&args, connData->getArgs);
+		res = args_get(&args, "res");
+		if (res != NULL) {
+			for (tier = 0; tier < ROLLUP_TIERS && os_strcmp(res, names[tier]); tier++);
+
+			if (tier == ROLLUP_TIERS) {
+				httpdStartResponse(connData, 400);
+				httpdEndHeaders(connData);
+				httpdSend(connData, "res must be 1m, 15m or 1h\n", -1);
+				return HTTPD_CGI_DONE;
+			}
+		}
+
+		c = pool_alloc(POOL_CURSOR, sizeof(struct RollupCursor));
+		if (c == NULL) {
+			httpdStartResponse(connData, 503);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		connData->cgiData = c;
+		c->tier = tier;
+
+		n = args_int(&args, "n", -1);
+		if (n >= 0 && n < rings[tier].used) c->i = rings[tier].used - n;
+
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/csv");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdEndHeaders(connData);
+		httpdSend(connData, "start_s,count,t_min,t_mean,t_max,h_min,h_mean,h_max\n", -1);
+		return HTTPD_CGI_MORE;
+	}
+
+	while (lines < ROLLUP_CGI_LINES && !rollup_get(c->tier, c->i, &start, &b)) {
+		c->i++;
+		if (b.count == 0) continue;
+
+		len += _rollup_line(buff + len, start, &b);
+		lines++;
+	}
+
+	if (len > 0) httpdSend(connData, buff, len);
+	if (lines == ROLLUP_CGI_LINES) return HTTPD_CGI_MORE;
+
+	pool_free(POOL_CURSOR, c);
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
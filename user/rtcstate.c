@@ -0,0 +1,190 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file rtcstate.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing runtime state kept in RTC memory.
+ *
+ * RTC user memory survives every reset except a power cycle, so the last DHT
+ * sample, relay state, manual override deadlines and counters are mirrored
+ * there. After a soft reset they are restored before the web server starts,
+ * the page shows valid data at once and relays keep their state. Flash is
+ * never touched.
+ */
+
+#include <esp8266.h>
+
+#include "rtcstate.h"
+#include "dht.h"
+#include "io.h"
+#include "action.h"
+#include "web.h"
+#include "config.h"
+
+//Debug 1 = on
+#define DEBUG 0
+
+// First RTC user memory block, blocks are 4 bytes long and user blocks
+// start at 64.
+#define RTC_STATE_BLOCK 64
+#define RTC_STATE_MAGIC 0x52544331
+
+struct rtc_state {
+	uint32 magic;
+	uint32 checksum;
+	struct DhtReading reading;
+	struct DhtStats stats;
+	uint32 relays;
+	// Relays turned on by a rule
+	uint32 latched;
+	uint32 deadline[IO_CHANNELS];
+	uint32 hits;
+};
+
+static int warmBoot = 0;
+static int restoring = 0;
+
+/*
+ * @brief Checksum of everything after the checksum field.
+ */
+
+static uint32 ICACHE_FLASH_ATTR _rtcstate_checksum(struct rtc_state *state) {
+	uint32 *word = (uint32 *)&state->reading;
+	uint32 *end = (uint32 *)(state + 1);
+	uint32 sum = RTC_STATE_MAGIC;
+
+	while (word < end) {
+		sum = ((sum << 5) | (sum >> 27)) ^ *word++;
+	}
+
+	return sum;
+}
+
+/*
+ * @brief RTC time, in RTC clock cycles, ms milliseconds from now.
+ *
+ * The RTC counter keeps running across soft resets, unlike system_get_time(),
+ * so deadlines stored with it are still valid after a reboot. 0 is never
+ * returned, callers use it as "no deadline".
+ */
+
+uint32 ICACHE_FLASH_ATTR rtcstate_deadline(uint32 ms) {
+	uint32 cali = system_rtc_clock_cali_proc();
+	uint32 deadline = system_get_rtc_time() + (uint32)((((uint64)ms * 1000) << 12) / cali);
+
+	return deadline ? deadline : 1;
+}
+
+/*
+ * @brief Milliseconds left until deadline, 0 if it has already passed.
+ */
+
+uint32 ICACHE_FLASH_ATTR rtcstate_remaining(uint32 deadline) {
+	uint32 cali = system_rtc_clock_cali_proc();
+	int32 cycles = (int32)(deadline - system_get_rtc_time());
+
+	if (cycles <= 0) return 0;
+
+	return (uint32)((((uint64)cycles * cali) >> 12) / 1000);
+}
+
+/*
+ * @brief Returns 1 if runtime state was restored from RTC memory.
+ */
+
+int ICACHE_FLASH_ATTR rtcstate_warm() {
+	return warmBoot;
+}
+
+/*
+ * @brief Mirror runtime state into RTC memory.
+ *
+ * Called every time a new sample is read or a relay changes. 
+ */
+
+void ICACHE_FLASH_ATTR rtcstate_save() {
+	struct rtc_state state;
+	short int ch;
+
+	if (restoring) return;
+
+	os_memset(&state, 0, sizeof(state));
+	state.magic = RTC_STATE_MAGIC;
+	state.reading = *dht_read(0);
+	state.stats = *dht_stats();
+	state.relays = io_get_mask();
+	state.latched = action_get_latched();
+	state.hits = web_get_hits();
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		state.deadline[ch] = io_timer_deadline(ch);
+	}
+
+	state.checksum = _rtcstate_checksum(&state);
+
+	if (!system_rtc_mem_write(RTC_STATE_BLOCK, &state, sizeof(state))) {
+		os_printf("Error writing RTC memory\n");
+	}
+}
+
+/*
+ * @brief Restore runtime state after a soft reset.
+ *
+ * Must run before io_init(), so relays are driven straight to their previous
+ * state, and before httpdInit(). State is ignored after a power cycle or if
+ * the checksum does not match.
+ */
+
+void ICACHE_FLASH_ATTR rtcstate_init() {
+	struct rtc_state state;
+	struct rst_info *rst = system_get_rst_info();
+
+	warmBoot = 0;
+
+	if (rst != NULL && rst->reason == REASON_DEFAULT_RST) {
+		os_printf("Power on, RTC state not restored\n");
+		return;
+	}
+
+	if (!system_rtc_mem_read(RTC_STATE_BLOCK, &state, sizeof(state))) {
+		os_printf("Error reading RTC memory\n");
+		return;
+	}
+
+	if (state.magic != RTC_STATE_MAGIC || state.checksum != _rtcstate_checksum(&state)) {
+		os_printf("No valid RTC state found\n");
+		return;
+	}
+
+	restoring = 1;
+	dht_restore(&state.reading, &state.stats);
+	io_restore(state.relays, state.deadline);
+	action_restore(state.latched);
+	web_set_hits(state.hits);
+	restoring = 0;
+
+	warmBoot = 1;
+	os_printf("RTC state restored; relays: %x, sample valid: %d\n", (unsigned int)state.relays, (int)state.reading.success);
+
+#if DEBUG
+	os_printf("RTC state; Temp = %d, Hum = %d, reads: %d\n", (int)(state.reading.temperature * 100),
+				(int)(state.reading.humidity * 100), (int)state.stats.reads);
+#endif
+}
@@ -0,0 +1,193 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file sampler.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Time between DHT readings, chosen from the readings themselves.
+ *
+ * After every good reading the next one is set as far away as it can be
+ * without missing a relay decision. Changes are counted in steps, SAMPLE_HUM_STEP
+ * of humidity or SAMPLE_TEMP_STEP of temperature, and the interval is the
+ * shortest of:
+ *
+ *  - the time the signal takes to move one step at its last rate of change,
+ *  - the time it takes to reach the nearest threshold, over SAMPLE_AHEAD,
+ *  - POOLTIME while it is within SAMPLE_NEAR steps of a threshold,
+ *
+ * kept between the limits given to sampler_init(). It is shortened at once
+ * and at most doubled from one reading to the next, so a single quiet
+ * reading in a spike does not stretch it. Channels that are off are not
+ * looked at. The interval and the term that chose it are in sampler_stats().
+ */
+
+#include <esp8266.h>
+
+#include "sampler.h"
+#include "config.h"
+#include "dht.h"
+
+// A change the relays could care about
+#define SAMPLE_HUM_STEP  1.0f
+#define SAMPLE_TEMP_STEP 0.5f
+// Readings wanted before the signal can reach a threshold at its rate
+#define SAMPLE_AHEAD 4
+#define SAMPLE_NEAR  3.0f
+
+static const char *reasonNames[SAMPLE_REASONS] = {"start", "stable", "change", "threshold"};
+
+static struct SamplerStats stats;
+static uint32 minMs;
+static uint32 maxMs;
+static struct DhtReading last;
+static uint32 lastTime;
+
+/*
+ * @brief Distance from a to b, in steps.
+ */
+
+static float ICACHE_FLASH_ATTR _sampler_steps(float a, float b, float step) {
+	float d = (a - b) / step;
+
+	return d < 0 ? -d : d;
+}
+
+/*
+ * @brief Steps from the reading to the nearest threshold of the channels
+ * that are on automatic, -1 if there is none.
+ */
+
+static float ICACHE_FLASH_ATTR _sampler_margin(struct DhtReading *r) {
+	struct config conf = config_read();
+	float margin = -1, m;
+	short int ch;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		if (conf.ch[ch].off) continue;
+
+		m = _sampler_steps(r->humidity, conf.ch[ch].hum, SAMPLE_HUM_STEP);
+		if (margin < 0 || m < margin) margin = m;
+
+		m = _sampler_steps(r->temperature, conf.ch[ch].temp, SAMPLE_TEMP_STEP);
+		if (m < margin) margin = m;
+	}
+
+	return margin;
+}
+
+/*
+ * @brief Chooses the interval to the next reading and sets it.
+ */
+
+static void ICACHE_FLASH_ATTR _sampler_reading(struct DhtReading *r) {
+	uint32 now = system_get_time();
+	float margin = _sampler_margin(r);
+	float rate, target, t;
+	uint32 ms;
+	enum SampleReason reason = SAMPLE_STABLE;
+
+	if (!last.success) {
+		last = *r;
+		lastTime = now;
+		return;
+	}
+
+	// Steps per millisecond since the last reading
+	t = (now - lastTime) / 1000.0f;
+	rate = _sampler_steps(r->humidity, last.humidity, SAMPLE_HUM_STEP);
+	if (_sampler_steps(r->temperature, last.temperature, SAMPLE_TEMP_STEP) > rate) {
+		rate = _sampler_steps(r->temperature, last.temperature, SAMPLE_TEMP_STEP);
+	}
+	rate /= t < 1 ? 1 : t;
+
+	last = *r;
+	lastTime = now;
+
+	target = maxMs;
+
+	if (rate > 0) {
+		if (1 / rate < target) {
+			target = 1 / rate;
+			reason = SAMPLE_CHANGE;
+		}
+
+		if (margin >= 0 && margin / (SAMPLE_AHEAD * rate) < target) {
+			target = margin / (SAMPLE_AHEAD * rate);
+			reason = SAMPLE_THRESHOLD;
+		}
+	}
+
+	if (margin >= 0 && margin < SAMPLE_NEAR && target > POOLTIME) {
+		target = POOLTIME;
+		reason = SAMPLE_THRESHOLD;
+	}
+
+	if (target > 2.0f * stats.interval) target = 2.0f * stats.interval;
+
+	// In tenths of a second, the time a reading takes does not move it
+	ms = (uint32)(target / 100 + 0.5f) * 100;
+	if (ms > maxMs) ms = maxMs;
+	if (ms < minMs) ms = minMs;
+
+	if (ms < stats.interval) stats.shortened++;
+	if (ms > stats.interval) stats.lengthened++;
+
+	stats.interval = ms;
+	stats.reason = reason;
+	stats.rate = (uint32)(rate * 60000 * 100);
+	stats.margin = margin < 0 ? -1 : (sint32)(margin * 100);
+
+	dht_interval(stats.interval);
+}
+
+/**
+ * @brief Starts choosing the interval, between min and max milliseconds.
+ *
+ * Equal limits give a fixed interval. POOLTIME is used until there are two
+ * readings to compare.
+ */
+
+void ICACHE_FLASH_ATTR sampler_init(uint32 min, uint32 max) {
+	minMs = min;
+	maxMs = max;
+	last.success = 0;
+
+	stats.interval = POOLTIME < min ? min : POOLTIME > max ? max : POOLTIME;
+	stats.reason = SAMPLE_START;
+	stats.margin = -1;
+
+	dht_interval(stats.interval);
+	dht_subscribe(_sampler_reading);
+}
+
+/**
+ * @brief Current interval, why it was chosen and how often it changed.
+ */
+
+struct SamplerStats *ICACHE_FLASH_ATTR sampler_stats(void) {
+	return &stats;
+}
+
+/**
+ * @brief Name of a reason, as shown in /metrics and /state.json.
+ */
+
+const char *ICACHE_FLASH_ATTR sampler_reason_name(enum SampleReason reason) {
+	return reason < SAMPLE_REASONS ? reasonNames[reason] : "";
+}
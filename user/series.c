@@ -0,0 +1,188 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file series.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief Compressed encoding of a series of samples.
+ *
+ * Each sample is coded against the previous one: the timestamp as a delta
+ * of delta, so samples taken at a steady rate cost nothing, and temperature
+ * and humidity as deltas. Every sample starts with a tag byte:
+ *
+ *   bits 7-6  delta of delta of the time: 0, +1 s, -1 s, or 3 if a
+ *             zig-zag varint follows
+ *   bits 5-3  temperature delta + 3, for deltas from -3 to +3 tenths, or 7
+ *             if a zig-zag varint follows
+ *   bits 2-0  humidity delta, like the temperature
+ *
+ * Varints follow the tag in that order, 7 bits per byte, low bits first.
+ * Zig-zag maps small negative numbers to small positive ones, -1 is 1, 1 is
+ * 2. A DHT22 read every 30 s almost always fits in the tag alone, one byte
+ * per sample instead of 8.
+ *
+ * The first sample of a series is not encoded, it is given to
+ * series_start() and stored raw by the caller.
+ */
+
+#include <esp8266.h>
+
+#include "history.h"
+#include "series.h"
+
+#define SERIES_ESCAPE 7
+#define SERIES_TIME_ESCAPE 3
+
+static uint32 ICACHE_FLASH_ATTR _series_zigzag(sint32 v) {
+	return ((uint32)v << 1) ^ (uint32)(v >> 31);
+}
+
+static sint32 ICACHE_FLASH_ATTR _series_unzigzag(uint32 v) {
+	return (sint32)(v >> 1) ^ -(sint32)(v & 1);
+}
+
+static int ICACHE_FLASH_ATTR _series_put(uint8 *out, sint32 v) {
+	uint32 z = _series_zigzag(v);
+	int n = 0;
+
+	while (z >= 0x80) {
+		out[n++] = (z & 0x7f) | 0x80;
+		z >>= 7;
+	}
+
+	out[n++] = z;
+	return n;
+}
+
+/*
+ * @brief Reads one varint, returns its length or 0 if it is cut short.
+ */
+
+static int ICACHE_FLASH_ATTR _series_get(const uint8 *in, int len, sint32 *v) {
+	uint32 z = 0;
+	int n = 0;
+
+	do {
+		if (n >= len || n == 5) return 0;
+		z |= (uint32)(in[n] & 0x7f) << (7 * n);
+	} while (in[n++] & 0x80);
+
+	*v = _series_unzigzag(z);
+	return n;
+}
+
+/*
+ * @brief Code of a value delta in the tag, SERIES_ESCAPE if it needs a
+ * varint.
+ */
+
+static int ICACHE_FLASH_ATTR _series_code(sint32 d) {
+	return d >= -3 && d <= 3 ? d + 3 : SERIES_ESCAPE;
+}
+
+/*
+ * @brief Starts a series, later samples are coded against first.
+ */
+
+void ICACHE_FLASH_ATTR series_start(struct SeriesState *st, const struct HistorySample *first) {
+	st->up = first->up;
+	st->delta = 0;
+	st->temp = first->temp;
+	st->hum = first->hum;
+}
+
+/*
+ * @brief Encodes s into out, which must hold SERIES_MAX_BYTES. Returns the
+ * length of the encoding.
+ */
+
+int ICACHE_FLASH_ATTR series_encode(struct SeriesState *st, const struct HistorySample *s, uint8 *out) {
+	sint32 delta = (sint32)(s->up - st->up);
+	sint32 dod = delta - st->delta;
+	sint32 dt = s->temp - st->temp;
+	sint32 dh = s->hum - st->hum;
+	int time, temp, hum;
+	int n = 1;
+
+	time = dod == 0 ? 0 : dod == 1 ? 1 : dod == -1 ? 2 : SERIES_TIME_ESCAPE;
+	temp = _series_code(dt);
+	hum = _series_code(dh);
+
+	out[0] = (time << 6) | (temp << 3) | hum;
+	if (time == SERIES_TIME_ESCAPE) n += _series_put(out + n, dod);
+	if (temp == SERIES_ESCAPE) n += _series_put(out + n, dt);
+	if (hum == SERIES_ESCAPE) n += _series_put(out + n, dh);
+
+	st->up = s->up;
+	st->delta = delta;
+	st->temp = s->temp;
+	st->hum = s->hum;
+	return n;
+}
+
+/*
+ * @brief Decodes the next sample from in into s.
+ *
+ * Returns the bytes used, or 0 if in ends before the sample does. st is
+ * only updated when a whole sample is decoded, so a stream can be decoded
+ * as it arrives.
+ */
+
+int ICACHE_FLASH_ATTR series_decode(struct SeriesState *st, const uint8 *in, int len, struct HistorySample *s) {
+	sint32 dod, dt, dh;
+	int time, temp, hum;
+	int n = 1, m;
+
+	if (len < 1) return 0;
+
+	time = in[0] >> 6;
+	temp = (in[0] >> 3) & 7;
+	hum = in[0] & 7;
+
+	if (time == SERIES_TIME_ESCAPE) {
+		if ((m = _series_get(in + n, len - n, &dod)) == 0) return 0;
+		n += m;
+	} else {
+		dod = time == 2 ? -1 : time;
+	}
+
+	if (temp == SERIES_ESCAPE) {
+		if ((m = _series_get(in + n, len - n, &dt)) == 0) return 0;
+		n += m;
+	} else {
+		dt = temp - 3;
+	}
+
+	if (hum == SERIES_ESCAPE) {
+		if ((m = _series_get(in + n, len - n, &dh)) == 0) return 0;
+		n += m;
+	} else {
+		dh = hum - 3;
+	}
+
+	st->delta += dod;
+	st->up += st->delta;
+	st->temp += dt;
+	st->hum += dh;
+
+	s->up = st->up;
+	s->temp = st->temp;
+	s->hum = st->hum;
+	return n;
+}
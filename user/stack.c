@@ -0,0 +1,208 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file stack.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the stack high-water monitor.
+ *
+ * Every callback of the SDK runs on the one stack that grows down from the
+ * top of RAM, an overflow silently overwrites what lies below it. At boot
+ * the free part is painted with a pattern, and handlers run between
+ * stack_enter() and stack_exit(). On exit the paint is looked for from the
+ * end of the stack up: the first word that was overwritten is the deepest
+ * the handler went, including the interrupts that came while it ran. Only
+ * the overwritten words are painted again, so the cost follows the use.
+ *
+ * What runs between handlers, the SDK itself and its network stack, is
+ * counted as the first site, from the top of the stack.
+ */
+
+#include <esp8266.h>
+
+#include "stack.h"
+
+#define STACK_PAINT 0xa5a5a5a5
+// Left unpainted below the caller, the frames of stack.c live there
+#define STACK_MARGIN 128
+
+#ifdef __ets__
+// Below the stack is the data of the ROM
+#define _STACK_BOTTOM(top) ((uint32 *)0x3fffe000)
+#else
+#define _STACK_BOTTOM(top) ((top) - STACK_HOST_BYTES / 4)
+#endif
+
+#define _STACK_FRAME() ((uint32 *)__builtin_frame_address(0))
+#define _STACK_FREE(frame) ((frame) - STACK_MARGIN / 4)
+
+struct StackLevel {
+	int site;
+	uint32 *sp;
+	uint32 *low;
+};
+
+static struct StackStats stats;
+static struct StackSite sites[STACK_SITES];
+static int siteCount;
+static struct StackLevel levels[STACK_LEVELS];
+static int level;
+static uint32 *top;
+static uint32 *bottom;
+
+static void ICACHE_FLASH_ATTR _stack_paint(uint32 *from, uint32 *to) {
+	while (from < to) *from++ = STACK_PAINT;
+}
+
+/*
+ * @brief Deepest word in use, the first one above the end of the stack that
+ * is not paint.
+ */
+
+static uint32 *ICACHE_FLASH_ATTR _stack_low(uint32 *limit) {
+	uint32 *p = bottom;
+
+	while (p < limit && *p == STACK_PAINT) p++;
+	return p;
+}
+
+/*
+ * @brief Index of the site of name, added if it is new.
+ */
+
+static int ICACHE_FLASH_ATTR _stack_site(const char *name) {
+	int i;
+
+	for (i = 0; i < siteCount; i++) {
+		if (sites[i].name == name || !os_strcmp(sites[i].name, name)) return i;
+	}
+
+	if (siteCount == STACK_SITES) return 0;
+
+	sites[siteCount].name = name;
+	return siteCount++;
+}
+
+static void ICACHE_FLASH_ATTR _stack_record(int site, uint32 *sp, uint32 *low) {
+	struct StackSite *s = &sites[site];
+	uint32 bytes = sp > low ? (sp - low) * 4 : 0;
+
+	s->calls++;
+	if (bytes > s->peak) s->peak = bytes;
+
+	bytes = top > low ? (top - low) * 4 : 0;
+	if (bytes > stats.peak) stats.peak = bytes;
+	if (low == bottom) stats.exhausted++;
+}
+
+/*
+ * @brief Paints the stack below the caller, call it first in user_init().
+ */
+
+void ICACHE_FLASH_ATTR stack_init(void) {
+	top = _STACK_FRAME();
+	bottom = _STACK_BOTTOM(top);
+
+	os_memset(&stats, 0, sizeof(stats));
+	os_memset(sites, 0, sizeof(sites));
+	sites[0].name = "sdk";
+	siteCount = 1;
+	level = 0;
+
+	stats.size = (top - bottom) * 4;
+	_stack_paint(bottom, _STACK_FREE(top));
+}
+
+/*
+ * @brief Starts following the handler name, a string that outlives it.
+ *
+ * Handlers can be nested, the outer one counts what the inner one used.
+ */
+
+void ICACHE_FLASH_ATTR stack_enter(const char *name) {
+	uint32 *sp = _STACK_FRAME();
+	uint32 *low;
+
+	if (bottom == NULL) return;
+
+	if (level == 0) {
+		low = _stack_low(_STACK_FREE(sp));
+		_stack_record(0, top, low);
+		_stack_paint(low, _STACK_FREE(sp));
+	}
+
+	if (level < STACK_LEVELS) {
+		levels[level].site = _stack_site(name);
+		levels[level].sp = sp;
+		levels[level].low = sp;
+	}
+
+	level++;
+}
+
+/*
+ * @brief Ends the handler of the last stack_enter().
+ */
+
+void ICACHE_FLASH_ATTR stack_exit(void) {
+	uint32 *sp = _STACK_FRAME();
+	struct StackLevel *l;
+	uint32 *low;
+
+	if (bottom == NULL || level == 0) return;
+	if (--level >= STACK_LEVELS) return;
+
+	l = &levels[level];
+	low = _stack_low(_STACK_FREE(sp));
+	if (l->low < low) low = l->low;
+
+	_stack_record(l->site, l->sp, low);
+	if (level > 0 && low < levels[level - 1].low) levels[level - 1].low = low;
+	_stack_paint(low, _STACK_FREE(sp));
+}
+
+struct StackStats *ICACHE_FLASH_ATTR stack_stats(void) {
+	return &stats;
+}
+
+int ICACHE_FLASH_ATTR stack_site_count(void) {
+	return siteCount;
+}
+
+struct StackSite *ICACHE_FLASH_ATTR stack_site(int i) {
+	return &sites[i];
+}
+
+/*
+ * @brief Index of the site with the rank-th deepest use, 0 is the worst.
+ */
+
+int ICACHE_FLASH_ATTR stack_site_ranked(int rank) {
+	int i, j, above;
+
+	for (i = 0; i < siteCount; i++) {
+		for (above = 0, j = 0; j < siteCount; j++) {
+			if (sites[j].peak > sites[i].peak || (sites[j].peak == sites[i].peak && j < i)) above++;
+		}
+
+		if (above == rank) return i;
+	}
+
+	return -1;
+}
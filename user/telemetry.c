@@ -0,0 +1,198 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file telemetry.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the /telemetry endpoint.
+ *
+ * The last sample, the relay states and the counters, for collectors that
+ * poll many devices. The same data is served as JSON or as a packed binary
+ * record of TELEMETRY_SIZE bytes, little endian:
+ *
+ *   offset  size  field
+ *        0     1  magic, 0x42
+ *        1     1  version, 1
+ *        2     2  length of the whole record
+ *        4     4  uptime, seconds
+ *        8     2  temperature, signed tenths of degree
+ *       10     2  humidity, tenths of percent
+ *       12     1  1 if the last read succeeded
+ *       13     1  number of relay channels
+ *       14     4  relay states, bit n is channel n
+ *       18     4  DHT reads
+ *       22     4  DHT errors
+ *       26     4  free heap, bytes
+ *       30     4  index page hits
+ *
+ * New fields are only ever appended and the length grows with them, so a
+ * decoder can skip what it does not know. The version changes only if the
+ * meaning of an existing field does.
+ *
+ * The binary form is sent if the request has format=bin, or an Accept header
+ * with application/octet-stream and no format argument. JSON otherwise.
+ */
+
+#include <esp8266.h>
+#include "telemetry.h"
+
+#include "args.h"
+#include "boot.h"
+#include "config.h"
+#include "dht.h"
+#include "io.h"
+#include "itoa.h"
+#include "web.h"
+
+/*
+ * @brief Fills t with the current state of the device.
+ */
+
+void ICACHE_FLASH_ATTR telemetry_collect(struct Telemetry *t) {
+	struct DhtReading *r = dht_read(0);
+	struct DhtStats *s = dht_stats();
+	int i;
+
+	t->uptime = boot_uptime();
+	t->temp = round_tenths(r->temperature);
+	t->hum = round_tenths(r->humidity);
+	t->ok = r->success ? 1 : 0;
+	t->channels = IO_CHANNELS;
+	t->relays = 0;
+	for (i = 0; i < IO_CHANNELS; i++) {
+		if (io_get_status(i)) t->relays |= 1 << i;
+	}
+	t->reads = s->reads;
+	t->errors = s->errors;
+	t->heap = system_get_free_heap_size();
+	t->hits = web_get_hits();
+}
+
+static uint8 * ICACHE_FLASH_ATTR _telemetry_put(uint8 *p, uint32 v, int size) {
+	while (size--) {
+		*p++ = v & 0xff;
+		v >>= 8;
+	}
+
+	return p;
+}
+
+/*
+ * @brief Writes the binary record of t into buff, which must hold
+ * TELEMETRY_SIZE bytes. Returns the length.
+ */
+
+int ICACHE_FLASH_ATTR telemetry_encode(struct Telemetry *t, uint8 *buff) {
+	uint8 *p = buff;
+
+	*p++ = TELEMETRY_MAGIC;
+	*p++ = TELEMETRY_VERSION;
+	p = _telemetry_put(p, TELEMETRY_SIZE, 2);
+	p = _telemetry_put(p, t->uptime, 4);
+	p = _telemetry_put(p, (uint16)t->temp, 2);
+	p = _telemetry_put(p, t->hum, 2);
+	*p++ = t->ok;
+	*p++ = t->channels;
+	p = _telemetry_put(p, t->relays, 4);
+	p = _telemetry_put(p, t->reads, 4);
+	p = _telemetry_put(p, t->errors, 4);
+	p = _telemetry_put(p, t->heap, 4);
+	p = _telemetry_put(p, t->hits, 4);
+
+	return p - buff;
+}
+
+/*
+ * @brief Writes the JSON form of t into buff, which must hold
+ * TELEMETRY_JSON_MAX bytes. Returns the length.
+ */
+
+int ICACHE_FLASH_ATTR telemetry_json(struct Telemetry *t, char *buff) {
+	int len, i;
+
+	len = os_sprintf(buff, "{\"v\":%d,\"up\":%u,\"t\":", TELEMETRY_VERSION, (unsigned int)t->uptime);
+	len += itoa_tenths(t->temp, buff + len);
+	len += os_sprintf(buff + len, ",\"h\":");
+	len += itoa_tenths(t->hum, buff + len);
+	len += os_sprintf(buff + len, ",\"ok\":%d,\"relays\":[", t->ok);
+	for (i = 0; i < t->channels; i++) {
+		len += os_sprintf(buff + len, "%s%d", i ? "," : "", (int)((t->relays >> i) & 1));
+	}
+	len += os_sprintf(buff + len, "],\"reads\":%u,\"errors\":%u,\"heap\":%u,\"hits\":%u}",
+			(unsigned int)t->reads, (unsigned int)t->errors, (unsigned int)t->heap, (unsigned int)t->hits);
+
+	return len;
+}
+
+/*
+ * @brief Returns 1 if the client asked for the binary form.
+ */
+
+static int ICACHE_FLASH_ATTR _telemetry_binary(HttpdConnData *connData) {
+	struct Args args;
+	const char *format;
+	char buff[64];
+
+	args_parse(&args, connData->getArgs);
+	format = args_get(&args, "format");
+	if (format != NULL) return os_strcmp(format, "bin") == 0;
+
+	if (httpdGetHeader(connData, "Accept", buff, sizeof(buff))) {
+		return os_strstr(buff, "application/octet-stream") != NULL;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Displays /telemetry.
+ */
+
+int ICACHE_FLASH_ATTR telemetry_cgi(HttpdConnData *connData) {
+	struct Telemetry t;
+	char buff[TELEMETRY_JSON_MAX];
+	char length[8];
+	int binary, len;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	binary = _telemetry_binary(connData);
+	telemetry_collect(&t);
+
+	if (binary) {
+		len = telemetry_encode(&t, (uint8 *)buff);
+	} else {
+		len = telemetry_json(&t, buff);
+	}
+
+	os_sprintf(length, "%d", len);
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", binary ? "application/octet-stream" : "application/json");
+	httpdHeader(connData, "Content-Length", length);
+	httpdHeader(connData, "Vary", "Accept");
+	httpdHeader(connData, "Cache-Control", "no-cache");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+
+	return HTTPD_CGI_DONE;
+}
@@ -0,0 +1,223 @@
+/****************************************************************************
+ * Copyright (C) 2016 by Carlos Martin Ugalde and Ignacio Ripoll García     *
+ *                                                                          *
+ * This file is part of Box.                                                *
+ *                                                                          *
+ *   Box is free software: you can redistribute it and/or modify it         *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   Box is distributed in the hope that it will be useful,                 *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with Box.  If not, see <http://www.gnu.org/licenses/>.   *
+ ****************************************************************************/
+
+/**
+ * @file ui.c
+ * @author Carlos Martin Ugalde and Ignacio Ripoll García
+ * @brief File containing the single page UI and the /state.json it reads.
+ *
+ * The UI is ui/app.html with its style sheets and scripts inlined by
+ * ui/bundle.sh and gzipped at build time into html/app.html.gz. It is sent
+ * as it is stored, with Content-Encoding gzip, so the device never
+ * decompresses it, and read from the filesystem UI_CHUNK bytes per call.
+ *
+ * The ETag is a hash of the bundle, worked out on the first request, so a
+ * browser keeps the page across visits and only revalidates it with a 304
+ * until the firmware changes. Everything that changes lives in
+ * /state.json, which is small and never cached.
+ */
+
+#include <esp8266.h>
+#include "ui.h"
+
+#include <espfs.h>
+#include "boot.h"
+#include "config.h"
+#include "io.h"
+#include "itoa.h"
+#include "sampler.h"
+#include "telemetry.h"
+#include "web.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+static char etag[12];
+
+/*
+ * @brief Hashes the bundle into etag. Returns 1 if it can not be read.
+ */
+
+static int ICACHE_FLASH_ATTR _ui_etag(char *name) {
+	EspFsFile *f = espFsOpen(name);
+	uint32 hash = FNV_OFFSET;
+	char buff[64];
+	int len, i;
+
+	if (f == NULL) {
+		os_printf("ui: %s not found\n", name);
+		return 1;
+	}
+
+	while ((len = espFsRead(f, buff, sizeof(buff))) > 0) {
+		for (i = 0; i < len; i++) hash = (hash ^ (uint8)buff[i]) * FNV_PRIME;
+	}
+	espFsClose(f);
+
+	os_sprintf(etag, "\"%08x\"", (unsigned int)hash);
+	return 0;
+}
+
+/*
+ * @brief Starts the answer to a bundle request. Returns the open file, or
+ * NULL if the answer is already complete.
+ */
+
+static EspFsFile *ICACHE_FLASH_ATTR _ui_start(HttpdConnData *connData) {
+	char *name = (char *)connData->cgiArg;
+	char buff[64];
+	EspFsFile *f;
+
+	if (etag[0] == 0 && _ui_etag(name)) {
+		httpdStartResponse(connData, 404);
+		httpdEndHeaders(connData);
+		return NULL;
+	}
+
+	web_set_hits(web_get_hits() + 1);
+
+	if (httpdGetHeader(connData, "If-None-Match", buff, sizeof(buff)) && !os_strcmp(buff, etag)) {
+		httpdStartResponse(connData, 304);
+		httpdHeader(connData, "ETag", etag);
+		httpdEndHeaders(connData);
+		return NULL;
+	}
+
+	// Only the gzipped form is stored
+	if (!httpdGetHeader(connData, "Accept-Encoding", buff, sizeof(buff)) || os_strstr(buff, "gzip") == NULL) {
+		httpdStartResponse(connData, 406);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdEndHeaders(connData);
+		httpdSend(connData, "Needs gzip, the plain pages are at /index.tpl\n", -1);
+		return NULL;
+	}
+
+	f = espFsOpen(name);
+	if (f == NULL) {
+		httpdStartResponse(connData, 404);
+		httpdEndHeaders(connData);
+		return NULL;
+	}
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/html");
+	httpdHeader(connData, "Content-Encoding", "gzip");
+	httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+	httpdHeader(connData, "ETag", etag);
+	httpdEndHeaders(connData);
+
+	return f;
+}
+
+/**
+ * @brief Sends the UI bundle named by the cgi arg.
+ */
+
+int ICACHE_FLASH_ATTR ui_cgi(HttpdConnData *connData) {
+	EspFsFile *f = connData->cgiData;
+	char buff[UI_CHUNK];
+	int len;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		if (f != NULL) espFsClose(f);
+		return HTTPD_CGI_DONE;
+	}
+
+	if (f == NULL) {
+		f = _ui_start(connData);
+		if (f == NULL) return HTTPD_CGI_DONE;
+		connData->cgiData = f;
+	}
+
+	len = espFsRead(f, buff, UI_CHUNK);
+	if (len > 0) httpdSend(connData, buff, len);
+	if (len == UI_CHUNK) return HTTPD_CGI_MORE;
+
+	espFsClose(f);
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
+
+/*
+ * @brief Writes s as a JSON string into buff. Returns the length.
+ */
+
+static int ICACHE_FLASH_ATTR _ui_string(const uint8 *s, int max, char *buff) {
+	int len = 0, i;
+
+	buff[len++] = '"';
+	for (i = 0; i < max && s[i]; i++) {
+		if (s[i] < 0x20) continue;
+		if (s[i] == '"' || s[i] == '\\') buff[len++] = '\\';
+		buff[len++] = s[i];
+	}
+	buff[len++] = '"';
+
+	return len;
+}
+
+/**
+ * @brief Displays /state.json, everything the UI shows.
+ */
+
+int ICACHE_FLASH_ATTR ui_cgi_state(HttpdConnData *connData) {
+	static struct station_config stconf;
+	struct config conf;
+	struct Telemetry t;
+	char buff[UI_STATE_MAX];
+	int len, i;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	telemetry_collect(&t);
+	conf = config_read();
+	wifi_station_get_config(&stconf);
+
+	len = os_sprintf(buff, "{\"up\":%u,\"t\":", (unsigned int)t.uptime);
+	len += itoa_tenths(t.temp, buff + len);
+	len += os_sprintf(buff + len, ",\"h\":");
+	len += itoa_tenths(t.hum, buff + len);
+	len += os_sprintf(buff + len, ",\"ok\":%d,\"reads\":%u,\"hits\":%u,\"sample\":{\"ms\":%u,\"why\":\"%s\"},\"relays\":[",
+			t.ok, (unsigned int)t.reads, (unsigned int)t.hits,
+			(unsigned int)sampler_stats()->interval, sampler_reason_name(sampler_stats()->reason));
+
+	for (i = 0; i < IO_CHANNELS; i++) {
+		len += os_sprintf(buff + len, "%s{\"on\":%d,\"off\":%d,\"hum\":%d,\"temp\":%d,\"time\":%d}",
+				i ? "," : "", io_get_status(i) ? 1 : 0, conf.ch[i].off ? 1 : 0,
+				conf.ch[i].hum, conf.ch[i].temp, conf.ch[i].time);
+	}
+
+	len += os_sprintf(buff + len, "],\"wifi\":{\"mode\":%d,\"ssid\":", wifi_get_opmode());
+	len += _ui_string(stconf.ssid, sizeof(stconf.ssid), buff + len);
+	len += os_sprintf(buff + len, ",\"connected\":%d}}",
+			wifi_station_get_connect_status() == STATION_GOT_IP);
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "application/json");
+	httpdHeader(connData, "Cache-Control", "no-cache");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+
+	boot_mark(BOOT_FIRST_RESPONSE);
+	return HTTPD_CGI_DONE;
+}
@@ -29,32 +29,133 @@
 #include "action.h"
 #include "config.h"
 #include "stdout.h"
+#include "rtcstate.h"
+#include "boot.h"
+#include "metrics.h"
+#include "mqtt.h"
+#include "coap.h"
+#include "history.h"
+#include "telemetry.h"
+#include "flashlog.h"
+#include "rollup.h"
+#include "chart.h"
+#include "pool.h"
+#include "stack.h"
+#include "pagecache.h"
+#include "ui.h"
+#include "admit.h"
+#include "sampler.h"
+
+/*
+ * Handlers run through these wrappers, so the stack they use is followed
+ * by stack.c. Routes are also admitted by admit.c, cls is their priority.
+ * A route that hands the connection to another cgi is done with as far as
+ * admission goes.
+ */
+
+#define ROUTE_CGI(fn, cls) static int ICACHE_FLASH_ATTR fn##_route(HttpdConnData *connData) { \
+	int r; \
+	if (!admit_begin(connData, cls)) return HTTPD_CGI_DONE; \
+	stack_enter(#fn); \
+	r = fn(connData); \
+	stack_exit(); \
+	admit_end(connData, r != HTTPD_CGI_MORE || connData->cgi != fn##_route); \
+	return r; \
+}
+
+#define STACK_TPL(fn) static void ICACHE_FLASH_ATTR fn##_stack(HttpdConnData *connData, char *token, void **arg) { \
+	STACK_CALL(#fn, fn(connData, token, arg)); \
+}
+
+ROUTE_CGI(cgiRedirect, ADMIT_PAGE)
+ROUTE_CGI(cgiEspFsHook, ADMIT_ASSET)
+ROUTE_CGI(cgiEspFsTemplate, ADMIT_PAGE)
+ROUTE_CGI(pagecache_cgi, ADMIT_PAGE)
+ROUTE_CGI(ui_cgi, ADMIT_PAGE)
+ROUTE_CGI(ui_cgi_state, ADMIT_PAGE)
+STACK_TPL(web_tpl_index)
+STACK_TPL(web_tpl_settings)
+STACK_TPL(web_tpl_relay_config)
+ROUTE_CGI(web_cgi_relay_config, ADMIT_CONTROL)
+ROUTE_CGI(web_cgi_config, ADMIT_CONTROL)
+ROUTE_CGI(web_cgi_relay, ADMIT_CONTROL)
+ROUTE_CGI(metrics_cgi, ADMIT_PAGE)
+ROUTE_CGI(metrics_heap_cgi, ADMIT_PAGE)
+ROUTE_CGI(metrics_stack_cgi, ADMIT_PAGE)
+ROUTE_CGI(telemetry_cgi, ADMIT_PAGE)
+ROUTE_CGI(flashlog_cgi, ADMIT_ASSET)
+ROUTE_CGI(rollup_cgi, ADMIT_PAGE)
+ROUTE_CGI(chart_cgi, ADMIT_ASSET)
+ROUTE_CGI(webwifi_cgi_scan, ADMIT_PAGE)
+STACK_TPL(webwifi_tpl)
+ROUTE_CGI(webwifi_cgi_connect, ADMIT_CONTROL)
+ROUTE_CGI(webwifi_cgi_set_mode, ADMIT_CONTROL)
 
 HttpdBuiltInUrl builtInUrls[]={
-	{"/", cgiRedirect, "/index.tpl"},
-	{"/index.tpl", cgiEspFsTemplate, web_tpl_index},
-	{"/settings.tpl", cgiEspFsTemplate, web_tpl_settings},
-	{"/relayconfig.tpl", cgiEspFsTemplate, web_tpl_relay_config},
-	{"/relayconfig.cgi", web_cgi_relay_config, NULL},
-	{"/relay.cgi", web_cgi_relay, NULL},
+	{"/", ui_cgi_route, "/app.html.gz"},
+	{"/state.json", ui_cgi_state_route, NULL},
+	{"/index.tpl", pagecache_cgi_route, web_tpl_index_stack},
+	{"/settings.tpl", cgiEspFsTemplate_route, web_tpl_settings_stack},
+	{"/relayconfig.tpl", pagecache_cgi_route, web_tpl_relay_config_stack},
+	{"/relayconfig.cgi", web_cgi_relay_config_route, NULL},
+	{"/config", web_cgi_config_route, NULL},
+	{"/relay.cgi", web_cgi_relay_route, NULL},
+	{"/metrics", metrics_cgi_route, NULL},
+	{"/heap", metrics_heap_cgi_route, NULL},
+	{"/stack", metrics_stack_cgi_route, NULL},
+	{"/telemetry", telemetry_cgi_route, NULL},
+	{"/log.csv", flashlog_cgi_route, NULL},
+	{"/rollup", rollup_cgi_route, NULL},
+	{"/chart.svg", chart_cgi_route, NULL},
 
 	//Routines to make the /wifi URL and everything beneath it work.
-	{"/wifi", cgiRedirect, "/wifi/wifi.tpl"},
-	{"/wifi/", cgiRedirect, "/wifi/wifi.tpl"},
-	{"/wifi/wifiscan.cgi", webwifi_cgi_scan, NULL},
-	{"/wifi/wifi.tpl", cgiEspFsTemplate, webwifi_tpl},
-	{"/wifi/connect.cgi", webwifi_cgi_connect},
-	{"/wifi/setmode.cgi", webwifi_cgi_set_mode, NULL},
-
-	{"*", cgiEspFsHook, NULL}, //Catch-all cgi function for the filesystem
+	{"/wifi", cgiRedirect_route, "/wifi/wifi.tpl"},
+	{"/wifi/", cgiRedirect_route, "/wifi/wifi.tpl"},
+	{"/wifi/wifiscan.cgi", webwifi_cgi_scan_route, NULL},
+	{"/wifi/wifi.tpl", cgiEspFsTemplate_route, webwifi_tpl_stack},
+	{"/wifi/connect.cgi", webwifi_cgi_connect_route},
+	{"/wifi/setmode.cgi", webwifi_cgi_set_mode_route, NULL},
+
+	{"*", cgiEspFsHook_route, NULL}, //Catch-all cgi function for the filesystem
 	{NULL, NULL, NULL}
 };
 
 
+/**
+ * @brief Initialization that is not needed to serve the first page.
+ *
+ * Runs once the SDK has finished its own init.
+ */
+
+static void ICACHE_FLASH_ATTR _user_init_done(void) {
+	wifi_init();
+	action_init();
+	mqtt_init(MQTT_HOST, MQTT_PORT);
+	flashlog_init();
+	boot_mark(BOOT_DEFERRED);
+}
+
 void user_init(void) {
+	// Paint the stack before anything else runs on it
+	stack_init();
 	stdout_init();
+	boot_init();
+	pool_init();
+	// Thresholds are needed by everything else
+	config_init();	
+	boot_mark(BOOT_CONFIG);
+	// Restore last sample and relay state after a soft reset, before relays
+	// are driven and the web server starts.
+	rtcstate_init();
 	io_init();
+	boot_mark(BOOT_IO);
+	// First reading is taken as soon as the sensor is stable
 	dht_init(SENSORTYPE, POOLTIME);
+	sampler_init(SAMPLE_MIN_MS, SAMPLE_MAX_MS);
+	history_init();
+	rollup_init();
+	pagecache_init();
+	boot_mark(BOOT_DHT);
 
 	// 0x40200000 is the base address for spi flash memory mapping, ESPFS_POS is the position
 	// where image is written in flash that is defined in Makefile.
@@ -64,10 +165,11 @@ void user_init(void) {
 	espFsInit((void*)(webpages_espfs_start));
 #endif
 	httpdInit(builtInUrls, 80);
+	coap_init(COAP_PORT);
+	boot_mark(BOOT_HTTPD);
 
-        wifi_init();
-	config_init();	
-        action_init();
+	system_init_done_cb(_user_init_done);
+	boot_mark(BOOT_READY);
 	os_printf("\nESP Ready\n");
 }
 
@@ -20,16 +20,80 @@
 #include <esp8266.h>
 #include "web.h"
 
+#include "args.h"
 #include "io.h"
 #include "itoa.h"
 #include "dht.h"
 #include "config.h"
+#include "boot.h"
+#include "pagecache.h"
 
 //Debug mode 1 = on
 #define DEBUG 1 
 
 static long hitCounter = 0;
 
+/**
+ * @brief Relay channel selected by the "channel" argument, 0 if missing and
+ * -1 if it is not a channel.
+ */
+
+static short int ICACHE_FLASH_ATTR _web_channel(struct Args *args) {
+	int ch = 0;
+
+	if (args_num(args, "channel", &ch) || ch < 0 || ch >= IO_CHANNELS) return -1;
+
+	return ch;
+}
+
+/*
+ * @brief Answers 400 with the reason, nothing has been changed.
+ */
+
+static void ICACHE_FLASH_ATTR _web_bad_request(HttpdConnData *connData, const char *reason) {
+	httpdStartResponse(connData, 400);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, reason, -1);
+}
+
+/**
+ * @brief Relay channel of a template request.
+ *
+ * Arguments can only be parsed once, so the channel is kept in the template
+ * arg, off by one as NULL means not parsed yet.
+ */
+
+static short int ICACHE_FLASH_ATTR _web_tpl_channel(HttpdConnData *connData, void **arg) {
+	struct Args args;
+	short int ch;
+
+	if (*arg == NULL) {
+		args_parse(&args, connData->getArgs);
+		ch = _web_channel(&args);
+		// Pages show the first channel, the CGIs refuse a bad one
+		*arg = (void *)(ch < 0 ? 1 : ch + 1);
+	}
+
+	return (int)*arg - 1;
+}
+
+/**
+ * @brief Number of index.tpl hits since power on.
+ */
+
+long ICACHE_FLASH_ATTR web_get_hits() {
+	return hitCounter;
+}
+
+/**
+ * @brief Restores the hit counter after a soft reset.
+ */
+
+void ICACHE_FLASH_ATTR web_set_hits(long hits) {
+	hitCounter = hits;
+}
+
 /**
  * @brief Displays settings.tpl.
  *
@@ -54,23 +118,27 @@ void ICACHE_FLASH_ATTR web_tpl_relay_config(HttpdConnData *connData, char *token
 	char buff[128];
 	char data[6];
 	struct config conf = config_read();
+	short int ch;
 
 	if (token == NULL) return;
 
+	ch = _web_tpl_channel(connData, arg);
 	os_strcpy(buff, "unknown");
 
-	if (!strcmp(token,"status")) {
-		if (conf.off) {
+	if (!strcmp(token,"channel")) {
+		os_strcpy(buff, itoa(ch, data));
+	} else if (!strcmp(token,"status")) {
+		if (conf.ch[ch].off) {
 			os_strcpy(buff, "off");
 		} else {
 			os_strcpy(buff, "on");
 		}
 	} else if (!strcmp(token, "humidity")) {
-		os_strcpy(buff, itoa(conf.hum, data));
+		os_strcpy(buff, itoa(conf.ch[ch].hum, data));
 	} else if (!strcmp(token, "temperature")) {
-		os_strcpy(buff, itoa(conf.temp, data));
+		os_strcpy(buff, itoa(conf.ch[ch].temp, data));
 	} else if (!strcmp(token, "time")) {
-		os_strcpy(buff, itoa(conf.time, data));
+		os_strcpy(buff, itoa(conf.ch[ch].time, data));
 	}
 
 # if DEBUG
@@ -78,7 +146,7 @@ void ICACHE_FLASH_ATTR web_tpl_relay_config(HttpdConnData *connData, char *token
 	os_printf("cgi_tpl_relay_config buff: %s\n", buff);
 # endif
 
-	httpdSend(connData, buff, -1);
+	pagecache_send(connData, buff, -1);
 	return;
 }
 
@@ -90,46 +158,223 @@ void ICACHE_FLASH_ATTR web_tpl_relay_config(HttpdConnData *connData, char *token
  */
 
 int ICACHE_FLASH_ATTR web_cgi_relay_config(HttpdConnData *connData) {
-	int len;
-	char buff[128];
-	struct config conf;
+	struct Args args;
+	const char *relay;
+	char buff[48];
+	struct config conf = config_read();
+	struct config_channel *rule;
+	short int ch;
+	int i, value;
 	
 	if (connData->conn == NULL) {
 		//Connection aborted. Clean up.
 		return HTTPD_CGI_DONE;
 	}
 
-	len = httpdFindArg(connData->getArgs, "relay", buff, sizeof(buff));
-	if (len) {
-		if (!os_strcmp(buff, "on")) {
-			conf.off = 0;
-		} else {
-			conf.off = 1;
-		}
+	args_parse(&args, connData->getArgs);
+	ch = _web_channel(&args);
+	if (ch < 0) {
+		_web_bad_request(connData, "channel not found\n");
+		return HTTPD_CGI_DONE;
 	}
+	rule = &conf.ch[ch];
 
-	len = httpdFindArg(connData->getArgs, "humidity", buff, sizeof(buff));
-	if (len) {
-		conf.hum = atoi(buff);
+	relay = args_get(&args, "relay");
+	if (relay != NULL) {
+		if (!os_strcmp(relay, "on")) {
+			rule->off = 0;
+		} else {
+			rule->off = 1;
+		}
 	}
 
-	len = httpdFindArg(connData->getArgs, "temperature", buff, sizeof(buff));
-	if (len) {
-		conf.temp = atoi(buff);
-	}
+	// Nothing is saved if a field is not a number or out of range
+	for (i = 0; i < CONFIG_FIELDS; i++) {
+		if (configFields[i].arg == NULL || args_get(&args, configFields[i].arg) == NULL) continue;
 
-	len = httpdFindArg(connData->getArgs, "time", buff, sizeof(buff));
-	if (len) {
-		conf.time = atoi(buff);
+		if (args_num(&args, configFields[i].arg, &value) || config_set(rule, i, value)) {
+			os_sprintf(buff, "%s must be %d to %d\n", configFields[i].arg, configFields[i].min, configFields[i].max);
+			_web_bad_request(connData, buff);
+			return HTTPD_CGI_DONE;
+		}
 	}
 
 # if DEBUG
-	os_printf("cgi_relay_config: On: %d, Hum: %d, Temp: %d, Time: %d\n", conf.off, conf.hum, conf.temp, conf.time);
+	os_printf("cgi_relay_config: On: %d, Hum: %d, Temp: %d, Time: %d\n", rule->off, rule->hum, rule->temp, rule->time);
 # endif
 
 	config_save(conf);
 
-	httpdRedirect(connData, "relayconfig.tpl");
+	os_sprintf(buff, "relayconfig.tpl?channel=%d", (int)(rule - conf.ch));
+	httpdRedirect(connData, buff);
+	return HTTPD_CGI_DONE;
+}
+
+/*
+ * @brief Writes the rules of every channel as JSON, in the form /config
+ * takes them. Returns the length.
+ */
+
+static int ICACHE_FLASH_ATTR _web_config_json(struct config *conf, char *buff) {
+	short int ch;
+	int len = 0, i;
+
+	for (ch = 0; ch < IO_CHANNELS; ch++) {
+		buff[len++] = ch ? ',' : '[';
+		for (i = 0; i < CONFIG_FIELDS; i++) {
+			len += os_sprintf(buff + len, "%c\"%s\":%d", i ? ',' : '{', configFields[i].name,
+					*config_field(&conf->ch[ch], i));
+		}
+		buff[len++] = '}';
+	}
+	buff[len++] = ']';
+	buff[len] = 0;
+
+	return len;
+}
+
+static const char *ICACHE_FLASH_ATTR _web_json_space(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+	return p;
+}
+
+/*
+ * @brief Parses the rules of a /config body onto conf, see web_cgi_config().
+ * Returns NULL, or the error with the place it was found in err.
+ */
+
+static const char *ICACHE_FLASH_ATTR _web_config_parse(const char *p, struct config *conf, char *err) {
+	char key[12];
+	short int ch = 0;
+	int i, len, value;
+
+	p = _web_json_space(p);
+	if (*p++ != '[') return "expected [";
+	p = _web_json_space(p);
+	if (*p == ']') return NULL;
+
+	for (;;) {
+		p = _web_json_space(p);
+		if (ch >= IO_CHANNELS) return "too many channels";
+
+		if (!os_strncmp(p, "null", 4)) {
+			// Channel left as it is
+			p += 4;
+		} else if (*p++ == '{') {
+			p = _web_json_space(p);
+
+			while (*p != '}') {
+				if (*p++ != '"') return "expected a field name";
+				for (len = 0; *p != '"' && *p && len < sizeof(key) - 1; len++) key[len] = *p++;
+				key[len] = 0;
+				if (*p++ != '"') return "unknown field";
+
+				for (i = 0; i < CONFIG_FIELDS && os_strcmp(key, configFields[i].name); i++);
+				os_sprintf(err, "[%d].%s", ch, key);
+				if (i == CONFIG_FIELDS) return "unknown field";
+
+				p = _web_json_space(p);
+				if (*p++ != ':') return "expected :";
+				p = _web_json_space(p);
+
+				if (!os_strncmp(p, "true", 4) || !os_strncmp(p, "false", 5)) {
+					value = *p == 't';
+					p += value ? 4 : 5;
+				} else {
+					value = 0;
+					len = *p == '-';
+					if (len) p++;
+					if (*p < '0' || *p > '9') return "expected a number";
+					while (*p >= '0' && *p <= '9' && value < 100000) value = value * 10 + *p++ - '0';
+					if (len) value = -value;
+				}
+
+				if (config_set(&conf->ch[ch], i, value)) return "out of range";
+
+				p = _web_json_space(p);
+				if (*p == ',') {
+					// A field has to follow
+					p = _web_json_space(p + 1);
+					if (*p != '"') return "expected a field name";
+				} else if (*p != '}') {
+					return "expected , or }";
+				}
+			}
+			p++;
+			err[0] = 0;
+		} else {
+			return "expected { or null";
+		}
+
+		ch++;
+		p = _web_json_space(p);
+		if (*p == ']') break;
+		if (*p++ != ',') return "expected , or ]";
+	}
+
+	if (*_web_json_space(p + 1) != 0) return "data after ]";
+
+	return NULL;
+}
+
+/**
+ * @brief Reads and sets the rules of every channel at once.
+ *
+ * GET returns them, POST takes the same JSON, for example
+ * [{"hum":70,"temp":30,"time":10,"off":0}]. Channels are in order, fields
+ * left out and channels given as null keep their value. Every field is
+ * checked against configFields and merged onto the current config, which
+ * is then saved in one write, or not at all if anything is wrong. The
+ * answer is the config in force, or 400 and the error.
+ */
+
+int ICACHE_FLASH_ATTR web_cgi_config(HttpdConnData *connData) {
+	struct config conf = config_read(), now = conf;
+	// Room for the rules or an error with its field, and the limits
+	char buff[32 + IO_CHANNELS * 56];
+	char err[24];
+	const char *error = NULL;
+	int status = 200, len;
+
+	if (connData->conn == NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+
+	err[0] = 0;
+
+	if (connData->requestType == HTTPD_METHOD_POST) {
+		if (connData->post->buff == NULL) {
+			status = 400;
+			error = "missing body";
+		} else if (connData->post->len > connData->post->buffLen) {
+			status = 413;
+			error = "body too large";
+		} else {
+			// libesphttpd ends the post buffer with a 0
+			error = _web_config_parse(connData->post->buff, &conf, err);
+			if (error != NULL) {
+				status = 400;
+			} else if (os_memcmp(&conf, &now, sizeof(conf)) && config_save(conf)) {
+				status = 500;
+				error = "flash write failed";
+				conf = config_read();
+			}
+		}
+	}
+
+	if (error != NULL) {
+		len = os_sprintf(buff, "{\"error\":\"%s%s%s\"}", err, err[0] ? " " : "", error);
+	} else {
+		len = _web_config_json(&conf, buff);
+	}
+
+	httpdStartResponse(connData, status);
+	httpdHeader(connData, "Content-Type", "application/json");
+	httpdHeader(connData, "Cache-Control", "no-cache");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+
 	return HTTPD_CGI_DONE;
 }
 
@@ -137,13 +382,17 @@ int ICACHE_FLASH_ATTR web_cgi_relay_config(HttpdConnData *connData) {
  * @brief Displays index.tpl.
  *
  * This template shows the main page. It has a counter to know how many times
- * it has been reqestel since last reboot. 
+ * it has been reqestel since last power on, it is the one token rendered on
+ * every request, the rest comes from the page cache.
  */
 
 void ICACHE_FLASH_ATTR web_tpl_index(HttpdConnData *connData, char *token, void **arg) {
-	char buff[128];
+	char buff[256];
 
-	if (token == NULL) return;
+	if (token == NULL) {
+		boot_mark(BOOT_FIRST_RESPONSE);
+		return;
+	}
 
 	struct DhtReading *dht = dht_read(0);
 
@@ -163,19 +412,34 @@ void ICACHE_FLASH_ATTR web_tpl_index(HttpdConnData *connData, char *token, void
 	} else if (!strcmp(token, "sensor_present")) {
 		os_sprintf(buff, dht->success ? "is" : "isn't");
 	} else if (!strcmp(token, "relayStatus")) {
-		int currRelayStatus = io_get_status();
+		int currRelayStatus = io_get_status(_web_tpl_channel(connData, arg));
 
 		if (currRelayStatus) {
 			os_strcpy(buff, "on");
 		} else {
 			os_strcpy(buff, "off");
 		}
+	} else if (!strcmp(token, "relays")) {
+		short int ch;
+
+		// One toggle form per channel
+		for (ch = 0; ch < IO_CHANNELS; ch++) {
+			int on = io_get_status(ch);
+			os_sprintf(buff, "<form method=\"get\" action=\"relay.cgi\"><p>Relay %d status: <b>%s</b>. "
+					"<input type=\"hidden\" name=\"channel\" value=\"%d\">"
+					"<input type=\"submit\" name=\"relay\" value=\"%s\" id=\"button\"></p></form>\n",
+					ch, on ? "on" : "off", ch, on ? "off" : "on");
+			pagecache_send(connData, buff, -1);
+		}
+
+		return;
 	} else if (!strcmp(token, "counter")) {
+		if (pagecache_live(connData, token)) return;
 		hitCounter++;
 		os_sprintf(buff, "%ld", hitCounter);
 	}
 
-	httpdSend(connData, buff, -1);
+	pagecache_send(connData, buff, -1);
 	return;
 }
 
@@ -183,27 +447,30 @@ void ICACHE_FLASH_ATTR web_tpl_index(HttpdConnData *connData, char *token, void
  * @brief Turns the realy on and off.
  *
  * It turns on and off the relay according to the data received. This CGI is
- * called by realy.tpl 
+ * called by realy.tpl, the optional "channel" argument selects the relay.
+ * A channel that does not exist gets 400 and no relay is touched.
  */
 
 int ICACHE_FLASH_ATTR web_cgi_relay(HttpdConnData *connData) {
-	int len;
-	char buff[1024];
+	struct Args args;
+	const char *relay;
+	short int ch;
 	
 	if (connData->conn == NULL) {
 		//Connection aborted. Clean up.
 		return HTTPD_CGI_DONE;
 	}
 
-	len = httpdFindArg(connData->getArgs, "relay", buff, sizeof(buff));
-	if (len) {
-		if (!os_strcmp(buff, "on")) {
-			io_enable(1);
-			io_timer(1);
-		} else {
-			io_enable(0);
-			io_timer(0);
-		}
+	args_parse(&args, connData->getArgs);
+	ch = _web_channel(&args);
+	if (ch < 0) {
+		_web_bad_request(connData, "channel not found\n");
+		return HTTPD_CGI_DONE;
+	}
+
+	relay = args_get(&args, "relay");
+	if (relay != NULL) {
+		io_manual(ch, !os_strcmp(relay, "on"));
 	} else {
 		os_printf("Argument 'relay' not found, check relay.tpl file.\n");
 	}
@@ -20,6 +20,9 @@
 
 #include <esp8266.h>
 #include "web.h"
+#include "args.h"
+#include "pool.h"
+#include "wifi.h"
 
 //WiFi access point data
 typedef struct {
@@ -33,7 +36,7 @@ typedef struct {
 //Scan result
 typedef struct {
 	char scanInProgress;
-	ApData **apData;
+	ApData *apData[POOL_APS];
 	int noAps;
 } ScanResultData;
 
@@ -43,6 +46,13 @@ static ScanResultData cgiWifiAps;
 //Temp store for new ap info.
 static struct station_config stconf;
 
+// Switch requested by the /wifi pages
+static int switchMode;
+static int switchConfig;
+static ETSTimer switchTimer;
+
+static void ICACHE_FLASH_ATTR _webwifi_schedule_switch(void);
+
 /**
  * @brief Displays wifi.tpl.
  *
@@ -51,7 +61,8 @@ static struct station_config stconf;
  */
 
 void ICACHE_FLASH_ATTR webwifi_tpl(HttpdConnData *connData, char *token, void **arg) {
-	char buff[1024];
+	// SSIDs and passwords fill their fields without a terminating zero
+	char buff[65];
 	int mode;
 	static struct station_config stconf;
 
@@ -76,9 +87,11 @@ void ICACHE_FLASH_ATTR webwifi_tpl(HttpdConnData *connData, char *token, void **
 				break;
 		}
 	} else if (!strcmp(token, "currSsid")) {
-		os_strcpy(buff, (char*)stconf.ssid);
+		os_memcpy(buff, stconf.ssid, sizeof(stconf.ssid));
+		buff[sizeof(stconf.ssid)] = 0;
 	} else if (!strcmp(token, "WiFiPasswd")) {
-		os_strcpy(buff, (char*)stconf.password);
+		os_memcpy(buff, stconf.password, sizeof(stconf.password));
+		buff[sizeof(stconf.password)] = 0;
 	}
 
 	httpdSend(connData, buff, -1);
@@ -92,20 +105,21 @@ void ICACHE_FLASH_ATTR webwifi_tpl(HttpdConnData *connData, char *token, void **
  */
 
 int ICACHE_FLASH_ATTR webwifi_cgi_set_mode(HttpdConnData *connData) {
-	int len;
-	char buff[1024];
+	struct Args args;
+	const char *mode;
 	
 	if (connData->conn == NULL) {
 		//Connection aborted. Clean up.
 		return HTTPD_CGI_DONE;
 	}
 
-	len = httpdFindArg(connData->getArgs, "mode", buff, sizeof(buff));
+	args_parse(&args, connData->getArgs);
+	mode = args_get(&args, "mode");
 
-	if (len != 0) {
-		os_printf("Changing WIFI mode to: %s\n", buff);
-		wifi_set_opmode(atoi(buff));
-		system_restart();
+	if (mode != NULL && atoi(mode) >= STATION_MODE && atoi(mode) <= STATIONAP_MODE) {
+		os_printf("Changing WIFI mode to: %s\n", mode);
+		switchMode = atoi(mode);
+		_webwifi_schedule_switch();
 	}
 
 	httpdRedirect(connData, "/wifi");
@@ -120,8 +134,9 @@ int ICACHE_FLASH_ATTR webwifi_cgi_set_mode(HttpdConnData *connData) {
  */
 
 void ICACHE_FLASH_ATTR _webwifi_scan_done_cb(void *arg, STATUS status) {
-	int counter;
 	struct bss_info *bss_link = (struct bss_info *)arg;
+	ApData *ap;
+	int i, weakest;
 	os_printf("_webwifi_scan_done_cb %d\n", status);
 
 	if (status != OK) {
@@ -129,62 +144,34 @@ void ICACHE_FLASH_ATTR _webwifi_scan_done_cb(void *arg, STATUS status) {
 		return;
 	}
 
-	// Clear previous ap data if needed.
-	if (cgiWifiAps.apData != NULL) {
-		for (counter = 0; counter < cgiWifiAps.noAps; counter++) free(cgiWifiAps.apData[counter]);
-		free(cgiWifiAps.apData);
-	}
-
-	// Count amount of access points found.
-	counter = 0;
-
-	while (bss_link != NULL) {
-		bss_link = bss_link->next.stqe_next;
-		counter++;
-	}
-
-	// Allocate memory for access point data
-	cgiWifiAps.apData = (ApData **)os_malloc(sizeof(ApData *)*counter);
-
-        if (cgiWifiAps.apData == NULL) {
-                os_printf("_webwifi_scan_done_cb: Out of memory allocating apData\n");
-                return;
-        }
-
-	cgiWifiAps.noAps = counter;
-
-	// Copy access point data to the static struct
-	bss_link = (struct bss_info *)arg;
-	counter = 0;
-
-	while (bss_link != NULL) {
-
-                if (counter >= cgiWifiAps.noAps) {
-                        // This means the bss_link changed under our nose. Shouldn't happen!
-                        // Break because otherwise we will write in unallocated memory.
-                        os_printf("_webwifi_scan_done_cb: I have more than the allocated %d aps!\n", cgiWifiAps.noAps);
-                        break;
-                }
-
-		cgiWifiAps.apData[counter] = (ApData *)os_malloc(sizeof(ApData));
-
-                if (cgiWifiAps.apData[counter] == NULL) {
-                        os_printf("_webwifi_scan_done_cb: Can't allocate mem for ap buff.\n");
-                        cgiWifiAps.scanInProgress = 0;
-                        return;
-                }
-
-                cgiWifiAps.apData[counter]->rssi=bss_link->rssi;
-                cgiWifiAps.apData[counter]->channel=bss_link->channel;
-                cgiWifiAps.apData[counter]->enc=bss_link->authmode;
-                strncpy(cgiWifiAps.apData[counter]->ssid, (char*)bss_link->ssid, 32);
-                strncpy(cgiWifiAps.apData[counter]->bssid, (char*)bss_link->bssid, 6);
+	// Clear previous ap data.
+	for (i = 0; i < cgiWifiAps.noAps; i++) pool_free(POOL_AP, cgiWifiAps.apData[i]);
+	cgiWifiAps.noAps = 0;
+
+	// Copy access point data to the pool, keeping the strongest ones if
+	// there are more than blocks
+	for (; bss_link != NULL; bss_link = bss_link->next.stqe_next) {
+		if (cgiWifiAps.noAps < POOL_APS) {
+			ap = (ApData *)pool_alloc(POOL_AP, sizeof(ApData));
+			if (ap == NULL) break;
+			cgiWifiAps.apData[cgiWifiAps.noAps++] = ap;
+		} else {
+			for (weakest = 0, i = 1; i < cgiWifiAps.noAps; i++) {
+				if ((sint8)cgiWifiAps.apData[i]->rssi < (sint8)cgiWifiAps.apData[weakest]->rssi) weakest = i;
+			}
+
+			if (bss_link->rssi <= (sint8)cgiWifiAps.apData[weakest]->rssi) continue;
+			ap = cgiWifiAps.apData[weakest];
+		}
 
-                bss_link = bss_link->next.stqe_next;
-		counter++;
+		ap->rssi = bss_link->rssi;
+		ap->channel = bss_link->channel;
+		ap->enc = bss_link->authmode;
+		strncpy(ap->ssid, (char*)bss_link->ssid, 32);
+		os_memcpy(ap->bssid, bss_link->bssid, 6);
 	}
 
-	os_printf("_webwifi_scan_done_cb: Scan done: found %d APs\n", counter);
+	os_printf("_webwifi_scan_done_cb: Scan done: kept %d APs\n", cgiWifiAps.noAps);
 	//We're done.
 	cgiWifiAps.scanInProgress = 0;
 }
@@ -249,7 +236,8 @@ static void ICACHE_FLASH_ATTR _webwifi_start_scan() {
 int ICACHE_FLASH_ATTR webwifi_cgi_scan(HttpdConnData *connData) {
 	int len;
 	int i;
-	char buff[1024];
+	// Longest line is an AP with a 32 character SSID
+	char buff[96];
 	httpdStartResponse(connData, 200);
 	httpdHeader(connData, "Content-Type", "text/json");
 	httpdEndHeaders(connData);
@@ -263,13 +251,11 @@ int ICACHE_FLASH_ATTR webwifi_cgi_scan(HttpdConnData *connData) {
 		len = os_sprintf(buff, "{\n \"result\": { \n\"inProgress\": \"0\", \n\"APs\": [\n");
 		httpdSend(connData, buff, len);
 
-		if (cgiWifiAps.apData == NULL) cgiWifiAps.noAps = 0;
-
 		for (i = 0; i < cgiWifiAps.noAps; i++) {
-			os_printf("{\"essid\": \"%s\", \"rssi\": \"%d\", \"enc\": \"%d\"}%s\n", 
+			os_printf("{\"essid\": \"%.32s\", \"rssi\": \"%d\", \"enc\": \"%d\"}%s\n", 
 					cgiWifiAps.apData[i]->ssid, cgiWifiAps.apData[i]->rssi, 
 					cgiWifiAps.apData[i]->enc, (i == cgiWifiAps.noAps-1)?"":",");
-			len = os_sprintf(buff, "{\"essid\": \"%s\", \"rssi\": \"%d\", \"enc\": \"%d\"}%s\n", 
+			len = os_sprintf(buff, "{\"essid\": \"%.32s\", \"rssi\": \"%d\", \"enc\": \"%d\"}%s\n", 
 					cgiWifiAps.apData[i]->ssid, cgiWifiAps.apData[i]->rssi, 
 					cgiWifiAps.apData[i]->enc, (i == cgiWifiAps.noAps-1)?"":",");
 			httpdSend(connData, buff, len);
@@ -285,47 +271,27 @@ int ICACHE_FLASH_ATTR webwifi_cgi_scan(HttpdConnData *connData) {
 }
 
 /**
- * @brief Check if we are porperly connected to AP
+ * @brief Makes the switch requested by the /wifi pages.
  *
- * This routine is ran some time after a connection attempt to an AP.
- * If the connection succeeds, ESP is reset to go into the selected mode.
+ * This routine is timed so the redirect is sent before the WiFi changes,
+ * I had problems with immediate connections. The switch itself is made live
+ * by wifi_switch(), there is no restart.
  */
 
-static void ICACHE_FLASH_ATTR _reset_timer_cb(void *arg) {
-	int conn = wifi_station_get_connect_status();
-        os_printf("WiFi State Update: ");
-        _print_wifi_status(conn);
+static void ICACHE_FLASH_ATTR _webwifi_switch_cb(void *arg) {
+	os_printf("WiFi switch to mode %d, ", switchMode);
+	_print_wifi_status(wifi_station_get_connect_status());
 
-	if (conn == STATION_GOT_IP) {
-		//Go to STA mode. This needs a reset, so do that.
-		wifi_set_opmode(1);
-		system_restart();
-	} else {
-		os_printf("Connect fail. Not going into STA-only mode.\n");
-	}
-}
+	if (switchConfig) os_printf("Connecting to %s\n", stconf.ssid);
 
-/**
- * @brief Connected to AP
- *
- * This routine is timed because I had problems with immediate connections.
- * It probably was something else that caused it, but I did'n whant to put
- * the code back :P.
- */
+	wifi_switch(switchMode, switchConfig ? &stconf : NULL);
+	switchConfig = 0;
+}
 
-static void ICACHE_FLASH_ATTR _reass_timer_cb(void *arg) {
-	static ETSTimer resetTimer;
-	wifi_station_disconnect();
-	wifi_station_set_config(&stconf);
-	os_printf("Connecting to %s with password %s", stconf.ssid, stconf.password);
-	wifi_station_connect();
-
-	if (wifi_get_opmode() != 1) {
-		//Schedule disconnect/connect
-		os_timer_disarm(&resetTimer);
-		os_timer_setfn(&resetTimer, _reset_timer_cb, NULL);
-		os_timer_arm(&resetTimer, 4000, 0);
-	}
+static void ICACHE_FLASH_ATTR _webwifi_schedule_switch(void) {
+	os_timer_disarm(&switchTimer);
+	os_timer_setfn(&switchTimer, _webwifi_switch_cb, NULL);
+	os_timer_arm(&switchTimer, 1000, 0);
 }
 
 /**
@@ -336,27 +302,31 @@ static void ICACHE_FLASH_ATTR _reass_timer_cb(void *arg) {
  */
 
 int ICACHE_FLASH_ATTR webwifi_cgi_connect(HttpdConnData *connData) {
-	char essid[128];
-	char passwd[128];
-	static ETSTimer reassTimer;
+	struct Args args;
+	const char *essid, *passwd;
 	
 	if (connData->conn == NULL) {
 		//Connection aborted. Clean up.
 		return HTTPD_CGI_DONE;
 	}
 	
-	httpdFindArg(connData->post->buff, "essid", essid, sizeof(essid));
-	httpdFindArg(connData->post->buff, "passwd", passwd, sizeof(passwd));
+	args_parse(&args, connData->post->buff);
+	essid = args_get(&args, "essid");
+	passwd = args_get(&args, "passwd");
+	if (essid == NULL) essid = "";
+	if (passwd == NULL) passwd = "";
 
 	os_strncpy((char*)stconf.ssid, essid, 32);
 	os_strncpy((char*)stconf.password, passwd, 64);
+	// Any access point of the network will do, not only the cached one
+	stconf.bssid_set = 0;
     
 	os_printf("Will connect to %s using password %s", essid, passwd);
 
-	//Schedule disconnect/connect
-	os_timer_disarm(&reassTimer);
-	os_timer_setfn(&reassTimer, _reass_timer_cb, NULL);
-	os_timer_arm(&reassTimer, 1000, 0);
+	// Station only once connected, like before
+	switchMode = STATION_MODE;
+	switchConfig = 1;
+	_webwifi_schedule_switch();
 	httpdRedirect(connData, "/wifi/connecting.html");
 	return HTTPD_CGI_DONE;
 }
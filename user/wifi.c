@@ -23,47 +23,389 @@
  * @date 15 May 2016
  * @brief File containing WIFI daemon.
  *
- * Init wifi connnecton. If we cannot connet to AP return to AM MODE for safety. 
- * 
+ * Keeps the station connected. The SDK reconnect policy is turned off and
+ * connections are driven from the WiFi events instead:
+ *
+ * - A lost connection is retried at once with the BSSID and channel of the
+ *   last access point, which skips the scan of all channels.
+ * - If that fails, or nothing is cached, the station connects with a full
+ *   scan. Failed attempts are retried with exponential backoff, the cached
+ *   access point first again.
+ * - After WIFI_FALLBACK_MS without connection the access point is turned
+ *   on too, so the box can still be reached, and the station keeps trying
+ *   in the background. The access point is turned off again when the
+ *   station connects, and never saved to flash.
+ *
+ * Only the disconnects the station asks for itself are ignored, any other
+ * loss is retried, whatever its reason. The link is also checked every
+ * WIFI_CHECK_MS while connected, in case its event is missed.
+ *
+ * Mode and credential changes are applied live by wifi_switch(), without a
+ * restart. The access point stays up while the station connects, and the
+ * new mode and credentials are only saved once the station has an IP. New
+ * credentials that do not connect are rolled back.
  */
 
 #include <string.h>
 #include <osapi.h>
 #include "user_interface.h"
 #include "espmissingincludes.h"
+#include "config.h"
 #include "wifi.h"
+#include "stack.h"
+
+enum WifiState {
+	WIFI_OFF,
+	WIFI_CONNECTING,
+	WIFI_CONNECTED,
+	WIFI_BACKOFF
+};
+
+static struct WifiStats stats;
+static enum WifiState state;
+static ETSTimer wifiTimer;
+static ETSTimer fallbackTimer;
+// Next attempt uses the cached access point, and the running one does
+static int tryFast;
+static int fast;
+// Access point turned on by us
+static int fallback;
+// Disconnect asked for by us, its event is not a lost connection
+static int leaving;
+static uint32 backoff;
+static uint32 attemptStart;
+static uint32 lostAt;
+static uint8 lastBssid[6];
+static uint8 lastChannel;
+// Switch in progress: mode to go to once connected, and what to roll back to
+static int targetMode;
+static int previousMode;
+static int newConfig;
+static struct station_config previous;
+static uint32 switchStart;
+
+static void ICACHE_FLASH_ATTR _wifi_timer_cb(void *arg);
+
+/**
+ * @brief Milliseconds since a system_get_time() timestamp.
+ */
+
+static uint32 ICACHE_FLASH_ATTR _wifi_ms_since(uint32 start) {
+	return (system_get_time() - start) / 1000;
+}
+
+static void ICACHE_FLASH_ATTR _wifi_arm(uint32 ms) {
+	os_timer_disarm(&wifiTimer);
+	os_timer_setfn(&wifiTimer, _wifi_timer_cb, NULL);
+	os_timer_arm(&wifiTimer, ms, 0);
+}
 
 /**
- * @brief Go into AP mode if we cant connect as STATION.
+ * @brief Turns the access point on when the station has been down too long.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_fallback_cb(void *arg) {
+	if (fallback || wifi_get_opmode() != STATION_MODE) return;
+
+	os_printf("WiFi: no connection for %d ms, turning on the access point\n", WIFI_FALLBACK_MS);
+	wifi_set_opmode_current(STATIONAP_MODE);
+	fallback = 1;
+	stats.fallbacks++;
+}
+
+/**
+ * @brief Starts the outage clock, the access point is turned on when it
+ * runs out.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_lost(void) {
+	lostAt = system_get_time();
+	os_timer_disarm(&fallbackTimer);
+	os_timer_setfn(&fallbackTimer, _wifi_fallback_cb, NULL);
+	os_timer_arm(&fallbackTimer, WIFI_FALLBACK_MS, 0);
+}
+
+/**
+ * @brief Starts a connection attempt, to the cached access point if tryFast
+ * is set.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_attempt(void) {
+	struct station_config cfg;
+
+	if (!(wifi_get_opmode() & STATION_MODE)) {
+		state = WIFI_OFF;
+		return;
+	}
+
+	fast = tryFast && lastChannel != 0;
+	tryFast = 0;
+
+	wifi_station_get_config(&cfg);
+	cfg.bssid_set = fast;
+	if (fast) {
+		os_memcpy(cfg.bssid, lastBssid, sizeof(lastBssid));
+		wifi_set_channel(lastChannel);
+	}
+
+	leaving = 1;
+	wifi_station_disconnect();
+	wifi_station_set_config_current(&cfg);
+	wifi_station_connect();
+
+	state = WIFI_CONNECTING;
+	attemptStart = system_get_time();
+	stats.attempts++;
+	_wifi_arm(fast ? WIFI_FAST_MS : WIFI_CONNECT_MS);
+}
+
+/**
+ * @brief The running attempt failed. A failed fast attempt is followed by a
+ * full scan at once, others wait for the backoff.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_fail(void) {
+	stats.failures++;
+
+	if (fast) {
+		_wifi_attempt();
+		return;
+	}
+
+	if (newConfig) {
+		os_printf("WiFi: new network does not connect, back to %.32s\n", (char *)previous.ssid);
+		wifi_station_set_config_current(&previous);
+		newConfig = 0;
+		targetMode = previousMode;
+		stats.switchFailures++;
+		_wifi_attempt();
+		return;
+	}
+
+	state = WIFI_BACKOFF;
+	_wifi_arm(backoff);
+	os_printf("WiFi: connect failed, retrying in %d ms\n", (int)backoff);
+
+	backoff *= 2;
+	if (backoff > WIFI_BACKOFF_MAX_MS) backoff = WIFI_BACKOFF_MAX_MS;
+}
+
+/**
+ * @brief The station has an IP, the switch in progress is made and saved.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_switch_done(void) {
+	struct station_config cfg;
+
+	if (newConfig) {
+		wifi_station_get_config(&cfg);
+		cfg.bssid_set = 0;
+		wifi_station_set_config(&cfg);
+		newConfig = 0;
+	}
+
+	wifi_set_opmode(targetMode);
+	targetMode = 0;
+	fallback = 0;
+	stats.switches++;
+	stats.switchMs = _wifi_ms_since(switchStart);
+	os_printf("WiFi: switched to mode %d in %d ms\n", wifi_get_opmode(), (int)stats.switchMs);
+}
+
+static void ICACHE_FLASH_ATTR _wifi_got_ip(void) {
+	if (state == WIFI_CONNECTED) return;
+
+	if (state == WIFI_CONNECTING) {
+		stats.lastMs = _wifi_ms_since(attemptStart);
+		if (stats.lastMs > stats.maxMs) stats.maxMs = stats.lastMs;
+		if (fast) stats.fastConnects++;
+	}
+
+	stats.outageMs = _wifi_ms_since(lostAt);
+	stats.connects++;
+
+	_wifi_arm(WIFI_CHECK_MS);
+	os_timer_disarm(&fallbackTimer);
+	state = WIFI_CONNECTED;
+	backoff = WIFI_BACKOFF_MIN_MS;
+
+	if (targetMode) {
+		_wifi_switch_done();
+	} else if (fallback) {
+		if (wifi_get_opmode() == STATIONAP_MODE) wifi_set_opmode_current(STATION_MODE);
+		fallback = 0;
+	}
+
+	os_printf("WiFi: got IP in %d ms, %d ms without connection\n", (int)stats.lastMs, (int)stats.outageMs);
+}
+
+/**
+ * @brief The connection was lost, it is retried at once on the same access
+ * point.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_link_lost(int reason) {
+	os_printf("WiFi: connection lost, reason %d\n", reason);
+	stats.disconnects++;
+	_wifi_lost();
+	tryFast = 1;
+	_wifi_attempt();
+}
+
+/**
+ * @brief Attempt timeout, end of the backoff or link check.
+ */
+
+static void ICACHE_FLASH_ATTR _wifi_timer_cb(void *arg) {
+	int up = wifi_station_get_connect_status() == STATION_GOT_IP;
+
+	if (state == WIFI_CONNECTED) {
+		if (up) _wifi_arm(WIFI_CHECK_MS);
+		else _wifi_link_lost(-1);
+	} else if (up) {
+		// The event may have been missed, before the handler was registered
+		_wifi_got_ip();
+	} else if (state == WIFI_CONNECTING) {
+		_wifi_fail();
+	} else if (state == WIFI_BACKOFF) {
+		tryFast = 1;
+		_wifi_attempt();
+	}
+}
+
+static void ICACHE_FLASH_ATTR _wifi_event_cb(System_Event_t *event) {
+	stack_enter("wifi_event");
+
+	switch (event->event) {
+		case EVENT_STAMODE_CONNECTED:
+			os_memcpy(lastBssid, event->event_info.connected.bssid, sizeof(lastBssid));
+			lastChannel = event->event_info.connected.channel;
+			// Our own disconnect, if any, came before
+			leaving = 0;
+			break;
+
+		case EVENT_STAMODE_GOT_IP:
+			_wifi_got_ip();
+			break;
+
+		case EVENT_STAMODE_DISCONNECTED:
+			// Left on purpose, by _wifi_attempt() or wifi_switch()
+			if (leaving && event->event_info.disconnected.reason == REASON_ASSOC_LEAVE) {
+				leaving = 0;
+				break;
+			}
+
+			if (state == WIFI_CONNECTED) {
+				_wifi_link_lost(event->event_info.disconnected.reason);
+			} else if (state == WIFI_CONNECTING) {
+				os_timer_disarm(&wifiTimer);
+				_wifi_fail();
+			}
+			break;
+	}
+
+	stack_exit();
+}
+
+/**
+ * @brief Changes the WiFi mode, and the station credentials if cfg is not
+ * NULL, without a restart.
  *
+ * Going to AP only is immediate. Otherwise the access point is kept on
+ * while the station connects, and the new mode and credentials are saved
+ * when it gets an IP. If the new credentials fail, the old ones and the
+ * old mode are restored. Returns 1 if mode is not valid.
  */
 
-static void ICACHE_FLASH_ATTR _wifi_check_cb(void *arg) {
-	int mode = wifi_get_opmode();
-        
-        int conn = wifi_station_get_connect_status();
-        
-	// If we are in Station mode, we do this to prevent loosing WIFI access to esp
-        if (mode == 1) {
-		if (conn == STATION_GOT_IP) {
-            		os_printf("WiFi mode: %d - got IP %d \n", mode, STATION_GOT_IP);
-        	} else {
-            		os_printf("Connect fail. Going into AP mode.\n");
-	    		wifi_set_opmode(2);
-		}
-        } else if (!mode) {
-		wifi_set_opmode(2);
+int ICACHE_FLASH_ATTR wifi_switch(int mode, struct station_config *cfg) {
+	if (mode < STATION_MODE || mode > STATIONAP_MODE) return 1;
+
+	switchStart = system_get_time();
+	os_timer_disarm(&fallbackTimer);
+
+	if (mode == SOFTAP_MODE) {
+		if (newConfig) wifi_station_set_config_current(&previous);
+		newConfig = 0;
+		os_timer_disarm(&wifiTimer);
+		leaving = 1;
+		wifi_station_disconnect();
+		targetMode = mode;
+		_wifi_switch_done();
+		state = WIFI_OFF;
+		return 0;
+	}
+
+	if (!newConfig) previousMode = fallback ? STATION_MODE : wifi_get_opmode();
+	targetMode = mode;
+
+	if (cfg != NULL) {
+		if (!newConfig) wifi_station_get_config(&previous);
+		newConfig = 1;
+		lastChannel = 0;
+		lostAt = switchStart;
+		wifi_station_set_config_current(cfg);
+	} else if (state == WIFI_CONNECTED) {
+		_wifi_switch_done();
+		return 0;
 	}
+
+	// Keep the box reachable until the station is confirmed
+	wifi_set_opmode_current(STATIONAP_MODE);
+	backoff = WIFI_BACKOFF_MIN_MS;
+	tryFast = 0;
+	_wifi_attempt();
+	return 0;
+}
+
+/*
+ * @brief Returns 1 if the station has an IP.
+ */
+
+int ICACHE_FLASH_ATTR wifi_connected(void) {
+	return state == WIFI_CONNECTED;
+}
+
+struct WifiStats *ICACHE_FLASH_ATTR wifi_stats(void) {
+	return &stats;
 }
 
 /**
  * @brief Init WIFI connection.
  *
+ * The SDK connects with the saved configuration on boot, that first attempt
+ * is followed like the others.
  */
 
-void ICACHE_FLASH_ATTR wifi_init(void){
-    static ETSTimer wifiTimer;
-    os_timer_disarm(&wifiTimer);
-    os_timer_setfn(&wifiTimer, _wifi_check_cb, NULL);
-    os_timer_arm(&wifiTimer, 5000, 0);
+void ICACHE_FLASH_ATTR wifi_init(void) {
+	int mode = wifi_get_opmode();
+
+	os_memset(&stats, 0, sizeof(stats));
+	state = WIFI_OFF;
+	fallback = 0;
+	leaving = 0;
+	tryFast = 0;
+	fast = 0;
+	lastChannel = 0;
+	targetMode = 0;
+	newConfig = 0;
+	backoff = WIFI_BACKOFF_MIN_MS;
+
+	// Also in AP mode, for a later switch to the station from /wifi
+	wifi_station_set_reconnect_policy(false);
+	wifi_set_event_handler_cb(_wifi_event_cb);
+
+	if (!mode) {
+		wifi_set_opmode(SOFTAP_MODE);
+		return;
+	}
+
+	if (!(mode & STATION_MODE)) return;
+
+	_wifi_lost();
+	state = WIFI_CONNECTING;
+	attemptStart = lostAt;
+	stats.attempts++;
+	_wifi_arm(WIFI_CONNECT_MS);
+
+	if (wifi_station_get_connect_status() == STATION_GOT_IP) _wifi_got_ip();
 }